@@ -0,0 +1,348 @@
+#include "AnalysisCache.h"
+#include "ContentHash.h"
+#include "MemoryBudget.h"
+
+#include <wincodec.h>
+
+#include <vector>
+
+#pragma comment(lib, "windowscodecs.lib")
+
+
+
+// size the picture is scaled to for its perceptual hash - 4x4 pixels per hash cell
+#define PERCEPTUAL_WIDTH            36
+#define PERCEPTUAL_HEIGHT           32
+
+// pictures bigger than this are not analyzed pictures - do not read them into memory
+#define MAX_PICTURE_BYTES           (256 * 1024 * 1024)
+
+// bookkeeping of an entry besides its result - list node, map node and the entry itself
+#define ENTRY_OVERHEAD_BYTES        64
+
+
+
+//
+// Decode the picture, scale it to PERCEPTUAL_WIDTH x PERCEPTUAL_HEIGHT gray pixels and
+// hash that.  JPEG decoders scale while decoding, so this is far cheaper than a full decode.
+//
+static HRESULT GetPicturePerceptualHash(BYTE* pData, DWORD cbData, UINT64* pHash)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IWICImagingFactory> pFactory;
+    CComPtr<IWICStream> pStream;
+    CComPtr<IWICBitmapDecoder> pDecoder;
+    CComPtr<IWICBitmapFrameDecode> pFrame;
+    CComPtr<IWICBitmapScaler> pScaler;
+    CComPtr<IWICFormatConverter> pConverter;
+    BYTE pixels[PERCEPTUAL_WIDTH * PERCEPTUAL_HEIGHT];
+
+    do
+    {
+        hr = pFactory.CoCreateInstance(CLSID_WICImagingFactory);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFactory->CreateStream(&pStream);
+        BREAK_ON_FAIL(hr);
+
+        hr = pStream->InitializeFromMemory(pData, cbData);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFactory->CreateDecoderFromStream(pStream, NULL, WICDecodeMetadataCacheOnDemand,
+            &pDecoder);
+        BREAK_ON_FAIL(hr);
+
+        hr = pDecoder->GetFrame(0, &pFrame);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFactory->CreateBitmapScaler(&pScaler);
+        BREAK_ON_FAIL(hr);
+
+        hr = pScaler->Initialize(pFrame, PERCEPTUAL_WIDTH, PERCEPTUAL_HEIGHT,
+            WICBitmapInterpolationModeFant);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFactory->CreateFormatConverter(&pConverter);
+        BREAK_ON_FAIL(hr);
+
+        hr = pConverter->Initialize(pScaler, GUID_WICPixelFormat8bppGray,
+            WICBitmapDitherTypeNone, NULL, 0.0, WICBitmapPaletteTypeCustom);
+        BREAK_ON_FAIL(hr);
+
+        hr = pConverter->CopyPixels(NULL, PERCEPTUAL_WIDTH, sizeof(pixels), pixels);
+        BREAK_ON_FAIL(hr);
+
+        *pHash = GetDifferenceHash(pixels, PERCEPTUAL_WIDTH, 1, PERCEPTUAL_WIDTH,
+            PERCEPTUAL_HEIGHT);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT GetPictureKey(PCWSTR path, bool perceptual, PictureKey* pKey)
+{
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    LARGE_INTEGER fileSize;
+    std::vector<BYTE> data;
+    DWORD read = 0;
+
+    do
+    {
+        BREAK_ON_NULL(path, E_POINTER);
+        BREAK_ON_NULL(pKey, E_POINTER);
+
+        ZeroMemory(pKey, sizeof(*pKey));
+
+        file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!GetFileSizeEx(file, &fileSize))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (fileSize.QuadPart == 0 || fileSize.QuadPart > MAX_PICTURE_BYTES)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_FILE_TOO_LARGE);
+            break;
+        }
+
+        data.resize((size_t)fileSize.QuadPart);
+
+        if (!ReadFile(file, &data[0], (DWORD)data.size(), &read, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        // a short read succeeds - the file shrank since its size was taken
+        if (read != data.size())
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_HANDLE_EOF);
+            break;
+        }
+
+        pKey->contentHash = CContentHash::Hash(&data[0], data.size());
+
+        // a picture WIC cannot decode still caches by content
+        if (perceptual)
+        {
+            pKey->hasPerceptualHash = SUCCEEDED(GetPicturePerceptualHash(&data[0],
+                (DWORD)data.size(), &pKey->perceptualHash));
+        }
+    }
+    while(false);
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
+
+
+
+
+CAnalysisCache::CAnalysisCache(UINT32 maxEntries, ULONGLONG budgetBytes) :
+    m_maxEntries(maxEntries),
+    m_budgetBytes(budgetBytes),
+    m_maxDistance(-1)
+{
+    ZeroMemory(&m_stats, sizeof(m_stats));
+    m_stats.budgetBytes = budgetBytes;
+}
+
+
+CAnalysisCache::~CAnalysisCache(void)
+{
+    Clear();
+}
+
+
+void CAnalysisCache::SetLimits(UINT32 maxEntries, ULONGLONG budgetBytes)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_maxEntries = maxEntries;
+    m_budgetBytes = budgetBytes;
+    m_stats.budgetBytes = budgetBytes;
+
+    Trim();
+}
+
+
+void CAnalysisCache::SetPerceptualTolerance(int maxDistance)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_maxDistance = min(maxDistance, 64);
+}
+
+
+//
+// An exact match is a hash table lookup.  A near match scans the entries, most recent
+// first - there are only a few dozen, and a 64-bit popcount each is cheaper than anything
+// that would index them.
+//
+bool CAnalysisCache::Lookup(const PictureKey& key, std::string* pResult)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+    EntryList::iterator match = m_entries.end();
+    bool nearMatch = false;
+
+    std::unordered_map<UINT64, EntryList::iterator>::iterator exact =
+        m_byContent.find(key.contentHash);
+
+    if (exact != m_byContent.end())
+    {
+        match = exact->second;
+    }
+    else if (m_maxDistance >= 0 && key.hasPerceptualHash)
+    {
+        for (EntryList::iterator entry = m_entries.begin(); entry != m_entries.end(); ++entry)
+        {
+            if (entry->key.hasPerceptualHash && GetHashDistance(entry->key.perceptualHash,
+                key.perceptualHash) <= (UINT32)m_maxDistance)
+            {
+                match = entry;
+                nearMatch = true;
+                break;
+            }
+        }
+    }
+
+    if (match == m_entries.end())
+    {
+        m_stats.misses++;
+        return false;
+    }
+
+    if (nearMatch)
+    {
+        m_stats.nearHits++;
+    }
+    else
+    {
+        m_stats.hits++;
+    }
+
+    // the match is now the most recently used entry
+    m_entries.splice(m_entries.begin(), m_entries, match);
+
+    if (pResult != NULL)
+    {
+        *pResult = match->result;
+    }
+
+    return true;
+}
+
+
+void CAnalysisCache::Insert(const PictureKey& key, const std::string& result)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+    Entry entry;
+
+    std::unordered_map<UINT64, EntryList::iterator>::iterator existing =
+        m_byContent.find(key.contentHash);
+
+    if (existing != m_byContent.end())
+    {
+        Remove(existing->second);
+    }
+
+    entry.key = key;
+    entry.result = result;
+
+    // a result bigger than the whole budget would only evict everything else
+    if (GetEntryBytes(entry) > m_budgetBytes || m_maxEntries == 0)
+    {
+        return;
+    }
+
+    // with the process short of memory, the cache shrinks to make room - or does not keep
+    // the result at all
+    while (!GetMemoryBudget()->Reserve(MemoryAccount_AnalysisCache, GetEntryBytes(entry)))
+    {
+        if (m_entries.empty())
+        {
+            return;
+        }
+
+        Remove(--m_entries.end());
+        m_stats.evictions++;
+    }
+
+    // moved in, so the entry holds exactly the bytes reserved for it
+    m_entries.push_front(Entry());
+    m_entries.front().key = key;
+    m_entries.front().result.swap(entry.result);
+    m_byContent[key.contentHash] = m_entries.begin();
+
+    m_stats.entries++;
+    m_stats.bytes += GetEntryBytes(m_entries.front());
+
+    Trim();
+}
+
+
+void CAnalysisCache::Clear(void)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_entries.clear();
+    m_byContent.clear();
+
+    GetMemoryBudget()->Release(MemoryAccount_AnalysisCache, m_stats.bytes);
+
+    m_stats.entries = 0;
+    m_stats.bytes = 0;
+}
+
+
+void CAnalysisCache::GetStats(AnalysisCacheStats* pStats) const
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    *pStats = m_stats;
+}
+
+
+ULONGLONG CAnalysisCache::GetEntryBytes(const Entry& entry)
+{
+    return ENTRY_OVERHEAD_BYTES + sizeof(Entry) + entry.result.capacity();
+}
+
+
+void CAnalysisCache::Remove(EntryList::iterator entry)
+{
+    m_stats.entries--;
+    m_stats.bytes -= GetEntryBytes(*entry);
+
+    GetMemoryBudget()->Release(MemoryAccount_AnalysisCache, GetEntryBytes(*entry));
+
+    m_byContent.erase(entry->key.contentHash);
+    m_entries.erase(entry);
+}
+
+
+void CAnalysisCache::Trim(void)
+{
+    while (!m_entries.empty() && (m_stats.entries > m_maxEntries ||
+        m_stats.bytes > m_budgetBytes))
+    {
+        Remove(--m_entries.end());
+        m_stats.evictions++;
+    }
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "Common.h"
+
+#include <list>
+#include <string>
+#include <unordered_map>
+
+
+
+//
+//  What identifies a picture to the cache - the hash of its bytes, and optionally the
+//  perceptual hash of its pixels for near-duplicate matches.
+//
+struct PictureKey
+{
+    UINT64      contentHash;            // CContentHash of the picture file
+    UINT64      perceptualHash;         // GetDifferenceHash() of its pixels
+    bool        hasPerceptualHash;
+};
+
+
+//
+//  Hash a picture file.  The perceptual hash costs a decode - through WIC, scaled down on
+//  the way - and is only computed when asked for.  COM must be initialized on the thread.
+//
+HRESULT GetPictureKey(PCWSTR path, bool perceptual, PictureKey* pKey);
+
+
+struct AnalysisCacheStats
+{
+    ULONGLONG   hits;                   // lookups answered by a picture with the same bytes
+    ULONGLONG   nearHits;               // lookups answered by a perceptually close picture
+    ULONGLONG   misses;
+    ULONGLONG   evictions;
+    UINT32      entries;
+    ULONGLONG   bytes;                  // memory held by the entries
+    ULONGLONG   budgetBytes;
+};
+
+
+//
+//  LRU cache of analysis results, keyed by picture content.  A picture with the same bytes
+//  as a cached one gets its result straight away; with a perceptual tolerance set, so does
+//  a picture whose perceptual hash is within that many bits of a cached one - a static
+//  scene captured again differs only by sensor noise.
+//
+//  The cache holds at most maxEntries results and budgetBytes of memory, and evicts the
+//  least recently used results to stay within both - and within the memory budget of the
+//  process, which the entries are reserved from.  Safe to use from any thread.
+//
+class CAnalysisCache
+{
+    public:
+        CAnalysisCache(UINT32 maxEntries = 64, ULONGLONG budgetBytes = 1024 * 1024);
+        ~CAnalysisCache(void);
+
+        void SetLimits(UINT32 maxEntries, ULONGLONG budgetBytes);
+
+        // match perceptual hashes up to maxDistance bits apart - negative matches exact
+        // content only, which is the default
+        void SetPerceptualTolerance(int maxDistance);
+        bool UsesPerceptualHash(void) const { return m_maxDistance >= 0; }
+
+        // result of an earlier analysis of the picture - false if there is none
+        bool Lookup(const PictureKey& key, std::string* pResult);
+        void Insert(const PictureKey& key, const std::string& result);
+
+        void Clear(void);
+
+        void GetStats(AnalysisCacheStats* pStats) const;
+
+    private:
+        struct Entry
+        {
+            PictureKey key;
+            std::string result;
+        };
+
+        typedef std::list<Entry> EntryList;
+
+        static ULONGLONG GetEntryBytes(const Entry& entry);
+
+        void Remove(EntryList::iterator entry);
+        void Trim(void);
+
+        mutable CComAutoCriticalSection m_critSec;
+
+        EntryList m_entries;            // most recently used first
+        std::unordered_map<UINT64, EntryList::iterator> m_byContent;
+
+        UINT32 m_maxEntries;
+        ULONGLONG m_budgetBytes;
+        int m_maxDistance;
+
+        AnalysisCacheStats m_stats;
+};
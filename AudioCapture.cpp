@@ -0,0 +1,341 @@
+#include "AudioCapture.h"
+#include "Tracer.h"
+
+#include <mferror.h>
+
+
+
+HRESULT CAudioCapture::CreateInstance(CAudioRing* pRing, CAudioCapture** ppCapture)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        BREAK_ON_NULL(ppCapture, E_POINTER);
+        BREAK_ON_NULL(pRing, E_INVALIDARG);
+
+        *ppCapture = new (std::nothrow) CAudioCapture(pRing);
+        BREAK_ON_NULL(*ppCapture, E_OUTOFMEMORY);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+CAudioCapture::CAudioCapture(CAudioRing* pRing) :
+    m_cRef(1),
+    m_pRing(pRing),
+    m_isFloat(false),
+    m_channels(0),
+    m_sampleRate(0),
+    m_restart(false)
+{
+}
+
+
+bool CAudioCapture::IsSupportedType(IMFMediaType* pType)
+{
+    GUID majorType = GUID_NULL;
+    GUID subtype = GUID_NULL;
+    UINT32 bits = 0;
+
+    if (FAILED(pType->GetGUID(MF_MT_MAJOR_TYPE, &majorType)) ||
+        FAILED(pType->GetGUID(MF_MT_SUBTYPE, &subtype)) ||
+        FAILED(pType->GetUINT32(MF_MT_AUDIO_BITS_PER_SAMPLE, &bits)) ||
+        majorType != MFMediaType_Audio)
+    {
+        return false;
+    }
+
+    return (subtype == MFAudioFormat_Float && bits == 32) ||
+        (subtype == MFAudioFormat_PCM && bits == 16);
+}
+
+
+HRESULT CAudioCapture::SelectStreamFormat(IMFMediaTypeHandler* pHandler)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaType> pBestType;
+    DWORD typeCount = 0;
+
+    do
+    {
+        hr = pHandler->GetMediaTypeCount(&typeCount);
+        BREAK_ON_FAIL(hr);
+
+        for (DWORD i = 0; i < typeCount; i++)
+        {
+            CComPtr<IMFMediaType> pType;
+            UINT32 rate = 0;
+
+            if (FAILED(pHandler->GetMediaTypeByIndex(i, &pType)) || !IsSupportedType(pType))
+            {
+                continue;
+            }
+
+            if (pBestType == NULL)
+            {
+                pBestType = pType;
+            }
+
+            // a type at the rate of the ring needs no resampling
+            if (SUCCEEDED(pType->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &rate)) &&
+                rate == m_pRing->GetSampleRate())
+            {
+                pBestType = pType;
+                break;
+            }
+        }
+
+        BREAK_ON_NULL(pBestType, MF_E_INVALIDMEDIATYPE);
+
+        hr = pHandler->SetCurrentMediaType(pBestType);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CAudioCapture::SetFormat(IMFMediaType* pType)
+{
+    HRESULT hr = S_OK;
+    GUID subtype = GUID_NULL;
+
+    do
+    {
+        if (!IsSupportedType(pType))
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        hr = pType->GetGUID(MF_MT_SUBTYPE, &subtype);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->GetUINT32(MF_MT_AUDIO_NUM_CHANNELS, &m_channels);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->GetUINT32(MF_MT_AUDIO_SAMPLES_PER_SECOND, &m_sampleRate);
+        BREAK_ON_FAIL(hr);
+
+        m_isFloat = (subtype == MFAudioFormat_Float);
+
+        // the channels are mapped before the resampler, which then works on fewer of them
+        // when the device has more
+        hr = m_resampler.Initialize(m_sampleRate, m_pRing->GetSampleRate(),
+            m_pRing->GetChannels());
+    }
+    while(false);
+
+    if (FAILED(hr))
+    {
+        m_channels = 0;
+    }
+
+    return hr;
+}
+
+
+HRESULT CAudioCapture::CreateSinkActivate(IMFMediaTypeHandler* pHandler,
+    IMFActivate** ppActivate)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaType> pType;
+    CComPtr<IMFActivate> pActivate;
+
+    do
+    {
+        BREAK_ON_NULL(ppActivate, E_POINTER);
+
+        hr = pHandler->GetCurrentMediaType(&pType);
+        BREAK_ON_FAIL(hr);
+
+        hr = SetFormat(pType);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFCreateSampleGrabberSinkActivate(pType, this, &pActivate);
+        BREAK_ON_FAIL(hr);
+
+        // a live source - deliver every sample as soon as it arrives
+        hr = pActivate->SetUINT32(MF_SAMPLEGRABBERSINK_IGNORE_CLOCK, TRUE);
+        BREAK_ON_FAIL(hr);
+
+        *ppActivate = pActivate.Detach();
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// IUnknown methods
+//
+HRESULT CAudioCapture::QueryInterface(REFIID riid, void** ppv)
+{
+    HRESULT hr = S_OK;
+
+    if(ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if(riid == IID_IUnknown || riid == IID_IMFSampleGrabberSinkCallback)
+    {
+        *ppv = static_cast<IMFSampleGrabberSinkCallback*>(this);
+    }
+    else if(riid == IID_IMFClockStateSink)
+    {
+        *ppv = static_cast<IMFClockStateSink*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        hr = E_NOINTERFACE;
+    }
+
+    if(SUCCEEDED(hr))
+        AddRef();
+
+    return hr;
+}
+
+ULONG CAudioCapture::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CAudioCapture::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+//
+// The time stamps start again with the session - the streaming thread restarts the ring
+// and the resampler before the next sample, as the writer of the ring.
+//
+HRESULT CAudioCapture::OnClockStart(MFTIME hnsSystemTime, LONGLONG llClockStartOffset)
+{
+    m_restart = true;
+
+    return S_OK;
+}
+
+
+void CAudioCapture::MapChannels(const float* pSource, UINT32 frameCount, float* pDest) const
+{
+    UINT32 ringChannels = m_pRing->GetChannels();
+
+    for (UINT32 frame = 0; frame < frameCount; frame++)
+    {
+        const float* pIn = pSource + (size_t)frame * m_channels;
+        float* pOut = pDest + (size_t)frame * ringChannels;
+
+        if (ringChannels == 1)
+        {
+            // a mono ring gets the mix of all channels
+            float sum = 0.0f;
+
+            for (UINT32 channel = 0; channel < m_channels; channel++)
+            {
+                sum += pIn[channel];
+            }
+
+            pOut[0] = sum / (float)m_channels;
+        }
+        else
+        {
+            // the first channels, and mono repeated into all of them
+            for (UINT32 channel = 0; channel < ringChannels; channel++)
+            {
+                pOut[channel] = pIn[channel % m_channels];
+            }
+        }
+    }
+}
+
+
+HRESULT CAudioCapture::OnProcessSample(REFGUID guidMajorMediaType, DWORD dwSampleFlags,
+    LONGLONG llSampleTime, LONGLONG llSampleDuration, const BYTE* pSampleBuffer,
+    DWORD dwSampleSize)
+{
+    UINT32 ringChannels = m_pRing->GetChannels();
+    UINT32 frameCount = 0;
+    UINT32 outputFrames = 0;
+    const float* pSamples = NULL;
+
+    if (guidMajorMediaType != MFMediaType_Audio || m_channels == 0)
+    {
+        return S_OK;
+    }
+
+    frameCount = dwSampleSize / ((m_isFloat ? sizeof(float) : sizeof(INT16)) * m_channels);
+    if (frameCount == 0)
+    {
+        return S_OK;
+    }
+
+    if (m_restart)
+    {
+        m_restart = false;
+        m_pRing->Restart();
+        m_resampler.Reset();
+    }
+
+    CTraceSpan span("audio", "capture");
+
+    if (m_isFloat)
+    {
+        pSamples = (const float*)pSampleBuffer;
+    }
+    else
+    {
+        if (m_converted.size() < (size_t)frameCount * m_channels)
+        {
+            m_converted.resize((size_t)frameCount * m_channels);
+        }
+
+        ConvertInt16ToFloat((const INT16*)pSampleBuffer, &m_converted[0],
+            frameCount * m_channels);
+        pSamples = &m_converted[0];
+    }
+
+    if (ringChannels != m_channels)
+    {
+        if (m_mapped.size() < (size_t)frameCount * ringChannels)
+        {
+            m_mapped.resize((size_t)frameCount * ringChannels);
+        }
+
+        MapChannels(pSamples, frameCount, &m_mapped[0]);
+        pSamples = &m_mapped[0];
+    }
+
+    outputFrames = frameCount;
+
+    if (!m_resampler.IsPassThrough())
+    {
+        UINT32 maxFrames = m_resampler.GetMaxOutputFrames(frameCount);
+
+        if (m_resampled.size() < (size_t)maxFrames * ringChannels)
+        {
+            m_resampled.resize((size_t)maxFrames * ringChannels);
+        }
+
+        outputFrames = m_resampler.Process(pSamples, frameCount, &m_resampled[0], maxFrames);
+        pSamples = &m_resampled[0];
+    }
+
+    // the resampled audio lags the input by the delay of the filter
+    m_pRing->Write(pSamples, outputFrames, llSampleTime - m_resampler.GetDelay());
+
+    return S_OK;
+}
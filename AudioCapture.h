@@ -0,0 +1,78 @@
+#pragma once
+
+#include "Common.h"
+#include "AudioKernels.h"
+#include "AudioRing.h"
+
+#include <mfapi.h>
+#include <mfidl.h>
+#include <vector>
+
+
+
+//
+//  Audio branch of the topology: a sample grabber sink whose callback converts the captured
+//  audio to float, maps its channels to those of the ring, resamples it to the rate of the
+//  ring and writes it to the ring with the time stamps of the samples.  The grabber ignores
+//  the presentation clock, so the audio reaches the ring as soon as the device delivers it;
+//  its time stamps are on the clock of the session all the same, like those of the video.
+//
+//  The stream is set to a native type of the device in int16 PCM or float, so that the
+//  session inserts no converter - the conversion and the resampling are done here, with the
+//  SSE2 kernels.
+//
+class CAudioCapture : public IMFSampleGrabberSinkCallback
+{
+    public:
+        static HRESULT CreateInstance(CAudioRing* pRing, CAudioCapture** ppCapture);
+
+        // pick a native type of the stream that the capture converts, at the rate of the
+        // ring if the device has it, and make it current
+        HRESULT SelectStreamFormat(IMFMediaTypeHandler* pHandler);
+
+        // the sink for the current type of the stream, with this capture as its callback
+        HRESULT CreateSinkActivate(IMFMediaTypeHandler* pHandler, IMFActivate** ppActivate);
+
+        // IUnknown interface implementation
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void);
+        STDMETHODIMP_(ULONG) Release(void);
+
+        // IMFClockStateSink interface implementation
+        STDMETHODIMP OnClockStart(MFTIME hnsSystemTime, LONGLONG llClockStartOffset);
+        STDMETHODIMP OnClockStop(MFTIME hnsSystemTime) { return S_OK; }
+        STDMETHODIMP OnClockPause(MFTIME hnsSystemTime) { return S_OK; }
+        STDMETHODIMP OnClockRestart(MFTIME hnsSystemTime) { return S_OK; }
+        STDMETHODIMP OnClockSetRate(MFTIME hnsSystemTime, float flRate) { return S_OK; }
+
+        // IMFSampleGrabberSinkCallback interface implementation
+        STDMETHODIMP OnSetPresentationClock(IMFPresentationClock* pPresentationClock)
+            { return S_OK; }
+        STDMETHODIMP OnProcessSample(REFGUID guidMajorMediaType, DWORD dwSampleFlags,
+            LONGLONG llSampleTime, LONGLONG llSampleDuration, const BYTE* pSampleBuffer,
+            DWORD dwSampleSize);
+        STDMETHODIMP OnShutdown(void) { return S_OK; }
+
+    private:
+        CAudioCapture(CAudioRing* pRing);
+        ~CAudioCapture(void) {}
+
+        HRESULT SetFormat(IMFMediaType* pType);
+        static bool IsSupportedType(IMFMediaType* pType);
+        void MapChannels(const float* pSource, UINT32 frameCount, float* pDest) const;
+
+        volatile long m_cRef;
+        CAudioRing* m_pRing;
+
+        // format of the stream
+        bool m_isFloat;                 // float, else int16 PCM
+        UINT32 m_channels;
+        UINT32 m_sampleRate;
+
+        // streaming thread state - the buffers only grow
+        CPolyphaseResampler m_resampler;
+        std::vector<float> m_converted;         // stream channels, stream rate
+        std::vector<float> m_mapped;            // ring channels, stream rate
+        std::vector<float> m_resampled;         // ring channels, ring rate
+        volatile bool m_restart;                // the session started again
+};
@@ -0,0 +1,406 @@
+#include "AudioKernels.h"
+
+#include <emmintrin.h>
+#include <malloc.h>
+#include <math.h>
+
+
+
+// Kaiser window shape - about 80 dB of stopband attenuation
+#define RESAMPLER_KAISER_BETA       8.0
+
+// cutoff of the prototype filter, as a share of the lower Nyquist frequency - below it, so
+// that little of the transition band folds back
+#define RESAMPLER_CUTOFF            0.9
+
+#define PI_D                        3.14159265358979323846
+
+
+
+void ConvertInt16ToFloatScalar(const INT16* pSource, float* pDest, UINT32 count)
+{
+    for (UINT32 i = 0; i < count; i++)
+    {
+        pDest[i] = (float)pSource[i] * (1.0f / 32768.0f);
+    }
+}
+
+
+void ConvertFloatToInt16Scalar(const float* pSource, INT16* pDest, UINT32 count)
+{
+    for (UINT32 i = 0; i < count; i++)
+    {
+        float value = pSource[i] * 32768.0f;
+
+        value = (value < -32768.0f) ? -32768.0f : value;
+        value = (value > 32767.0f) ? 32767.0f : value;
+
+        // rounds to nearest even, like _mm_cvtps_epi32()
+        pDest[i] = (INT16)lrintf(value);
+    }
+}
+
+
+//
+// Each int16 is placed in the high half of a 32-bit lane and shifted down arithmetically,
+// which sign-extends it without SSE4.1.
+//
+void ConvertInt16ToFloat(const INT16* pSource, float* pDest, UINT32 count)
+{
+    const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+    UINT32 i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128i samples = _mm_loadu_si128((const __m128i*)(pSource + i));
+        __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+        __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+
+        _mm_storeu_ps(pDest + i, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+        _mm_storeu_ps(pDest + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+
+    ConvertInt16ToFloatScalar(pSource + i, pDest + i, count - i);
+}
+
+
+//
+// The samples are clamped before the conversion - _mm_cvtps_epi32() turns anything out of
+// the 32-bit range into INT_MIN, which the saturating pack would keep negative.
+//
+void ConvertFloatToInt16(const float* pSource, INT16* pDest, UINT32 count)
+{
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 low = _mm_set1_ps(-32768.0f);
+    const __m128 high = _mm_set1_ps(32767.0f);
+    UINT32 i = 0;
+
+    for (; i + 8 <= count; i += 8)
+    {
+        __m128 first = _mm_mul_ps(_mm_loadu_ps(pSource + i), scale);
+        __m128 second = _mm_mul_ps(_mm_loadu_ps(pSource + i + 4), scale);
+
+        first = _mm_min_ps(_mm_max_ps(first, low), high);
+        second = _mm_min_ps(_mm_max_ps(second, low), high);
+
+        _mm_storeu_si128((__m128i*)(pDest + i),
+            _mm_packs_epi32(_mm_cvtps_epi32(first), _mm_cvtps_epi32(second)));
+    }
+
+    ConvertFloatToInt16Scalar(pSource + i, pDest + i, count - i);
+}
+
+
+
+
+
+static UINT32 GreatestCommonDivisor(UINT32 a, UINT32 b)
+{
+    while (b != 0)
+    {
+        UINT32 rest = a % b;
+        a = b;
+        b = rest;
+    }
+
+    return a;
+}
+
+
+// modified Bessel function of the first kind, order zero - its series converges quickly
+// for the arguments of the window
+static double BesselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 50 && term > sum * 1e-12; k++)
+    {
+        double factor = x / (2.0 * k);
+        term *= factor * factor;
+        sum += term;
+    }
+
+    return sum;
+}
+
+
+static float DotScalar(const float* pTaps, const float* pSamples)
+{
+    float sum = 0.0f;
+
+    for (UINT32 i = 0; i < RESAMPLER_TAPS; i++)
+    {
+        sum += pTaps[i] * pSamples[i];
+    }
+
+    return sum;
+}
+
+
+// two accumulators, so that consecutive adds do not wait for each other
+static float DotSse2(const float* pTaps, const float* pSamples)
+{
+    __m128 first = _mm_setzero_ps();
+    __m128 second = _mm_setzero_ps();
+
+    for (UINT32 i = 0; i < RESAMPLER_TAPS; i += 8)
+    {
+        first = _mm_add_ps(first, _mm_mul_ps(_mm_load_ps(pTaps + i), _mm_loadu_ps(pSamples + i)));
+        second = _mm_add_ps(second,
+            _mm_mul_ps(_mm_load_ps(pTaps + i + 4), _mm_loadu_ps(pSamples + i + 4)));
+    }
+
+    first = _mm_add_ps(first, second);
+    first = _mm_add_ps(first, _mm_movehl_ps(first, first));
+    first = _mm_add_ss(first, _mm_shuffle_ps(first, first, _MM_SHUFFLE(1, 1, 1, 1)));
+
+    return _mm_cvtss_f32(first);
+}
+
+
+
+CPolyphaseResampler::CPolyphaseResampler(void) :
+    m_inputRate(0),
+    m_outputRate(0),
+    m_channels(0),
+    m_upFactor(1),
+    m_downFactor(1),
+    m_scalar(false),
+    m_pTaps(NULL),
+    m_pHistory(NULL),
+    m_historyStride(0),
+    m_phase(0),
+    m_position(0)
+{
+}
+
+
+CPolyphaseResampler::~CPolyphaseResampler(void)
+{
+    _aligned_free(m_pTaps);
+    _aligned_free(m_pHistory);
+}
+
+
+HRESULT CPolyphaseResampler::Initialize(UINT32 inputRate, UINT32 outputRate, UINT32 channels)
+{
+    HRESULT hr = S_OK;
+    UINT32 divisor = 0;
+
+    do
+    {
+        if (inputRate == 0 || outputRate == 0 || channels == 0)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        divisor = GreatestCommonDivisor(inputRate, outputRate);
+        if (outputRate / divisor > RESAMPLER_MAX_PHASES)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        _aligned_free(m_pTaps);
+        _aligned_free(m_pHistory);
+        m_pTaps = NULL;
+        m_pHistory = NULL;
+
+        m_inputRate = inputRate;
+        m_outputRate = outputRate;
+        m_channels = channels;
+        m_upFactor = outputRate / divisor;
+        m_downFactor = inputRate / divisor;
+
+        if (IsPassThrough())
+        {
+            break;
+        }
+
+        hr = DesignFilter();
+        BREAK_ON_FAIL(hr);
+
+        // whole vectors per channel, so every channel starts aligned
+        m_historyStride = (RESAMPLER_TAPS - 1 + RESAMPLER_BLOCK_FRAMES + 3) & ~3;
+
+        m_pHistory = (float*)_aligned_malloc(
+            (size_t)m_historyStride * m_channels * sizeof(float), 16);
+        BREAK_ON_NULL(m_pHistory, E_OUTOFMEMORY);
+
+        Reset();
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The prototype filter runs at L times the input rate.  Every phase is normalized to a gain
+// of one, which removes the ripple the phases would otherwise put on a constant signal.
+//
+HRESULT CPolyphaseResampler::DesignFilter(void)
+{
+    HRESULT hr = S_OK;
+    UINT32 length = m_upFactor * RESAMPLER_TAPS;
+    double center = (length - 1) / 2.0;
+    double ratio = (m_outputRate < m_inputRate) ? (double)m_outputRate / m_inputRate : 1.0;
+    double cutoff = RESAMPLER_CUTOFF * 0.5 * ratio / m_upFactor;    // cycles per sample
+    double windowScale = 1.0 / BesselI0(RESAMPLER_KAISER_BETA);
+
+    do
+    {
+        m_pTaps = (float*)_aligned_malloc((size_t)length * sizeof(float), 16);
+        BREAK_ON_NULL(m_pTaps, E_OUTOFMEMORY);
+
+        for (UINT32 phase = 0; phase < m_upFactor; phase++)
+        {
+            float* pPhase = m_pTaps + phase * RESAMPLER_TAPS;
+            double sum = 0.0;
+
+            for (UINT32 tap = 0; tap < RESAMPLER_TAPS; tap++)
+            {
+                UINT32 n = phase + tap * m_upFactor;
+                double x = (double)n - center;
+                double position = 2.0 * x / (length - 1);
+                double sinc = (x == 0.0) ? 1.0 :
+                    sin(2.0 * PI_D * cutoff * x) / (2.0 * PI_D * cutoff * x);
+                double window = BesselI0(RESAMPLER_KAISER_BETA *
+                    sqrt(max(0.0, 1.0 - position * position))) * windowScale;
+                double value = sinc * window;
+
+                // reversed, so the dot product walks the samples forwards
+                pPhase[RESAMPLER_TAPS - 1 - tap] = (float)value;
+                sum += value;
+            }
+
+            for (UINT32 tap = 0; tap < RESAMPLER_TAPS; tap++)
+            {
+                pPhase[tap] = (float)(pPhase[tap] / sum);
+            }
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+void CPolyphaseResampler::Reset(void)
+{
+    if (m_pHistory != NULL)
+    {
+        ZeroMemory(m_pHistory, (size_t)m_historyStride * m_channels * sizeof(float));
+    }
+
+    m_phase = 0;
+    m_position = RESAMPLER_TAPS - 1;
+}
+
+
+UINT32 CPolyphaseResampler::GetMaxOutputFrames(UINT32 inputFrames) const
+{
+    return (UINT32)(((ULONGLONG)inputFrames * m_upFactor) / m_downFactor) + 2;
+}
+
+
+//
+// The center of the prototype filter, at L times the input rate.
+//
+LONGLONG CPolyphaseResampler::GetDelay(void) const
+{
+    if (IsPassThrough())
+    {
+        return 0;
+    }
+
+    return (LONGLONG)((m_upFactor * RESAMPLER_TAPS - 1) / (2.0 * m_upFactor) * 10000000.0 /
+        m_inputRate);
+}
+
+
+UINT32 CPolyphaseResampler::Process(const float* pInput, UINT32 inputFrames, float* pOutput,
+    UINT32 maxOutputFrames)
+{
+    UINT32 written = 0;
+
+    if (IsPassThrough())
+    {
+        written = min(inputFrames, maxOutputFrames);
+        CopyMemory(pOutput, pInput, (size_t)written * m_channels * sizeof(float));
+        return written;
+    }
+
+    if (m_pHistory == NULL)
+    {
+        return 0;
+    }
+
+    while (inputFrames > 0 && written < maxOutputFrames)
+    {
+        UINT32 frames = min(inputFrames, (UINT32)RESAMPLER_BLOCK_FRAMES);
+
+        // planar, after the kept samples of every channel
+        for (UINT32 channel = 0; channel < m_channels; channel++)
+        {
+            float* pDest = m_pHistory + channel * m_historyStride + RESAMPLER_TAPS - 1;
+            const float* pSource = pInput + channel;
+
+            for (UINT32 i = 0; i < frames; i++)
+            {
+                pDest[i] = pSource[i * m_channels];
+            }
+        }
+
+        written += ProcessBlock(frames, pOutput + (size_t)written * m_channels,
+            maxOutputFrames - written);
+
+        pInput += (size_t)frames * m_channels;
+        inputFrames -= frames;
+    }
+
+    return written;
+}
+
+
+UINT32 CPolyphaseResampler::ProcessBlock(UINT32 inputFrames, float* pOutput,
+    UINT32 maxOutputFrames)
+{
+    UINT32 filled = RESAMPLER_TAPS - 1 + inputFrames;
+    UINT32 written = 0;
+
+    while (m_position < filled && written < maxOutputFrames)
+    {
+        const float* pTaps = m_pTaps + m_phase * RESAMPLER_TAPS;
+        UINT32 first = m_position - (RESAMPLER_TAPS - 1);
+
+        for (UINT32 channel = 0; channel < m_channels; channel++)
+        {
+            const float* pSamples = m_pHistory + channel * m_historyStride + first;
+
+            pOutput[channel] = m_scalar ? DotScalar(pTaps, pSamples) : DotSse2(pTaps, pSamples);
+        }
+
+        pOutput += m_channels;
+        written++;
+
+        m_phase += m_downFactor;
+        m_position += m_phase / m_upFactor;
+        m_phase %= m_upFactor;
+    }
+
+    // keep the last samples for the first outputs of the next block
+    for (UINT32 channel = 0; channel < m_channels; channel++)
+    {
+        float* pChannel = m_pHistory + channel * m_historyStride;
+
+        MoveMemory(pChannel, pChannel + inputFrames, (RESAMPLER_TAPS - 1) * sizeof(float));
+    }
+
+    // input the output had no room for is skipped
+    m_position = max(m_position, filled) - inputFrames;
+
+    return written;
+}
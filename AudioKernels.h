@@ -0,0 +1,91 @@
+#pragma once
+
+#include "Common.h"
+
+
+
+//
+//  Sample format conversions of the audio path.  Float samples are in [-1, 1); int16
+//  samples are scaled by 32768.  The SSE2 kernels convert eight samples per step and the
+//  rest one by one with the scalar kernels, which are also the reference the SSE2 kernels
+//  are checked against - both round to nearest even and saturate the same way, so they
+//  agree to the bit.
+//
+
+void ConvertInt16ToFloat(const INT16* pSource, float* pDest, UINT32 count);
+void ConvertFloatToInt16(const float* pSource, INT16* pDest, UINT32 count);
+
+void ConvertInt16ToFloatScalar(const INT16* pSource, float* pDest, UINT32 count);
+void ConvertFloatToInt16Scalar(const float* pSource, INT16* pDest, UINT32 count);
+
+
+
+// taps of every phase of the resampler - a multiple of four, for the SSE2 kernel
+#define RESAMPLER_TAPS              32
+
+// largest number of phases - the output rate divided by the greatest common divisor of the
+// rates, e.g. 160 for 44.1 kHz to 48 kHz
+#define RESAMPLER_MAX_PHASES        1024
+
+// input frames deinterleaved per step
+#define RESAMPLER_BLOCK_FRAMES      1024
+
+
+//
+//  Rational polyphase resampler of interleaved float audio.  For a rate change of L/M in
+//  lowest terms, the prototype low-pass filter - a Kaiser windowed sinc at the lower of the
+//  two Nyquist frequencies - is split into L phases of RESAMPLER_TAPS taps each, and every
+//  output sample is the dot product of one phase with the latest input samples of its
+//  channel.  Only the taps that meet an input sample are computed, so the cost is
+//  RESAMPLER_TAPS multiply-adds per output sample whatever the ratio.
+//
+//  The dot products run in SSE2 on planar copies of the channels, with the taps of every
+//  phase stored reversed and aligned.  The scalar kernel computes the same sums in order,
+//  as the reference for the SSE2 kernel - the two differ only by the rounding of the sums.
+//
+class CPolyphaseResampler
+{
+    public:
+        CPolyphaseResampler(void);
+        ~CPolyphaseResampler(void);
+
+        // E_INVALIDARG for rates whose ratio needs more than RESAMPLER_MAX_PHASES phases
+        HRESULT Initialize(UINT32 inputRate, UINT32 outputRate, UINT32 channels);
+
+        // use the scalar kernel instead of the SSE2 one
+        void SetScalar(bool scalar) { m_scalar = scalar; }
+
+        // resample frames of interleaved samples, keeping the end of the input for the next
+        // call - returns the frames written, at most maxOutputFrames.  Room for
+        // GetMaxOutputFrames(inputFrames) frames is always enough.
+        UINT32 Process(const float* pInput, UINT32 inputFrames, float* pOutput,
+            UINT32 maxOutputFrames);
+
+        UINT32 GetMaxOutputFrames(UINT32 inputFrames) const;
+
+        // forget the kept input, e.g. after a discontinuity
+        void Reset(void);
+
+        // delay of the output behind the input, 100-ns units
+        LONGLONG GetDelay(void) const;
+
+        bool IsPassThrough(void) const { return m_upFactor == m_downFactor; }
+
+    private:
+        HRESULT DesignFilter(void);
+        UINT32 ProcessBlock(UINT32 inputFrames, float* pOutput, UINT32 maxOutputFrames);
+
+        UINT32 m_inputRate;
+        UINT32 m_outputRate;
+        UINT32 m_channels;
+        UINT32 m_upFactor;          // L - phases
+        UINT32 m_downFactor;        // M - phase advance per output sample
+        bool m_scalar;
+
+        float* m_pTaps;             // m_upFactor phases of RESAMPLER_TAPS taps, reversed
+        float* m_pHistory;          // per channel: RESAMPLER_TAPS - 1 kept samples, then a block
+        UINT32 m_historyStride;     // floats per channel in m_pHistory
+
+        UINT32 m_phase;             // phase of the next output sample
+        UINT32 m_position;          // input sample of the next output sample, in a block
+};
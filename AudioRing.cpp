@@ -0,0 +1,379 @@
+#include "AudioRing.h"
+#include "MemoryBudget.h"
+#include "Tracer.h"
+
+#include <malloc.h>
+#include <math.h>
+#include <mferror.h>
+
+
+
+// a reader that keeps finding the timeline changing gives up and reads silence
+#define AUDIO_RING_READ_ATTEMPTS        16
+
+
+
+CAudioRing::CAudioRing(void) :
+    m_sampleRate(0),
+    m_channels(0),
+    m_capacity(0),
+    m_pSamples(NULL),
+    m_cbSamples(0),
+    m_writing(0),
+    m_written(0),
+    m_timelineVersion(0),
+    m_hasTimeline(false),
+    m_framesWritten(0),
+    m_silenceFrames(0),
+    m_discontinuities(0),
+    m_overrunReads(0),
+    m_pFramesMetric(NULL),
+    m_pSilenceMetric(NULL),
+    m_pDiscontinuityMetric(NULL),
+    m_pOverrunMetric(NULL)
+{
+    ZeroMemory(&m_timeline, sizeof(m_timeline));
+}
+
+
+CAudioRing::~CAudioRing(void)
+{
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+
+    pMetrics->Remove(m_pFramesMetric);
+    pMetrics->Remove(m_pSilenceMetric);
+    pMetrics->Remove(m_pDiscontinuityMetric);
+    pMetrics->Remove(m_pOverrunMetric);
+
+    if (m_pSamples != NULL)
+    {
+        _aligned_free(m_pSamples);
+        GetMemoryBudget()->Release(MemoryAccount_Audio, m_cbSamples);
+    }
+}
+
+
+HRESULT CAudioRing::Initialize(UINT32 sampleRate, UINT32 channels, UINT32 capacityFrames,
+    PCSTR labels)
+{
+    HRESULT hr = S_OK;
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+    UINT32 capacity = 1;
+
+    do
+    {
+        if (m_pSamples != NULL)
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        if (sampleRate == 0 || channels == 0 || capacityFrames == 0 ||
+            capacityFrames > 0x10000000 / channels)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        while (capacity < capacityFrames)
+        {
+            capacity <<= 1;
+        }
+
+        m_cbSamples = (ULONGLONG)capacity * channels * sizeof(float);
+        if (!GetMemoryBudget()->Reserve(MemoryAccount_Audio, m_cbSamples))
+        {
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        m_pSamples = (float*)_aligned_malloc((size_t)m_cbSamples, 16);
+        if (m_pSamples == NULL)
+        {
+            GetMemoryBudget()->Release(MemoryAccount_Audio, m_cbSamples);
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        ZeroMemory(m_pSamples, (size_t)m_cbSamples);
+
+        m_sampleRate = sampleRate;
+        m_channels = channels;
+        m_capacity = capacity;
+
+        m_pFramesMetric = pMetrics->CreateCounter("mfcp_audio_frames_total",
+            "Audio frames captured into the ring.", labels, 1.0, ReadValue,
+            (void*)&m_framesWritten);
+        m_pSilenceMetric = pMetrics->CreateCounter("mfcp_audio_silence_frames_total",
+            "Frames of silence written into gaps of the captured audio.", labels, 1.0,
+            ReadValue, (void*)&m_silenceFrames);
+        m_pDiscontinuityMetric = pMetrics->CreateCounter("mfcp_audio_discontinuities_total",
+            "Restarts of the audio timeline after a jump of the time stamps.", labels, 1.0,
+            ReadValue, (void*)&m_discontinuities);
+        m_pOverrunMetric = pMetrics->CreateCounter("mfcp_audio_overrun_reads_total",
+            "Reads of audio that was overwritten while it was copied.", labels, 1.0,
+            ReadValue, (void*)&m_overrunReads);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+LONGLONG CAudioRing::TimeOf(const Timeline& timeline, LONGLONG index) const
+{
+    return timeline.anchorTime + (LONGLONG)floor(
+        (double)(index - timeline.anchorIndex) * 10000000.0 / m_sampleRate + 0.5);
+}
+
+
+LONGLONG CAudioRing::IndexOf(const Timeline& timeline, LONGLONG time) const
+{
+    return timeline.anchorIndex + (LONGLONG)floor(
+        (double)(time - timeline.anchorTime) * m_sampleRate / 10000000.0 + 0.5);
+}
+
+
+UINT32 CAudioRing::GetFrameCount(LONGLONG duration) const
+{
+    return (duration <= 0) ? 0 : (UINT32)((double)duration * m_sampleRate / 10000000.0 + 0.5);
+}
+
+
+//
+// The interlocked increments are full barriers, so a reader that sees the same even version
+// before and after copying the timeline copied a consistent one.
+//
+void CAudioRing::SetTimeline(LONGLONG anchorIndex, LONGLONG anchorTime, LONGLONG firstIndex)
+{
+    InterlockedIncrement(&m_timelineVersion);
+
+    m_timeline.anchorIndex = anchorIndex;
+    m_timeline.anchorTime = anchorTime;
+    m_timeline.firstIndex = firstIndex;
+
+    InterlockedIncrement(&m_timelineVersion);
+}
+
+
+bool CAudioRing::ReadTimeline(Timeline* pTimeline, LONG* pVersion) const
+{
+    for (int attempt = 0; attempt < AUDIO_RING_READ_ATTEMPTS; attempt++)
+    {
+        LONG version = m_timelineVersion;
+
+        if (version == 0)
+        {
+            return false;
+        }
+
+        if ((version & 1) == 0)
+        {
+            *pTimeline = m_timeline;
+            MemoryBarrier();
+
+            if (m_timelineVersion == version)
+            {
+                if (pVersion != NULL)
+                {
+                    *pVersion = version;
+                }
+                return true;
+            }
+        }
+
+        YieldProcessor();
+    }
+
+    return false;
+}
+
+
+//
+// Publish the end of the write before the samples change and after they did - a reader
+// that copied frames the write reached sees it in m_writing once it is done copying.
+//
+void CAudioRing::CopyIn(const float* pFrames, UINT32 frameCount)
+{
+    LONGLONG start = m_written;
+    UINT32 done = (frameCount > m_capacity) ? frameCount - m_capacity : 0;
+
+    InterlockedExchange64(&m_writing, start + frameCount);
+
+    while (done < frameCount)
+    {
+        UINT32 offset = (UINT32)((start + done) & (m_capacity - 1));
+        UINT32 run = min(frameCount - done, m_capacity - offset);
+        float* pDest = m_pSamples + (size_t)offset * m_channels;
+
+        if (pFrames != NULL)
+        {
+            CopyMemory(pDest, pFrames + (size_t)done * m_channels,
+                (size_t)run * m_channels * sizeof(float));
+        }
+        else
+        {
+            ZeroMemory(pDest, (size_t)run * m_channels * sizeof(float));
+        }
+
+        done += run;
+    }
+
+    InterlockedExchange64(&m_written, start + frameCount);
+}
+
+
+void CAudioRing::Write(const float* pFrames, UINT32 frameCount, LONGLONG timestamp)
+{
+    LONGLONG written = m_written;
+
+    if (m_pSamples == NULL || frameCount == 0)
+    {
+        return;
+    }
+
+    if (!m_hasTimeline)
+    {
+        SetTimeline(written, timestamp, written);
+        m_hasTimeline = true;
+    }
+    else
+    {
+        LONGLONG difference = timestamp - TimeOf(m_timeline, written);
+
+        if (difference > AUDIO_RING_MAX_GAP || difference < -AUDIO_RING_MAX_GAP)
+        {
+            // the audio before cannot be placed on the new timeline
+            SetTimeline(written, timestamp, written);
+            InterlockedIncrement64(&m_discontinuities);
+            CTracer::Instant("audio", "discontinuity", "difference", difference);
+        }
+        else if (difference > AUDIO_RING_DRIFT_TOLERANCE)
+        {
+            // the device lost audio - keep the frames where they belong
+            UINT32 silence = GetFrameCount(difference);
+
+            CopyIn(NULL, silence);
+            InterlockedExchangeAdd64(&m_silenceFrames, silence);
+            CTracer::Instant("audio", "gap", "frames", silence);
+        }
+        else if (difference < -AUDIO_RING_DRIFT_TOLERANCE)
+        {
+            // the audio clock runs fast against the presentation clock - the frames before
+            // move by the drift, which stays within the tolerance
+            SetTimeline(written, timestamp, m_timeline.firstIndex);
+        }
+    }
+
+    CopyIn(pFrames, frameCount);
+    InterlockedExchangeAdd64(&m_framesWritten, frameCount);
+}
+
+
+void CAudioRing::Restart(void)
+{
+    LONGLONG written = m_written;
+
+    SetTimeline(written, 0, written);
+    m_hasTimeline = false;
+}
+
+
+HRESULT CAudioRing::Read(LONGLONG time, float* pDest, UINT32 frameCount, UINT32* pAvailable)
+{
+    HRESULT hr = S_FALSE;
+    Timeline timeline;
+    LONG version = 0;
+    UINT32 frameBytes = m_channels * sizeof(float);
+
+    if (pDest == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if (pAvailable != NULL)
+    {
+        *pAvailable = 0;
+    }
+
+    // the timeline changing under the copy maps the time to other frames - copy again
+    for (int attempt = 0; attempt < AUDIO_RING_READ_ATTEMPTS; attempt++)
+    {
+        LONGLONG start = 0;
+        LONGLONG first = 0;
+        LONGLONG end = 0;
+        LONGLONG overwritten = 0;
+
+        ZeroMemory(pDest, (size_t)frameCount * frameBytes);
+
+        if (m_pSamples == NULL || !ReadTimeline(&timeline, &version))
+        {
+            break;
+        }
+
+        start = IndexOf(timeline, time);
+        end = min(start + frameCount, Load(&m_written));
+        first = max(start, max(timeline.firstIndex, Load(&m_writing) - (LONGLONG)m_capacity));
+
+        for (LONGLONG index = first; index < end; )
+        {
+            UINT32 offset = (UINT32)(index & (m_capacity - 1));
+            UINT32 run = (UINT32)min(end - index, (LONGLONG)(m_capacity - offset));
+
+            CopyMemory(pDest + (size_t)(index - start) * m_channels,
+                m_pSamples + (size_t)offset * m_channels, (size_t)run * frameBytes);
+            index += run;
+        }
+
+        if (m_timelineVersion != version)
+        {
+            continue;
+        }
+
+        // the writer may have come round to the oldest frames while they were copied
+        overwritten = Load(&m_writing) - (LONGLONG)m_capacity;
+        if (first < end && overwritten > first)
+        {
+            LONGLONG lost = min(overwritten, end) - first;
+
+            ZeroMemory(pDest + (size_t)(first - start) * m_channels, (size_t)lost * frameBytes);
+            first += lost;
+            InterlockedIncrement64(&m_overrunReads);
+        }
+
+        if (pAvailable != NULL)
+        {
+            *pAvailable = (UINT32)max((LONGLONG)0, min(end - start, (LONGLONG)frameCount));
+        }
+
+        hr = (first > start || end < start + frameCount) ? S_FALSE : S_OK;
+        break;
+    }
+
+    return hr;
+}
+
+
+bool CAudioRing::GetEndTime(LONGLONG* pTime) const
+{
+    Timeline timeline;
+    LONGLONG written = Load(&m_written);
+
+    if (m_pSamples == NULL || !ReadTimeline(&timeline) || written <= timeline.firstIndex)
+    {
+        return false;
+    }
+
+    *pTime = TimeOf(timeline, written);
+
+    return true;
+}
+
+
+void CAudioRing::GetStats(AudioRingStats* pStats) const
+{
+    pStats->framesWritten = (ULONGLONG)Load(&m_framesWritten);
+    pStats->silenceFrames = (ULONGLONG)Load(&m_silenceFrames);
+    pStats->discontinuities = (ULONGLONG)Load(&m_discontinuities);
+    pStats->overrunReads = (ULONGLONG)Load(&m_overrunReads);
+}
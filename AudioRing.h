@@ -0,0 +1,119 @@
+#pragma once
+
+#include "Common.h"
+#include "Metrics.h"
+
+
+
+// seconds of audio the ring of a player keeps
+#define AUDIO_RING_SECONDS              4
+
+// timestamps this far from where the ring expects them are taken as drift and followed
+// smoothly, 100-ns units - 5 ms
+#define AUDIO_RING_DRIFT_TOLERANCE      (5 * 10000)
+
+// gaps up to this long are filled with silence, longer ones restart the timeline - 1 s
+#define AUDIO_RING_MAX_GAP              (1000 * 10000)
+
+
+struct AudioRingStats
+{
+    ULONGLONG   framesWritten;      // captured frames, without the silence
+    ULONGLONG   silenceFrames;      // frames of silence written into gaps
+    ULONGLONG   discontinuities;    // restarts of the timeline
+    ULONGLONG   overrunReads;       // reads that found their audio overwritten meanwhile
+};
+
+
+//
+//  Ring of interleaved float audio, on the presentation clock of the session - the clock
+//  the time stamps of the video frames are on, so the audio of a frame is read by its time
+//  stamp.
+//
+//  One thread writes; any number of threads read, without locks and without holding up the
+//  writer.  The writer never waits - it overwrites the oldest audio.  A reader copies what it
+//  asks for and then checks that the writer did not reach the copied frames meanwhile: the
+//  writer publishes how far it is about to write before it copies, and how far it wrote
+//  after.  The mapping of times to frames is published the same way, with a version that is
+//  odd while it changes.
+//
+//  The timeline is one frame index counting every frame ever written, and an anchor tying
+//  an index to a time.  The captured buffers are expected to follow each other without gaps;
+//  a gap is filled with silence, a small difference is followed by moving the anchor, and a
+//  jump backwards or a long gap restarts the timeline - the audio before it can no longer be
+//  read.
+//
+class CAudioRing
+{
+    public:
+        CAudioRing(void);
+        ~CAudioRing(void);
+
+        // the capacity is rounded up to a power of two; labels are those of the metrics of
+        // the ring, e.g. those of its player
+        HRESULT Initialize(UINT32 sampleRate, UINT32 channels, UINT32 capacityFrames,
+            PCSTR labels = NULL);
+
+        UINT32 GetSampleRate(void) const { return m_sampleRate; }
+        UINT32 GetChannels(void) const { return m_channels; }
+
+        // writer only - frames of interleaved samples, the first at the time in 100-ns units
+        void Write(const float* pFrames, UINT32 frameCount, LONGLONG timestamp);
+
+        // writer only - forget the timeline, e.g. when the session starts again
+        void Restart(void);
+
+        // any thread - the frames from the time on.  Frames the ring does not have - not yet
+        // written, or already overwritten - are silence, and S_FALSE is returned.
+        // pAvailable gets the frames up to the last one written; the rest is still to come.
+        HRESULT Read(LONGLONG time, float* pDest, UINT32 frameCount, UINT32* pAvailable = NULL);
+
+        // any thread - the time just after the last frame written, false if none was
+        bool GetEndTime(LONGLONG* pTime) const;
+
+        // any thread - frames covering a duration, rounded
+        UINT32 GetFrameCount(LONGLONG duration) const;
+
+        void GetStats(AudioRingStats* pStats) const;
+
+    private:
+        struct Timeline
+        {
+            LONGLONG anchorIndex;           // frame index at anchorTime
+            LONGLONG anchorTime;
+            LONGLONG firstIndex;            // first frame of the timeline
+        };
+
+        void CopyIn(const float* pFrames, UINT32 frameCount);
+        void SetTimeline(LONGLONG anchorIndex, LONGLONG anchorTime, LONGLONG firstIndex);
+        bool ReadTimeline(Timeline* pTimeline, LONG* pVersion = NULL) const;
+        LONGLONG TimeOf(const Timeline& timeline, LONGLONG index) const;
+        LONGLONG IndexOf(const Timeline& timeline, LONGLONG time) const;
+
+        static LONGLONG Load(const volatile LONGLONG* pValue)
+            { return InterlockedCompareExchange64((volatile LONGLONG*)pValue, 0, 0); }
+        static LONGLONG ReadValue(void* pContext) { return Load((volatile LONGLONG*)pContext); }
+
+        UINT32 m_sampleRate;
+        UINT32 m_channels;
+        UINT32 m_capacity;                  // frames, a power of two
+        float* m_pSamples;
+        ULONGLONG m_cbSamples;              // reserved from the memory budget
+
+        volatile LONGLONG m_writing;        // frames written once the current write is done
+        volatile LONGLONG m_written;        // frames written
+
+        volatile LONG m_timelineVersion;    // odd while the timeline changes
+        Timeline m_timeline;
+        bool m_hasTimeline;                 // writer only
+
+        volatile LONGLONG m_framesWritten;
+        volatile LONGLONG m_silenceFrames;
+        volatile LONGLONG m_discontinuities;
+        volatile LONGLONG m_overrunReads;
+
+        CMetricCounter* m_pFramesMetric;
+        CMetricCounter* m_pSilenceMetric;
+        CMetricCounter* m_pDiscontinuityMetric;
+        CMetricCounter* m_pOverrunMetric;
+};
@@ -0,0 +1,322 @@
+#include "ContentHash.h"
+#include "FrameFileSource.h"
+
+#include <emmintrin.h>
+#include <string.h>
+
+
+
+#define HASH_STRIPE_BYTES           64
+#define HASH_BLOCK_STRIPES          8       // stripes between two scrambles of the lanes
+
+static const UINT64 PRIME64_1 = 0x9E3779B185EBCA87ULL;
+static const UINT64 PRIME64_2 = 0xC2B2AE3D27D4EB4FULL;
+static const UINT64 PRIME64_3 = 0x165667B19E3779F9ULL;
+static const UINT64 PRIME64_4 = 0x85EBCA77C2B2AE63ULL;
+static const UINT64 PRIME64_5 = 0x27D4EB2F165667C5ULL;
+static const UINT32 PRIME32_1 = 0x9E3779B1U;
+static const UINT32 PRIME32_2 = 0x85EBCA77U;
+static const UINT32 PRIME32_3 = 0xC2B2AE3DU;
+
+//
+// Key the stripes are mixed with - stripe n of a block uses the 64 bytes at n * 8, and the
+// scramble the last 64.  Any random bytes do, these are the first outputs of splitmix64.
+//
+static const UINT64 s_key[16] =
+{
+    0xE220A8397B1DCDAFULL, 0x6E789E6AA1B965F4ULL,
+    0x06C45D188009454FULL, 0xF88BB8A8724C81ECULL,
+    0x1B39896A51A8749BULL, 0x53CB9F0C747EA2EAULL,
+    0x2C829ABE1F4532E1ULL, 0xC584133AC916AB3CULL,
+    0x3EE5789041C98AC3ULL, 0xF3B8488C368CB0A6ULL,
+    0x657EECDD3CB13D09ULL, 0xC2D326E0055BDEF6ULL,
+    0x8621A03FE0BBDB7BULL, 0x8E1F7555983AA92FULL,
+    0xB54E0F1600CC4D19ULL, 0x84BB3F97971D80ABULL,
+};
+
+
+static inline UINT64 RotateLeft(UINT64 value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+
+static inline UINT64 MergeRound(UINT64 hash, UINT64 lane)
+{
+    hash ^= RotateLeft(lane * PRIME64_2, 31) * PRIME64_1;
+    return RotateLeft(hash, 27) * PRIME64_1 + PRIME64_4;
+}
+
+
+
+
+
+void CContentHash::Reset(UINT64 seed)
+{
+    m_acc[0] = PRIME32_3;
+    m_acc[1] = PRIME64_1 + seed;
+    m_acc[2] = PRIME64_2;
+    m_acc[3] = PRIME64_3 - seed;
+    m_acc[4] = PRIME64_4;
+    m_acc[5] = PRIME32_2 + seed;
+    m_acc[6] = PRIME64_5;
+    m_acc[7] = PRIME32_1 - seed;
+
+    m_buffered = 0;
+    m_stripe = 0;
+    m_total = 0;
+}
+
+
+void CContentHash::Update(const void* pData, size_t cbData)
+{
+    const BYTE* pBytes = (const BYTE*)pData;
+    size_t stripes = 0;
+
+    m_total += cbData;
+
+    // complete the partial stripe of the last call first
+    if (m_buffered > 0)
+    {
+        size_t take = min(cbData, (size_t)(HASH_STRIPE_BYTES - m_buffered));
+
+        memcpy(m_buffer + m_buffered, pBytes, take);
+        m_buffered += (UINT32)take;
+        pBytes += take;
+        cbData -= take;
+
+        if (m_buffered < HASH_STRIPE_BYTES)
+        {
+            return;
+        }
+
+        Accumulate(m_buffer, 1);
+        m_buffered = 0;
+    }
+
+    // whole stripes straight from the caller's memory
+    stripes = cbData / HASH_STRIPE_BYTES;
+    if (stripes > 0)
+    {
+        Accumulate(pBytes, stripes);
+        pBytes += stripes * HASH_STRIPE_BYTES;
+        cbData -= stripes * HASH_STRIPE_BYTES;
+    }
+
+    if (cbData > 0)
+    {
+        memcpy(m_buffer, pBytes, cbData);
+        m_buffered = (UINT32)cbData;
+    }
+}
+
+
+//
+// The partial stripe is accumulated zero padded into a copy of the lanes, so Final() can be
+// called in the middle of the data.  The byte count goes into the merge, which keeps
+// inputs that differ only by trailing zeros apart.
+//
+UINT64 CContentHash::Final(void) const
+{
+    CContentHash state(*this);
+    UINT64 hash = m_total * PRIME64_5;
+
+    if (state.m_buffered > 0)
+    {
+        memset(state.m_buffer + state.m_buffered, 0, HASH_STRIPE_BYTES - state.m_buffered);
+        state.Accumulate(state.m_buffer, 1);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        hash = MergeRound(hash, state.m_acc[i]);
+    }
+
+    hash ^= hash >> 33;
+    hash *= PRIME64_2;
+    hash ^= hash >> 29;
+    hash *= PRIME64_3;
+    hash ^= hash >> 32;
+
+    return hash;
+}
+
+
+UINT64 CContentHash::Hash(const void* pData, size_t cbData, UINT64 seed)
+{
+    CContentHash hash(seed);
+
+    hash.Update(pData, cbData);
+    return hash.Final();
+}
+
+
+//
+// Every 64-bit lane takes the data xor the key, multiplies its two 32-bit halves, and adds
+// the product and the data of the neighbouring lane - so a lane whose product happens to
+// be zero still depends on the data.
+//
+void CContentHash::Accumulate(const BYTE* pStripes, size_t stripeCount)
+{
+    const BYTE* pKey = (const BYTE*)s_key;
+    const __m128i prime = _mm_set1_epi32((int)PRIME32_1);
+    __m128i acc[4];
+
+    for (int j = 0; j < 4; j++)
+    {
+        acc[j] = _mm_loadu_si128((const __m128i*)m_acc + j);
+    }
+
+    for (size_t i = 0; i < stripeCount; i++, pStripes += HASH_STRIPE_BYTES)
+    {
+        const BYTE* pStripeKey = pKey + m_stripe * 8;
+
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i data = _mm_loadu_si128((const __m128i*)pStripes + j);
+            __m128i key = _mm_loadu_si128((const __m128i*)pStripeKey + j);
+            __m128i mixed = _mm_xor_si128(data, key);
+            __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(0, 3, 0, 1)));
+
+            acc[j] = _mm_add_epi64(acc[j], _mm_add_epi64(product,
+                _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2))));
+        }
+
+        if (++m_stripe < HASH_BLOCK_STRIPES)
+        {
+            continue;
+        }
+
+        // scramble the lanes at the end of a block, so the sums do not only ever grow
+        for (int j = 0; j < 4; j++)
+        {
+            __m128i key = _mm_loadu_si128((const __m128i*)(pKey + 64) + j);
+            __m128i value = _mm_xor_si128(acc[j], _mm_srli_epi64(acc[j], 47));
+
+            value = _mm_xor_si128(value, key);
+            acc[j] = _mm_add_epi64(_mm_mul_epu32(value, prime),
+                _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(value, 32), prime), 32));
+        }
+
+        m_stripe = 0;
+    }
+
+    for (int j = 0; j < 4; j++)
+    {
+        _mm_storeu_si128((__m128i*)m_acc + j, acc[j]);
+    }
+}
+
+
+
+
+
+UINT64 GetFrameContentHash(const FrameFormat& format, const FramePlane* pPlanes)
+{
+    CContentHash hash;
+    DWORD rowBytes = GetPackedRowBytes(format.subtype, format.width);
+    UINT32 planeCount = (format.subtype == MFVideoFormat_NV12) ? 2 : 1;
+
+    for (UINT32 i = 0; i < planeCount; i++)
+    {
+        const BYTE* pRow = pPlanes[i].pData;
+
+        for (UINT32 y = 0; y < pPlanes[i].height; y++, pRow += pPlanes[i].stride)
+        {
+            hash.Update(pRow, rowBytes);
+        }
+    }
+
+    return hash.Final();
+}
+
+
+//
+// The cells are averaged over a grid of at most 16x16 samples each - enough for a stable
+// average, and a 4K frame costs about as much as a thumbnail.
+//
+UINT64 GetDifferenceHash(const BYTE* pData, LONG stride, UINT32 step, UINT32 width,
+    UINT32 height)
+{
+    const UINT32 columns = 9;
+    const UINT32 rows = 8;
+    UINT32 cells[rows][columns];
+    UINT64 hash = 0;
+
+    if (pData == NULL || width < columns || height < rows)
+    {
+        return 0;
+    }
+
+    for (UINT32 cy = 0; cy < rows; cy++)
+    {
+        UINT32 top = cy * height / rows;
+        UINT32 bottom = (cy + 1) * height / rows;
+        UINT32 dy = max((bottom - top) / 16, 1u);
+
+        for (UINT32 cx = 0; cx < columns; cx++)
+        {
+            UINT32 left = cx * width / columns;
+            UINT32 right = (cx + 1) * width / columns;
+            UINT32 dx = max((right - left) / 16, 1u);
+            UINT32 sum = 0;
+            UINT32 count = 0;
+
+            for (UINT32 y = top; y < bottom; y += dy)
+            {
+                const BYTE* pRow = pData + (LONG)y * stride;
+
+                for (UINT32 x = left; x < right; x += dx)
+                {
+                    sum += pRow[x * step];
+                    count++;
+                }
+            }
+
+            cells[cy][cx] = sum / count;
+        }
+    }
+
+    for (UINT32 cy = 0; cy < rows; cy++)
+    {
+        for (UINT32 cx = 0; cx + 1 < columns; cx++)
+        {
+            hash = (hash << 1) | ((cells[cy][cx] < cells[cy][cx + 1]) ? 1 : 0);
+        }
+    }
+
+    return hash;
+}
+
+
+//
+// RGB32 has no luma plane - green carries most of the luminance and stands in for it.
+//
+UINT64 GetFrameDifferenceHash(const FrameFormat& format, const FramePlane* pPlanes)
+{
+    if (format.subtype == MFVideoFormat_YUY2)
+    {
+        return GetDifferenceHash(pPlanes[0].pData, pPlanes[0].stride, 2, format.width,
+            format.height);
+    }
+    else if (format.subtype == MFVideoFormat_RGB32)
+    {
+        return GetDifferenceHash(pPlanes[0].pData + 1, pPlanes[0].stride, 4, format.width,
+            format.height);
+    }
+
+    return GetDifferenceHash(pPlanes[0].pData, pPlanes[0].stride, 1, format.width,
+        format.height);
+}
+
+
+UINT32 GetHashDistance(UINT64 hash1, UINT64 hash2)
+{
+    UINT64 bits = hash1 ^ hash2;
+
+    bits = bits - ((bits >> 1) & 0x5555555555555555ULL);
+    bits = (bits & 0x3333333333333333ULL) + ((bits >> 2) & 0x3333333333333333ULL);
+    bits = (bits + (bits >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+
+    return (UINT32)((bits * 0x0101010101010101ULL) >> 56);
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameView.h"
+
+
+
+//
+//  Fast 64-bit content hash, in the style of xxHash3: the data is consumed in 64-byte
+//  stripes by eight 64-bit lanes, each stripe mixed with a slice of a fixed key and
+//  folded in with a 32x32->64 multiply - four SSE2 multiplies per stripe, so a frame
+//  hashes at memory speed.  The lanes are scrambled every few stripes, and merged and
+//  avalanched into the hash at the end.
+//
+//  The hash identifies content, it is not a cryptographic hash - anybody can make two
+//  inputs collide on purpose.
+//
+class CContentHash
+{
+    public:
+        CContentHash(UINT64 seed = 0) { Reset(seed); }
+
+        void Reset(UINT64 seed = 0);
+
+        // add bytes - the hash does not depend on how the data is split between calls
+        void Update(const void* pData, size_t cbData);
+
+        // hash of the bytes added since Reset() - more bytes may still be added after it
+        UINT64 Final(void) const;
+
+        // hash of one block of memory
+        static UINT64 Hash(const void* pData, size_t cbData, UINT64 seed = 0);
+
+    private:
+        void Accumulate(const BYTE* pStripes, size_t stripeCount);
+
+        UINT64 m_acc[8];
+        BYTE m_buffer[64];              // partial stripe
+        UINT32 m_buffered;
+        UINT32 m_stripe;                // stripe within the current block - picks the key
+        ULONGLONG m_total;              // bytes added
+};
+
+
+//
+//  Hash of the visible pixels of a frame - padding at the end of the rows is left out, so
+//  the same picture hashes the same whatever buffer it was captured into.
+//
+UINT64 GetFrameContentHash(const FrameFormat& format, const FramePlane* pPlanes);
+
+
+//
+//  Perceptual difference hash (dHash) of an 8-bit image: the image is reduced to 9x8 cell
+//  averages, and every bit tells whether a cell is darker than its right neighbour.  Noise,
+//  recompression and small changes of brightness leave most bits as they are, so similar
+//  pictures have hashes a few bits apart - compare them with GetHashDistance().
+//
+//  step is the distance in bytes between two samples of a row - 2 for the luma of YUY2.
+//  Images smaller than 9x8 have no perceptual hash and give 0.
+//
+UINT64 GetDifferenceHash(const BYTE* pData, LONG stride, UINT32 step, UINT32 width,
+    UINT32 height);
+
+// perceptual hash of the luma of a frame
+UINT64 GetFrameDifferenceHash(const FrameFormat& format, const FramePlane* pPlanes);
+
+// number of bits in which two hashes differ
+UINT32 GetHashDistance(UINT64 hash1, UINT64 hash2);
@@ -0,0 +1,175 @@
+#include "EventBus.h"
+
+#include <malloc.h>
+
+
+
+CEventBus::CEventBus(PCSTR labels)
+{
+    static const double batchBounds[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256 };
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+
+    InitializeSListHead(&m_pending);
+    InitializeSListHead(&m_pool);
+
+    // auto-reset - the consumer drains everything after each wake up
+    m_wakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+
+    m_pPostedMetric = pMetrics->CreateCounter("mfcp_event_bus_events_total",
+        "Events posted to the event bus of the player.", labels);
+    m_pBatchMetric = pMetrics->CreateHistogram("mfcp_event_bus_batch_size",
+        "Events handled per wake up of the control thread.", labels, batchBounds,
+        ARRAYSIZE(batchBounds));
+    m_pLatencyMetric = pMetrics->CreateLatencyHistogram("mfcp_event_bus_latency_seconds",
+        "Time from posting an event to the control thread taking it.", labels);
+}
+
+
+CEventBus::~CEventBus(void)
+{
+    PSLIST_ENTRY pEntry = NULL;
+
+    Free(Drain());
+
+    while ((pEntry = InterlockedPopEntrySList(&m_pool)) != NULL)
+    {
+        _aligned_free(pEntry);
+    }
+
+    if (m_wakeEvent != NULL)
+    {
+        CloseHandle(m_wakeEvent);
+    }
+
+    GetMetricsRegistry()->Remove(m_pPostedMetric);
+    GetMetricsRegistry()->Remove(m_pBatchMetric);
+    GetMetricsRegistry()->Remove(m_pLatencyMetric);
+}
+
+
+//
+// An event from the pool, or a new one.  The pool is popped by any producer, which the
+// interlocked list handles without the ABA problem of a plain compare-and-swap stack.
+//
+BusEvent* CEventBus::AllocateEvent(void)
+{
+    BusEvent* pEvent = (BusEvent*)InterlockedPopEntrySList(&m_pool);
+
+    if (pEvent == NULL)
+    {
+        pEvent = (BusEvent*)_aligned_malloc(sizeof(BusEvent), MEMORY_ALLOCATION_ALIGNMENT);
+    }
+
+    return pEvent;
+}
+
+
+HRESULT CEventBus::Post(BusEventType type, DWORD code, HRESULT status, LONGLONG value,
+    IUnknown* pObject)
+{
+    BusEvent* pEvent = AllocateEvent();
+
+    if (pEvent == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    pEvent->pNext = NULL;
+    pEvent->type = type;
+    pEvent->code = code;
+    pEvent->status = status;
+    pEvent->value = value;
+    pEvent->posted = GetMetricsTime();
+    pEvent->pObject = pObject;
+
+    if (pObject != NULL)
+    {
+        pObject->AddRef();
+    }
+
+    if (m_pPostedMetric != NULL)
+    {
+        m_pPostedMetric->Add(1);
+    }
+
+    // Only the post that finds the bus empty wakes the consumer - the others land in the
+    // batch it is about to drain.  If the consumer drains between the push and the signal,
+    // it wakes once more to an empty bus, which is harmless.
+    if (InterlockedPushEntrySList(&m_pending, &pEvent->entry) == NULL)
+    {
+        SetEvent(m_wakeEvent);
+    }
+
+    return S_OK;
+}
+
+
+//
+// Take the whole pending list in one exchange and reverse it - it was pushed newest first.
+//
+BusEvent* CEventBus::Drain(UINT32* pCount)
+{
+    PSLIST_ENTRY pEntry = InterlockedFlushSList(&m_pending);
+    BusEvent* pBatch = NULL;
+    LONGLONG now = 0;
+    UINT32 count = 0;
+
+    if (pEntry != NULL)
+    {
+        now = GetMetricsTime();
+    }
+
+    while (pEntry != NULL)
+    {
+        BusEvent* pEvent = (BusEvent*)pEntry;
+
+        pEntry = pEntry->Next;
+
+        pEvent->pNext = pBatch;
+        pBatch = pEvent;
+        count++;
+
+        if (m_pLatencyMetric != NULL)
+        {
+            m_pLatencyMetric->Observe(now - pEvent->posted);
+        }
+    }
+
+    if (count > 0 && m_pBatchMetric != NULL)
+    {
+        m_pBatchMetric->Observe(count);
+    }
+
+    if (pCount != NULL)
+    {
+        *pCount = count;
+    }
+
+    return pBatch;
+}
+
+
+void CEventBus::Free(BusEvent* pBatch)
+{
+    while (pBatch != NULL)
+    {
+        BusEvent* pEvent = pBatch;
+
+        pBatch = pBatch->pNext;
+
+        if (pEvent->pObject != NULL)
+        {
+            pEvent->pObject->Release();
+            pEvent->pObject = NULL;
+        }
+
+        if (QueryDepthSList(&m_pool) < EVENT_BUS_POOL_SIZE)
+        {
+            InterlockedPushEntrySList(&m_pool, &pEvent->entry);
+        }
+        else
+        {
+            _aligned_free(pEvent);
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include "Common.h"
+#include "Metrics.h"
+
+
+
+//
+//  Multi-producer, single-consumer event bus of the player.  Media session events, camera
+//  hot-plug notifications, commands of the UI and errors of the frame pipeline are posted
+//  from whatever thread they happen on, and one control thread drains them in batches.
+//
+//  Posting is lock-free: an event is pushed on an interlocked singly linked list, and the
+//  consumer takes every pending event at once with a single interlocked exchange, so a burst
+//  of events costs the consumer one wait and one lock, not one per event.  The wait event is
+//  only signaled by the post that finds the bus empty.  Drained events are recycled through
+//  a second interlocked list, so a steady stream of events does not touch the heap.
+//
+
+#define EVENT_BUS_POOL_SIZE         256     // drained events kept for reuse
+
+enum BusEventType
+{
+    BusEvent_Session = 0,       // media session event - code is the MediaEventType,
+                                // pObject the IMFMediaEvent
+    BusEvent_Device,            // capture device arrived or left - code is the DBT_ code
+    BusEvent_Command,           // command to the consumer - code is defined by it
+    BusEvent_PipelineError      // the pipeline failed - code is the stage index
+};
+
+
+//
+//  One event.  The bus holds a reference to pObject until the event is freed.
+//
+struct BusEvent
+{
+    SLIST_ENTRY entry;          // first, and aligned as the interlocked list needs
+    BusEvent* pNext;            // next event of a drained batch, in posting order
+    BusEventType type;
+    DWORD code;
+    HRESULT status;
+    LONGLONG value;
+    LONGLONG posted;            // GetMetricsTime() when posted
+    IUnknown* pObject;
+};
+
+
+class CEventBus
+{
+    public:
+        // labels of the metrics of the bus, e.g. those of its player
+        CEventBus(PCSTR labels = NULL);
+        ~CEventBus(void);
+
+        // from any thread - fails only if out of memory
+        HRESULT Post(BusEventType type, DWORD code, HRESULT status = S_OK, LONGLONG value = 0,
+            IUnknown* pObject = NULL);
+
+        // signaled when events are pending - the consumer waits on it, then drains
+        HANDLE GetWaitHandle(void) const { return m_wakeEvent; }
+
+        // take every pending event, oldest first, NULL if none - consumer thread only.  The
+        // batch is handed back with Free().
+        BusEvent* Drain(UINT32* pCount = NULL);
+        void Free(BusEvent* pBatch);
+
+    private:
+        BusEvent* AllocateEvent(void);
+
+        SLIST_HEADER m_pending;             // posted events, newest first
+        SLIST_HEADER m_pool;                // free events
+        HANDLE m_wakeEvent;
+
+        CMetricCounter* m_pPostedMetric;
+        CMetricHistogram* m_pBatchMetric;
+        CMetricHistogram* m_pLatencyMetric;
+};
@@ -0,0 +1,852 @@
+#include "FrameCodec.h"
+#include "FrameFileSource.h"
+
+
+
+// rANS coder parameters - frequencies sum to 1 << RANS_SCALE_BITS, and the state is kept in
+// [RANS_LOWER_BOUND, RANS_LOWER_BOUND << 8) with byte-wise renormalization
+#define RANS_SCALE_BITS             12
+#define RANS_SCALE                  (1u << RANS_SCALE_BITS)
+#define RANS_LOWER_BOUND            (1u << 23)
+
+// bytes of the rANS header of a component - frequency table and data size
+#define RANS_HEADER_BYTES           (256 * sizeof(WORD) + sizeof(DWORD))
+
+
+
+//
+// Median edge detector of LOCO-I - the smaller of left and up across a horizontal or
+// vertical edge, the plane through the three neighbours elsewhere.  That is the gradient
+// left + up - upLeft clamped between left and up, which needs no branches.
+//
+static inline BYTE PredictMed(BYTE left, BYTE up, BYTE upLeft)
+{
+    int low = min(left, up);
+    int high = max(left, up);
+    int gradient = (int)left + up - upLeft;
+
+    return (BYTE)max(low, min(high, gradient));
+}
+
+
+//
+// Residuals are folded so that small differences of either sign become small codes -
+// 0, -1, 1, -2, 2 ... map to 0, 1, 2, 3, 4 ...
+//
+static inline BYTE FoldResidual(BYTE residual)
+{
+    signed char d = (signed char)residual;
+
+    return (d >= 0) ? (BYTE)(d * 2) : (BYTE)(-d * 2 - 1);
+}
+
+static inline BYTE UnfoldResidual(BYTE code)
+{
+    return (code & 1) ? (BYTE)(-(int)((code + 1) >> 1)) : (BYTE)(code >> 1);
+}
+
+
+//
+// Scale the symbol counts to frequencies that sum to RANS_SCALE.  Every symbol that occurs
+// keeps a frequency of at least 1; what that adds is taken from the most frequent symbols.
+//
+static void NormalizeFrequencies(const DWORD* pCounts, DWORD total, WORD* pFreq)
+{
+    DWORD sum = 0;
+    DWORD largest = 0;
+
+    for (UINT32 s = 0; s < 256; s++)
+    {
+        DWORD freq = 0;
+
+        if (pCounts[s] != 0)
+        {
+            freq = (DWORD)((ULONGLONG)pCounts[s] * RANS_SCALE / total);
+            if (freq == 0)
+            {
+                freq = 1;
+            }
+        }
+
+        pFreq[s] = (WORD)freq;
+        sum += freq;
+
+        if (freq > pFreq[largest])
+        {
+            largest = s;
+        }
+    }
+
+    if (sum < RANS_SCALE)
+    {
+        pFreq[largest] = (WORD)(pFreq[largest] + (RANS_SCALE - sum));
+        return;
+    }
+
+    while (sum > RANS_SCALE)
+    {
+        DWORD take = 0;
+
+        largest = 0;
+        for (UINT32 s = 1; s < 256; s++)
+        {
+            if (pFreq[s] > pFreq[largest])
+            {
+                largest = s;
+            }
+        }
+
+        take = min(sum - RANS_SCALE, (DWORD)pFreq[largest] - 1);
+        pFreq[largest] = (WORD)(pFreq[largest] - take);
+        sum -= take;
+    }
+}
+
+
+//
+// Encoder view of a symbol - the division of the coder step is done as a multiplication with
+// a fixed-point reciprocal of the frequency (see Fabian Giesen, "rANS with static
+// probability distributions").
+//
+struct RansSymbol
+{
+    UINT32 limit;               // state from which the coder renormalizes first
+    UINT32 reciprocal;
+    UINT32 bias;
+    UINT32 complement;          // RANS_SCALE - frequency
+    UINT32 shift;
+};
+
+static void InitRansSymbols(const WORD* pFreq, RansSymbol* pSymbols)
+{
+    UINT32 start = 0;
+
+    for (UINT32 s = 0; s < 256; s++)
+    {
+        RansSymbol& symbol = pSymbols[s];
+        UINT32 freq = pFreq[s];
+
+        symbol.limit = ((RANS_LOWER_BOUND >> RANS_SCALE_BITS) << 8) * freq;
+        symbol.complement = RANS_SCALE - freq;
+
+        if (freq < 2)
+        {
+            // x / 1 is x - the reciprocal rounds to all ones, and the bias makes up for it
+            symbol.reciprocal = ~0u;
+            symbol.shift = 32;
+            symbol.bias = start + RANS_SCALE - 1;
+        }
+        else
+        {
+            UINT32 shift = 0;
+
+            while (freq > (1u << shift))
+            {
+                shift++;
+            }
+
+            symbol.reciprocal = (UINT32)(((1ull << (shift + 31)) + freq - 1) / freq);
+            symbol.shift = shift - 1 + 32;
+            symbol.bias = start;
+        }
+
+        start += freq;
+    }
+}
+
+
+//
+// Encode the symbols with two interleaved coders - even symbols on one, odd on the other -
+// which halves the dependency chain of the decoder.  rANS works backwards: the symbols are
+// coded last to first, and the output grows from the end of the buffer towards its start.
+// Every symbol emits at most two bytes, so 2 * count + 8 bytes always suffice.
+//
+static const BYTE* RansEncode(const BYTE* pSymbols, DWORD count, const WORD* pFreq,
+    BYTE* pOut, DWORD cbOut)
+{
+    RansSymbol symbols[256];
+    BYTE* p = pOut + cbOut;
+    UINT32 state[2] = { RANS_LOWER_BOUND, RANS_LOWER_BOUND };
+
+    InitRansSymbols(pFreq, symbols);
+
+    for (DWORD i = count; i-- > 0; )
+    {
+        UINT32& x = state[i & 1];
+        const RansSymbol& symbol = symbols[pSymbols[i]];
+        UINT32 quotient = 0;
+
+        while (x >= symbol.limit)
+        {
+            *--p = (BYTE)x;
+            x >>= 8;
+        }
+
+        // x = (x / freq) * RANS_SCALE + x % freq + start
+        quotient = (UINT32)(((ULONGLONG)x * symbol.reciprocal) >> symbol.shift);
+        x += symbol.bias + quotient * symbol.complement;
+    }
+
+    // the decoder reads the state of the even symbols first
+    for (int k = 1; k >= 0; k--)
+    {
+        p -= 4;
+        p[0] = (BYTE)state[k];
+        p[1] = (BYTE)(state[k] >> 8);
+        p[2] = (BYTE)(state[k] >> 16);
+        p[3] = (BYTE)(state[k] >> 24);
+    }
+
+    return p;
+}
+
+
+static HRESULT RansDecode(const BYTE* pData, DWORD cbData, const WORD* pFreq, BYTE* pSymbols,
+    DWORD count)
+{
+    BYTE slotSymbol[RANS_SCALE];
+    WORD start[256];
+    const BYTE* p = pData;
+    const BYTE* pEnd = pData + cbData;
+    UINT32 state[2];
+    DWORD sum = 0;
+
+    for (UINT32 s = 0; s < 256; s++)
+    {
+        if (sum + pFreq[s] > RANS_SCALE)
+        {
+            return MF_E_INVALID_FILE_FORMAT;
+        }
+
+        start[s] = (WORD)sum;
+        FillMemory(slotSymbol + sum, pFreq[s], (BYTE)s);
+        sum += pFreq[s];
+    }
+
+    if (sum != RANS_SCALE || cbData < 8)
+    {
+        return MF_E_INVALID_FILE_FORMAT;
+    }
+
+    for (int k = 0; k < 2; k++)
+    {
+        state[k] = p[0] | (p[1] << 8) | (p[2] << 16) | ((UINT32)p[3] << 24);
+        p += 4;
+    }
+
+    for (DWORD i = 0; i < count; i++)
+    {
+        UINT32& x = state[i & 1];
+        UINT32 slot = x & (RANS_SCALE - 1);
+        BYTE s = slotSymbol[slot];
+
+        x = pFreq[s] * (x >> RANS_SCALE_BITS) + slot - start[s];
+
+        while (x < RANS_LOWER_BOUND)
+        {
+            if (p == pEnd)
+            {
+                return MF_E_INVALID_FILE_FORMAT;
+            }
+
+            x = (x << 8) | *p++;
+        }
+
+        pSymbols[i] = s;
+    }
+
+    return S_OK;
+}
+
+
+
+
+
+CFrameCodec::CFrameCodec(void) :
+    m_pScheduler(NULL),
+    m_sliceCount(0),
+    m_pPlanes(NULL),
+    m_componentCount(0),
+    m_activeSlices(0)
+{
+    ZeroMemory(&m_format, sizeof(m_format));
+    ZeroMemory(m_components, sizeof(m_components));
+}
+
+
+//
+// Every byte of a packed frame is one sample of one component, so a frame codes into at most
+// its packed size, plus the headers and one mode byte per component and slice.
+//
+DWORD CFrameCodec::GetMaxEncodedBytes(const FrameFormat& format)
+{
+    return sizeof(FrameCodecHeader) + FRAME_CODEC_MAX_SLICES * (sizeof(DWORD) + 4) +
+        GetPackedFrameBytes(format.subtype, format.width, format.height);
+}
+
+
+void CFrameCodec::GetPackedPlanes(const FrameFormat& format, BYTE* pData, FramePlane* pPlanes)
+{
+    pPlanes[0].pData = pData;
+    pPlanes[0].stride = (LONG)GetPackedRowBytes(format.subtype, format.width);
+    pPlanes[0].width = format.width;
+    pPlanes[0].height = format.height;
+
+    if (format.subtype == MFVideoFormat_NV12)
+    {
+        pPlanes[1].pData = pData + pPlanes[0].stride * (LONG)format.height;
+        pPlanes[1].stride = pPlanes[0].stride;
+        pPlanes[1].width = format.width / 2;
+        pPlanes[1].height = format.height / 2;
+    }
+}
+
+
+//
+// The green channel of RGB32 is coded first, so red and blue can be coded as their
+// difference to it - which removes most of what the three channels have in common.
+//
+UINT32 CFrameCodec::GetComponents(const FrameFormat& format, Component* pComponents) const
+{
+    const Component yuy2[3] =
+    {
+        { 0, 0, 2, format.width, 0, false },
+        { 0, 1, 4, format.width / 2, 0, false },
+        { 0, 3, 4, format.width / 2, 0, false }
+    };
+    const Component nv12[3] =
+    {
+        { 0, 0, 1, format.width, 0, false },
+        { 1, 0, 2, format.width / 2, 1, false },
+        { 1, 1, 2, format.width / 2, 1, false }
+    };
+    const Component rgb32[4] =
+    {
+        { 0, 1, 4, format.width, 0, false },
+        { 0, 0, 4, format.width, 0, true },
+        { 0, 2, 4, format.width, 0, true },
+        { 0, 3, 4, format.width, 0, false }
+    };
+
+    if (format.subtype == MFVideoFormat_YUY2)
+    {
+        CopyMemory(pComponents, yuy2, sizeof(yuy2));
+        return ARRAYSIZE(yuy2);
+    }
+
+    if (format.subtype == MFVideoFormat_NV12)
+    {
+        CopyMemory(pComponents, nv12, sizeof(nv12));
+        return ARRAYSIZE(nv12);
+    }
+
+    if (format.subtype == MFVideoFormat_RGB32)
+    {
+        CopyMemory(pComponents, rgb32, sizeof(rgb32));
+        return ARRAYSIZE(rgb32);
+    }
+
+    return 0;
+}
+
+
+//
+// Split the frame into bands of rows - an even number of rows each, so no NV12 chroma row is
+// shared by two slices.
+//
+void CFrameCodec::PlanSlices(const FrameFormat& format, UINT32 sliceCount)
+{
+    UINT32 maxSlices = max(format.height / 2, 1u);
+
+    sliceCount = min(max(sliceCount, 1u), min(maxSlices, (UINT32)FRAME_CODEC_MAX_SLICES));
+
+    if (m_slices.size() < sliceCount)
+    {
+        m_slices.resize(sliceCount);
+    }
+
+    for (UINT32 i = 0; i < sliceCount; i++)
+    {
+        UINT32 first = (i * format.height / sliceCount) & ~1u;
+        UINT32 next = (i + 1 == sliceCount) ? format.height :
+            ((i + 1) * format.height / sliceCount) & ~1u;
+
+        m_slices[i].firstRow = first;
+        m_slices[i].rowCount = next - first;
+        m_slices[i].pSource = NULL;
+        m_slices[i].cbSource = 0;
+        m_slices[i].hr = S_OK;
+    }
+
+    m_activeSlices = sliceCount;
+}
+
+
+//
+// Run every slice as a task, and wait for all of them - the waiting thread runs tasks too.
+// Without a running scheduler the slices run one after the other on the caller.
+//
+void CFrameCodec::RunSlices(TaskProc pProc)
+{
+    CTask* pJoin = NULL;
+
+    if (m_pScheduler != NULL && m_pScheduler->GetWorkerCount() > 0 && m_activeSlices > 1)
+    {
+        CTask::Create(JoinProc, this, 0, &pJoin);
+    }
+
+    for (UINT32 i = 0; i < m_activeSlices; i++)
+    {
+        CTask* pTask = NULL;
+
+        if (pJoin != NULL && SUCCEEDED(CTask::Create(pProc, this, i, &pTask)) &&
+            SUCCEEDED(m_pScheduler->Submit(pTask)))
+        {
+            pJoin->AddDependency(pTask);
+            pTask->Release();
+            continue;
+        }
+
+        if (pTask != NULL)
+        {
+            pTask->Release();
+        }
+
+        pProc(this, i);
+    }
+
+    if (pJoin != NULL)
+    {
+        m_pScheduler->Submit(pJoin);
+        m_pScheduler->Wait(pJoin);
+        pJoin->Release();
+    }
+}
+
+
+void CFrameCodec::EncodeSliceProc(void* pContext, UINT32 index)
+{
+    CFrameCodec* pCodec = static_cast<CFrameCodec*>(pContext);
+    Slice& slice = pCodec->m_slices[index];
+
+    slice.hr = pCodec->EncodeSlice(slice);
+}
+
+
+void CFrameCodec::DecodeSliceProc(void* pContext, UINT32 index)
+{
+    CFrameCodec* pCodec = static_cast<CFrameCodec*>(pContext);
+    Slice& slice = pCodec->m_slices[index];
+
+    slice.hr = pCodec->DecodeSlice(slice);
+}
+
+
+HRESULT CFrameCodec::Encode(const FrameFormat& format, const FramePlane* pPlanes, BYTE* pDest,
+    DWORD cbDest, DWORD* pcbEncoded)
+{
+    HRESULT hr = S_OK;
+    FrameCodecHeader header;
+    BYTE* pOut = pDest;
+    DWORD* pSliceBytes = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pPlanes, E_POINTER);
+        BREAK_ON_NULL(pDest, E_POINTER);
+        BREAK_ON_NULL(pcbEncoded, E_POINTER);
+
+        m_componentCount = GetComponents(format, m_components);
+        if (m_componentCount == 0)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        if (cbDest < GetMaxEncodedBytes(format))
+        {
+            hr = MF_E_INSUFFICIENT_BUFFER;
+            break;
+        }
+
+        m_format = format;
+        m_pPlanes = pPlanes;
+
+        PlanSlices(format, (m_sliceCount != 0) ? m_sliceCount :
+            (m_pScheduler != NULL) ? m_pScheduler->GetWorkerCount() : 1);
+
+        RunSlices(EncodeSliceProc);
+
+        ZeroMemory(&header, sizeof(header));
+        header.magic = FRAME_CODEC_MAGIC;
+        header.version = FRAME_CODEC_VERSION;
+        header.sliceCount = (WORD)m_activeSlices;
+        header.subtype = format.subtype;
+        header.width = format.width;
+        header.height = format.height;
+
+        CopyMemory(pOut, &header, sizeof(header));
+        pOut += sizeof(header);
+
+        pSliceBytes = (DWORD*)pOut;
+        pOut += m_activeSlices * sizeof(DWORD);
+
+        for (UINT32 i = 0; i < m_activeSlices; i++)
+        {
+            const Slice& slice = m_slices[i];
+
+            hr = slice.hr;
+            BREAK_ON_FAIL(hr);
+
+            pSliceBytes[i] = slice.cbSource;
+            CopyMemory(pOut, &slice.output[0], slice.cbSource);
+            pOut += slice.cbSource;
+        }
+        BREAK_ON_FAIL(hr);
+
+        *pcbEncoded = (DWORD)(pOut - pDest);
+    }
+    while(false);
+
+    m_pPlanes = NULL;
+
+    return hr;
+}
+
+
+//
+// Predict and code every component of the rows of the slice.  The rows of a component are
+// gathered into a contiguous row first, so the prediction works alike for every layout.
+//
+HRESULT CFrameCodec::EncodeSlice(Slice& slice)
+{
+    DWORD cbBound = 0;
+    BYTE* pOut = NULL;
+
+    for (UINT32 c = 0; c < m_componentCount; c++)
+    {
+        const Component& comp = m_components[c];
+
+        cbBound += 1 + comp.width * (slice.rowCount >> comp.rowShift);
+    }
+
+    slice.output.resize(max(cbBound, 1u));
+    pOut = &slice.output[0];
+
+    for (UINT32 c = 0; c < m_componentCount; c++)
+    {
+        const Component& comp = m_components[c];
+        const FramePlane& plane = m_pPlanes[comp.plane];
+        UINT32 firstRow = slice.firstRow >> comp.rowShift;
+        UINT32 rowCount = slice.rowCount >> comp.rowShift;
+        DWORD count = comp.width * rowCount;
+        DWORD counts[256];
+        WORD freq[256];
+        BYTE* pResidual = NULL;
+        BYTE* pCur = NULL;
+        BYTE* pPrev = NULL;
+        const BYTE* pCoded = NULL;
+        DWORD cbCoded = 0;
+
+        if (count == 0)
+        {
+            *pOut++ = FRAME_CODEC_STORED;
+            continue;
+        }
+
+        slice.residuals.resize(count);
+        slice.rows.resize(comp.width * 2);
+        pResidual = &slice.residuals[0];
+        pCur = &slice.rows[0];
+        pPrev = pCur + comp.width;
+
+        ZeroMemory(counts, sizeof(counts));
+
+        for (UINT32 y = 0; y < rowCount; y++)
+        {
+            const BYTE* pRow = plane.pData + (LONG)(firstRow + y) * plane.stride;
+
+            for (UINT32 x = 0; x < comp.width; x++)
+            {
+                BYTE value = pRow[comp.offset + x * comp.step];
+
+                pCur[x] = comp.minusGreen ? (BYTE)(value - pRow[x * 4 + 1]) : value;
+            }
+
+            // the first row of a slice has nothing above it - slices do not depend on
+            // each other
+            pResidual[0] = FoldResidual((BYTE)(pCur[0] - ((y == 0) ? 0 : pPrev[0])));
+
+            if (y == 0)
+            {
+                for (UINT32 x = 1; x < comp.width; x++)
+                {
+                    pResidual[x] = FoldResidual((BYTE)(pCur[x] - pCur[x - 1]));
+                }
+            }
+            else
+            {
+                for (UINT32 x = 1; x < comp.width; x++)
+                {
+                    pResidual[x] = FoldResidual((BYTE)(pCur[x] -
+                        PredictMed(pCur[x - 1], pPrev[x], pPrev[x - 1])));
+                }
+            }
+
+            for (UINT32 x = 0; x < comp.width; x++)
+            {
+                counts[pResidual[x]]++;
+            }
+
+            pResidual += comp.width;
+
+            BYTE* pSwap = pCur;
+            pCur = pPrev;
+            pPrev = pSwap;
+        }
+
+        NormalizeFrequencies(counts, count, freq);
+
+        slice.coded.resize(count * 2 + 8);
+        pCoded = RansEncode(&slice.residuals[0], count, freq, &slice.coded[0],
+            (DWORD)slice.coded.size());
+        cbCoded = (DWORD)(&slice.coded[0] + slice.coded.size() - pCoded);
+
+        if (RANS_HEADER_BYTES + cbCoded < count)
+        {
+            *pOut++ = FRAME_CODEC_RANS;
+            CopyMemory(pOut, freq, sizeof(freq));
+            pOut += sizeof(freq);
+            CopyMemory(pOut, &cbCoded, sizeof(cbCoded));
+            pOut += sizeof(cbCoded);
+            CopyMemory(pOut, pCoded, cbCoded);
+            pOut += cbCoded;
+        }
+        else
+        {
+            *pOut++ = FRAME_CODEC_STORED;
+            CopyMemory(pOut, &slice.residuals[0], count);
+            pOut += count;
+        }
+    }
+
+    slice.cbSource = (DWORD)(pOut - &slice.output[0]);
+
+    return S_OK;
+}
+
+
+HRESULT CFrameCodec::Decode(const BYTE* pSource, DWORD cbSource, const FrameFormat& format,
+    const FramePlane* pPlanes)
+{
+    HRESULT hr = S_OK;
+    FrameCodecHeader header;
+    const BYTE* pSlice = NULL;
+    const DWORD* pSliceBytes = NULL;
+    DWORD cbLeft = 0;
+
+    do
+    {
+        BREAK_ON_NULL(pSource, E_POINTER);
+        BREAK_ON_NULL(pPlanes, E_POINTER);
+
+        if (cbSource < sizeof(header))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        CopyMemory(&header, pSource, sizeof(header));
+
+        if (header.magic != FRAME_CODEC_MAGIC || header.version != FRAME_CODEC_VERSION ||
+            header.sliceCount == 0 || header.sliceCount > FRAME_CODEC_MAX_SLICES ||
+            cbSource - sizeof(header) < header.sliceCount * sizeof(DWORD))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        if (header.subtype != format.subtype || header.width != format.width ||
+            header.height != format.height)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        m_componentCount = GetComponents(format, m_components);
+        if (m_componentCount == 0)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        m_format = format;
+        m_pPlanes = pPlanes;
+
+        // the encoder planned the same slices from the same count
+        PlanSlices(format, header.sliceCount);
+        if (m_activeSlices != header.sliceCount)
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        pSliceBytes = (const DWORD*)(pSource + sizeof(header));
+        pSlice = (const BYTE*)(pSliceBytes + header.sliceCount);
+        cbLeft = cbSource - sizeof(header) - header.sliceCount * sizeof(DWORD);
+
+        for (UINT32 i = 0; i < m_activeSlices; i++)
+        {
+            if (pSliceBytes[i] > cbLeft)
+            {
+                hr = MF_E_INVALID_FILE_FORMAT;
+                break;
+            }
+
+            m_slices[i].pSource = pSlice;
+            m_slices[i].cbSource = pSliceBytes[i];
+            pSlice += pSliceBytes[i];
+            cbLeft -= pSliceBytes[i];
+        }
+        BREAK_ON_FAIL(hr);
+
+        RunSlices(DecodeSliceProc);
+
+        for (UINT32 i = 0; i < m_activeSlices; i++)
+        {
+            hr = m_slices[i].hr;
+            BREAK_ON_FAIL(hr);
+        }
+    }
+    while(false);
+
+    m_pPlanes = NULL;
+
+    return hr;
+}
+
+
+//
+// Decode the residuals of every component, and undo the prediction row by row.  Stored
+// residuals are used right where they are in the source.
+//
+HRESULT CFrameCodec::DecodeSlice(Slice& slice)
+{
+    HRESULT hr = S_OK;
+    const BYTE* p = slice.pSource;
+    const BYTE* pEnd = slice.pSource + slice.cbSource;
+
+    for (UINT32 c = 0; c < m_componentCount && SUCCEEDED(hr); c++)
+    {
+        const Component& comp = m_components[c];
+        const FramePlane& plane = m_pPlanes[comp.plane];
+        UINT32 firstRow = slice.firstRow >> comp.rowShift;
+        UINT32 rowCount = slice.rowCount >> comp.rowShift;
+        DWORD count = comp.width * rowCount;
+        const BYTE* pResidual = NULL;
+        BYTE* pCur = NULL;
+        BYTE* pPrev = NULL;
+        BYTE mode = 0;
+
+        if (p == pEnd)
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        mode = *p++;
+
+        if (count == 0)
+        {
+            continue;
+        }
+
+        if (mode == FRAME_CODEC_STORED)
+        {
+            if ((DWORD)(pEnd - p) < count)
+            {
+                hr = MF_E_INVALID_FILE_FORMAT;
+                break;
+            }
+
+            pResidual = p;
+            p += count;
+        }
+        else if (mode == FRAME_CODEC_RANS)
+        {
+            WORD freq[256];
+            DWORD cbCoded = 0;
+
+            if ((DWORD)(pEnd - p) < RANS_HEADER_BYTES)
+            {
+                hr = MF_E_INVALID_FILE_FORMAT;
+                break;
+            }
+
+            CopyMemory(freq, p, sizeof(freq));
+            CopyMemory(&cbCoded, p + sizeof(freq), sizeof(cbCoded));
+            p += RANS_HEADER_BYTES;
+
+            if ((DWORD)(pEnd - p) < cbCoded)
+            {
+                hr = MF_E_INVALID_FILE_FORMAT;
+                break;
+            }
+
+            slice.residuals.resize(count);
+
+            hr = RansDecode(p, cbCoded, freq, &slice.residuals[0], count);
+            BREAK_ON_FAIL(hr);
+
+            pResidual = &slice.residuals[0];
+            p += cbCoded;
+        }
+        else
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        slice.rows.resize(comp.width * 2);
+        pCur = &slice.rows[0];
+        pPrev = pCur + comp.width;
+
+        for (UINT32 y = 0; y < rowCount; y++)
+        {
+            BYTE* pRow = plane.pData + (LONG)(firstRow + y) * plane.stride;
+
+            pCur[0] = (BYTE)(((y == 0) ? 0 : pPrev[0]) + UnfoldResidual(pResidual[0]));
+
+            if (y == 0)
+            {
+                for (UINT32 x = 1; x < comp.width; x++)
+                {
+                    pCur[x] = (BYTE)(pCur[x - 1] + UnfoldResidual(pResidual[x]));
+                }
+            }
+            else
+            {
+                for (UINT32 x = 1; x < comp.width; x++)
+                {
+                    pCur[x] = (BYTE)(PredictMed(pCur[x - 1], pPrev[x], pPrev[x - 1]) +
+                        UnfoldResidual(pResidual[x]));
+                }
+            }
+
+            pResidual += comp.width;
+
+            // green was decoded before red and blue, so it is in place already
+            for (UINT32 x = 0; x < comp.width; x++)
+            {
+                pRow[comp.offset + x * comp.step] = comp.minusGreen ?
+                    (BYTE)(pCur[x] + pRow[x * 4 + 1]) : pCur[x];
+            }
+
+            BYTE* pSwap = pCur;
+            pCur = pPrev;
+            pPrev = pSwap;
+        }
+    }
+
+    return hr;
+}
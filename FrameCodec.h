@@ -0,0 +1,131 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameView.h"
+#include "TaskScheduler.h"
+
+#include <vector>
+
+
+
+//
+//  Encoded frame layout:
+//
+//      FrameCodecHeader
+//      DWORD sliceBytes[sliceCount]
+//      slice 0, slice 1, ...
+//
+//  A slice is a band of rows coded on its own, so slices encode and decode in parallel.
+//  It holds every component of its rows - Y, U and V for YUY2 and NV12, G, B-G, R-G and A
+//  for RGB32 - one after the other, each as:
+//
+//      BYTE mode                       FRAME_CODEC_RANS or FRAME_CODEC_STORED
+//      rANS:   WORD frequency[256], DWORD cbData, rANS data
+//      stored: the residuals, one byte per sample
+//
+//  Every sample is predicted from its neighbours with the median edge detector of LOCO-I,
+//  and the residual is entropy coded with two interleaved rANS coders over the residual
+//  statistics of the component in the slice.  A component whose residuals would not shrink
+//  is stored, so noise costs only a few bytes over the raw frame.
+//
+#define FRAME_CODEC_MAGIC           0x43444346      // "FCDC"
+#define FRAME_CODEC_VERSION         1
+#define FRAME_CODEC_MAX_SLICES      64
+
+#define FRAME_CODEC_RANS            0
+#define FRAME_CODEC_STORED          1
+
+struct FrameCodecHeader
+{
+    DWORD       magic;                  // FRAME_CODEC_MAGIC
+    WORD        version;                // FRAME_CODEC_VERSION
+    WORD        sliceCount;
+    GUID        subtype;
+    UINT32      width;
+    UINT32      height;
+};
+
+
+//
+//  Lossless frame codec for YUY2, NV12 and RGB32 frames.
+//
+//  The slices of a frame are coded as tasks of a scheduler when one is set, and on the
+//  calling thread otherwise.  A codec codes one frame at a time - its slice buffers are
+//  reused from frame to frame.
+//
+class CFrameCodec
+{
+    public:
+        CFrameCodec(void);
+        ~CFrameCodec(void) {}
+
+        // run the slices on the workers of a scheduler - NULL runs them on the caller
+        void SetScheduler(CTaskScheduler* pScheduler) { m_pScheduler = pScheduler; }
+
+        // slices per frame - 0 gives every worker of the scheduler one
+        void SetSliceCount(UINT32 sliceCount) { m_sliceCount = sliceCount; }
+
+        // size of the buffer Encode() needs for any frame of the format
+        static DWORD GetMaxEncodedBytes(const FrameFormat& format);
+
+        // planes of a frame stored without padding - see GetPackedFrameBytes()
+        static void GetPackedPlanes(const FrameFormat& format, BYTE* pData, FramePlane* pPlanes);
+
+        // encode the visible pixels of the planes
+        HRESULT Encode(const FrameFormat& format, const FramePlane* pPlanes, BYTE* pDest,
+            DWORD cbDest, DWORD* pcbEncoded);
+
+        // decode a frame into planes of the format it was encoded with
+        HRESULT Decode(const BYTE* pSource, DWORD cbSource, const FrameFormat& format,
+            const FramePlane* pPlanes);
+
+    private:
+        //
+        // Samples of one component - Y, U or V, or one channel of RGB32 - within the planes
+        // of a frame.
+        //
+        struct Component
+        {
+            UINT32 plane;
+            UINT32 offset;              // byte of the first sample in a row
+            UINT32 step;                // bytes from one sample to the next
+            UINT32 width;               // samples per row
+            UINT32 rowShift;            // 1 for NV12 chroma, with half as many rows
+            bool minusGreen;            // coded as the difference to the green channel
+        };
+
+        struct Slice
+        {
+            UINT32 firstRow;            // luma rows of the slice
+            UINT32 rowCount;
+            const BYTE* pSource;        // coded slice, for decoding
+            DWORD cbSource;             // bytes of the coded slice
+            std::vector<BYTE> output;   // coded slice, for encoding
+            std::vector<BYTE> residuals;
+            std::vector<BYTE> coded;    // rANS output, written back to front
+            std::vector<BYTE> rows;     // current and previous row of a component
+            HRESULT hr;
+        };
+
+        static void EncodeSliceProc(void* pContext, UINT32 index);
+        static void DecodeSliceProc(void* pContext, UINT32 index);
+        static void JoinProc(void* pContext, UINT32 index) {}
+
+        UINT32 GetComponents(const FrameFormat& format, Component* pComponents) const;
+        void PlanSlices(const FrameFormat& format, UINT32 sliceCount);
+        void RunSlices(TaskProc pProc);
+
+        HRESULT EncodeSlice(Slice& slice);
+        HRESULT DecodeSlice(Slice& slice);
+
+        CTaskScheduler* m_pScheduler;
+        UINT32 m_sliceCount;
+
+        // frame being coded
+        FrameFormat m_format;
+        const FramePlane* m_pPlanes;
+        Component m_components[4];
+        UINT32 m_componentCount;
+        std::vector<Slice> m_slices;
+        UINT32 m_activeSlices;
+};
@@ -0,0 +1,1292 @@
+#include "FrameDump.h"
+#include "MemoryBudget.h"
+
+#include <mmreg.h>
+
+
+
+// frames the recorder queues for its writer thread before it starts dropping
+#define FRAME_RECORDER_QUEUE_DEPTH      8
+
+// audio frames the recorder reads from the ring at a time
+#define FRAME_RECORDER_AUDIO_BLOCK      4096
+
+
+
+//
+//  Header of the WAV file of a recording - float samples, interleaved.  The sizes are
+//  patched when the recording is closed.
+//
+#pragma pack(push, 1)
+struct WavFileHeader
+{
+    DWORD       riffId;                 // "RIFF"
+    DWORD       riffBytes;              // bytes after this field
+    DWORD       waveId;                 // "WAVE"
+    DWORD       fmtId;                  // "fmt "
+    DWORD       fmtBytes;               // 16
+    WORD        formatTag;              // WAVE_FORMAT_IEEE_FLOAT
+    WORD        channels;
+    DWORD       sampleRate;
+    DWORD       bytesPerSecond;
+    WORD        blockAlign;
+    WORD        bitsPerSample;
+    DWORD       dataId;                 // "data"
+    DWORD       dataBytes;
+};
+#pragma pack(pop)
+
+
+
+//
+//  A file mapping shared by the frame buffers of a dump reader - the buffers may outlive the
+//  reader, so the mapping is reference counted.
+//
+class CMappedFile
+{
+    public:
+        // takes ownership of the file handle, even on failure
+        static HRESULT Create(HANDLE file, CMappedFile** ppMappedFile);
+
+        ULONG AddRef(void) { return InterlockedIncrement(&m_cRef); }
+        ULONG Release(void);
+
+        // map cb bytes at offset - the view starts at the allocation granularity boundary
+        // below offset, and is released with UnmapViewOfFile(*ppView)
+        HRESULT Map(ULONGLONG offset, DWORD cb, void** ppView, BYTE** ppData);
+
+    private:
+        CMappedFile(HANDLE file);
+        ~CMappedFile(void);
+
+        volatile long m_cRef;
+        HANDLE m_hFile;
+        HANDLE m_hMapping;
+        DWORD m_granularity;
+};
+
+
+CMappedFile::CMappedFile(HANDLE file) :
+    m_cRef(1),
+    m_hFile(file),
+    m_hMapping(NULL),
+    m_granularity(65536)
+{
+    SYSTEM_INFO systemInfo;
+
+    GetSystemInfo(&systemInfo);
+    m_granularity = systemInfo.dwAllocationGranularity;
+}
+
+
+CMappedFile::~CMappedFile(void)
+{
+    if (m_hMapping != NULL)
+    {
+        CloseHandle(m_hMapping);
+    }
+
+    CloseHandle(m_hFile);
+}
+
+
+HRESULT CMappedFile::Create(HANDLE file, CMappedFile** ppMappedFile)
+{
+    HRESULT hr = S_OK;
+    CMappedFile* pMappedFile = NULL;
+
+    do
+    {
+        pMappedFile = new (std::nothrow) CMappedFile(file);
+        if (pMappedFile == NULL)
+        {
+            CloseHandle(file);
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        // copy-on-write, so the read-only file can still be handed out as writable buffers
+        pMappedFile->m_hMapping = CreateFileMapping(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+        BREAK_ON_NULL(pMappedFile->m_hMapping, HRESULT_FROM_WIN32(GetLastError()));
+
+        *ppMappedFile = pMappedFile;
+        pMappedFile = NULL;
+    }
+    while(false);
+
+    if (pMappedFile != NULL)
+    {
+        pMappedFile->Release();
+    }
+
+    return hr;
+}
+
+
+ULONG CMappedFile::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+HRESULT CMappedFile::Map(ULONGLONG offset, DWORD cb, void** ppView, BYTE** ppData)
+{
+    ULONGLONG viewOffset = offset - offset % m_granularity;
+    DWORD skip = (DWORD)(offset - viewOffset);
+    void* pView = MapViewOfFile(m_hMapping, FILE_MAP_COPY, (DWORD)(viewOffset >> 32),
+        (DWORD)viewOffset, skip + cb);
+
+    if (pView == NULL)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    *ppView = pView;
+    *ppData = (BYTE*)pView + skip;
+
+    return S_OK;
+}
+
+
+
+//
+//  A media buffer over the mapped view of one frame.
+//
+class CMappedFrameBuffer : public IMFMediaBuffer
+{
+    public:
+        CMappedFrameBuffer(CMappedFile* pFile, void* pView, BYTE* pData, DWORD cbData) :
+            m_cRef(1), m_pFile(pFile), m_pView(pView), m_pData(pData), m_cbData(cbData),
+            m_cbCurrent(cbData)
+        {
+            m_pFile->AddRef();
+        }
+
+        // IUnknown interface implementation
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void) { return InterlockedIncrement(&m_cRef); }
+        STDMETHODIMP_(ULONG) Release(void);
+
+        // IMFMediaBuffer interface implementation
+        STDMETHODIMP Lock(BYTE** ppbBuffer, DWORD* pcbMaxLength, DWORD* pcbCurrentLength);
+        STDMETHODIMP Unlock(void) { return S_OK; }
+        STDMETHODIMP GetCurrentLength(DWORD* pcbCurrentLength);
+        STDMETHODIMP SetCurrentLength(DWORD cbCurrentLength);
+        STDMETHODIMP GetMaxLength(DWORD* pcbMaxLength);
+
+    private:
+        ~CMappedFrameBuffer(void)
+        {
+            UnmapViewOfFile(m_pView);
+            m_pFile->Release();
+        }
+
+        volatile long m_cRef;
+        CMappedFile* m_pFile;
+        void* m_pView;
+        BYTE* m_pData;
+        DWORD m_cbData;
+        DWORD m_cbCurrent;
+};
+
+
+HRESULT CMappedFrameBuffer::QueryInterface(REFIID riid, void** ppv)
+{
+    if (ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if (riid == IID_IUnknown || riid == IID_IMFMediaBuffer)
+    {
+        *ppv = static_cast<IMFMediaBuffer*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    AddRef();
+    return S_OK;
+}
+
+
+ULONG CMappedFrameBuffer::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+HRESULT CMappedFrameBuffer::Lock(BYTE** ppbBuffer, DWORD* pcbMaxLength,
+    DWORD* pcbCurrentLength)
+{
+    if (ppbBuffer == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *ppbBuffer = m_pData;
+
+    if (pcbMaxLength != NULL)
+    {
+        *pcbMaxLength = m_cbData;
+    }
+
+    if (pcbCurrentLength != NULL)
+    {
+        *pcbCurrentLength = m_cbCurrent;
+    }
+
+    return S_OK;
+}
+
+
+HRESULT CMappedFrameBuffer::GetCurrentLength(DWORD* pcbCurrentLength)
+{
+    if (pcbCurrentLength == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pcbCurrentLength = m_cbCurrent;
+    return S_OK;
+}
+
+
+HRESULT CMappedFrameBuffer::SetCurrentLength(DWORD cbCurrentLength)
+{
+    if (cbCurrentLength > m_cbData)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_cbCurrent = cbCurrentLength;
+    return S_OK;
+}
+
+
+HRESULT CMappedFrameBuffer::GetMaxLength(DWORD* pcbMaxLength)
+{
+    if (pcbMaxLength == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pcbMaxLength = m_cbData;
+    return S_OK;
+}
+
+
+
+
+
+CFrameRecorder::CFrameRecorder(void) :
+    m_hFile(INVALID_HANDLE_VALUE),
+    m_hThread(NULL),
+    m_hWakeEvent(NULL),
+    m_stopping(false),
+    m_compress(false),
+    m_headerWritten(false),
+    m_recordOffset(0),
+    m_pAudioRing(NULL),
+    m_hAudioFile(INVALID_HANDLE_VALUE),
+    m_audioStart(0),
+    m_audioFrames(0),
+    m_frameCount(0),
+    m_droppedCount(0)
+{
+    m_indexPath[0] = L'\0';
+    ZeroMemory(&m_format, sizeof(m_format));
+}
+
+
+CFrameRecorder::~CFrameRecorder(void)
+{
+    Close();
+}
+
+
+void CFrameRecorder::EnableCompression(CTaskScheduler* pScheduler)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    // the writer thread reads these - they only change between recordings
+    if (m_hThread == NULL)
+    {
+        m_compress = true;
+        m_codec.SetScheduler(pScheduler);
+    }
+}
+
+
+void CFrameRecorder::SetAudioSource(CAudioRing* pRing)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    // the ring is read until the audio file is closed
+    if (m_hThread == NULL && m_hAudioFile == INVALID_HANDLE_VALUE)
+    {
+        m_pAudioRing = pRing;
+    }
+}
+
+
+HRESULT CFrameRecorder::Open(PCWSTR path)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        BREAK_ON_NULL(path, E_POINTER);
+
+        if (m_hFile != INVALID_HANDLE_VALUE)
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        m_headerWritten = false;
+        m_stopping = false;
+        m_recordOffset = 0;
+        m_frameCount = 0;
+        m_droppedCount = 0;
+
+        // without an index the dump is only slower to open
+        if (FAILED(GetFrameIndexPath(path, m_indexPath, ARRAYSIZE(m_indexPath))))
+        {
+            m_indexPath[0] = L'\0';
+        }
+
+        m_hFile = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (m_pAudioRing != NULL)
+        {
+            hr = OpenAudioFile(path);
+            BREAK_ON_FAIL(hr);
+        }
+
+        m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        BREAK_ON_NULL(m_hWakeEvent, HRESULT_FROM_WIN32(GetLastError()));
+
+        m_hThread = CreateThread(NULL, 0, WriterThreadProc, this, 0, NULL);
+        BREAK_ON_NULL(m_hThread, HRESULT_FROM_WIN32(GetLastError()));
+    }
+    while(false);
+
+    if (FAILED(hr) && hr != MF_E_ALREADY_INITIALIZED)
+    {
+        Close();
+    }
+
+    return hr;
+}
+
+
+//
+// The writer thread drains the queue before it exits, so every frame accepted by OnFrame()
+// ends up in the dump.
+//
+HRESULT CFrameRecorder::Close(void)
+{
+    HANDLE thread = NULL;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        m_stopping = true;
+        thread = m_hThread;
+        m_hThread = NULL;
+
+        if (m_hWakeEvent != NULL)
+        {
+            SetEvent(m_hWakeEvent);
+        }
+    }
+
+    if (thread != NULL)
+    {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+
+    m_indexWriter.Close();
+    CloseAudioFile();
+
+    if (m_hWakeEvent != NULL)
+    {
+        CloseHandle(m_hWakeEvent);
+        m_hWakeEvent = NULL;
+    }
+
+    return S_OK;
+}
+
+
+//
+// A queued frame holds on to its capture buffer until it is written, so it is reserved from
+// the memory budget - with the budget short, the frame is dropped like with the queue full.
+//
+void CFrameRecorder::OnFrame(CFrameView* pFrame)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (m_hThread == NULL || m_stopping)
+    {
+        return;
+    }
+
+    if (m_queue.size() >= FRAME_RECORDER_QUEUE_DEPTH ||
+        !GetMemoryBudget()->Reserve(MemoryAccount_Recording, GetQueuedBytes(pFrame)))
+    {
+        m_droppedCount++;
+        return;
+    }
+
+    pFrame->AddRef();
+    m_queue.push_back(pFrame);
+    SetEvent(m_hWakeEvent);
+}
+
+
+DWORD WINAPI CFrameRecorder::WriterThreadProc(LPVOID pParam)
+{
+    CFrameRecorder* pRecorder = static_cast<CFrameRecorder*>(pParam);
+
+    pRecorder->WriterLoop();
+
+    return 0;
+}
+
+
+void CFrameRecorder::WriterLoop(void)
+{
+    while (true)
+    {
+        CFrameView* pFrame = NULL;
+
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            if (!m_queue.empty())
+            {
+                pFrame = m_queue.front();
+                m_queue.pop_front();
+            }
+            else if (m_stopping)
+            {
+                break;
+            }
+        }
+
+        if (pFrame == NULL)
+        {
+            WaitForSingleObject(m_hWakeEvent, INFINITE);
+            continue;
+        }
+
+        if (FAILED(WriteFrame(pFrame)))
+        {
+            // OnFrame() counts its drops on the capture thread
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            m_droppedCount++;
+        }
+
+        GetMemoryBudget()->Release(MemoryAccount_Recording, GetQueuedBytes(pFrame));
+        pFrame->Release();
+    }
+}
+
+
+DWORD CFrameRecorder::GetQueuedBytes(CFrameView* pFrame)
+{
+    const FrameFormat& format = pFrame->Format();
+
+    return GetPackedFrameBytes(format.subtype, format.width, format.height);
+}
+
+
+//
+// Assemble the record of the frame - record header and packed or coded planes - and write it
+// in one piece.  Frames of another format than the first one cannot be stored in the same
+// dump.
+//
+HRESULT CFrameRecorder::WriteFrame(CFrameView* pFrame)
+{
+    HRESULT hr = S_OK;
+    const FrameFormat& format = pFrame->Format();
+    DWORD rowBytes = GetPackedRowBytes(format.subtype, format.width);
+    DWORD cbFrame = m_compress ? CFrameCodec::GetMaxEncodedBytes(format) :
+        GetPackedFrameBytes(format.subtype, format.width, format.height);
+    FrameDumpRecord* pRecord = NULL;
+    FramePlane planes[2];
+    BYTE* pData = NULL;
+    DWORD written = 0;
+
+    do
+    {
+        if (!m_headerWritten)
+        {
+            hr = WriteHeader(pFrame);
+            BREAK_ON_FAIL(hr);
+        }
+
+        if (format.subtype != m_format.subtype || format.width != m_format.width ||
+            format.height != m_format.height)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        m_record.resize(sizeof(FrameDumpRecord) + cbFrame);
+
+        pRecord = (FrameDumpRecord*)&m_record[0];
+        pRecord->timestamp = pFrame->Timestamp();
+        pRecord->duration = pFrame->Duration();
+        pRecord->cbFrame = cbFrame;
+        pRecord->flags = 0;
+
+        pData = &m_record[sizeof(FrameDumpRecord)];
+
+        if (m_compress)
+        {
+            // the codec reads the capture buffer directly - no packed copy is made
+            for (UINT32 i = 0; i < pFrame->PlaneCount(); i++)
+            {
+                planes[i] = pFrame->Plane(i);
+            }
+
+            hr = m_codec.Encode(format, planes, pData, cbFrame, &pRecord->cbFrame);
+            BREAK_ON_FAIL(hr);
+
+            m_record.resize(sizeof(FrameDumpRecord) + pRecord->cbFrame);
+        }
+        else
+        {
+            for (UINT32 i = 0; i < pFrame->PlaneCount(); i++)
+            {
+                hr = pFrame->CopyPlane(i, pData, (LONG)rowBytes);
+                BREAK_ON_FAIL(hr);
+
+                pData += rowBytes * pFrame->Plane(i).height;
+            }
+            BREAK_ON_FAIL(hr);
+        }
+
+        if (!WriteFile(m_hFile, &m_record[0], (DWORD)m_record.size(), &written, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        IndexRecord(pRecord);
+
+        m_recordOffset += m_record.size();
+        m_frameCount++;
+
+        // a failed audio write leaves the frame in the dump
+        if (m_hAudioFile != INVALID_HANDLE_VALUE)
+        {
+            if (m_frameCount == 1)
+            {
+                m_audioStart = pFrame->Timestamp();
+            }
+
+            WriteAudio(pFrame->Timestamp() + pFrame->Duration());
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CFrameRecorder::OpenAudioFile(PCWSTR path)
+{
+    HRESULT hr = S_OK;
+    WCHAR audioPath[MAX_PATH];
+    WavFileHeader header;
+    DWORD written = 0;
+
+    do
+    {
+        if (wcscpy_s(audioPath, ARRAYSIZE(audioPath), path) != 0 ||
+            wcscat_s(audioPath, ARRAYSIZE(audioPath), L".wav") != 0)
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+            break;
+        }
+
+        m_hAudioFile = CreateFile(audioPath, GENERIC_WRITE, FILE_SHARE_READ, NULL,
+            CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_hAudioFile == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        header.riffId = MAKEFOURCC('R', 'I', 'F', 'F');
+        header.riffBytes = sizeof(header) - 8;
+        header.waveId = MAKEFOURCC('W', 'A', 'V', 'E');
+        header.fmtId = MAKEFOURCC('f', 'm', 't', ' ');
+        header.fmtBytes = 16;
+        header.formatTag = WAVE_FORMAT_IEEE_FLOAT;
+        header.channels = (WORD)m_pAudioRing->GetChannels();
+        header.sampleRate = m_pAudioRing->GetSampleRate();
+        header.blockAlign = (WORD)(header.channels * sizeof(float));
+        header.bytesPerSecond = header.sampleRate * header.blockAlign;
+        header.bitsPerSample = 32;
+        header.dataId = MAKEFOURCC('d', 'a', 't', 'a');
+        header.dataBytes = 0;
+
+        if (!WriteFile(m_hAudioFile, &header, sizeof(header), &written, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        m_audioStart = 0;
+        m_audioFrames = 0;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Append the audio up to the end of a frame, or up to the newest audio in the ring when the
+// device is behind - the rest is written with a later frame.  The position in the file is
+// kept as a count of frames, so the audio does not drift from the video by rounding.
+//
+HRESULT CFrameRecorder::WriteAudio(LONGLONG endTime)
+{
+    HRESULT hr = S_OK;
+    UINT32 channels = m_pAudioRing->GetChannels();
+    LONGLONG ringEnd = 0;
+    ULONGLONG targetFrames = 0;
+
+    if (!m_pAudioRing->GetEndTime(&ringEnd))
+    {
+        return S_OK;
+    }
+
+    targetFrames = m_pAudioRing->GetFrameCount(min(endTime, ringEnd) - m_audioStart);
+
+    if (m_audioBuffer.size() < (size_t)FRAME_RECORDER_AUDIO_BLOCK * channels)
+    {
+        m_audioBuffer.resize((size_t)FRAME_RECORDER_AUDIO_BLOCK * channels);
+    }
+
+    while (m_audioFrames < targetFrames)
+    {
+        UINT32 count = (UINT32)min(targetFrames - m_audioFrames,
+            (ULONGLONG)FRAME_RECORDER_AUDIO_BLOCK);
+        LONGLONG time = m_audioStart +
+            (LONGLONG)((double)m_audioFrames * 10000000.0 / m_pAudioRing->GetSampleRate() + 0.5);
+        DWORD cb = count * channels * sizeof(float);
+        DWORD written = 0;
+
+        // missing audio is written as silence, which keeps the file in step
+        hr = m_pAudioRing->Read(time, &m_audioBuffer[0], count);
+        BREAK_ON_FAIL(hr);
+
+        if (!WriteFile(m_hAudioFile, &m_audioBuffer[0], cb, &written, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        m_audioFrames += count;
+    }
+
+    return hr;
+}
+
+
+//
+// Patch the sizes of the RIFF and data chunks now that the length is known.
+//
+void CFrameRecorder::CloseAudioFile(void)
+{
+    ULONGLONG dataBytes = 0;
+    DWORD size = 0;
+    DWORD written = 0;
+
+    if (m_hAudioFile == INVALID_HANDLE_VALUE)
+    {
+        return;
+    }
+
+    dataBytes = m_audioFrames * m_pAudioRing->GetChannels() * sizeof(float);
+    size = (DWORD)min(dataBytes, (ULONGLONG)(MAXDWORD - sizeof(WavFileHeader)));
+
+    SetFilePointer(m_hAudioFile, FIELD_OFFSET(WavFileHeader, dataBytes), NULL, FILE_BEGIN);
+    WriteFile(m_hAudioFile, &size, sizeof(size), &written, NULL);
+
+    size += sizeof(WavFileHeader) - 8;
+    SetFilePointer(m_hAudioFile, FIELD_OFFSET(WavFileHeader, riffBytes), NULL, FILE_BEGIN);
+    WriteFile(m_hAudioFile, &size, sizeof(size), &written, NULL);
+
+    CloseHandle(m_hAudioFile);
+    m_hAudioFile = INVALID_HANDLE_VALUE;
+}
+
+
+//
+// The dump takes the format of its first frame.
+//
+HRESULT CFrameRecorder::WriteHeader(CFrameView* pFrame)
+{
+    HRESULT hr = S_OK;
+    FrameDumpHeader header;
+    DWORD written = 0;
+
+    do
+    {
+        ZeroMemory(&header, sizeof(header));
+
+        header.magic = FRAME_DUMP_MAGIC;
+        header.version = FRAME_DUMP_VERSION;
+        header.headerBytes = sizeof(header);
+        header.compression = m_compress ? FRAME_DUMP_LOSSLESS : FRAME_DUMP_RAW;
+        header.subtype = pFrame->Format().subtype;
+        header.width = pFrame->Format().width;
+        header.height = pFrame->Format().height;
+
+        if (pFrame->Duration() <= 0 || FAILED(MFAverageTimePerFrameToFrameRate(
+            (UINT64)pFrame->Duration(), &header.frameRateNumerator,
+            &header.frameRateDenominator)))
+        {
+            header.frameRateNumerator = 30;
+            header.frameRateDenominator = 1;
+        }
+
+        if (!WriteFile(m_hFile, &header, sizeof(header), &written, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        m_format = pFrame->Format();
+        m_headerWritten = true;
+        m_recordOffset = sizeof(header);
+
+        if (m_indexPath[0] != L'\0')
+        {
+            m_indexWriter.Open(m_indexPath, sizeof(header), m_compress ? 0 :
+                sizeof(FrameDumpRecord) +
+                GetPackedFrameBytes(header.subtype, header.width, header.height));
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Append the entry of a record just written to the index.  An index that could not be
+// written is given up on - the reader indexes the records it is missing.
+//
+void CFrameRecorder::IndexRecord(const FrameDumpRecord* pRecord)
+{
+    FrameIndexEntry entry;
+
+    if (!m_indexWriter.IsOpen())
+    {
+        return;
+    }
+
+    entry.timestamp = pRecord->timestamp;
+    entry.duration = pRecord->duration;
+    entry.offset = m_recordOffset;
+
+    if (FAILED(m_indexWriter.Append(&entry, 1)))
+    {
+        m_indexWriter.Close();
+    }
+}
+
+
+
+
+
+CFrameDumpReader::CFrameDumpReader(void) :
+    m_pFile(NULL),
+    m_fileSize(0),
+    m_compressed(false),
+    m_nextFrame(0)
+{
+    ZeroMemory(&m_info, sizeof(m_info));
+}
+
+
+CFrameDumpReader::~CFrameDumpReader(void)
+{
+    if (m_pFile != NULL)
+    {
+        m_pFile->Release();
+    }
+}
+
+
+HRESULT CFrameDumpReader::Open(PCWSTR path, IFrameFileReader** ppReader)
+{
+    HRESULT hr = S_OK;
+    CFrameDumpReader* pReader = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(ppReader, E_POINTER);
+
+        pReader = new (std::nothrow) CFrameDumpReader();
+        BREAK_ON_NULL(pReader, E_OUTOFMEMORY);
+
+        hr = pReader->Load(path);
+        BREAK_ON_FAIL(hr);
+
+        *ppReader = pReader;
+        pReader = NULL;
+    }
+    while(false);
+
+    delete pReader;
+
+    return hr;
+}
+
+
+//
+// Check the header and find the records, then map the file.
+//
+HRESULT CFrameDumpReader::Load(PCWSTR path)
+{
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    LARGE_INTEGER fileSize;
+    FrameDumpHeader header;
+    DWORD read = 0;
+
+    do
+    {
+        file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!GetFileSizeEx(file, &fileSize))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!ReadFile(file, &header, sizeof(header), &read, NULL) || read != sizeof(header) ||
+            header.magic != FRAME_DUMP_MAGIC)
+        {
+            hr = MF_E_UNSUPPORTED_BYTESTREAM_TYPE;
+            break;
+        }
+
+        if (header.version != FRAME_DUMP_VERSION || header.headerBytes < sizeof(header) ||
+            header.compression > FRAME_DUMP_LOSSLESS ||
+            (header.subtype != MFVideoFormat_YUY2 && header.subtype != MFVideoFormat_NV12 &&
+             header.subtype != MFVideoFormat_RGB32))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        // the records are checked against the file size as they are indexed, with the
+        // frame size computed from these
+        hr = CheckFrameFileSize(header.subtype, header.width, header.height);
+        BREAK_ON_FAIL(hr);
+
+        m_info.subtype = header.subtype;
+        m_info.width = header.width;
+        m_info.height = header.height;
+        m_info.frameRateNumerator = header.frameRateNumerator;
+        m_info.frameRateDenominator = header.frameRateDenominator;
+
+        m_fileSize = (ULONGLONG)fileSize.QuadPart;
+        m_compressed = (header.compression == FRAME_DUMP_LOSSLESS);
+
+        hr = LoadIndex(path, file, header.headerBytes);
+        BREAK_ON_FAIL(hr);
+
+        if (m_compressed)
+        {
+            // a frame decodes on every core, so replay keeps up with the recording
+            hr = m_decodeScheduler.Start(0);
+            BREAK_ON_FAIL(hr);
+
+            m_codec.SetScheduler(&m_decodeScheduler);
+        }
+
+        // the mapped file owns the handle from here on
+        hr = CMappedFile::Create(file, &m_pFile);
+        file = INVALID_HANDLE_VALUE;
+    }
+    while(false);
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
+
+//
+// Take the index of the dump if it agrees with the dump, and index the records after it.
+// Only a dump without a current index has its record headers read.
+//
+HRESULT CFrameDumpReader::LoadIndex(PCWSTR path, HANDLE file, DWORD firstRecord)
+{
+    HRESULT hr = S_OK;
+    DWORD cbRecord = m_compressed ? 0 : sizeof(FrameDumpRecord) +
+        GetPackedFrameBytes(m_info.subtype, m_info.width, m_info.height);
+    WCHAR indexPath[MAX_PATH];
+    bool hasIndexPath = SUCCEEDED(GetFrameIndexPath(path, indexPath, ARRAYSIZE(indexPath)));
+    ULONGLONG offset = firstRecord;
+    size_t indexed = 0;
+
+    do
+    {
+        if (!hasIndexPath || FAILED(m_index.Load(indexPath, firstRecord, cbRecord)))
+        {
+            m_index.Reset(firstRecord, cbRecord);
+        }
+
+        // a last entry that does not match its record means the index belongs to an
+        // earlier recording of the same name
+        if (m_index.Count() > 0 &&
+            !CheckRecord(file, m_index.Entry(m_index.Count() - 1), &offset))
+        {
+            m_index.Reset(firstRecord, cbRecord);
+            offset = firstRecord;
+        }
+
+        indexed = m_index.Count();
+
+        hr = ScanRecords(file, offset);
+        BREAK_ON_FAIL(hr);
+
+        // the dump may be on read-only media - the index is only an optimization
+        if (m_index.Count() != indexed && hasIndexPath)
+        {
+            m_index.Save(indexPath);
+        }
+
+        if (m_index.Count() > 0)
+        {
+            const FrameIndexEntry& last = m_index.Entry(m_index.Count() - 1);
+
+            m_info.startTime = m_index.Entry(0).timestamp;
+            m_info.duration = last.timestamp + last.duration - m_info.startTime;
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Walk the record headers from the given offset on.  A record that does not fit in the file
+// is the remains of an interrupted recording, and ends the dump.
+//
+HRESULT CFrameDumpReader::ScanRecords(HANDLE file, ULONGLONG offset)
+{
+    HRESULT hr = S_OK;
+
+    while (offset + sizeof(FrameDumpRecord) <= m_fileSize)
+    {
+        FrameDumpRecord record;
+        FrameIndexEntry entry;
+        LARGE_INTEGER position;
+        DWORD read = 0;
+
+        position.QuadPart = (LONGLONG)offset;
+
+        if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN) ||
+            !ReadFile(file, &record, sizeof(record), &read, NULL) || read != sizeof(record))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!IsValidFrameSize(record.cbFrame))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        if (offset + sizeof(FrameDumpRecord) + record.cbFrame > m_fileSize)
+        {
+            break;
+        }
+
+        entry.timestamp = record.timestamp;
+        entry.duration = record.duration;
+        entry.offset = offset;
+        m_index.Append(entry);
+
+        offset += sizeof(FrameDumpRecord) + record.cbFrame;
+    }
+
+    return hr;
+}
+
+
+//
+// Read the record of an entry, and find where the next record starts.
+//
+bool CFrameDumpReader::CheckRecord(HANDLE file, const FrameIndexEntry& entry,
+    ULONGLONG* pNextOffset)
+{
+    FrameDumpRecord record;
+    LARGE_INTEGER position;
+    DWORD read = 0;
+
+    position.QuadPart = (LONGLONG)entry.offset;
+
+    if (!SetFilePointerEx(file, position, NULL, FILE_BEGIN) ||
+        !ReadFile(file, &record, sizeof(record), &read, NULL) || read != sizeof(record) ||
+        record.timestamp != entry.timestamp || record.duration != entry.duration ||
+        !IsValidFrameSize(record.cbFrame) ||
+        entry.offset + sizeof(FrameDumpRecord) + record.cbFrame > m_fileSize)
+    {
+        return false;
+    }
+
+    *pNextOffset = entry.offset + sizeof(FrameDumpRecord) + record.cbFrame;
+
+    return true;
+}
+
+
+//
+// Raw frames are all the same size, coded ones at most the size the codec allows for.
+//
+bool CFrameDumpReader::IsValidFrameSize(DWORD cbFrame) const
+{
+    FrameFormat format = { m_info.subtype, m_info.width, m_info.height, 0 };
+
+    if (m_compressed)
+    {
+        return cbFrame >= sizeof(FrameCodecHeader) &&
+            cbFrame <= CFrameCodec::GetMaxEncodedBytes(format);
+    }
+
+    return cbFrame == GetPackedFrameBytes(m_info.subtype, m_info.width, m_info.height);
+}
+
+
+//
+// Frame shown at the given time, or the frame count past the end of the last frame.
+//
+size_t CFrameDumpReader::FindFrame(LONGLONG time) const
+{
+    if (m_index.Count() == 0 || time >= m_info.startTime + m_info.duration)
+    {
+        return m_index.Count();
+    }
+
+    return m_index.Find(time);
+}
+
+
+HRESULT CFrameDumpReader::Seek(LONGLONG time)
+{
+    m_nextFrame = FindFrame(time);
+
+    return S_OK;
+}
+
+
+HRESULT CFrameDumpReader::ReadFrameAt(LONGLONG time, IMFSample** ppSample)
+{
+    size_t frame = FindFrame(time);
+
+    if (frame >= m_index.Count())
+    {
+        return MF_E_END_OF_STREAM;
+    }
+
+    return ReadRecord(frame, ppSample);
+}
+
+
+HRESULT CFrameDumpReader::ReadFrame(IMFSample** ppSample)
+{
+    HRESULT hr = S_OK;
+
+    if (m_nextFrame >= m_index.Count())
+    {
+        return MF_E_END_OF_STREAM;
+    }
+
+    hr = ReadRecord(m_nextFrame, ppSample);
+    if (SUCCEEDED(hr))
+    {
+        m_nextFrame++;
+    }
+
+    return hr;
+}
+
+
+//
+// Map the record of a frame and wrap its frame bytes in a sample - or the frame decoded from
+// them, for a compressed dump.
+//
+HRESULT CFrameDumpReader::ReadRecord(size_t frame, IMFSample** ppSample)
+{
+    HRESULT hr = S_OK;
+    ULONGLONG offset = m_index.Entry(frame).offset;
+    DWORD cbFrame = GetPackedFrameBytes(m_info.subtype, m_info.width, m_info.height);
+    DWORD cbMapped = sizeof(FrameDumpRecord) + cbFrame;
+    void* pView = NULL;
+    BYTE* pData = NULL;
+    const FrameDumpRecord* pRecord = NULL;
+    CComPtr<IMFMediaBuffer> pBuffer;
+    CComPtr<IMFSample> pSample;
+
+    do
+    {
+        BREAK_ON_NULL(ppSample, E_POINTER);
+
+        // the size of a coded frame is in its record - map as much as it may take
+        if (m_compressed)
+        {
+            FrameFormat format = { m_info.subtype, m_info.width, m_info.height, 0 };
+
+            cbMapped = (DWORD)min((ULONGLONG)sizeof(FrameDumpRecord) +
+                CFrameCodec::GetMaxEncodedBytes(format), m_fileSize - offset);
+        }
+
+        hr = m_pFile->Map(offset, cbMapped, &pView, &pData);
+        BREAK_ON_FAIL(hr);
+
+        pRecord = (const FrameDumpRecord*)pData;
+
+        if (m_compressed)
+        {
+            hr = (pRecord->cbFrame <= cbMapped - sizeof(FrameDumpRecord)) ?
+                DecodeRecord(pRecord, &pBuffer) : MF_E_INVALID_FILE_FORMAT;
+            UnmapViewOfFile(pView);
+            BREAK_ON_FAIL(hr);
+        }
+        else
+        {
+            // the buffer owns the view from here on
+            pBuffer.Attach(new (std::nothrow) CMappedFrameBuffer(m_pFile, pView,
+                pData + sizeof(FrameDumpRecord), cbFrame));
+            if (pBuffer == NULL)
+            {
+                UnmapViewOfFile(pView);
+                hr = E_OUTOFMEMORY;
+                break;
+            }
+        }
+
+        hr = MFCreateSample(&pSample);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->AddBuffer(pBuffer);
+        BREAK_ON_FAIL(hr);
+
+        // the view of a coded frame is gone - the index has the times of the record too
+        hr = pSample->SetSampleTime(m_index.Entry(frame).timestamp);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->SetSampleDuration(m_index.Entry(frame).duration);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->SetUINT32(MFSampleExtension_CleanPoint, TRUE);
+        BREAK_ON_FAIL(hr);
+
+        *ppSample = pSample.Detach();
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Decode a coded frame into a memory buffer, packed like the frames of a raw dump.
+//
+HRESULT CFrameDumpReader::DecodeRecord(const FrameDumpRecord* pRecord,
+    IMFMediaBuffer** ppBuffer)
+{
+    HRESULT hr = S_OK;
+    FrameFormat format = { m_info.subtype, m_info.width, m_info.height, 0 };
+    DWORD cbFrame = GetPackedFrameBytes(m_info.subtype, m_info.width, m_info.height);
+    CComPtr<IMFMediaBuffer> pBuffer;
+    FramePlane planes[2];
+    BYTE* pData = NULL;
+
+    do
+    {
+        if (!IsValidFrameSize(pRecord->cbFrame))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        hr = MFCreateMemoryBuffer(cbFrame, &pBuffer);
+        BREAK_ON_FAIL(hr);
+
+        hr = pBuffer->Lock(&pData, NULL, NULL);
+        BREAK_ON_FAIL(hr);
+
+        format.stride = (LONG)GetPackedRowBytes(m_info.subtype, m_info.width);
+        CFrameCodec::GetPackedPlanes(format, pData, planes);
+
+        hr = m_codec.Decode((const BYTE*)(pRecord + 1), pRecord->cbFrame, format, planes);
+
+        pBuffer->Unlock();
+        BREAK_ON_FAIL(hr);
+
+        hr = pBuffer->SetCurrentLength(cbFrame);
+        BREAK_ON_FAIL(hr);
+
+        *ppBuffer = pBuffer.Detach();
+    }
+    while(false);
+
+    return hr;
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameSink.h"
+#include "FrameFileSource.h"
+#include "FrameIndex.h"
+#include "FrameCodec.h"
+#include "AudioRing.h"
+
+#include <deque>
+#include <vector>
+
+
+
+//
+//  Frame dump file layout - a header, then one record per frame:
+//
+//      FrameDumpHeader
+//      FrameDumpRecord, frame bytes
+//      FrameDumpRecord, frame bytes
+//      ...
+//
+//  The frame bytes are the planes of the frame without padding (see GetPackedFrameBytes), so
+//  a dump costs exactly the raw video plus 24 bytes per frame - or, in a compressed dump,
+//  the frame coded by CFrameCodec, which makes every record as long as its frame needs.  A
+//  dump whose recording was cut short is still readable up to its last complete record.
+//
+//  Next to every dump the recorder writes its index (see FrameIndexHeader), which finds the
+//  record of any time without reading the dump.
+//
+#define FRAME_DUMP_MAGIC            0x504D4446      // "FDMP"
+#define FRAME_DUMP_VERSION          1
+
+#define FRAME_DUMP_RAW              0
+#define FRAME_DUMP_LOSSLESS         1               // frames coded by CFrameCodec
+
+struct FrameDumpHeader
+{
+    DWORD       magic;                  // FRAME_DUMP_MAGIC
+    DWORD       version;                // FRAME_DUMP_VERSION
+    DWORD       headerBytes;            // sizeof(FrameDumpHeader) - the first record follows
+    DWORD       compression;            // FRAME_DUMP_RAW or FRAME_DUMP_LOSSLESS
+    GUID        subtype;
+    UINT32      width;
+    UINT32      height;
+    UINT32      frameRateNumerator;     // from the duration of the first frame
+    UINT32      frameRateDenominator;
+};
+
+struct FrameDumpRecord
+{
+    LONGLONG    timestamp;              // presentation time of the frame, 100-ns units
+    LONGLONG    duration;
+    DWORD       cbFrame;                // frame bytes that follow
+    DWORD       flags;                  // reserved, 0
+};
+
+
+//
+//  Frame consumer that writes every frame it receives into a frame dump, so the frames of
+//  any pipeline - a camera, or a region of it - can be replayed later.
+//
+//  OnFrame() only queues a reference to the frame; a writer thread copies and writes it.
+//  If the disk falls behind by more than a few frames, the recorder drops frames rather than
+//  holding on to capture buffers and stalling the camera.  With compression the writer
+//  thread codes every frame first, split into slices coded on the workers of a scheduler.
+//
+//  With an audio ring, the audio of the recorded frames goes to a float WAV file next to
+//  the dump (the dump path with ".wav" appended), from the time of the first frame on - its
+//  first sample is at the time stamp of the first frame, so the two play back in step.
+//
+class CFrameRecorder : public IFrameConsumer
+{
+    public:
+        CFrameRecorder(void);
+        virtual ~CFrameRecorder(void);
+
+        // code the frames of the dumps opened from now on with the lossless codec, on the
+        // workers of the scheduler - NULL codes them on the writer thread
+        void EnableCompression(CTaskScheduler* pScheduler);
+
+        // write the audio of the dumps opened from now on from the ring, NULL for none
+        void SetAudioSource(CAudioRing* pRing);
+
+        // create the dump - the header is written with the first frame
+        HRESULT Open(PCWSTR path);
+
+        // write the queued frames and close the dump
+        HRESULT Close(void);
+
+        ULONGLONG GetFrameCount(void) const { return m_frameCount; }
+        ULONGLONG GetDroppedCount(void) const { return m_droppedCount; }
+
+        // IFrameConsumer implementation
+        virtual void OnFrame(CFrameView* pFrame);
+
+    private:
+        static DWORD WINAPI WriterThreadProc(LPVOID pParam);
+        void WriterLoop(void);
+
+        // memory a queued frame holds, as reserved from the memory budget
+        static DWORD GetQueuedBytes(CFrameView* pFrame);
+        HRESULT WriteFrame(CFrameView* pFrame);
+        HRESULT WriteHeader(CFrameView* pFrame);
+        void IndexRecord(const FrameDumpRecord* pRecord);
+        HRESULT OpenAudioFile(PCWSTR path);
+        HRESULT WriteAudio(LONGLONG endTime);
+        void CloseAudioFile(void);
+
+        CComAutoCriticalSection m_critSec;
+        std::deque<CFrameView*> m_queue;        // frames waiting for the writer thread
+        HANDLE m_hFile;
+        WCHAR m_indexPath[MAX_PATH];            // index of the dump, empty if the path is too long
+        HANDLE m_hThread;
+        HANDLE m_hWakeEvent;
+        bool m_stopping;
+
+        // writer thread state
+        bool m_compress;
+        CFrameCodec m_codec;
+        bool m_headerWritten;
+        FrameFormat m_format;                   // format of the frames in the dump
+        std::vector<BYTE> m_record;             // one record, assembled before it is written
+        CFrameIndexWriter m_indexWriter;
+        ULONGLONG m_recordOffset;               // file offset of the next record
+
+        // audio of the dump, written by the writer thread
+        CAudioRing* m_pAudioRing;
+        HANDLE m_hAudioFile;
+        LONGLONG m_audioStart;                  // time of the first sample
+        ULONGLONG m_audioFrames;                // frames in the audio file
+        std::vector<float> m_audioBuffer;
+
+        ULONGLONG m_frameCount;
+        ULONGLONG m_droppedCount;
+};
+
+
+class CMappedFile;
+
+
+//
+//  Reads a frame dump through a file mapping.  The samples point straight into mapped views
+//  of the file, so replaying a dump copies no pixel data - the views are mapped copy-on-write,
+//  so a component that writes to its input only changes its private copy.  Every sample
+//  maps only its own frame, which keeps even multi-GB dumps within a 32-bit address space.
+//
+//  The records are found through the index of the dump, which the reader completes - or
+//  builds, for a dump without one - and writes back when it had to read record headers.
+//
+//  The frames of a compressed dump are decoded into memory buffers instead, on workers of a
+//  scheduler of the reader.
+//
+class CFrameDumpReader : public IFrameFileReader
+{
+    public:
+        // MF_E_UNSUPPORTED_BYTESTREAM_TYPE if the file is not a frame dump
+        static HRESULT Open(PCWSTR path, IFrameFileReader** ppReader);
+
+        virtual ~CFrameDumpReader(void);
+
+        // IFrameFileReader implementation
+        virtual const FrameFileInfo& GetInfo(void) const { return m_info; }
+        virtual HRESULT ReadFrame(IMFSample** ppSample);
+        virtual HRESULT Rewind(void) { m_nextFrame = 0; return S_OK; }
+        virtual HRESULT Seek(LONGLONG time);
+        virtual HRESULT ReadFrameAt(LONGLONG time, IMFSample** ppSample);
+
+    private:
+        CFrameDumpReader(void);
+
+        HRESULT Load(PCWSTR path);
+        HRESULT LoadIndex(PCWSTR path, HANDLE file, DWORD firstRecord);
+        HRESULT ScanRecords(HANDLE file, ULONGLONG offset);
+        bool CheckRecord(HANDLE file, const FrameIndexEntry& entry, ULONGLONG* pNextOffset);
+        bool IsValidFrameSize(DWORD cbFrame) const;
+        HRESULT DecodeRecord(const FrameDumpRecord* pRecord, IMFMediaBuffer** ppBuffer);
+        HRESULT ReadRecord(size_t frame, IMFSample** ppSample);
+        size_t FindFrame(LONGLONG time) const;
+
+        CMappedFile* m_pFile;
+        ULONGLONG m_fileSize;
+        FrameFileInfo m_info;
+        bool m_compressed;
+        CFrameCodec m_codec;
+        CTaskScheduler m_decodeScheduler;       // started for compressed dumps only
+        CFrameIndex m_index;                    // time stamp and file offset of every record
+        size_t m_nextFrame;
+};
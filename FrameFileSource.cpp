@@ -0,0 +1,1109 @@
+#include "FrameFileSource.h"
+#include "FrameDump.h"
+#include "StreamingFileReader.h"
+#include "Tracer.h"
+
+
+
+//
+//  CFrameFileStream constructor - creates the event queue of the stream.
+//
+CFrameFileStream::CFrameFileStream(CFrameFileSource* pSource,
+    IMFStreamDescriptor* pStreamDescriptor, HRESULT* pHr) :
+    m_cRef(1),
+    m_pSource(pSource),
+    m_pStreamDescriptor(pStreamDescriptor),
+    m_isShutdown(false)
+{
+    *pHr = MFCreateEventQueue(&m_pEventQueue);
+}
+
+
+CFrameFileStream::~CFrameFileStream(void)
+{
+    Shutdown();
+}
+
+
+//
+// IUnknown methods
+//
+HRESULT CFrameFileStream::QueryInterface(REFIID riid, void** ppv)
+{
+    HRESULT hr = S_OK;
+
+    if(ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if(riid == IID_IUnknown || riid == IID_IMFMediaStream)
+    {
+        *ppv = static_cast<IMFMediaStream*>(this);
+    }
+    else if(riid == IID_IMFMediaEventGenerator)
+    {
+        *ppv = static_cast<IMFMediaEventGenerator*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        hr = E_NOINTERFACE;
+    }
+
+    if(SUCCEEDED(hr))
+        AddRef();
+
+    return hr;
+}
+
+ULONG CFrameFileStream::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CFrameFileStream::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+//
+// IMFMediaEventGenerator methods - all of them are delegated to the event queue.
+//
+HRESULT CFrameFileStream::BeginGetEvent(IMFAsyncCallback* pCallback, IUnknown* punkState)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->BeginGetEvent(pCallback, punkState);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameFileStream::EndGetEvent(IMFAsyncResult* pResult, IMFMediaEvent** ppEvent)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->EndGetEvent(pResult, ppEvent);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameFileStream::GetEvent(DWORD dwFlags, IMFMediaEvent** ppEvent)
+{
+    CComPtr<IMFMediaEventQueue> pQueue;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        HRESULT hr = CheckShutdown();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        pQueue = m_pEventQueue;
+    }
+
+    // GetEvent() can block indefinitely, so it must not be called while holding the lock
+    return pQueue->GetEvent(dwFlags, ppEvent);
+}
+
+HRESULT CFrameFileStream::QueueEvent(MediaEventType met, REFGUID guidExtendedType,
+    HRESULT hrStatus, const PROPVARIANT* pvValue)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->QueueEventParamVar(met, guidExtendedType, hrStatus, pvValue);
+    }
+
+    return hr;
+}
+
+
+
+//
+// IMFMediaStream methods
+//
+HRESULT CFrameFileStream::GetMediaSource(IMFMediaSource** ppMediaSource)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (ppMediaSource == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pSource->QueryInterface(IID_IMFMediaSource, (void**)ppMediaSource);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameFileStream::GetStreamDescriptor(IMFStreamDescriptor** ppStreamDescriptor)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (ppStreamDescriptor == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        *ppStreamDescriptor = m_pStreamDescriptor;
+        (*ppStreamDescriptor)->AddRef();
+    }
+
+    return hr;
+}
+
+
+//
+// The samples are read and paced by the source - the stream only queues the request.
+//
+HRESULT CFrameFileStream::RequestSample(IUnknown* pToken)
+{
+    CFrameFileSource* pSource = NULL;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        HRESULT hr = CheckShutdown();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        pSource = m_pSource;
+    }
+
+    return pSource->RequestSample(pToken);
+}
+
+
+HRESULT CFrameFileStream::DeliverSample(IMFSample* pSample)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->QueueEventParamUnk(MEMediaSample, GUID_NULL, S_OK, pSample);
+    }
+
+    return hr;
+}
+
+
+HRESULT CFrameFileStream::Shutdown(void)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (m_isShutdown)
+    {
+        return S_OK;
+    }
+
+    m_isShutdown = true;
+
+    if (m_pEventQueue != NULL)
+    {
+        m_pEventQueue->Shutdown();
+    }
+
+    m_pSource = NULL;
+
+    return S_OK;
+}
+
+
+
+
+
+CFrameFileSource::CFrameFileSource(IFrameFileReader* pReader,
+    const FrameReplayOptions& options) :
+    m_cRef(1),
+    m_pStream(NULL),
+    m_pReader(pReader),
+    m_options(options),
+    m_state(SourceState_Stopped),
+    m_streamAnnounced(false),
+    m_isShutdown(false),
+    m_hThread(NULL),
+    m_hWakeEvent(NULL),
+    m_nextSampleTime(0),
+    m_rewindPending(true),
+    m_startPosition(0),
+    m_endOfStream(false),
+    m_loopOffset(0),
+    m_clockStart(0),
+    m_clockTime(0),
+    m_clockFrequency(1)
+{
+    LARGE_INTEGER frequency;
+
+    if (QueryPerformanceFrequency(&frequency))
+    {
+        m_clockFrequency = frequency.QuadPart;
+    }
+}
+
+
+CFrameFileSource::~CFrameFileSource(void)
+{
+    Shutdown();
+}
+
+
+HRESULT CFrameFileSource::CreateInstance(IFrameFileReader* pReader,
+    const FrameReplayOptions& options, IMFMediaSource** ppSource)
+{
+    HRESULT hr = S_OK;
+    CFrameFileSource* pSource = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pReader, E_POINTER);
+
+        if (ppSource == NULL)
+        {
+            delete pReader;
+            hr = E_POINTER;
+            break;
+        }
+
+        pSource = new (std::nothrow) CFrameFileSource(pReader, options);
+        if (pSource == NULL)
+        {
+            delete pReader;
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        hr = pSource->Initialize();
+        BREAK_ON_FAIL(hr);
+
+        *ppSource = pSource;
+        (*ppSource)->AddRef();
+    }
+    while(false);
+
+    if (pSource != NULL)
+    {
+        pSource->Release();
+    }
+
+    return hr;
+}
+
+
+//
+// Describe the stream, and start the delivery thread.
+//
+HRESULT CFrameFileSource::Initialize(void)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaType> pType;
+    CComPtr<IMFStreamDescriptor> pStreamDescriptor;
+    CComPtr<IMFMediaTypeHandler> pHandler;
+    IMFMediaType* types[1];
+    IMFStreamDescriptor* streams[1];
+
+    do
+    {
+        hr = MFCreateEventQueue(&m_pEventQueue);
+        BREAK_ON_FAIL(hr);
+
+        hr = CreateMediaType(&pType);
+        BREAK_ON_FAIL(hr);
+
+        types[0] = pType;
+        hr = MFCreateStreamDescriptor(0, 1, types, &pStreamDescriptor);
+        BREAK_ON_FAIL(hr);
+
+        hr = pStreamDescriptor->GetMediaTypeHandler(&pHandler);
+        BREAK_ON_FAIL(hr);
+
+        hr = pHandler->SetCurrentMediaType(pType);
+        BREAK_ON_FAIL(hr);
+
+        streams[0] = pStreamDescriptor;
+        hr = MFCreatePresentationDescriptor(1, streams, &m_pPresentationDescriptor);
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pPresentationDescriptor->SelectStream(0);
+        BREAK_ON_FAIL(hr);
+
+        // a looped file never ends
+        if (!m_options.loop && m_pReader->GetInfo().duration > 0)
+        {
+            hr = m_pPresentationDescriptor->SetUINT64(MF_PD_DURATION,
+                (UINT64)m_pReader->GetInfo().duration);
+            BREAK_ON_FAIL(hr);
+        }
+
+        m_pStream = new (std::nothrow) CFrameFileStream(this, pStreamDescriptor, &hr);
+        BREAK_ON_NULL(m_pStream, E_OUTOFMEMORY);
+        BREAK_ON_FAIL(hr);
+
+        m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        BREAK_ON_NULL(m_hWakeEvent, HRESULT_FROM_WIN32(GetLastError()));
+
+        m_hThread = CreateThread(NULL, 0, DeliveryThreadProc, this, 0, NULL);
+        BREAK_ON_NULL(m_hThread, HRESULT_FROM_WIN32(GetLastError()));
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The frames are stored without padding, so the stride is the width of a packed row.
+//
+HRESULT CFrameFileSource::CreateMediaType(IMFMediaType** ppType)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaType> pType;
+    const FrameFileInfo& info = m_pReader->GetInfo();
+
+    do
+    {
+        hr = MFCreateMediaType(&pType);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetGUID(MF_MT_SUBTYPE, info.subtype);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFSetAttributeSize(pType, MF_MT_FRAME_SIZE, info.width, info.height);
+        BREAK_ON_FAIL(hr);
+
+        if (info.frameRateNumerator != 0 && info.frameRateDenominator != 0)
+        {
+            hr = MFSetAttributeRatio(pType, MF_MT_FRAME_RATE, info.frameRateNumerator,
+                info.frameRateDenominator);
+            BREAK_ON_FAIL(hr);
+        }
+
+        hr = MFSetAttributeRatio(pType, MF_MT_PIXEL_ASPECT_RATIO, 1, 1);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetUINT32(MF_MT_ALL_SAMPLES_INDEPENDENT, TRUE);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetUINT32(MF_MT_FIXED_SIZE_SAMPLES, TRUE);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetUINT32(MF_MT_SAMPLE_SIZE,
+            GetPackedFrameBytes(info.subtype, info.width, info.height));
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetUINT32(MF_MT_DEFAULT_STRIDE, GetPackedRowBytes(info.subtype, info.width));
+        BREAK_ON_FAIL(hr);
+
+        *ppType = pType.Detach();
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// IUnknown methods
+//
+HRESULT CFrameFileSource::QueryInterface(REFIID riid, void** ppv)
+{
+    HRESULT hr = S_OK;
+
+    if(ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if(riid == IID_IUnknown || riid == IID_IMFMediaSource)
+    {
+        *ppv = static_cast<IMFMediaSource*>(this);
+    }
+    else if(riid == IID_IMFMediaEventGenerator)
+    {
+        *ppv = static_cast<IMFMediaEventGenerator*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        hr = E_NOINTERFACE;
+    }
+
+    if(SUCCEEDED(hr))
+        AddRef();
+
+    return hr;
+}
+
+ULONG CFrameFileSource::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CFrameFileSource::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+//
+// IMFMediaEventGenerator methods - all of them are delegated to the event queue.
+//
+HRESULT CFrameFileSource::BeginGetEvent(IMFAsyncCallback* pCallback, IUnknown* punkState)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->BeginGetEvent(pCallback, punkState);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameFileSource::EndGetEvent(IMFAsyncResult* pResult, IMFMediaEvent** ppEvent)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->EndGetEvent(pResult, ppEvent);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameFileSource::GetEvent(DWORD dwFlags, IMFMediaEvent** ppEvent)
+{
+    CComPtr<IMFMediaEventQueue> pQueue;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        HRESULT hr = CheckShutdown();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        pQueue = m_pEventQueue;
+    }
+
+    // GetEvent() can block indefinitely, so it must not be called while holding the lock
+    return pQueue->GetEvent(dwFlags, ppEvent);
+}
+
+HRESULT CFrameFileSource::QueueEvent(MediaEventType met, REFGUID guidExtendedType,
+    HRESULT hrStatus, const PROPVARIANT* pvValue)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->QueueEventParamVar(met, guidExtendedType, hrStatus, pvValue);
+    }
+
+    return hr;
+}
+
+
+
+//
+// IMFMediaSource methods
+//
+HRESULT CFrameFileSource::GetCharacteristics(DWORD* pdwCharacteristics)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (pdwCharacteristics == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pdwCharacteristics = MFMEDIASOURCE_CAN_PAUSE | MFMEDIASOURCE_CAN_SEEK;
+
+    return CheckShutdown();
+}
+
+
+HRESULT CFrameFileSource::CreatePresentationDescriptor(
+    IMFPresentationDescriptor** ppPresentationDescriptor)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (ppPresentationDescriptor == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pPresentationDescriptor->Clone(ppPresentationDescriptor);
+    }
+
+    return hr;
+}
+
+
+//
+// Start from the beginning or at a position, or resume after a pause.  A start at a position
+// while the source runs is a seek, and is announced as one.
+//
+HRESULT CFrameFileSource::Start(IMFPresentationDescriptor* pPresentationDescriptor,
+    const GUID* pguidTimeFormat, const PROPVARIANT* pvarStartPosition)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFStreamDescriptor> pStreamDescriptor;
+    BOOL selected = FALSE;
+    bool seeking = false;
+    PROPVARIANT startTime;
+    LARGE_INTEGER now;
+
+    PropVariantInit(&startTime);
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        hr = CheckShutdown();
+        BREAK_ON_FAIL(hr);
+
+        BREAK_ON_NULL(pPresentationDescriptor, E_INVALIDARG);
+        BREAK_ON_NULL(pvarStartPosition, E_INVALIDARG);
+
+        if ((pguidTimeFormat != NULL && *pguidTimeFormat != GUID_NULL) ||
+            (pvarStartPosition->vt != VT_EMPTY && pvarStartPosition->vt != VT_I8))
+        {
+            hr = MF_E_UNSUPPORTED_TIME_FORMAT;
+            break;
+        }
+
+        hr = pPresentationDescriptor->GetStreamDescriptorByIndex(0, &selected,
+            &pStreamDescriptor);
+        BREAK_ON_FAIL(hr);
+
+        if (pvarStartPosition->vt == VT_I8 || m_state == SourceState_Stopped)
+        {
+            seeking = (pvarStartPosition->vt == VT_I8 && m_state == SourceState_Started);
+
+            m_startPosition = (pvarStartPosition->vt == VT_I8) ?
+                max(pvarStartPosition->hVal.QuadPart, 0) : 0;
+
+            m_pNextSample.Release();
+            m_rewindPending = true;
+            m_endOfStream = false;
+            m_nextSampleTime = m_startPosition;
+        }
+
+        startTime.vt = VT_I8;
+        startTime.hVal.QuadPart = m_nextSampleTime;
+
+        // the next sample is due right away, and the ones after it at their own pace
+        QueryPerformanceCounter(&now);
+        m_clockStart = now.QuadPart;
+        m_clockTime = m_nextSampleTime;
+
+        if (selected)
+        {
+            hr = m_pEventQueue->QueueEventParamUnk(m_streamAnnounced ? MEUpdatedStream :
+                MENewStream, GUID_NULL, S_OK, static_cast<IMFMediaStream*>(m_pStream));
+            BREAK_ON_FAIL(hr);
+
+            m_streamAnnounced = true;
+
+            hr = m_pStream->QueueEvent(seeking ? MEStreamSeeked : MEStreamStarted, GUID_NULL,
+                S_OK, &startTime);
+            BREAK_ON_FAIL(hr);
+        }
+
+        hr = m_pEventQueue->QueueEventParamVar(seeking ? MESourceSeeked : MESourceStarted,
+            GUID_NULL, S_OK, &startTime);
+        BREAK_ON_FAIL(hr);
+
+        m_state = SourceState_Started;
+        SetEvent(m_hWakeEvent);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CFrameFileSource::Stop(void)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        hr = CheckShutdown();
+        BREAK_ON_FAIL(hr);
+
+        // the session drops its outstanding requests when the source stops
+        m_state = SourceState_Stopped;
+        ClearRequests();
+        m_pNextSample.Release();
+
+        hr = m_pStream->QueueEvent(MEStreamStopped, GUID_NULL, S_OK, NULL);
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pEventQueue->QueueEventParamVar(MESourceStopped, GUID_NULL, S_OK, NULL);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CFrameFileSource::Pause(void)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        hr = CheckShutdown();
+        BREAK_ON_FAIL(hr);
+
+        if (m_state != SourceState_Started)
+        {
+            hr = MF_E_INVALID_STATE_TRANSITION;
+            break;
+        }
+
+        m_state = SourceState_Paused;
+
+        hr = m_pStream->QueueEvent(MEStreamPaused, GUID_NULL, S_OK, NULL);
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pEventQueue->QueueEventParamVar(MESourcePaused, GUID_NULL, S_OK, NULL);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Stop the delivery thread and release everything.  The thread takes the source lock, so
+// it is joined after the lock is released.
+//
+HRESULT CFrameFileSource::Shutdown(void)
+{
+    HANDLE thread = NULL;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_isShutdown)
+        {
+            return MF_E_SHUTDOWN;
+        }
+
+        m_isShutdown = true;
+
+        if (m_pStream != NULL)
+        {
+            m_pStream->Shutdown();
+        }
+
+        if (m_pEventQueue != NULL)
+        {
+            m_pEventQueue->Shutdown();
+        }
+
+        ClearRequests();
+
+        thread = m_hThread;
+        m_hThread = NULL;
+
+        if (m_hWakeEvent != NULL)
+        {
+            SetEvent(m_hWakeEvent);
+        }
+    }
+
+    if (thread != NULL)
+    {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_pNextSample.Release();
+
+    if (m_pStream != NULL)
+    {
+        m_pStream->Release();
+        m_pStream = NULL;
+    }
+
+    delete m_pReader;
+    m_pReader = NULL;
+
+    if (m_hWakeEvent != NULL)
+    {
+        CloseHandle(m_hWakeEvent);
+        m_hWakeEvent = NULL;
+    }
+
+    return S_OK;
+}
+
+
+//
+// Read the frame under the lock, like the delivery thread does, so the two never use the
+// reader at the same time - a snapshot only holds up delivery for the read of one frame.
+//
+HRESULT CFrameFileSource::GetSnapshot(LONGLONG time, IMFSample** ppSample)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFSample> pSample;
+    LONGLONG loopOffset = 0;
+    LONGLONG sampleTime = 0;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        hr = CheckShutdown();
+        BREAK_ON_FAIL(hr);
+
+        BREAK_ON_NULL(ppSample, E_POINTER);
+
+        if (time < 0)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        const FrameFileInfo& info = m_pReader->GetInfo();
+
+        loopOffset = GetLoopOffset(time);
+
+        hr = m_pReader->ReadFrameAt(info.startTime + time - loopOffset, &pSample);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->GetSampleTime(&sampleTime);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->SetSampleTime(sampleTime - info.startTime + loopOffset);
+        BREAK_ON_FAIL(hr);
+
+        *ppSample = pSample.Detach();
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Start of the pass of a looped file that shows the given presentation time - 0 for a file
+// that plays once.
+//
+LONGLONG CFrameFileSource::GetLoopOffset(LONGLONG time) const
+{
+    LONGLONG duration = m_pReader->GetInfo().duration;
+
+    if (!m_options.loop || duration <= 0)
+    {
+        return 0;
+    }
+
+    return time - time % duration;
+}
+
+
+//
+// Queue a sample request of the stream for the delivery thread.
+//
+HRESULT CFrameFileSource::RequestSample(IUnknown* pToken)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (FAILED(hr))
+    {
+        return hr;
+    }
+
+    if (m_state == SourceState_Stopped)
+    {
+        return MF_E_INVALIDREQUEST;
+    }
+
+    if (m_endOfStream)
+    {
+        return MF_E_END_OF_STREAM;
+    }
+
+    if (pToken != NULL)
+    {
+        pToken->AddRef();
+    }
+
+    m_requests.push_back(pToken);
+    SetEvent(m_hWakeEvent);
+
+    return S_OK;
+}
+
+
+void CFrameFileSource::ClearRequests(void)
+{
+    for (size_t i = 0; i < m_requests.size(); i++)
+    {
+        if (m_requests[i] != NULL)
+        {
+            m_requests[i]->Release();
+        }
+    }
+
+    m_requests.clear();
+}
+
+
+
+DWORD WINAPI CFrameFileSource::DeliveryThreadProc(LPVOID pParam)
+{
+    CFrameFileSource* pSource = static_cast<CFrameFileSource*>(pParam);
+
+    pSource->DeliveryLoop();
+
+    return 0;
+}
+
+
+//
+// Serve the sample requests while the source is started.  The thread sleeps until a request
+// or a state change wakes it up, or until the next sample is due.
+//
+void CFrameFileSource::DeliveryLoop(void)
+{
+    while (true)
+    {
+        DWORD timeout = INFINITE;
+
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            if (m_isShutdown)
+            {
+                break;
+            }
+
+            if (m_state == SourceState_Started && !m_requests.empty() && !m_endOfStream)
+            {
+                timeout = DeliverNextSample();
+            }
+        }
+
+        if (timeout != 0)
+        {
+            WaitForSingleObject(m_hWakeEvent, timeout);
+        }
+    }
+}
+
+
+//
+// Send the next sample in answer to the oldest request - called with the lock held.
+// Returns the milliseconds until the sample is due, 0 if it was sent, or INFINITE when
+// there is nothing left to send.
+//
+DWORD CFrameFileSource::DeliverNextSample(void)
+{
+    HRESULT hr = S_OK;
+    IUnknown* pToken = NULL;
+    LONGLONG duration = 0;
+
+    if (m_pNextSample == NULL)
+    {
+        hr = ReadNextSample();
+
+        if (FAILED(hr))
+        {
+            m_endOfStream = true;
+            ClearRequests();
+
+            if (hr == MF_E_END_OF_STREAM)
+            {
+                m_pStream->QueueEvent(MEEndOfStream, GUID_NULL, S_OK, NULL);
+                m_pEventQueue->QueueEventParamVar(MEEndOfPresentation, GUID_NULL, S_OK, NULL);
+            }
+            else
+            {
+                m_pEventQueue->QueueEventParamVar(MEError, GUID_NULL, hr, NULL);
+            }
+
+            return INFINITE;
+        }
+    }
+
+    if (m_options.timing == FrameReplay_Original)
+    {
+        LARGE_INTEGER now;
+        LONGLONG due = m_clockStart + (LONGLONG)((double)(m_nextSampleTime - m_clockTime) *
+            m_clockFrequency / 10000000);
+
+        QueryPerformanceCounter(&now);
+
+        // round up, so the thread does not wake up just before the sample is due
+        if (now.QuadPart < due)
+        {
+            return (DWORD)((due - now.QuadPart) * 1000 / m_clockFrequency) + 1;
+        }
+    }
+
+    pToken = m_requests.front();
+    m_requests.pop_front();
+
+    if (pToken != NULL)
+    {
+        m_pNextSample->SetUnknown(MFSampleExtension_Token, pToken);
+        pToken->Release();
+    }
+
+    m_pStream->DeliverSample(m_pNextSample);
+
+    // should the source be paused now, it resumes where this sample ends
+    if (SUCCEEDED(m_pNextSample->GetSampleDuration(&duration)))
+    {
+        m_nextSampleTime += duration;
+    }
+
+    m_pNextSample.Release();
+
+    return 0;
+}
+
+
+//
+// Read the next frame, and rebase its time stamp so the file starts at 0 and every pass of
+// a looped file continues where the previous one ended.  After a start the reader seeks to
+// the start position first - into a later pass, for a looped file.
+//
+HRESULT CFrameFileSource::ReadNextSample(void)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFSample> pSample;
+    const FrameFileInfo& info = m_pReader->GetInfo();
+    LONGLONG time = 0;
+    CTraceSpan span("source", "ReadNextSample");
+
+    do
+    {
+        if (m_rewindPending)
+        {
+            m_loopOffset = GetLoopOffset(m_startPosition);
+
+            hr = m_pReader->Seek(info.startTime + m_startPosition - m_loopOffset);
+            BREAK_ON_FAIL(hr);
+
+            m_rewindPending = false;
+        }
+
+        hr = m_pReader->ReadFrame(&pSample);
+
+        if (hr == MF_E_END_OF_STREAM && m_options.loop && info.duration > 0)
+        {
+            m_loopOffset += info.duration;
+
+            hr = m_pReader->Rewind();
+            BREAK_ON_FAIL(hr);
+
+            hr = m_pReader->ReadFrame(&pSample);
+        }
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->GetSampleTime(&time);
+        BREAK_ON_FAIL(hr);
+
+        time = time - info.startTime + m_loopOffset;
+
+        hr = pSample->SetSampleTime(time);
+        BREAK_ON_FAIL(hr);
+
+        m_nextSampleTime = time;
+        m_pNextSample = pSample;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
+//
+// Try the frame file formats in turn - each reader rejects a file that is not its own.
+//
+HRESULT CreateFrameFileSource(PCWSTR path, const FrameReplayOptions& options,
+    IMFMediaSource** ppSource)
+{
+    HRESULT hr = S_OK;
+    IFrameFileReader* pReader = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(path, E_POINTER);
+        BREAK_ON_NULL(ppSource, E_POINTER);
+
+        hr = CFrameDumpReader::Open(path, &pReader);
+        if (hr == MF_E_UNSUPPORTED_BYTESTREAM_TYPE)
+        {
+            hr = CStreamingFileReader::Open(path, &pReader);
+        }
+        BREAK_ON_FAIL(hr);
+
+        hr = CFrameFileSource::CreateInstance(pReader, options, ppSource);
+    }
+    while(false);
+
+    return hr;
+}
@@ -0,0 +1,276 @@
+#pragma once
+
+#include "Common.h"
+
+// Media Foundation headers
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mferror.h>
+
+#include <deque>
+
+
+
+//
+//  Format of the frames stored in a frame file.
+//
+struct FrameFileInfo
+{
+    GUID        subtype;                // MFVideoFormat_YUY2, MFVideoFormat_NV12, MFVideoFormat_RGB32
+    UINT32      width;
+    UINT32      height;
+    UINT32      frameRateNumerator;
+    UINT32      frameRateDenominator;
+    LONGLONG    startTime;              // time stamp of the first frame, 100-ns units
+    LONGLONG    duration;               // from the first frame to the end of the last one
+};
+
+
+// largest width and height of the frames of a frame file, as in pipeline files
+#define FRAME_FILE_MAX_DIMENSION        16384
+
+
+//
+// Bytes of one frame stored without padding - every row as wide as its visible pixels, and
+// the NV12 chroma plane right after the luma plane.  The size must have passed
+// CheckFrameFileSize() if it comes from a file.
+//
+inline DWORD GetPackedRowBytes(REFGUID subtype, UINT32 width)
+{
+    if (subtype == MFVideoFormat_YUY2)
+        return width * 2;
+    if (subtype == MFVideoFormat_RGB32)
+        return width * 4;
+    return width;
+}
+
+inline DWORD GetPackedFrameBytes(REFGUID subtype, UINT32 width, UINT32 height)
+{
+    DWORD cbFrame = GetPackedRowBytes(subtype, width) * height;
+
+    return (subtype == MFVideoFormat_NV12) ? cbFrame + cbFrame / 2 : cbFrame;
+}
+
+//
+// Check a frame size read from a file before any size is computed from it - a crafted file
+// must not get a frame whose byte count wraps around, with a media type far larger than
+// the frames it delivers.
+//
+inline HRESULT CheckFrameFileSize(REFGUID subtype, UINT32 width, UINT32 height)
+{
+    ULONGLONG cbFrame = 0;
+
+    if (width == 0 || height == 0 || width > FRAME_FILE_MAX_DIMENSION ||
+        height > FRAME_FILE_MAX_DIMENSION)
+    {
+        return MF_E_INVALID_FILE_FORMAT;
+    }
+
+    cbFrame = (ULONGLONG)GetPackedRowBytes(subtype, width) * height;
+    if (subtype == MFVideoFormat_NV12)
+        cbFrame += cbFrame / 2;
+
+    return (cbFrame <= MAXDWORD) ? S_OK : MF_E_INVALID_FILE_FORMAT;
+}
+
+
+//
+//  Reads the frames of one file format, in file order, or the frame shown at a given time.
+//  The frame file source calls its reader with its lock held only, so readers need no
+//  locking of their own.
+//
+//  Times are the time stamps of the file - the first frame is at GetInfo().startTime.
+//
+class IFrameFileReader
+{
+    public:
+        virtual ~IFrameFileReader(void) {}
+
+        virtual const FrameFileInfo& GetInfo(void) const = 0;
+
+        // the next frame, stamped with the time it was recorded at - MF_E_END_OF_STREAM after
+        // the last frame
+        virtual HRESULT ReadFrame(IMFSample** ppSample) = 0;
+
+        // go back to the first frame
+        virtual HRESULT Rewind(void) = 0;
+
+        // continue reading at the frame shown at the given time - the last frame stamped at
+        // or before it, or the first frame if the time is before the file
+        virtual HRESULT Seek(LONGLONG time) = 0;
+
+        // the frame shown at the given time, without moving the read position -
+        // MF_E_END_OF_STREAM if the time is past the end of the last frame
+        virtual HRESULT ReadFrameAt(LONGLONG time, IMFSample** ppSample) = 0;
+};
+
+
+//
+//  How the frame file source paces the frames.
+//
+enum FrameReplayTiming
+{
+    FrameReplay_Original = 0,       // at the rate they were recorded at
+    FrameReplay_AsFastAsPossible    // as soon as the session asks for them
+};
+
+struct FrameReplayOptions
+{
+    FrameReplayTiming timing;
+    bool loop;                      // start over after the last frame, time stamps keep rising
+};
+
+
+class CFrameFileSource;
+
+
+//
+//  The single video stream of the frame file source.
+//
+class CFrameFileStream : public IMFMediaStream
+{
+    public:
+        CFrameFileStream(CFrameFileSource* pSource, IMFStreamDescriptor* pStreamDescriptor,
+            HRESULT* pHr);
+        ~CFrameFileStream(void);
+
+        // IUnknown interface implementation
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void);
+        STDMETHODIMP_(ULONG) Release(void);
+
+        // IMFMediaEventGenerator interface implementation
+        STDMETHODIMP BeginGetEvent(IMFAsyncCallback* pCallback, IUnknown* punkState);
+        STDMETHODIMP EndGetEvent(IMFAsyncResult* pResult, IMFMediaEvent** ppEvent);
+        STDMETHODIMP GetEvent(DWORD dwFlags, IMFMediaEvent** ppEvent);
+        STDMETHODIMP QueueEvent(MediaEventType met, REFGUID guidExtendedType,
+            HRESULT hrStatus, const PROPVARIANT* pvValue);
+
+        // IMFMediaStream interface implementation
+        STDMETHODIMP GetMediaSource(IMFMediaSource** ppMediaSource);
+        STDMETHODIMP GetStreamDescriptor(IMFStreamDescriptor** ppStreamDescriptor);
+        STDMETHODIMP RequestSample(IUnknown* pToken);
+
+        // called by the source
+        HRESULT DeliverSample(IMFSample* pSample);
+        HRESULT Shutdown(void);
+
+    private:
+        volatile long m_cRef;
+        CComAutoCriticalSection m_critSec;
+
+        CFrameFileSource* m_pSource;                        // parent source - not reference counted
+        CComPtr<IMFMediaEventQueue> m_pEventQueue;          // stream event queue
+        CComPtr<IMFStreamDescriptor> m_pStreamDescriptor;
+        bool m_isShutdown;
+
+        HRESULT CheckShutdown(void) const { return m_isShutdown ? MF_E_SHUTDOWN : S_OK; }
+};
+
+
+//
+//  A media source that plays back the frames of a file, so OpenURL() can open recordings
+//  the way it opens a camera - the rest of the topology does not know the difference.
+//
+//  Samples are handed out by a delivery thread of the source, one per sample request of the
+//  session.  With FrameReplay_Original the thread holds every sample back until its time
+//  has come on the wall clock, which paces even the rateless frame sink like a live camera;
+//  with FrameReplay_AsFastAsPossible the frames go out as fast as the pipeline takes them.
+//
+//  The source can seek - Start() at a position continues with the frame shown at that time -
+//  and GetSnapshot() reads any frame in between the frames it delivers.
+//
+class CFrameFileSource : public IMFMediaSource
+{
+    public:
+        // takes ownership of the reader, even on failure
+        static HRESULT CreateInstance(IFrameFileReader* pReader,
+            const FrameReplayOptions& options, IMFMediaSource** ppSource);
+
+        // IUnknown interface implementation
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void);
+        STDMETHODIMP_(ULONG) Release(void);
+
+        // IMFMediaEventGenerator interface implementation
+        STDMETHODIMP BeginGetEvent(IMFAsyncCallback* pCallback, IUnknown* punkState);
+        STDMETHODIMP EndGetEvent(IMFAsyncResult* pResult, IMFMediaEvent** ppEvent);
+        STDMETHODIMP GetEvent(DWORD dwFlags, IMFMediaEvent** ppEvent);
+        STDMETHODIMP QueueEvent(MediaEventType met, REFGUID guidExtendedType,
+            HRESULT hrStatus, const PROPVARIANT* pvValue);
+
+        // IMFMediaSource interface implementation
+        STDMETHODIMP GetCharacteristics(DWORD* pdwCharacteristics);
+        STDMETHODIMP CreatePresentationDescriptor(
+            IMFPresentationDescriptor** ppPresentationDescriptor);
+        STDMETHODIMP Start(IMFPresentationDescriptor* pPresentationDescriptor,
+            const GUID* pguidTimeFormat, const PROPVARIANT* pvarStartPosition);
+        STDMETHODIMP Stop(void);
+        STDMETHODIMP Pause(void);
+        STDMETHODIMP Shutdown(void);
+
+        // the frame shown at the given presentation time - the file starts at 0, as in the
+        // samples the source delivers - read while the source keeps playing
+        HRESULT GetSnapshot(LONGLONG time, IMFSample** ppSample);
+
+        // called by the stream
+        HRESULT RequestSample(IUnknown* pToken);
+
+    private:
+        enum SourceState
+        {
+            SourceState_Stopped = 0,
+            SourceState_Started,
+            SourceState_Paused
+        };
+
+        CFrameFileSource(IFrameFileReader* pReader, const FrameReplayOptions& options);
+        ~CFrameFileSource(void);
+
+        HRESULT Initialize(void);
+        HRESULT CreateMediaType(IMFMediaType** ppType);
+        void ClearRequests(void);
+
+        static DWORD WINAPI DeliveryThreadProc(LPVOID pParam);
+        void DeliveryLoop(void);
+        DWORD DeliverNextSample(void);
+        HRESULT ReadNextSample(void);
+        LONGLONG GetLoopOffset(LONGLONG time) const;
+
+        volatile long m_cRef;
+        CComAutoCriticalSection m_critSec;
+
+        CComPtr<IMFMediaEventQueue> m_pEventQueue;          // source event queue
+        CComPtr<IMFPresentationDescriptor> m_pPresentationDescriptor;
+        CFrameFileStream* m_pStream;                        // the only stream of this source
+        IFrameFileReader* m_pReader;
+        FrameReplayOptions m_options;
+        SourceState m_state;
+        bool m_streamAnnounced;                             // MENewStream was sent
+        bool m_isShutdown;
+
+        // delivery thread
+        HANDLE m_hThread;
+        HANDLE m_hWakeEvent;                                // requests, state changes, shutdown
+        std::deque<IUnknown*> m_requests;                   // tokens of pending sample requests
+        CComPtr<IMFSample> m_pNextSample;                   // read, waiting for its time
+        LONGLONG m_nextSampleTime;                          // its presentation time
+        bool m_rewindPending;                               // seek with the next read
+        LONGLONG m_startPosition;                           // presentation time it seeks to
+        bool m_endOfStream;
+        LONGLONG m_loopOffset;                              // added to the time stamps of this pass
+
+        // pacing - the presentation time m_clockTime is due at m_clockStart
+        LONGLONG m_clockStart;                              // QueryPerformanceCounter ticks
+        LONGLONG m_clockTime;
+        LONGLONG m_clockFrequency;
+
+        HRESULT CheckShutdown(void) const { return m_isShutdown ? MF_E_SHUTDOWN : S_OK; }
+};
+
+
+//
+//  Open a frame file as a media source - the format is recognized from the content.
+//
+HRESULT CreateFrameFileSource(PCWSTR path, const FrameReplayOptions& options,
+    IMFMediaSource** ppSource);
@@ -0,0 +1,251 @@
+#include "FrameIndex.h"
+
+#include <algorithm>
+
+
+
+// appended to the path of a dump to name its index
+#define FRAME_INDEX_EXTENSION       L".fidx"
+
+
+
+HRESULT GetFrameIndexPath(PCWSTR dumpPath, WCHAR* pIndexPath, DWORD cchIndexPath)
+{
+    if (dumpPath == NULL || pIndexPath == NULL)
+    {
+        return E_POINTER;
+    }
+
+    // wcscpy_s() and wcscat_s() abort on a buffer that is too small - check it first
+    if (wcslen(dumpPath) + wcslen(FRAME_INDEX_EXTENSION) >= cchIndexPath)
+    {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+
+    wcscpy_s(pIndexPath, cchIndexPath, dumpPath);
+    wcscat_s(pIndexPath, cchIndexPath, FRAME_INDEX_EXTENSION);
+
+    return S_OK;
+}
+
+
+
+
+
+void CFrameIndex::Reset(ULONGLONG firstRecord, DWORD recordBytes)
+{
+    m_entries.clear();
+    m_firstRecord = firstRecord;
+    m_recordBytes = recordBytes;
+}
+
+
+//
+// Read the entries in one piece.  An entry that is not where the record layout puts it - or
+// not after the one before it, for records of varying size - means the index belongs to
+// another dump.  A partial entry at the end is ignored, the reader indexes the records it
+// is missing anyway.
+//
+HRESULT CFrameIndex::Load(PCWSTR indexPath, ULONGLONG firstRecord, DWORD recordBytes)
+{
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    LARGE_INTEGER fileSize;
+    FrameIndexHeader header;
+    ULONGLONG count = 0;
+    DWORD read = 0;
+
+    Reset(firstRecord, recordBytes);
+
+    do
+    {
+        file = CreateFile(indexPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!GetFileSizeEx(file, &fileSize))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!ReadFile(file, &header, sizeof(header), &read, NULL) || read != sizeof(header) ||
+            header.magic != FRAME_INDEX_MAGIC || header.version != FRAME_INDEX_VERSION ||
+            header.headerBytes != sizeof(header))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        if (header.firstRecord != firstRecord || header.recordBytes != recordBytes)
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        count = ((ULONGLONG)fileSize.QuadPart - sizeof(header)) / sizeof(FrameIndexEntry);
+        if (count == 0)
+        {
+            break;
+        }
+
+        // the entries of a multi-hour dump take a few MB - one read is far cheaper than
+        // reading the record headers scattered over GBs of dump
+        if (count * sizeof(FrameIndexEntry) > MAXDWORD)
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        m_entries.resize((size_t)count);
+
+        if (!ReadFile(file, &m_entries[0], (DWORD)(count * sizeof(FrameIndexEntry)), &read,
+            NULL) || read != count * sizeof(FrameIndexEntry))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        for (size_t i = 0; i < m_entries.size(); i++)
+        {
+            bool placed = (recordBytes != 0) ?
+                (m_entries[i].offset == firstRecord + i * recordBytes) :
+                (i == 0) ? (m_entries[i].offset == firstRecord) :
+                (m_entries[i].offset > m_entries[i - 1].offset);
+
+            if (!placed)
+            {
+                hr = MF_E_INVALID_FILE_FORMAT;
+                break;
+            }
+        }
+    }
+    while(false);
+
+    if (FAILED(hr))
+    {
+        m_entries.clear();
+    }
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
+
+HRESULT CFrameIndex::Save(PCWSTR indexPath) const
+{
+    HRESULT hr = S_OK;
+    CFrameIndexWriter writer;
+
+    do
+    {
+        hr = writer.Open(indexPath, m_firstRecord, m_recordBytes);
+        BREAK_ON_FAIL(hr);
+
+        if (!m_entries.empty())
+        {
+            hr = writer.Append(&m_entries[0], (DWORD)m_entries.size());
+            BREAK_ON_FAIL(hr);
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+size_t CFrameIndex::Find(LONGLONG time) const
+{
+    struct TimeLess
+    {
+        bool operator()(LONGLONG time, const FrameIndexEntry& entry) const
+            { return time < entry.timestamp; }
+    };
+
+    std::vector<FrameIndexEntry>::const_iterator next =
+        std::upper_bound(m_entries.begin(), m_entries.end(), time, TimeLess());
+
+    return (next == m_entries.begin()) ? 0 : (size_t)(next - m_entries.begin()) - 1;
+}
+
+
+
+
+
+HRESULT CFrameIndexWriter::Open(PCWSTR indexPath, ULONGLONG firstRecord, DWORD recordBytes)
+{
+    HRESULT hr = S_OK;
+    FrameIndexHeader header;
+    DWORD written = 0;
+
+    do
+    {
+        Close();
+
+        m_hFile = CreateFile(indexPath, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (m_hFile == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        ZeroMemory(&header, sizeof(header));
+
+        header.magic = FRAME_INDEX_MAGIC;
+        header.version = FRAME_INDEX_VERSION;
+        header.headerBytes = sizeof(header);
+        header.recordBytes = recordBytes;
+        header.firstRecord = firstRecord;
+
+        if (!WriteFile(m_hFile, &header, sizeof(header), &written, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+    }
+    while(false);
+
+    if (FAILED(hr))
+    {
+        Close();
+    }
+
+    return hr;
+}
+
+
+HRESULT CFrameIndexWriter::Append(const FrameIndexEntry* pEntries, DWORD count)
+{
+    DWORD written = 0;
+
+    if (m_hFile == INVALID_HANDLE_VALUE)
+    {
+        return MF_E_NOT_INITIALIZED;
+    }
+
+    if (!WriteFile(m_hFile, pEntries, count * sizeof(FrameIndexEntry), &written, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return S_OK;
+}
+
+
+void CFrameIndexWriter::Close(void)
+{
+    if (m_hFile != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(m_hFile);
+        m_hFile = INVALID_HANDLE_VALUE;
+    }
+}
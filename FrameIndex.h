@@ -0,0 +1,105 @@
+#pragma once
+
+#include "Common.h"
+
+#include <mferror.h>
+
+#include <vector>
+
+
+
+//
+//  Frame index file layout - the sidecar of a frame dump, "<dump>.fidx", with a header and
+//  one entry per record of the dump:
+//
+//      FrameIndexHeader
+//      FrameIndexEntry
+//      FrameIndexEntry
+//      ...
+//
+//  The recorder appends an entry after every record it wrote, so the index of a recording
+//  that was cut short lags its dump by at most a record.  Readers check the index against
+//  the dump, index the records it is missing, and write it back - dumps recorded before
+//  the index existed get theirs the first time they are opened.
+//
+#define FRAME_INDEX_MAGIC           0x58444946      // "FIDX"
+#define FRAME_INDEX_VERSION         1
+
+struct FrameIndexHeader
+{
+    DWORD       magic;                  // FRAME_INDEX_MAGIC
+    DWORD       version;                // FRAME_INDEX_VERSION
+    DWORD       headerBytes;            // sizeof(FrameIndexHeader) - the first entry follows
+    DWORD       recordBytes;            // bytes of a record of the dump, with its frame - 0 if
+                                        // the records of the dump vary in size
+    ULONGLONG   firstRecord;            // file offset of the first record of the dump
+};
+
+struct FrameIndexEntry
+{
+    LONGLONG    timestamp;              // presentation time of the frame, 100-ns units
+    LONGLONG    duration;
+    ULONGLONG   offset;                 // file offset of its record in the dump
+};
+
+
+//
+//  Path of the index of a dump.
+//
+HRESULT GetFrameIndexPath(PCWSTR dumpPath, WCHAR* pIndexPath, DWORD cchIndexPath);
+
+
+//
+//  The entries of a frame index, in record order.  Time stamps rise through a dump - the
+//  recorder writes the frames in the order they were captured - so the frame shown at any
+//  time is found with a binary search, in a handful of steps even for hours of video.
+//
+class CFrameIndex
+{
+    public:
+        CFrameIndex(void) : m_firstRecord(0), m_recordBytes(0) {}
+
+        // start an empty index of the given dump layout
+        void Reset(ULONGLONG firstRecord, DWORD recordBytes);
+
+        // read an index file - fails if it is missing or describes another record layout
+        HRESULT Load(PCWSTR indexPath, ULONGLONG firstRecord, DWORD recordBytes);
+
+        // write the whole index to a file
+        HRESULT Save(PCWSTR indexPath) const;
+
+        void Append(const FrameIndexEntry& entry) { m_entries.push_back(entry); }
+
+        // entry of the frame shown at the given time - the last one stamped at or before it,
+        // the first one if the time is before the dump
+        size_t Find(LONGLONG time) const;
+
+        size_t Count(void) const { return m_entries.size(); }
+        const FrameIndexEntry& Entry(size_t i) const { return m_entries[i]; }
+
+    private:
+        std::vector<FrameIndexEntry> m_entries;
+        ULONGLONG m_firstRecord;
+        DWORD m_recordBytes;
+};
+
+
+//
+//  Appends the entries of a dump being recorded to its index, as the records are written.
+//
+class CFrameIndexWriter
+{
+    public:
+        CFrameIndexWriter(void) : m_hFile(INVALID_HANDLE_VALUE) {}
+        ~CFrameIndexWriter(void) { Close(); }
+
+        // create the index, with its header
+        HRESULT Open(PCWSTR indexPath, ULONGLONG firstRecord, DWORD recordBytes);
+        HRESULT Append(const FrameIndexEntry* pEntries, DWORD count);
+        void Close(void);
+
+        bool IsOpen(void) const { return m_hFile != INVALID_HANDLE_VALUE; }
+
+    private:
+        HANDLE m_hFile;
+};
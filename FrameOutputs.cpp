@@ -0,0 +1,558 @@
+#include "FrameOutputs.h"
+#include "PixelKernels.h"
+
+
+
+// rows of the frame read by one tile
+#define OUTPUT_BAND_HEIGHT          64
+
+
+
+//
+// Whether an image of the input subtype can be made into one of the output subtype.
+//
+static bool CanMake(REFGUID input, REFGUID output)
+{
+    if (input == MFVideoFormat_NV12 || input == MFVideoFormat_YUY2)
+    {
+        return true;
+    }
+    else if (input == FrameSubtype_Gray8 || input == MFVideoFormat_RGB32)
+    {
+        return output == input;
+    }
+
+    return false;
+}
+
+
+//
+// First row of an output whose source rows start at or after srcRow - the rows made from a
+// band of the frame are [GetFirstRow(band start), GetFirstRow(band end)).
+//
+static UINT32 GetFirstRow(UINT32 srcRow, UINT32 srcHeight, UINT32 destHeight)
+{
+    return (UINT32)(((ULONGLONG)srcRow * destHeight + srcHeight - 1) / srcHeight);
+}
+
+
+//
+// Average the source samples under every sample of the rows [firstRow, endRow) of the
+// destination.  Samples are step bytes apart within a row, so the same loop scales a luma
+// plane, one channel of the interleaved NV12 chroma, or one channel of packed YUY2.
+//
+static void ScaleChannel(const BYTE* pSrc, LONG srcStride, UINT32 srcStep, UINT32 srcWidth,
+    UINT32 srcHeight, BYTE* pDest, LONG destStride, UINT32 destStep, UINT32 destWidth,
+    UINT32 destHeight, UINT32 firstRow, UINT32 endRow)
+{
+    ULONGLONG stepX = ((ULONGLONG)srcWidth << 16) / destWidth;
+
+    for (UINT32 y = firstRow; y < endRow && y < destHeight; y++)
+    {
+        UINT32 y0 = (UINT32)((ULONGLONG)y * srcHeight / destHeight);
+        UINT32 y1 = max((UINT32)((ULONGLONG)(y + 1) * srcHeight / destHeight), y0 + 1);
+        BYTE* pOut = pDest + (LONG)y * destStride;
+        ULONGLONG srcX = 0;
+
+        for (UINT32 x = 0; x < destWidth; x++, pOut += destStep)
+        {
+            UINT32 x0 = (UINT32)(srcX >> 16);
+            UINT32 x1 = 0;
+            UINT32 sum = 0;
+            UINT32 count = 0;
+
+            srcX += stepX;
+            x1 = min(max((UINT32)(srcX >> 16), x0 + 1), srcWidth);
+
+            for (UINT32 sy = y0; sy < y1; sy++)
+            {
+                const BYTE* pIn = pSrc + (LONG)sy * srcStride + x0 * srcStep;
+
+                for (UINT32 sx = x0; sx < x1; sx++, pIn += srcStep)
+                {
+                    sum += *pIn;
+                }
+            }
+
+            count = (y1 - y0) * (x1 - x0);
+            *pOut = (BYTE)((sum + count / 2) / count);
+        }
+    }
+}
+
+
+
+
+CFrameOutputStage::CFrameOutputStage(void) :
+    m_preparedFrame((ULONGLONG)-1),
+    m_frameCount(0)
+{
+    ZeroMemory(&m_planFormat, sizeof(m_planFormat));
+}
+
+
+CFrameOutputStage::~CFrameOutputStage(void)
+{
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        if (m_outputs[i].pCurrent != NULL)
+        {
+            m_outputs[i].pCurrent->Release();
+        }
+    }
+}
+
+
+HRESULT CFrameOutputStage::AddOutput(UINT32 maxWidth, UINT32 maxHeight, REFGUID subtype,
+    DWORD* pIndex)
+{
+    HRESULT hr = S_OK;
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+    Output output;
+
+    do
+    {
+        BREAK_ON_NULL(pIndex, E_POINTER);
+
+        if (subtype != MFVideoFormat_NV12 && subtype != FrameSubtype_Gray8 &&
+            subtype != MFVideoFormat_RGB32)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        ZeroMemory(&output.format, sizeof(output.format));
+        output.maxWidth = maxWidth;
+        output.maxHeight = maxHeight;
+        output.subtype = subtype;
+        output.method = OutputMethod_None;
+        output.input = -1;
+        output.inTiles = false;
+        output.pCurrent = NULL;
+
+        m_outputs.push_back(output);
+        *pIndex = (DWORD)(m_outputs.size() - 1);
+
+        // planned again with the next frame
+        m_planFormat.subtype = GUID_NULL;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// A consumer added while frames flow is told the format of its output straight away.
+//
+HRESULT CFrameOutputStage::AddConsumer(DWORD output, IFrameConsumer* pConsumer)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (pConsumer == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if (output >= m_outputs.size())
+    {
+        return E_INVALIDARG;
+    }
+
+    m_outputs[output].consumers.push_back(pConsumer);
+
+    if (m_planFormat.subtype != GUID_NULL && m_outputs[output].method != OutputMethod_None)
+    {
+        pConsumer->OnFormat(m_outputs[output].format);
+    }
+
+    return S_OK;
+}
+
+
+HRESULT CFrameOutputStage::RemoveConsumer(DWORD output, IFrameConsumer* pConsumer)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+    std::vector<IFrameConsumer*>* pConsumers = NULL;
+
+    if (output >= m_outputs.size())
+    {
+        return E_INVALIDARG;
+    }
+
+    pConsumers = &m_outputs[output].consumers;
+
+    for (size_t i = 0; i < pConsumers->size(); i++)
+    {
+        if ((*pConsumers)[i] == pConsumer)
+        {
+            pConsumers->erase(pConsumers->begin() + i);
+            return S_OK;
+        }
+    }
+
+    return HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+}
+
+
+//
+// One tile per band of frame rows.
+//
+UINT32 CFrameOutputStage::GetTileCount(CFrameView* pFrame)
+{
+    UINT32 height = pFrame->Format().height;
+
+    return max((height + OUTPUT_BAND_HEIGHT - 1) / OUTPUT_BAND_HEIGHT, 1u);
+}
+
+
+//
+// Decide how every output is made from frames of the format.  The outputs are made largest
+// first, so every output can be made from an image made before it, and an NV12 output goes
+// before a gray output of its size, which is then only a plane of it.
+//
+void CFrameOutputStage::Plan(const FrameFormat& format)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_order.clear();
+
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        Output& output = m_outputs[i];
+        UINT32 width = format.width;
+        UINT32 height = format.height;
+
+        if (output.maxWidth > 0 && width > output.maxWidth)
+        {
+            height = (UINT32)((ULONGLONG)height * output.maxWidth / width);
+            width = output.maxWidth;
+        }
+        if (output.maxHeight > 0 && height > output.maxHeight)
+        {
+            width = (UINT32)((ULONGLONG)width * output.maxHeight / height);
+            height = output.maxHeight;
+        }
+
+        if (output.subtype == MFVideoFormat_NV12)
+        {
+            width &= ~1u;
+            height &= ~1u;
+        }
+
+        output.format.subtype = output.subtype;
+        output.format.width = width;
+        output.format.height = height;
+        output.format.stride = 0;
+        output.method = OutputMethod_None;
+        output.input = -1;
+        output.inTiles = false;
+
+        // insertion sort - there are only a few outputs
+        size_t position = m_order.size();
+        ULONGLONG area = (ULONGLONG)width * height;
+
+        while (position > 0)
+        {
+            const FrameFormat& before = m_outputs[m_order[position - 1]].format;
+            ULONGLONG beforeArea = (ULONGLONG)before.width * before.height;
+
+            if (beforeArea > area || (beforeArea == area &&
+                (before.subtype == MFVideoFormat_NV12 || output.subtype != MFVideoFormat_NV12)))
+            {
+                break;
+            }
+
+            position--;
+        }
+
+        m_order.insert(m_order.begin() + position, (DWORD)i);
+    }
+
+    for (size_t n = 0; n < m_order.size(); n++)
+    {
+        Output& output = m_outputs[m_order[n]];
+        bool frameSize = (output.format.width == format.width &&
+            output.format.height == format.height);
+
+        if (output.format.width == 0 || output.format.height == 0 ||
+            !CanMake(format.subtype, output.subtype))
+        {
+            continue;
+        }
+
+        if (frameSize && output.subtype == format.subtype)
+        {
+            output.method = OutputMethod_Frame;
+            output.format = format;
+            continue;
+        }
+
+        if (output.subtype == FrameSubtype_Gray8)
+        {
+            if (frameSize && format.subtype == MFVideoFormat_NV12)
+            {
+                output.method = OutputMethod_Plane;
+                continue;
+            }
+
+            for (size_t k = 0; k < n; k++)
+            {
+                const Output& nv12 = m_outputs[m_order[k]];
+
+                if (nv12.method != OutputMethod_None && nv12.subtype == MFVideoFormat_NV12 &&
+                    nv12.format.width == output.format.width &&
+                    nv12.format.height == output.format.height)
+                {
+                    output.method = OutputMethod_Plane;
+                    output.input = (int)m_order[k];
+                    break;
+                }
+            }
+
+            if (output.method == OutputMethod_Plane)
+            {
+                continue;
+            }
+        }
+
+        output.method = (output.subtype == MFVideoFormat_RGB32) ? OutputMethod_Convert :
+            OutputMethod_Scale;
+        output.input = FindInput(format, output.format, n);
+        output.inTiles = (output.input < 0);
+    }
+
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        for (size_t k = 0; m_outputs[i].method != OutputMethod_None &&
+            k < m_outputs[i].consumers.size(); k++)
+        {
+            m_outputs[i].consumers[k]->OnFormat(m_outputs[i].format);
+        }
+    }
+
+    m_planFormat = format;
+}
+
+
+//
+// The smallest image planned before the first `planned` outputs of m_order that is at least
+// as large as the output and can be made into it - -1 for the frame.
+//
+int CFrameOutputStage::FindInput(const FrameFormat& frameFormat, const FrameFormat& format,
+    size_t planned) const
+{
+    int best = -1;
+    ULONGLONG bestArea = (ULONGLONG)frameFormat.width * frameFormat.height;
+
+    for (size_t k = 0; k < planned; k++)
+    {
+        const Output& candidate = m_outputs[m_order[k]];
+        ULONGLONG area = (ULONGLONG)candidate.format.width * candidate.format.height;
+
+        // the frame itself, or a plane of it, is the frame
+        if (candidate.method == OutputMethod_None || candidate.method == OutputMethod_Frame ||
+            (candidate.method == OutputMethod_Plane && candidate.input < 0))
+        {
+            continue;
+        }
+
+        if (CanMake(candidate.format.subtype, format.subtype) &&
+            candidate.format.width >= format.width && candidate.format.height >= format.height &&
+            area < bestArea)
+        {
+            best = (int)m_order[k];
+            bestArea = area;
+        }
+    }
+
+    return best;
+}
+
+
+//
+// Plan for the format of the frame if it changed, and allocate the images of the frame.
+// The tiles of the previous frame are all done by the time any tile of this frame runs, so
+// only the tiles of this frame race for it.  An image the memory budget has no room for is
+// skipped - its consumers miss the frame.
+//
+void CFrameOutputStage::PrepareFrame(CFrameView* pFrame)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_prepareLock);
+    const FrameFormat& format = pFrame->Format();
+
+    if (m_preparedFrame == m_frameCount)
+    {
+        return;
+    }
+
+    if (format.subtype != m_planFormat.subtype || format.width != m_planFormat.width ||
+        format.height != m_planFormat.height)
+    {
+        Plan(format);
+    }
+
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        Output& output = m_outputs[i];
+
+        if ((output.method == OutputMethod_Scale || output.method == OutputMethod_Convert) &&
+            FAILED(CFrameView::CreateImage(output.format, pFrame, MemoryAccount_FrameOutputs,
+                &output.pCurrent)))
+        {
+            output.pCurrent = NULL;
+        }
+    }
+
+    m_preparedFrame = m_frameCount;
+}
+
+
+//
+// Make the outputs that read the frame, from the source rows of the band.
+//
+void CFrameOutputStage::ProcessTile(CFrameView* pFrame, UINT32 tile)
+{
+    const FrameFormat& format = pFrame->Format();
+    UINT32 bandStart = tile * OUTPUT_BAND_HEIGHT;
+    UINT32 bandEnd = min(bandStart + OUTPUT_BAND_HEIGHT, format.height);
+
+    PrepareFrame(pFrame);
+
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        const Output& output = m_outputs[i];
+
+        if (output.inTiles && output.pCurrent != NULL)
+        {
+            MakeOutput(pFrame, output,
+                GetFirstRow(bandStart, format.height, output.format.height),
+                GetFirstRow(bandEnd, format.height, output.format.height));
+        }
+    }
+}
+
+
+//
+// Make the outputs that cascade from other outputs, in planned order, then deliver them all.
+//
+void CFrameOutputStage::EndFrame(CFrameView* pFrame)
+{
+    // a frame without tiles never prepared the state
+    PrepareFrame(pFrame);
+
+    for (size_t n = 0; n < m_order.size(); n++)
+    {
+        Output& output = m_outputs[m_order[n]];
+        CFrameView* pInput = (output.input < 0) ? pFrame : m_outputs[output.input].pCurrent;
+
+        if (output.method == OutputMethod_Frame)
+        {
+            pFrame->AddRef();
+            output.pCurrent = pFrame;
+        }
+        else if (output.method == OutputMethod_Plane)
+        {
+            if (pInput == NULL || FAILED(pInput->CreatePlaneView(0, &output.pCurrent)))
+            {
+                output.pCurrent = NULL;
+            }
+        }
+        else if (!output.inTiles && output.pCurrent != NULL)
+        {
+            // the input was skipped for lack of memory
+            if (pInput == NULL)
+            {
+                output.pCurrent->Release();
+                output.pCurrent = NULL;
+                continue;
+            }
+
+            MakeOutput(pInput, output, 0, output.format.height);
+        }
+    }
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        for (size_t i = 0; i < m_outputs.size(); i++)
+        {
+            for (size_t k = 0; m_outputs[i].pCurrent != NULL &&
+                k < m_outputs[i].consumers.size(); k++)
+            {
+                m_outputs[i].consumers[k]->OnFrame(m_outputs[i].pCurrent);
+            }
+        }
+    }
+
+    for (size_t i = 0; i < m_outputs.size(); i++)
+    {
+        if (m_outputs[i].pCurrent != NULL)
+        {
+            m_outputs[i].pCurrent->Release();
+            m_outputs[i].pCurrent = NULL;
+        }
+    }
+
+    m_frameCount++;
+}
+
+
+//
+// Make the rows [firstRow, endRow) of the output from its input.
+//
+void CFrameOutputStage::MakeOutput(CFrameView* pInput, const Output& output, UINT32 firstRow,
+    UINT32 endRow)
+{
+    const FrameFormat& format = pInput->Format();
+    const FramePlane& src = pInput->Plane(0);
+    const FramePlane& dest = output.pCurrent->Plane(0);
+    UINT32 width = output.format.width;
+    UINT32 height = output.format.height;
+
+    if (endRow <= firstRow)
+    {
+        return;
+    }
+
+    if (output.method == OutputMethod_Convert)
+    {
+        ConvertScaleFrame<Bgra32Writer>(pInput, dest.pData, dest.stride, width, height,
+            firstRow, endRow - firstRow, NoOp());
+        return;
+    }
+
+    // YUY2 keeps a luma byte in every other byte
+    ScaleChannel(src.pData, src.stride, (format.subtype == MFVideoFormat_YUY2) ? 2 : 1,
+        format.width, format.height, dest.pData, dest.stride, 1, width, height, firstRow,
+        endRow);
+
+    if (output.format.subtype != MFVideoFormat_NV12)
+    {
+        return;
+    }
+
+    // a chroma row covers luma rows 2r and 2r + 1, and is made with the rows that hold 2r
+    const FramePlane& chroma = output.pCurrent->Plane(1);
+    UINT32 firstChromaRow = (firstRow + 1) / 2;
+    UINT32 endChromaRow = (endRow + 1) / 2;
+
+    for (UINT32 c = 0; c < 2; c++)
+    {
+        if (format.subtype == MFVideoFormat_NV12)
+        {
+            const FramePlane& srcChroma = pInput->Plane(1);
+
+            ScaleChannel(srcChroma.pData + c, srcChroma.stride, 2, format.width / 2,
+                format.height / 2, chroma.pData + c, chroma.stride, 2, width / 2, height / 2,
+                firstChromaRow, endChromaRow);
+        }
+        else
+        {
+            // U and V are bytes 1 and 3 of every pixel pair, on every row
+            ScaleChannel(src.pData + 1 + c * 2, src.stride, 4, format.width / 2,
+                format.height, chroma.pData + c, chroma.stride, 2, width / 2, height / 2,
+                firstChromaRow, endChromaRow);
+        }
+    }
+}
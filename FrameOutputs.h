@@ -0,0 +1,89 @@
+#pragma once
+
+#include "Common.h"
+#include "FramePipeline.h"
+
+#include <vector>
+
+
+
+//
+//  Pipeline stage that turns every frame into several outputs of other sizes and formats -
+//  e.g. the full frame for analysis, a 640x360 preview and a small gray image for motion
+//  detection - and hands each output to consumers of its own.
+//
+//  The outputs are planned once per frame format so that no full-frame work is done twice.
+//  An output of the size and format of the frame is the frame itself, and a gray output of
+//  an NV12 image of its size is a plane view of it - neither copies a pixel.  Every other
+//  output is made from the smallest image already made that is at least as large, so only
+//  the outputs made straight from the frame read it, split into bands of rows processed on
+//  all workers, and the smaller outputs cascade from them in EndFrame.  Scaling averages the
+//  source pixels under every output pixel; RGB32 outputs are converted by the fused kernels.
+//
+//  Outputs are made from NV12 and YUY2 frames, and RGB32 outputs from RGB32 frames as well.
+//  An output that cannot be made from the frames gets none.
+//
+class CFrameOutputStage : public IFrameStage
+{
+    public:
+        CFrameOutputStage(void);
+        virtual ~CFrameOutputStage(void);
+
+        // add an output - the frame scaled down to fit inside maxWidth x maxHeight, keeping
+        // its aspect ratio, 0 for no limit, in NV12, FrameSubtype_Gray8 or RGB32.  Only while
+        // no frames are flowing.
+        HRESULT AddOutput(UINT32 maxWidth, UINT32 maxHeight, REFGUID subtype, DWORD* pIndex);
+
+        // consumers of an output get its frames on a worker of the pipeline, once all the
+        // outputs of the frame are made
+        HRESULT AddConsumer(DWORD output, IFrameConsumer* pConsumer);
+        HRESULT RemoveConsumer(DWORD output, IFrameConsumer* pConsumer);
+
+        // IFrameStage implementation
+        virtual UINT32 GetTileCount(CFrameView* pFrame);
+        virtual void ProcessTile(CFrameView* pFrame, UINT32 tile);
+        virtual void EndFrame(CFrameView* pFrame);
+
+    private:
+        // how an output is made
+        enum OutputMethod
+        {
+            OutputMethod_None = 0,      // not from frames of this format
+            OutputMethod_Frame,         // the frame itself
+            OutputMethod_Plane,         // the luma plane of its input
+            OutputMethod_Scale,         // its input averaged down, in the same family
+            OutputMethod_Convert        // its input converted to RGB32 by a fused kernel
+        };
+
+        struct Output
+        {
+            UINT32 maxWidth;
+            UINT32 maxHeight;
+            GUID subtype;
+            std::vector<IFrameConsumer*> consumers;
+
+            // plan for the frame format, and the output of the frame in the stage
+            FrameFormat format;
+            OutputMethod method;
+            int input;                  // output it is made from, -1 for the frame
+            bool inTiles;               // made by the tiles
+            CFrameView* pCurrent;
+        };
+
+        void Plan(const FrameFormat& format);
+        int FindInput(const FrameFormat& frameFormat, const FrameFormat& format,
+            size_t planned) const;
+        void PrepareFrame(CFrameView* pFrame);
+        void MakeOutput(CFrameView* pInput, const Output& output, UINT32 firstRow,
+            UINT32 endRow);
+
+        CComAutoCriticalSection m_critSec;      // consumers of the outputs
+        std::vector<Output> m_outputs;
+        std::vector<DWORD> m_order;             // outputs in the order they are made
+        FrameFormat m_planFormat;               // frame format the outputs are planned for
+
+        // per-frame work state - only one frame is in this stage at a time
+        CComAutoCriticalSection m_prepareLock;  // the first tile of a frame prepares the state
+        ULONGLONG m_preparedFrame;              // m_frameCount of the frame it was prepared for
+        ULONGLONG m_frameCount;
+};
@@ -0,0 +1,454 @@
+#include "FramePipeline.h"
+#include "Tracer.h"
+
+#include <stdio.h>
+#include <new>
+
+
+
+// default number of frames that may be between the first and the last stage at once
+#define PIPELINE_DEFAULT_FRAMES_IN_FLIGHT   3
+
+
+
+CFramePipeline::CFramePipeline(CTaskScheduler* pScheduler, PCSTR labels) :
+    m_pScheduler(pScheduler),
+    m_pEventBus(NULL),
+    m_labels((labels != NULL) ? labels : ""),
+    m_maxFramesInFlight(PIPELINE_DEFAULT_FRAMES_IN_FLIGHT),
+    m_framesInFlight(0),
+    m_droppedFrames(0)
+{
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+
+    m_pFramesInFlightMetric = pMetrics->CreateGauge("mfcp_pipeline_frames_in_flight",
+        "Frames between the first and the last stage of the pipeline.", labels, 1.0,
+        ReadFramesInFlight, this);
+    m_pDroppedFramesMetric = pMetrics->CreateCounter("mfcp_pipeline_dropped_frames_total",
+        "Frames dropped because the pipeline stages were behind.", labels, 1.0,
+        ReadDroppedFrames, this);
+}
+
+
+CFramePipeline::~CFramePipeline(void)
+{
+    Drain();
+
+    for (size_t i = 0; i < m_lastFrameTasks.size(); i++)
+    {
+        if (m_lastFrameTasks[i] != NULL)
+        {
+            m_lastFrameTasks[i]->Release();
+        }
+    }
+
+    for (size_t i = 0; i < m_numaCounters.size(); i++)
+    {
+        delete m_numaCounters[i];
+    }
+
+    for (size_t i = 0; i < m_stageMetrics.size(); i++)
+    {
+        GetMetricsRegistry()->Remove(m_stageMetrics[i]->pLatency);
+        GetMetricsRegistry()->Remove(m_stageMetrics[i]->pBusyTime);
+        delete m_stageMetrics[i];
+    }
+
+    GetMetricsRegistry()->Remove(m_pFramesInFlightMetric);
+    GetMetricsRegistry()->Remove(m_pDroppedFramesMetric);
+}
+
+
+HRESULT CFramePipeline::AddStage(IFrameStage* pStage)
+{
+    HRESULT hr = S_OK;
+    StageNumaCounters* pCounters = NULL;
+    StageMetrics* pStageMetrics = NULL;
+    char label[64];
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        BREAK_ON_NULL(pStage, E_POINTER);
+
+        if (m_framesInFlight != 0)
+        {
+            hr = MF_E_INVALIDREQUEST;
+            break;
+        }
+
+        pCounters = new (std::nothrow) StageNumaCounters();
+        BREAK_ON_NULL(pCounters, E_OUTOFMEMORY);
+        ZeroMemory(pCounters, sizeof(*pCounters));
+
+        pStageMetrics = new (std::nothrow) StageMetrics();
+        BREAK_ON_NULL(pStageMetrics, E_OUTOFMEMORY);
+
+        sprintf_s(label, "%s%sstage=\"%u\"", m_labels.c_str(), m_labels.empty() ? "" : ",",
+            (UINT32)m_stages.size());
+
+        pStageMetrics->pLatency = GetMetricsRegistry()->CreateLatencyHistogram(
+            "mfcp_stage_latency_seconds",
+            "Time from a frame arriving at the pipeline to the stage finishing it.", label);
+        pStageMetrics->pBusyTime = GetMetricsRegistry()->CreateCounter(
+            "mfcp_stage_busy_seconds_total", "Time the workers spent in the tiles of the stage.",
+            label, 1.0 / (double)GetMetricsTicksPerSecond());
+
+        m_stages.push_back(pStage);
+        m_lastFrameTasks.push_back(NULL);
+        m_numaCounters.push_back(pCounters);
+        m_stageMetrics.push_back(pStageMetrics);
+
+        pCounters = NULL;
+    }
+    while(false);
+
+    delete pCounters;
+
+    return hr;
+}
+
+
+//
+// The metrics of the stage are removed after the lock is released, like they are created
+// before the stage is used - a scrape holds the registry lock.
+//
+HRESULT CFramePipeline::RemoveStage(IFrameStage* pStage)
+{
+    HRESULT hr = S_OK;
+    StageMetrics* pStageMetrics = NULL;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        BREAK_ON_NULL(pStage, E_POINTER);
+
+        if (m_framesInFlight != 0)
+        {
+            hr = MF_E_INVALIDREQUEST;
+            break;
+        }
+
+        size_t index = 0;
+        while (index < m_stages.size() && m_stages[index] != pStage)
+        {
+            index++;
+        }
+
+        if (index == m_stages.size())
+        {
+            hr = MF_E_NOT_FOUND;
+            break;
+        }
+
+        if (m_lastFrameTasks[index] != NULL)
+        {
+            m_lastFrameTasks[index]->Release();
+        }
+        delete m_numaCounters[index];
+        pStageMetrics = m_stageMetrics[index];
+
+        m_stages.erase(m_stages.begin() + index);
+        m_lastFrameTasks.erase(m_lastFrameTasks.begin() + index);
+        m_numaCounters.erase(m_numaCounters.begin() + index);
+        m_stageMetrics.erase(m_stageMetrics.begin() + index);
+    }
+    while(false);
+
+    if (pStageMetrics != NULL)
+    {
+        GetMetricsRegistry()->Remove(pStageMetrics->pLatency);
+        GetMetricsRegistry()->Remove(pStageMetrics->pBusyTime);
+        delete pStageMetrics;
+    }
+
+    return hr;
+}
+
+
+HRESULT CFramePipeline::GetStageNumaStats(DWORD stageIndex, NumaTrafficStats* pStats)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        BREAK_ON_NULL(pStats, E_POINTER);
+
+        if (stageIndex >= m_numaCounters.size())
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        pStats->localTiles = (ULONGLONG)m_numaCounters[stageIndex]->localTiles;
+        pStats->remoteTiles = (ULONGLONG)m_numaCounters[stageIndex]->remoteTiles;
+        pStats->unknownTiles = (ULONGLONG)m_numaCounters[stageIndex]->unknownTiles;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+DWORD CFramePipeline::GetStageCount(void)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    return (DWORD)m_stages.size();
+}
+
+
+//
+// The end-of-frame task of the last stage of the newest frame transitively depends on every
+// earlier task, so waiting for it waits for the whole pipeline.
+//
+HRESULT CFramePipeline::Drain(void)
+{
+    CTask* pLast = NULL;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (!m_lastFrameTasks.empty())
+        {
+            pLast = m_lastFrameTasks.back();
+            if (pLast != NULL)
+            {
+                pLast->AddRef();
+            }
+        }
+    }
+
+    if (pLast != NULL)
+    {
+        m_pScheduler->Wait(pLast);
+        pLast->Release();
+    }
+
+    return S_OK;
+}
+
+
+//
+// Create the task graph of one frame and hand it to the scheduler.
+//
+void CFramePipeline::OnFrame(CFrameView* pFrame)
+{
+    HRESULT hr = S_OK;
+    CTask* pPrevStage = NULL;
+    CTask* pEndFrame = NULL;
+    USHORT frameNode = NUMA_NODE_ANY;
+    LONGLONG arrival = GetMetricsTime();
+
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (m_stages.empty() || m_pScheduler->GetWorkerCount() == 0)
+    {
+        return;
+    }
+
+    // the stages are behind - holding on to more frames would starve the capture source
+    if ((DWORD)m_framesInFlight >= m_maxFramesInFlight)
+    {
+        InterlockedIncrement64(&m_droppedFrames);
+        CTracer::Instant("pipeline", "dropped frame");
+        return;
+    }
+
+    InterlockedIncrement(&m_framesInFlight);
+
+    // every stage of the frame reads the same memory, so look up its node only once
+    if (pFrame->PlaneCount() > 0)
+    {
+        frameNode = GetMemoryNumaNode(pFrame->Plane(0).pData);
+    }
+
+    for (DWORD i = 0; i < m_stages.size(); i++)
+    {
+        hr = ScheduleStage(i, pFrame, frameNode, arrival, pPrevStage, &pEndFrame);
+        if (FAILED(hr))
+        {
+            ReportError(i, hr);
+            break;
+        }
+
+        pPrevStage = pEndFrame;
+    }
+
+    // If the graph could not be completed the last stage never releases the frame slot.
+    // The stages that were scheduled still run, so just give the slot back here.
+    if (FAILED(hr))
+    {
+        InterlockedDecrement(&m_framesInFlight);
+    }
+}
+
+
+//
+// Schedule the tiles and the end-of-frame task of one stage.  The tiles wait for the
+// previous stage of this frame and for the same stage of the previous frame.  Once the
+// end-of-frame task exists the stage is always completed, even if some of its tiles could
+// not be created.
+//
+HRESULT CFramePipeline::ScheduleStage(DWORD stageIndex, CFrameView* pFrame, USHORT frameNode,
+    LONGLONG arrival, CTask* pPrevStage, CTask** ppEndFrame)
+{
+    HRESULT hr = S_OK;
+    StageWork* pWork = NULL;
+    CTask* pEndFrame = NULL;
+    CTask* pTile = NULL;
+    CTask* pPrevFrame = m_lastFrameTasks[stageIndex];
+    UINT32 tileCount = 0;
+
+    do
+    {
+        pWork = new (std::nothrow) StageWork();
+        BREAK_ON_NULL(pWork, E_OUTOFMEMORY);
+
+        pWork->pPipeline = this;
+        pWork->pStage = m_stages[stageIndex];
+        pWork->pFrame = pFrame;
+        pWork->pCounters = m_numaCounters[stageIndex];
+        pWork->pMetrics = m_stageMetrics[stageIndex];
+        pWork->arrival = arrival;
+        pWork->stageIndex = stageIndex;
+        pWork->frameNode = frameNode;
+        pWork->lastStage = (stageIndex == m_stages.size() - 1);
+
+        hr = CTask::Create(EndFrameProc, pWork, 0, &pEndFrame);
+        if (FAILED(hr))
+        {
+            delete pWork;
+            break;
+        }
+
+        // the end-of-frame task owns pWork and the frame reference from here on
+        pFrame->AddRef();
+
+        // the end-of-frame task always carries the dependencies, so the stage stays in order
+        // even if it has no tiles
+        if (pPrevStage != NULL)
+            pEndFrame->AddDependency(pPrevStage);
+        if (pPrevFrame != NULL)
+            pEndFrame->AddDependency(pPrevFrame);
+
+        tileCount = m_stages[stageIndex]->GetTileCount(pFrame);
+
+        for (UINT32 tile = 0; tile < tileCount; tile++)
+        {
+            if (FAILED(CTask::Create(TileProc, pWork, tile, &pTile)))
+            {
+                ReportError(stageIndex, E_OUTOFMEMORY);
+                break;
+            }
+
+            if (pPrevStage != NULL)
+                pTile->AddDependency(pPrevStage);
+            if (pPrevFrame != NULL)
+                pTile->AddDependency(pPrevFrame);
+
+            pEndFrame->AddDependency(pTile);
+
+            m_pScheduler->Submit(pTile);
+            pTile->Release();
+        }
+
+        m_pScheduler->Submit(pEndFrame);
+
+        if (pPrevFrame != NULL)
+        {
+            pPrevFrame->Release();
+        }
+
+        // keep the reference - the same stage of the next frame depends on this task
+        m_lastFrameTasks[stageIndex] = pEndFrame;
+        *ppEndFrame = pEndFrame;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// A frame did not go through a stage completely - tell the owner of the pipeline.  Called
+// on the delivery thread, which must not block, so the error is only posted.
+//
+void CFramePipeline::ReportError(DWORD stageIndex, HRESULT hr)
+{
+    if (m_pEventBus != NULL)
+    {
+        m_pEventBus->Post(BusEvent_PipelineError, stageIndex, hr);
+    }
+}
+
+
+void CFramePipeline::TileProc(void* pContext, UINT32 tile)
+{
+    StageWork* pWork = (StageWork*)pContext;
+    USHORT node = (pWork->frameNode != NUMA_NODE_ANY) ? GetCurrentNumaNode() : NUMA_NODE_ANY;
+
+    if (node == NUMA_NODE_ANY)
+        InterlockedIncrement64(&pWork->pCounters->unknownTiles);
+    else if (node == pWork->frameNode)
+        InterlockedIncrement64(&pWork->pCounters->localTiles);
+    else
+        InterlockedIncrement64(&pWork->pCounters->remoteTiles);
+
+    LONGLONG start = GetMetricsTime();
+    LONGLONG end = 0;
+
+    pWork->pStage->ProcessTile(pWork->pFrame, tile);
+
+    end = GetMetricsTime();
+
+    if (pWork->pMetrics->pBusyTime != NULL)
+    {
+        pWork->pMetrics->pBusyTime->Add(end - start);
+    }
+
+    if (CTracer::IsEnabled())
+    {
+        CTracer::Span("pipeline", "ProcessTile", start, end, pWork->pFrame->Timestamp(),
+            "stage", pWork->stageIndex);
+    }
+}
+
+
+//
+// All tiles of the stage are done - finish the frame for this stage and release its
+// reference to the frame.  The last stage also frees the frame slot of the pipeline.
+//
+void CFramePipeline::EndFrameProc(void* pContext, UINT32 index)
+{
+    StageWork* pWork = (StageWork*)pContext;
+    LONGLONG start = GetMetricsTime();
+    LONGLONG frame = pWork->pFrame->Timestamp();
+    LONGLONG end = 0;
+
+    pWork->pStage->EndFrame(pWork->pFrame);
+    pWork->pFrame->Release();
+
+    end = GetMetricsTime();
+
+    if (pWork->pMetrics->pLatency != NULL)
+    {
+        pWork->pMetrics->pLatency->Observe(end - pWork->arrival);
+    }
+
+    if (CTracer::IsEnabled())
+    {
+        CTracer::Span("pipeline", "EndFrame", start, end, frame, "stage", pWork->stageIndex);
+    }
+
+    if (pWork->lastStage)
+    {
+        InterlockedDecrement(&pWork->pPipeline->m_framesInFlight);
+    }
+
+    delete pWork;
+}
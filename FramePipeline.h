@@ -0,0 +1,132 @@
+#pragma once
+
+#include "Common.h"
+#include "EventBus.h"
+#include "FrameSink.h"
+#include "Metrics.h"
+#include "TaskScheduler.h"
+
+#include <vector>
+
+
+
+//
+//  One processing stage of the frame pipeline.  A stage splits every frame into tiles that
+//  are processed in parallel, and gets a call once all tiles of the frame are done.  The
+//  frames reach a stage in capture order, and a stage never works on two frames at once, so
+//  per-frame state needs no locking - but the next stage may already be working on the
+//  previous frame.
+//
+class IFrameStage
+{
+    public:
+        virtual ~IFrameStage(void) {}
+
+        // number of independent tiles the frame is split into - called when the frame is
+        // scheduled, possibly while the stage is still working on the previous frame
+        virtual UINT32 GetTileCount(CFrameView* pFrame) { return 1; }
+
+        // process one tile of the frame - called on a scheduler worker, concurrently with the
+        // other tiles of the same frame
+        virtual void ProcessTile(CFrameView* pFrame, UINT32 tile) = 0;
+
+        // called once every tile of the frame has been processed
+        virtual void EndFrame(CFrameView* pFrame) {}
+};
+
+
+//
+//  Runs the frames through a chain of stages on the work-stealing scheduler.  Stage N of
+//  frame K starts when stage N-1 of frame K and stage N of frame K-1 are both complete, so
+//  successive frames flow through the chain like through an assembly line.
+//
+class CFramePipeline : public IFrameConsumer
+{
+    public:
+        // labels are those of the metrics of the pipeline, e.g. those of its player
+        CFramePipeline(CTaskScheduler* pScheduler, PCSTR labels = NULL);
+        ~CFramePipeline(void);
+
+        // add a stage at the end of the chain - only while no frames are flowing
+        HRESULT AddStage(IFrameStage* pStage);
+        DWORD GetStageCount(void);
+
+        // remove a stage from the chain - only once the frames have been drained
+        HRESULT RemoveStage(IFrameStage* pStage);
+
+        // frames beyond this limit are dropped instead of holding more capture buffers
+        void SetMaxFramesInFlight(DWORD maxFrames) { m_maxFramesInFlight = maxFrames; }
+        ULONGLONG GetDroppedFrames(void) const { return (ULONGLONG)m_droppedFrames; }
+
+        // frames that cannot be scheduled are reported here as BusEvent_PipelineError
+        void SetEventBus(CEventBus* pEventBus) { m_pEventBus = pEventBus; }
+
+        // tiles of the stage that ran on the NUMA node of the frame memory, and on another one
+        HRESULT GetStageNumaStats(DWORD stageIndex, NumaTrafficStats* pStats);
+
+        // wait until every frame in flight has gone through all stages
+        HRESULT Drain(void);
+
+        // IFrameConsumer implementation - schedules the frame and returns immediately
+        virtual void OnFrame(CFrameView* pFrame);
+
+    private:
+        // NUMA traffic counters of one stage
+        struct StageNumaCounters
+        {
+            volatile LONGLONG localTiles;
+            volatile LONGLONG remoteTiles;
+            volatile LONGLONG unknownTiles;
+        };
+
+        // exported metrics of one stage
+        struct StageMetrics
+        {
+            CMetricHistogram* pLatency;     // from the frame arriving to the stage finishing it
+            CMetricCounter* pBusyTime;      // time spent in the tiles, over all workers
+        };
+
+        // state shared by the tile tasks and the end-of-frame task of one stage and frame
+        struct StageWork
+        {
+            CFramePipeline* pPipeline;
+            IFrameStage* pStage;
+            CFrameView* pFrame;
+            StageNumaCounters* pCounters;
+            StageMetrics* pMetrics;
+            LONGLONG arrival;           // GetMetricsTime() when the frame arrived
+            DWORD stageIndex;
+            USHORT frameNode;           // node of the frame memory, NUMA_NODE_ANY if unknown
+            bool lastStage;
+        };
+
+        static void TileProc(void* pContext, UINT32 tile);
+        static void EndFrameProc(void* pContext, UINT32 index);
+
+        static LONGLONG ReadFramesInFlight(void* pContext)
+            { return ((CFramePipeline*)pContext)->m_framesInFlight; }
+        static LONGLONG ReadDroppedFrames(void* pContext)
+            { return ((CFramePipeline*)pContext)->m_droppedFrames; }
+
+        HRESULT ScheduleStage(DWORD stageIndex, CFrameView* pFrame, USHORT frameNode,
+            LONGLONG arrival, CTask* pPrevStage, CTask** ppEndFrame);
+
+        void ReportError(DWORD stageIndex, HRESULT hr);
+
+        CTaskScheduler* m_pScheduler;
+        CEventBus* m_pEventBus;
+        CComAutoCriticalSection m_critSec;      // protects the stage lists
+
+        std::vector<IFrameStage*> m_stages;
+        std::vector<CTask*> m_lastFrameTasks;   // end-of-frame task of the newest frame, per stage
+        std::vector<StageNumaCounters*> m_numaCounters;
+        std::vector<StageMetrics*> m_stageMetrics;
+
+        std::string m_labels;                   // of the metrics, may be empty
+        CMetricGauge* m_pFramesInFlightMetric;
+        CMetricCounter* m_pDroppedFramesMetric;
+
+        DWORD m_maxFramesInFlight;
+        volatile long m_framesInFlight;
+        volatile LONGLONG m_droppedFrames;
+};
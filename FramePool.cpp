@@ -0,0 +1,192 @@
+#include "FramePool.h"
+
+
+
+CFramePool::CFramePool(void) :
+    m_allocatedCount(0),
+    m_maxCount(0),
+    m_cbBuffer(0),
+    m_numaNode(NUMA_NODE_ANY),
+    m_account(MemoryAccount_FramePool)
+{
+}
+
+
+CFramePool::~CFramePool(void)
+{
+    Shutdown();
+}
+
+
+HRESULT CFramePool::Initialize(DWORD cbBuffer, DWORD initialCount, DWORD maxCount,
+    USHORT numaNode, MemoryAccount account)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_cbBuffer != 0)
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        if (cbBuffer == 0 || maxCount < initialCount)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        m_cbBuffer = cbBuffer;
+        m_maxCount = maxCount;
+        m_numaNode = numaNode;
+        m_account = account;
+
+        for (DWORD i = 0; i < initialCount; i++)
+        {
+            BYTE* pBuffer = AllocateBuffer();
+            if (pBuffer == NULL)
+            {
+                // the pool grows on demand later, once the budget allows
+                hr = (i == 0) ? E_OUTOFMEMORY : S_OK;
+                break;
+            }
+
+            m_freeBuffers.push_back(pBuffer);
+        }
+    }
+    while(false);
+
+    if (SUCCEEDED(hr))
+    {
+        GetMemoryBudget()->AddReclaimer(this);
+    }
+    else if (hr != MF_E_ALREADY_INITIALIZED)
+    {
+        Shutdown();
+    }
+
+    return hr;
+}
+
+
+//
+// The reclaimer is removed before the lock is taken - a reclaim in progress may be waiting
+// to try it.
+//
+void CFramePool::Shutdown(void)
+{
+    GetMemoryBudget()->RemoveReclaimer(this);
+
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    for (size_t i = 0; i < m_freeBuffers.size(); i++)
+    {
+        VirtualFree(m_freeBuffers[i], 0, MEM_RELEASE);
+    }
+
+    GetMemoryBudget()->Release(m_account, (ULONGLONG)m_freeBuffers.size() * m_cbBuffer);
+
+    m_freeBuffers.clear();
+    m_allocatedCount = 0;
+    m_cbBuffer = 0;
+}
+
+
+BYTE* CFramePool::Acquire(void)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    BYTE* pBuffer = NULL;
+
+    if (!m_freeBuffers.empty())
+    {
+        pBuffer = m_freeBuffers.back();
+        m_freeBuffers.pop_back();
+    }
+    else if (m_cbBuffer != 0 && m_allocatedCount < m_maxCount)
+    {
+        pBuffer = AllocateBuffer();
+    }
+
+    return pBuffer;
+}
+
+
+void CFramePool::Return(BYTE* pBuffer)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (pBuffer != NULL)
+    {
+        m_freeBuffers.push_back(pBuffer);
+    }
+}
+
+
+//
+// Called by the budget on the thread of a reservation it could not grant, which may hold
+// the lock of another pool - so the lock of this one is only tried.  The budget calls this
+// pool too when it is the one growing; it has no idle buffers then.
+//
+void CFramePool::Reclaim(ULONGLONG cbWanted)
+{
+    ULONGLONG cbFreed = 0;
+
+    if (!TryEnterCriticalSection(&m_critSec.m_sec))
+    {
+        return;
+    }
+
+    while (!m_freeBuffers.empty() && cbFreed < cbWanted)
+    {
+        VirtualFree(m_freeBuffers.back(), 0, MEM_RELEASE);
+        m_freeBuffers.pop_back();
+        m_allocatedCount--;
+
+        cbFreed += m_cbBuffer;
+    }
+
+    GetMemoryBudget()->Release(m_account, cbFreed);
+
+    LeaveCriticalSection(&m_critSec.m_sec);
+}
+
+
+//
+// Allocate one buffer with the NUMA node as the preferred node of its physical pages, if
+// the budget allows it.  Called with the lock held.
+//
+BYTE* CFramePool::AllocateBuffer(void)
+{
+    BYTE* pBuffer = NULL;
+
+    if (!GetMemoryBudget()->Reserve(m_account, m_cbBuffer))
+    {
+        return NULL;
+    }
+
+    if (m_numaNode != NUMA_NODE_ANY)
+    {
+        pBuffer = (BYTE*)VirtualAllocExNuma(GetCurrentProcess(), NULL, m_cbBuffer,
+            MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, m_numaNode);
+    }
+    else
+    {
+        pBuffer = (BYTE*)VirtualAlloc(NULL, m_cbBuffer, MEM_RESERVE | MEM_COMMIT,
+            PAGE_READWRITE);
+    }
+
+    if (pBuffer != NULL)
+    {
+        m_allocatedCount++;
+    }
+    else
+    {
+        GetMemoryBudget()->Release(m_account, m_cbBuffer);
+    }
+
+    return pBuffer;
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "Common.h"
+#include "MemoryBudget.h"
+#include "ThreadAffinity.h"
+
+#include <vector>
+
+
+
+//
+//  A pool of equally sized frame buffers allocated on a given NUMA node.  Buffers are
+//  allocated once and recycled, so a steady stream of frames costs no heap traffic, and the
+//  memory stays on the node whose cores process the frames.
+//
+//  Every buffer is reserved from the memory budget under the account of the pool.  When the
+//  budget runs short the pool grows no further, and gives its idle buffers back to the
+//  budget for others that need them.
+//
+class CFramePool : public IMemoryReclaimer
+{
+    public:
+        CFramePool(void);
+        ~CFramePool(void);
+
+        // allocate initialCount buffers up front, and allow the pool to grow to maxCount.  If
+        // the budget denies some of the initial buffers, the pool starts with fewer - it fails
+        // only without any.
+        HRESULT Initialize(DWORD cbBuffer, DWORD initialCount, DWORD maxCount, USHORT numaNode,
+            MemoryAccount account = MemoryAccount_FramePool);
+
+        // free all buffers - every buffer must have been returned
+        void Shutdown(void);
+
+        // take a buffer, or NULL if the pool is exhausted or the budget is
+        BYTE* Acquire(void);
+
+        // give a buffer back to the pool
+        void Return(BYTE* pBuffer);
+
+        DWORD GetBufferSize(void) const { return m_cbBuffer; }
+        USHORT GetNumaNode(void) const { return m_numaNode; }
+        bool IsInitialized(void) const { return m_cbBuffer != 0; }
+
+        // IMemoryReclaimer - free idle buffers
+        virtual void Reclaim(ULONGLONG cbWanted);
+
+    private:
+        BYTE* AllocateBuffer(void);
+
+        CComAutoCriticalSection m_critSec;
+        std::vector<BYTE*> m_freeBuffers;
+        DWORD m_allocatedCount;
+        DWORD m_maxCount;
+        DWORD m_cbBuffer;
+        USHORT m_numaNode;
+        MemoryAccount m_account;
+};
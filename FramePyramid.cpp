@@ -0,0 +1,473 @@
+#include "FramePyramid.h"
+
+#include <emmintrin.h>
+
+
+
+// rows of level 0 built by one tile
+#define PYRAMID_BAND_HEIGHT         64
+
+// levels smaller than this in either direction are not built
+#define PYRAMID_MIN_LEVEL_SIZE      8
+
+// pyramid buffers the pool may hold - one per frame in flight is plenty
+#define PYRAMID_POOL_BUFFERS        8
+
+
+
+CFramePyramid::CFramePyramid(CFramePool* pPool, BYTE* pBuffer, DWORD cbBuffer,
+    PyramidFilter filter) :
+    m_cRef(1),
+    m_pPool(pPool),
+    m_pBuffer(pBuffer),
+    m_cbBuffer(cbBuffer),
+    m_filter(filter),
+    m_levelCount(0)
+{
+    ZeroMemory(m_levels, sizeof(m_levels));
+}
+
+
+CFramePyramid::~CFramePyramid(void)
+{
+    if (m_pPool != NULL)
+    {
+        m_pPool->Return(m_pBuffer);
+    }
+    else
+    {
+        delete[] m_pBuffer;
+        GetMemoryBudget()->Release(MemoryAccount_FramePool, m_cbBuffer);
+    }
+}
+
+
+HRESULT CFramePyramid::FromFrame(CFrameView* pFrame, CFramePyramid** ppPyramid)
+{
+    HRESULT hr = S_OK;
+    IUnknown* pUnknown = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pFrame, E_POINTER);
+        BREAK_ON_NULL(ppPyramid, E_POINTER);
+
+        hr = pFrame->GetAttachment(FRAME_ATTACHMENT_PYRAMID, IID_IUnknown, (void**)&pUnknown);
+        BREAK_ON_FAIL(hr);
+
+        // only the pyramid stage attaches under this key
+        *ppPyramid = static_cast<CFramePyramid*>(pUnknown);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CFramePyramid::QueryInterface(REFIID riid, void** ppv)
+{
+    if (ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if (riid == IID_IUnknown)
+    {
+        *ppv = static_cast<IUnknown*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    AddRef();
+    return S_OK;
+}
+
+
+ULONG CFramePyramid::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+
+ULONG CFramePyramid::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+
+
+CFramePyramidStage::CFramePyramidStage(void) :
+    m_levelCount(4),
+    m_filter(PyramidFilter_Box),
+    m_preparedFrame((ULONGLONG)-1),
+    m_frameCount(0),
+    m_pCurrent(NULL),
+    m_scratchRowBytes(0)
+{
+}
+
+
+CFramePyramidStage::~CFramePyramidStage(void)
+{
+    if (m_pCurrent != NULL)
+    {
+        m_pCurrent->Release();
+    }
+}
+
+
+void CFramePyramidStage::SetLevelCount(UINT32 levelCount)
+{
+    m_levelCount = (levelCount > PYRAMID_MAX_LEVELS) ? PYRAMID_MAX_LEVELS : levelCount;
+}
+
+
+//
+// One tile per band of level 0 rows.
+//
+UINT32 CFramePyramidStage::GetTileCount(CFrameView* pFrame)
+{
+    UINT32 height = pFrame->Format().height / 2;
+
+    return (height + PYRAMID_BAND_HEIGHT - 1) / PYRAMID_BAND_HEIGHT;
+}
+
+
+//
+// Create the pyramid of the frame and size the scratch rows of the tiles.  The tiles of the
+// previous frame are all done by the time any tile of this frame runs, so only the tiles of
+// this frame race for it.
+//
+void CFramePyramidStage::PrepareFrame(const FrameFormat& format)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_prepareLock);
+    UINT32 tileCount = (format.height / 2 + PYRAMID_BAND_HEIGHT - 1) / PYRAMID_BAND_HEIGHT;
+
+    if (m_preparedFrame == m_frameCount)
+    {
+        return;
+    }
+
+    // a frame too small for even one level goes through without a pyramid
+    if (FAILED(CreatePyramid(format, &m_pCurrent)))
+    {
+        m_pCurrent = NULL;
+    }
+
+    // three luma rows, then the 16-bit row of the Gaussian filter
+    m_scratchRowBytes = (format.width + 15) & ~15u;
+    m_scratch.resize((size_t)max(tileCount, 1u) * m_scratchRowBytes * 5);
+
+    m_preparedFrame = m_frameCount;
+}
+
+
+//
+// Lay out the levels in one buffer, taken from the pool when it fits.  The pool is sized by
+// the first frame; a larger frame later on gets its buffer from the heap.
+//
+HRESULT CFramePyramidStage::CreatePyramid(const FrameFormat& format, CFramePyramid** ppPyramid)
+{
+    HRESULT hr = S_OK;
+    FramePlane levels[PYRAMID_MAX_LEVELS];
+    UINT32 levelCount = 0;
+    DWORD cbBuffer = 0;
+    UINT32 width = format.width / 2;
+    UINT32 height = format.height / 2;
+    CFramePool* pPool = NULL;
+    BYTE* pBuffer = NULL;
+    CFramePyramid* pPyramid = NULL;
+
+    do
+    {
+        while (levelCount < m_levelCount && width >= PYRAMID_MIN_LEVEL_SIZE &&
+            height >= PYRAMID_MIN_LEVEL_SIZE)
+        {
+            levels[levelCount].width = width;
+            levels[levelCount].height = height;
+            levels[levelCount].stride = (width + 15) & ~15;
+            cbBuffer += levels[levelCount].stride * height;
+
+            levelCount++;
+            width /= 2;
+            height /= 2;
+        }
+
+        if (levelCount == 0)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        if (!m_pool.IsInitialized())
+        {
+            // the first tile runs on a worker of the pipeline - keep the levels on its node
+            m_pool.Initialize(cbBuffer, 2, PYRAMID_POOL_BUFFERS, GetCurrentNumaNode());
+        }
+
+        if (m_pool.IsInitialized() && cbBuffer <= m_pool.GetBufferSize())
+        {
+            pBuffer = m_pool.Acquire();
+            pPool = &m_pool;
+        }
+
+        // the frame goes without a pyramid rather than over the memory budget
+        if (pBuffer == NULL && GetMemoryBudget()->Reserve(MemoryAccount_FramePool, cbBuffer))
+        {
+            pBuffer = new (std::nothrow) BYTE[cbBuffer];
+            pPool = NULL;
+
+            if (pBuffer == NULL)
+            {
+                GetMemoryBudget()->Release(MemoryAccount_FramePool, cbBuffer);
+            }
+        }
+        BREAK_ON_NULL(pBuffer, E_OUTOFMEMORY);
+
+        pPyramid = new (std::nothrow) CFramePyramid(pPool, pBuffer, cbBuffer, m_filter);
+        if (pPyramid == NULL)
+        {
+            if (pPool != NULL)
+            {
+                pPool->Return(pBuffer);
+            }
+            else
+            {
+                delete[] pBuffer;
+                GetMemoryBudget()->Release(MemoryAccount_FramePool, cbBuffer);
+            }
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        for (UINT32 i = 0; i < levelCount; i++)
+        {
+            pPyramid->m_levels[i] = levels[i];
+            pPyramid->m_levels[i].pData = pBuffer;
+            pBuffer += levels[i].stride * levels[i].height;
+        }
+
+        pPyramid->m_levelCount = levelCount;
+        *ppPyramid = pPyramid;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Build a band of level 0 rows straight from the frame.
+//
+void CFramePyramidStage::ProcessTile(CFrameView* pFrame, UINT32 tile)
+{
+    const FrameFormat& format = pFrame->Format();
+
+    PrepareFrame(format);
+
+    if (m_pCurrent == NULL)
+    {
+        return;
+    }
+
+    const FramePlane& level = m_pCurrent->m_levels[0];
+    BYTE* pScratch = &m_scratch[(size_t)tile * m_scratchRowBytes * 5];
+    USHORT* pTemp = (USHORT*)(pScratch + m_scratchRowBytes * 3);
+    UINT32 firstRow = tile * PYRAMID_BAND_HEIGHT;
+    UINT32 lastRow = min(firstRow + PYRAMID_BAND_HEIGHT, level.height);
+
+    for (UINT32 y = firstRow; y < lastRow; y++)
+    {
+        UINT32 srcY = y * 2;
+        const BYTE* pRow = GetLumaRow(pFrame, srcY, pScratch + m_scratchRowBytes);
+        const BYTE* pDown = GetLumaRow(pFrame, min(srcY + 1, format.height - 1),
+            pScratch + m_scratchRowBytes * 2);
+        const BYTE* pUp = pRow;
+
+        // the box filter only looks at the two rows of the block
+        if (m_filter == PyramidFilter_Gaussian && srcY > 0)
+        {
+            pUp = GetLumaRow(pFrame, srcY - 1, pScratch);
+        }
+
+        DownsampleRow(pUp, pRow, pDown, level.pData + (LONG)y * level.stride, level.width,
+            format.width, pTemp);
+    }
+}
+
+
+//
+// Build the smaller levels, then hand the pyramid over to the frame.
+//
+void CFramePyramidStage::EndFrame(CFrameView* pFrame)
+{
+    // a frame without tiles never prepared the state
+    PrepareFrame(pFrame->Format());
+
+    if (m_pCurrent != NULL)
+    {
+        USHORT* pTemp = (USHORT*)(&m_scratch[0] + m_scratchRowBytes * 3);
+
+        for (UINT32 i = 1; i < m_pCurrent->m_levelCount; i++)
+        {
+            BuildLevel(i, pTemp);
+        }
+
+        pFrame->SetAttachment(FRAME_ATTACHMENT_PYRAMID, m_pCurrent);
+
+        m_pCurrent->Release();
+        m_pCurrent = NULL;
+    }
+
+    m_frameCount++;
+}
+
+
+void CFramePyramidStage::BuildLevel(UINT32 level, USHORT* pTemp)
+{
+    const FramePlane& source = m_pCurrent->m_levels[level - 1];
+    const FramePlane& dest = m_pCurrent->m_levels[level];
+
+    for (UINT32 y = 0; y < dest.height; y++)
+    {
+        UINT32 srcY = y * 2;
+        const BYTE* pRow = source.pData + (LONG)srcY * source.stride;
+        const BYTE* pUp = (srcY > 0) ? pRow - source.stride : pRow;
+        const BYTE* pDown = (srcY + 1 < source.height) ? pRow + source.stride : pRow;
+
+        DownsampleRow(pUp, pRow, pDown, dest.pData + (LONG)y * dest.stride, dest.width,
+            source.width, pTemp);
+    }
+}
+
+
+//
+// Luma of one frame row.  NV12 has it in a plane of its own and a gray plane view is
+// nothing else, so both are read in place; YUY2 has it in every other byte, and RGB32 has
+// to compute it - both go to the scratch row.
+//
+const BYTE* CFramePyramidStage::GetLumaRow(CFrameView* pFrame, UINT32 y, BYTE* pScratch) const
+{
+    const FrameFormat& format = pFrame->Format();
+    const FramePlane& plane = pFrame->Plane(0);
+    const BYTE* pSource = plane.pData + (LONG)y * plane.stride;
+    UINT32 x = 0;
+
+    if (format.subtype == MFVideoFormat_NV12 || format.subtype == FrameSubtype_Gray8)
+    {
+        return pSource;
+    }
+
+    if (format.subtype == MFVideoFormat_YUY2)
+    {
+        const __m128i mask = _mm_set1_epi16(0x00FF);
+
+        // Y0 U Y1 V - keep the low byte of every 16-bit pair
+        for (; x + 16 <= format.width; x += 16)
+        {
+            __m128i first = _mm_loadu_si128((const __m128i*)(pSource + x * 2));
+            __m128i second = _mm_loadu_si128((const __m128i*)(pSource + x * 2 + 16));
+
+            _mm_storeu_si128((__m128i*)(pScratch + x),
+                _mm_packus_epi16(_mm_and_si128(first, mask), _mm_and_si128(second, mask)));
+        }
+
+        for (; x < format.width; x++)
+        {
+            pScratch[x] = pSource[x * 2];
+        }
+    }
+    else
+    {
+        // BT.601 luma in video range, to match the YUV formats
+        for (; x < format.width; x++)
+        {
+            const BYTE* pPixel = pSource + x * 4;
+            pScratch[x] = (BYTE)((25 * pPixel[0] + 129 * pPixel[1] + 66 * pPixel[2] + 128 + 4096) >> 8);
+        }
+    }
+
+    return pScratch;
+}
+
+
+//
+// One output row from the input rows around it.  The box filter averages the 2x2 blocks of
+// pRow and pDown, eight output pixels per step.  The Gaussian filter runs the vertical
+// 1 2 1 pass over the whole input row in 16-bit lanes, then the horizontal pass on every
+// other pixel; the edges repeat the outermost pixel.
+//
+void CFramePyramidStage::DownsampleRow(const BYTE* pUp, const BYTE* pRow, const BYTE* pDown,
+    BYTE* pOut, UINT32 outWidth, UINT32 inWidth, USHORT* pTemp) const
+{
+    UINT32 x = 0;
+
+    if (m_filter == PyramidFilter_Box)
+    {
+        const __m128i mask = _mm_set1_epi16(0x00FF);
+        const __m128i two = _mm_set1_epi16(2);
+
+        for (; x + 8 <= outWidth; x += 8)
+        {
+            __m128i row = _mm_loadu_si128((const __m128i*)(pRow + x * 2));
+            __m128i down = _mm_loadu_si128((const __m128i*)(pDown + x * 2));
+
+            // even and odd pixels of both rows, summed in 16-bit lanes
+            __m128i sum = _mm_add_epi16(
+                _mm_add_epi16(_mm_and_si128(row, mask), _mm_srli_epi16(row, 8)),
+                _mm_add_epi16(_mm_and_si128(down, mask), _mm_srli_epi16(down, 8)));
+
+            sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+            _mm_storel_epi64((__m128i*)(pOut + x), _mm_packus_epi16(sum, sum));
+        }
+
+        for (; x < outWidth; x++)
+        {
+            pOut[x] = (BYTE)((pRow[x * 2] + pRow[x * 2 + 1] + pDown[x * 2] + pDown[x * 2 + 1] + 2) >> 2);
+        }
+
+        return;
+    }
+
+    const __m128i zero = _mm_setzero_si128();
+
+    for (; x + 16 <= inWidth; x += 16)
+    {
+        __m128i up = _mm_loadu_si128((const __m128i*)(pUp + x));
+        __m128i row = _mm_loadu_si128((const __m128i*)(pRow + x));
+        __m128i down = _mm_loadu_si128((const __m128i*)(pDown + x));
+
+        __m128i low = _mm_add_epi16(
+            _mm_add_epi16(_mm_unpacklo_epi8(up, zero), _mm_unpacklo_epi8(down, zero)),
+            _mm_slli_epi16(_mm_unpacklo_epi8(row, zero), 1));
+        __m128i high = _mm_add_epi16(
+            _mm_add_epi16(_mm_unpackhi_epi8(up, zero), _mm_unpackhi_epi8(down, zero)),
+            _mm_slli_epi16(_mm_unpackhi_epi8(row, zero), 1));
+
+        _mm_storeu_si128((__m128i*)(pTemp + x), low);
+        _mm_storeu_si128((__m128i*)(pTemp + x + 8), high);
+    }
+
+    for (; x < inWidth; x++)
+    {
+        pTemp[x] = (USHORT)(pUp[x] + 2 * pRow[x] + pDown[x]);
+    }
+
+    for (x = 0; x < outWidth; x++)
+    {
+        UINT32 center = x * 2;
+        UINT32 left = (center > 0) ? center - 1 : 0;
+        UINT32 right = (center + 1 < inWidth) ? center + 1 : center;
+
+        pOut[x] = (BYTE)((pTemp[left] + 2 * pTemp[center] + pTemp[right] + 8) >> 4);
+    }
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Common.h"
+#include "FramePipeline.h"
+#include "FramePool.h"
+
+
+
+// most levels a pyramid can have
+#define PYRAMID_MAX_LEVELS          8
+
+// key of the pyramid among the attachments of a frame
+// {6C1B0F9E-3A57-4E2B-9C1D-52E4A8F0B731}
+static const GUID FRAME_ATTACHMENT_PYRAMID =
+    { 0x6c1b0f9e, 0x3a57, 0x4e2b, { 0x9c, 0x1d, 0x52, 0xe4, 0xa8, 0xf0, 0xb7, 0x31 } };
+
+
+//
+//  How a level is filtered before it is decimated.
+//
+enum PyramidFilter
+{
+    PyramidFilter_Box = 0,      // average of every 2x2 block
+    PyramidFilter_Gaussian      // 3x3 binomial kernel (1 2 1), then every other pixel
+};
+
+
+//
+//  The luma pyramid of one frame.  Level 0 is half the size of the frame, every following
+//  level half the size of the one before it.  The levels share one buffer, taken from the
+//  pool of the stage that built the pyramid, and the buffer goes back to the pool when the
+//  last reference is released - the pyramid must not outlive its stage.
+//
+class CFramePyramid : public IUnknown
+{
+    public:
+        // the pyramid attached to the frame by a pyramid stage earlier in the pipeline
+        static HRESULT FromFrame(CFrameView* pFrame, CFramePyramid** ppPyramid);
+
+        UINT32 LevelCount(void) const { return m_levelCount; }
+        const FramePlane& Level(UINT32 index) const { return m_levels[index]; }
+        PyramidFilter Filter(void) const { return m_filter; }
+
+        // IUnknown
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void);
+        STDMETHODIMP_(ULONG) Release(void);
+
+    private:
+        friend class CFramePyramidStage;
+
+        CFramePyramid(CFramePool* pPool, BYTE* pBuffer, DWORD cbBuffer, PyramidFilter filter);
+        ~CFramePyramid(void);
+
+        volatile long m_cRef;
+        CFramePool* m_pPool;                    // owner of m_pBuffer, NULL if taken from the heap
+        BYTE* m_pBuffer;
+        DWORD m_cbBuffer;
+        PyramidFilter m_filter;
+        UINT32 m_levelCount;
+        FramePlane m_levels[PYRAMID_MAX_LEVELS];
+};
+
+
+//
+//  Pipeline stage that builds the luma pyramid of every frame once and attaches it to the
+//  frame, so every stage after it shares the same levels instead of downscaling the frame
+//  on its own.
+//
+//  Level 0 is the expensive one - it reads the whole frame - so it is split into bands of
+//  rows that are built in parallel, each band reading the luma of its source rows straight
+//  from the capture buffer.  The smaller levels together cost a third of level 0 and are
+//  built in EndFrame.  The row kernels use SSE2.
+//
+class CFramePyramidStage : public IFrameStage
+{
+    public:
+        CFramePyramidStage(void);
+        virtual ~CFramePyramidStage(void);
+
+        // call before frames flow - levels stop early once they get smaller than 8x8
+        void SetLevelCount(UINT32 levelCount);
+        void SetFilter(PyramidFilter filter) { m_filter = filter; }
+
+        // IFrameStage implementation
+        virtual UINT32 GetTileCount(CFrameView* pFrame);
+        virtual void ProcessTile(CFrameView* pFrame, UINT32 tile);
+        virtual void EndFrame(CFrameView* pFrame);
+
+    private:
+        void PrepareFrame(const FrameFormat& format);
+        HRESULT CreatePyramid(const FrameFormat& format, CFramePyramid** ppPyramid);
+        const BYTE* GetLumaRow(CFrameView* pFrame, UINT32 y, BYTE* pScratch) const;
+        void DownsampleRow(const BYTE* pUp, const BYTE* pRow, const BYTE* pDown,
+            BYTE* pOut, UINT32 outWidth, UINT32 inWidth, USHORT* pTemp) const;
+        void BuildLevel(UINT32 level, USHORT* pTemp);
+
+        UINT32 m_levelCount;
+        PyramidFilter m_filter;
+        CFramePool m_pool;                      // pyramid buffers, sized on the first frame
+
+        // per-frame work state - only one frame is in this stage at a time
+        CComAutoCriticalSection m_prepareLock;  // the first tile of a frame prepares the state
+        ULONGLONG m_preparedFrame;              // m_frameCount of the frame it was prepared for
+        ULONGLONG m_frameCount;
+        CFramePyramid* m_pCurrent;              // pyramid of the frame in the stage
+        std::vector<BYTE> m_scratch;            // luma rows and filter rows of every tile
+        DWORD m_scratchRowBytes;                // one frame row, rounded up to 16 bytes
+};
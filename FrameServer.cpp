@@ -0,0 +1,869 @@
+#include "FrameServer.h"
+
+#include <ws2tcpip.h>
+#include <stdio.h>
+#include <deque>
+#include <new>
+
+
+
+//
+// Per-client state.  The OVERLAPPED structure must stay first, since the completion thread
+// gets back to the client from the OVERLAPPED pointer.
+//
+struct FrameServerClient
+{
+    OVERLAPPED overlapped;              // overlapped structure of the send in flight
+    SOCKET socket;                      // connected client socket
+    std::deque<CFramePacket*> queue;    // packets waiting to be sent, front is in flight
+    DWORD sentBytes;                    // bytes of the front packet already sent
+    bool sending;                       // a WSASend() is outstanding
+    bool closing;                       // the client is being disconnected
+    CMetricGauge* pQueueDepth;          // metrics of the connection
+    CMetricCounter* pSentBytes;
+    CMetricCounter* pDroppedPackets;
+};
+
+
+// key posted to the completion port to stop the completion thread
+#define FRAME_SERVER_QUIT_KEY           ((ULONG_PTR)-1)
+
+// default number of frames that may be queued for a single client
+#define FRAME_SERVER_DEFAULT_QUEUE      4
+
+
+
+//
+// Allocate a packet with room for cbCapacity bytes.  A packet from the heap is reserved
+// from the memory budget like the pool buffers - when the budget denies it, the frame is
+// not served.
+//
+HRESULT CFramePacket::Create(DWORD cbCapacity, CFramePool* pPool, CFramePacket** ppPacket)
+{
+    HRESULT hr = S_OK;
+    CFramePacket* pPacket = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(ppPacket, E_POINTER);
+
+        pPacket = new (std::nothrow) CFramePacket();
+        BREAK_ON_NULL(pPacket, E_OUTOFMEMORY);
+
+        if (pPool != NULL && cbCapacity <= pPool->GetBufferSize())
+        {
+            pPacket->m_pData = pPool->Acquire();
+            if (pPacket->m_pData != NULL)
+            {
+                pPacket->m_pPool = pPool;
+                cbCapacity = pPool->GetBufferSize();
+            }
+        }
+
+        if (pPacket->m_pData == NULL)
+        {
+            if (!GetMemoryBudget()->Reserve(MemoryAccount_ServerPackets, cbCapacity))
+            {
+                hr = E_OUTOFMEMORY;
+                break;
+            }
+
+            pPacket->m_pData = new (std::nothrow) BYTE[cbCapacity];
+            if (pPacket->m_pData == NULL)
+            {
+                GetMemoryBudget()->Release(MemoryAccount_ServerPackets, cbCapacity);
+                hr = E_OUTOFMEMORY;
+                break;
+            }
+        }
+
+        pPacket->m_cbCapacity = cbCapacity;
+
+        *ppPacket = pPacket;
+        pPacket = NULL;
+    }
+    while(false);
+
+    if (pPacket != NULL)
+    {
+        pPacket->Release();
+    }
+
+    return hr;
+}
+
+CFramePacket::~CFramePacket(void)
+{
+    if (m_pPool != NULL)
+    {
+        m_pPool->Return(m_pData);
+    }
+    else if (m_pData != NULL)
+    {
+        delete [] m_pData;
+        GetMemoryBudget()->Release(MemoryAccount_ServerPackets, m_cbCapacity);
+    }
+}
+
+ULONG CFramePacket::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CFramePacket::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+
+
+
+CFrameServer::CFrameServer(void) :
+    m_listenSocket(INVALID_SOCKET),
+    m_completionPort(NULL),
+    m_acceptThread(NULL),
+    m_completionThread(NULL),
+    m_wsaStarted(false),
+    m_stopping(false),
+    m_maxQueuedPackets(FRAME_SERVER_DEFAULT_QUEUE),
+    m_dropPolicy(DropPolicy_DropOldest),
+    m_numaNode(NUMA_NODE_ANY),
+    m_poolBuffers(2),
+    m_clientCount(0),
+    m_droppedPackets(0),
+    m_port(0),
+    m_nextClientId(0),
+    m_pClientsMetric(NULL),
+    m_pDroppedMetric(NULL)
+{
+    ZeroMemory(&m_cores, sizeof(m_cores));
+}
+
+
+CFrameServer::~CFrameServer(void)
+{
+    Stop();
+}
+
+
+//
+// Create the completion port, start listening on 127.0.0.1:port and start the accept and
+// completion threads.
+//
+HRESULT CFrameServer::Start(USHORT port)
+{
+    HRESULT hr = S_OK;
+    WSADATA wsaData;
+    sockaddr_in address;
+    char label[32];
+
+    do
+    {
+        if (m_listenSocket != INVALID_SOCKET)
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            break;
+        }
+        m_wsaStarted = true;
+        m_stopping = false;
+
+        m_completionPort = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+        BREAK_ON_NULL(m_completionPort, HRESULT_FROM_WIN32(GetLastError()));
+
+        m_listenSocket = WSASocket(AF_INET, SOCK_STREAM, IPPROTO_TCP, NULL, 0,
+            WSA_FLAG_OVERLAPPED);
+        if (m_listenSocket == INVALID_SOCKET)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            break;
+        }
+
+        // local clients only
+        ZeroMemory(&address, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+
+        if (bind(m_listenSocket, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR ||
+            listen(m_listenSocket, SOMAXCONN) == SOCKET_ERROR)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            break;
+        }
+
+        m_completionThread = CreateThread(NULL, 0, CompletionThreadProc, this, 0, NULL);
+        BREAK_ON_NULL(m_completionThread, HRESULT_FROM_WIN32(GetLastError()));
+
+        m_acceptThread = CreateThread(NULL, 0, AcceptThreadProc, this, 0, NULL);
+        BREAK_ON_NULL(m_acceptThread, HRESULT_FROM_WIN32(GetLastError()));
+
+        PinThread(m_completionThread, m_cores);
+        PinThread(m_acceptThread, m_cores);
+
+        m_port = port;
+        sprintf_s(label, "server=\"%u\"", (UINT32)port);
+
+        m_pClientsMetric = GetMetricsRegistry()->CreateGauge("mfcp_server_clients",
+            "Clients connected to the frame server.", label, 1.0, ReadClientCount, this);
+        m_pDroppedMetric = GetMetricsRegistry()->CreateCounter(
+            "mfcp_server_dropped_packets_total",
+            "Packets dropped because a client queue was full.", label, 1.0,
+            ReadDroppedPackets, this);
+    }
+    while(false);
+
+    if (FAILED(hr))
+    {
+        Stop();
+    }
+
+    return hr;
+}
+
+
+//
+// Stop accepting, disconnect every client, and wait for the outstanding sends to complete
+// before shutting down the completion thread.  The sends are cancelled, so their completions
+// come right away - the completion thread drains them, and exits once the last client is
+// gone; only then are the packets and Winsock shut down.
+//
+HRESULT CFrameServer::Stop(void)
+{
+    // closing the listening socket makes the blocking accept() fail, which ends the accept
+    // thread
+    if (m_listenSocket != INVALID_SOCKET)
+    {
+        closesocket(m_listenSocket);
+        m_listenSocket = INVALID_SOCKET;
+    }
+
+    if (m_acceptThread != NULL)
+    {
+        WaitForSingleObject(m_acceptThread, INFINITE);
+        CloseHandle(m_acceptThread);
+        m_acceptThread = NULL;
+    }
+
+    // Disconnect everybody.  Clients without a send in flight are deleted right away, the
+    // rest are deleted by the completion thread when their cancelled send completes.
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        m_stopping = true;
+
+        for (size_t i = m_clients.size(); i > 0; i--)
+        {
+            FrameServerClient* pClient = m_clients[i - 1];
+
+            if (pClient->sending && pClient->socket != INVALID_SOCKET)
+            {
+                CancelIoEx((HANDLE)pClient->socket, &pClient->overlapped);
+            }
+
+            CloseClient(pClient);
+        }
+    }
+
+    RemoveRetiredMetrics();
+
+    if (m_completionThread != NULL)
+    {
+        PostQueuedCompletionStatus(m_completionPort, 0, FRAME_SERVER_QUIT_KEY, NULL);
+        WaitForSingleObject(m_completionThread, INFINITE);
+        CloseHandle(m_completionThread);
+        m_completionThread = NULL;
+    }
+
+    if (m_completionPort != NULL)
+    {
+        CloseHandle(m_completionPort);
+        m_completionPort = NULL;
+    }
+
+    if (m_wsaStarted)
+    {
+        WSACleanup();
+        m_wsaStarted = false;
+    }
+
+    // every client is gone, and every packet has been released with the client queues
+    m_packetPool.Shutdown();
+
+    GetMetricsRegistry()->Remove(m_pClientsMetric);
+    GetMetricsRegistry()->Remove(m_pDroppedMetric);
+    m_pClientsMetric = NULL;
+    m_pDroppedMetric = NULL;
+
+    return S_OK;
+}
+
+
+void CFrameServer::SetQueueLimit(DWORD maxPackets, DropPolicy policy)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_maxQueuedPackets = (maxPackets > 0) ? maxPackets : 1;
+    m_dropPolicy = policy;
+}
+
+
+void CFrameServer::SetPlacement(const GROUP_AFFINITY& cores, USHORT numaNode)
+{
+    m_cores = cores;
+    m_numaNode = numaNode;
+}
+
+
+//
+// Serialize the frame once and share the packet between all clients.
+//
+void CFrameServer::OnFrame(CFrameView* pFrame)
+{
+    HRESULT hr = S_OK;
+    CFramePacket* pPacket = NULL;
+
+    do
+    {
+        // nobody is watching - don't spend any time on the frame
+        if (m_clientCount == 0)
+        {
+            break;
+        }
+
+        hr = SerializeFrame(pFrame, &pPacket);
+        BREAK_ON_FAIL(hr);
+        BREAK_ON_NULL(pPacket, S_OK);
+
+        hr = Broadcast(pPacket);
+    }
+    while(false);
+
+    if (pPacket != NULL)
+    {
+        pPacket->Release();
+    }
+}
+
+
+//
+// Queue the packet to every client.  The packet is reference counted, so each queue only
+// holds a reference to the same memory.
+//
+HRESULT CFrameServer::Broadcast(CFramePacket* pPacket)
+{
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        for (size_t i = m_clients.size(); i > 0; i--)
+        {
+            Enqueue(m_clients[i - 1], pPacket);
+        }
+    }
+
+    // clients disconnected by the drop policy or by a failed send
+    RemoveRetiredMetrics();
+
+    return S_OK;
+}
+
+
+//
+// Row size in a packet.  Only the first plane can have a different row size - NV12 chroma
+// rows are as wide as the luma rows.
+//
+static DWORD GetPacketRowBytes(const FrameFormat& format)
+{
+    if (format.subtype == MFVideoFormat_YUY2)
+    {
+        return format.width * 2;
+    }
+    else if (format.subtype == MFVideoFormat_RGB32)
+    {
+        return format.width * 4;
+    }
+    else if (format.subtype == MFVideoFormat_NV12 || format.subtype == FrameSubtype_Gray8)
+    {
+        return format.width;
+    }
+
+    return (DWORD)abs(format.stride);
+}
+
+
+//
+// Size the pool for the frame format: every client can hold a full queue, plus the frame
+// being serialized.  Only the first format sizes it - larger packets come from the heap.
+//
+void CFrameServer::InitializePacketPool(DWORD cbPacket)
+{
+    if (!m_packetPool.IsInitialized())
+    {
+        m_packetPool.Initialize(cbPacket, m_poolBuffers,
+            max(m_poolBuffers, m_maxQueuedPackets * 8 + 1), m_numaNode,
+            MemoryAccount_ServerPackets);
+    }
+}
+
+
+//
+// Allocate the packet pool before the first frame rather than on it.
+//
+void CFrameServer::OnFormat(const FrameFormat& format)
+{
+    DWORD rows = format.height;
+
+    if (format.subtype == MFVideoFormat_NV12)
+    {
+        rows += (format.height + 1) / 2;
+    }
+
+    InitializePacketPool(sizeof(FramePacketHeader) + GetPacketRowBytes(format) * rows);
+}
+
+
+//
+// Default serialization - a FramePacketHeader followed by the visible rows of every plane.
+//
+HRESULT CFrameServer::SerializeFrame(CFrameView* pFrame, CFramePacket** ppPacket)
+{
+    HRESULT hr = S_OK;
+    CFramePacket* pPacket = NULL;
+    FramePacketHeader header;
+    DWORD rowBytes = 0;
+    DWORD payloadSize = 0;
+    BYTE* pDest = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pFrame, E_POINTER);
+
+        const FrameFormat& format = pFrame->Format();
+
+        rowBytes = GetPacketRowBytes(format);
+
+        for (UINT32 i = 0; i < pFrame->PlaneCount(); i++)
+        {
+            payloadSize += rowBytes * pFrame->Plane(i).height;
+        }
+
+        // normally sized by OnFormat() already
+        InitializePacketPool(sizeof(header) + payloadSize);
+
+        hr = CFramePacket::Create(sizeof(header) + payloadSize, &m_packetPool, &pPacket);
+        BREAK_ON_FAIL(hr);
+
+        ZeroMemory(&header, sizeof(header));
+        header.magic = FRAME_PACKET_MAGIC;
+        header.headerSize = sizeof(header);
+        header.subtype = format.subtype;
+        header.width = format.width;
+        header.height = format.height;
+        header.rowBytes = rowBytes;
+        header.timestamp = pFrame->Timestamp();
+        header.payloadSize = payloadSize;
+
+        CopyMemory(pPacket->Data(), &header, sizeof(header));
+
+        pDest = pPacket->Data() + sizeof(header);
+        for (UINT32 i = 0; i < pFrame->PlaneCount(); i++)
+        {
+            hr = pFrame->CopyPlane(i, pDest, (LONG)rowBytes);
+            BREAK_ON_FAIL(hr);
+
+            pDest += rowBytes * pFrame->Plane(i).height;
+        }
+        BREAK_ON_FAIL(hr);
+
+        pPacket->SetSize(sizeof(header) + payloadSize);
+
+        *ppPacket = pPacket;
+        pPacket = NULL;
+    }
+    while(false);
+
+    if (pPacket != NULL)
+    {
+        pPacket->Release();
+    }
+
+    return hr;
+}
+
+
+
+
+
+DWORD WINAPI CFrameServer::AcceptThreadProc(LPVOID pParam)
+{
+    static_cast<CFrameServer*>(pParam)->AcceptLoop();
+    return 0;
+}
+
+DWORD WINAPI CFrameServer::CompletionThreadProc(LPVOID pParam)
+{
+    static_cast<CFrameServer*>(pParam)->CompletionLoop();
+    return 0;
+}
+
+
+//
+// Accept clients until the listening socket is closed.
+//
+void CFrameServer::AcceptLoop(void)
+{
+    while (true)
+    {
+        SOCKET s = accept(m_listenSocket, NULL, NULL);
+        if (s == INVALID_SOCKET)
+        {
+            break;
+        }
+
+        if (FAILED(AcceptClient(s)) || FAILED(AddClient(s)))
+        {
+            closesocket(s);
+        }
+    }
+}
+
+
+//
+// Associate a new client with the completion port and send it the preamble.
+//
+HRESULT CFrameServer::AddClient(SOCKET s)
+{
+    HRESULT hr = S_OK;
+    FrameServerClient* pClient = NULL;
+    CFramePacket* pPreamble = NULL;
+    BOOL noDelay = TRUE;
+    char label[64];
+
+    do
+    {
+        // frames are large and sent whole - don't let Nagle hold back the tail of a frame
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+        if (CreateIoCompletionPort((HANDLE)s, m_completionPort, 0, 0) == NULL)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        hr = CreatePreamble(&pPreamble);
+        BREAK_ON_FAIL(hr);
+
+        pClient = new (std::nothrow) FrameServerClient();
+        BREAK_ON_NULL(pClient, E_OUTOFMEMORY);
+
+        ZeroMemory(&pClient->overlapped, sizeof(pClient->overlapped));
+        pClient->socket = s;
+        pClient->sentBytes = 0;
+        pClient->sending = false;
+        pClient->closing = false;
+
+        // the metrics are registered outside of the server lock - scrapes take the registry
+        // lock, and the frame path must not wait for them
+        sprintf_s(label, "server=\"%u\",client=\"%u\"", (UINT32)m_port,
+            (UINT32)++m_nextClientId);
+
+        pClient->pQueueDepth = GetMetricsRegistry()->CreateGauge("mfcp_client_queue_depth",
+            "Packets queued to a client connection.", label);
+        pClient->pSentBytes = GetMetricsRegistry()->CreateCounter("mfcp_client_sent_bytes_total",
+            "Bytes sent to a client connection.", label);
+        pClient->pDroppedPackets = GetMetricsRegistry()->CreateCounter(
+            "mfcp_client_dropped_packets_total",
+            "Packets dropped because the queue of a client connection was full.", label);
+
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        m_clients.push_back(pClient);
+        InterlockedIncrement(&m_clientCount);
+
+        if (pPreamble != NULL)
+        {
+            Enqueue(pClient, pPreamble);
+        }
+    }
+    while(false);
+
+    if (pPreamble != NULL)
+    {
+        pPreamble->Release();
+    }
+
+    RemoveRetiredMetrics();
+
+    return hr;
+}
+
+
+//
+// Add a packet to the client queue, applying the drop policy if the queue is full.  Called
+// with the server lock held.
+//
+HRESULT CFrameServer::Enqueue(FrameServerClient* pClient, CFramePacket* pPacket)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        if (pClient->closing)
+        {
+            break;
+        }
+
+        if (pClient->queue.size() >= m_maxQueuedPackets)
+        {
+            InterlockedIncrement64(&m_droppedPackets);
+
+            if (pClient->pDroppedPackets != NULL)
+            {
+                pClient->pDroppedPackets->Add(1);
+            }
+
+            if (m_dropPolicy == DropPolicy_DropNewest)
+            {
+                break;
+            }
+            else if (m_dropPolicy == DropPolicy_Disconnect)
+            {
+                CloseClient(pClient);
+                break;
+            }
+
+            // Drop the oldest packet that is not partially sent - the packet in flight must
+            // be completed, or the client would receive a truncated frame.
+            std::deque<CFramePacket*>::iterator oldest = pClient->queue.begin();
+            if (pClient->sending && oldest != pClient->queue.end())
+            {
+                ++oldest;
+            }
+
+            if (oldest == pClient->queue.end())
+            {
+                break;
+            }
+
+            (*oldest)->Release();
+            pClient->queue.erase(oldest);
+        }
+
+        pPacket->AddRef();
+        pClient->queue.push_back(pPacket);
+
+        if (pClient->pQueueDepth != NULL)
+        {
+            pClient->pQueueDepth->Set((LONGLONG)pClient->queue.size());
+        }
+
+        if (!pClient->sending)
+        {
+            hr = StartSend(pClient);
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Start an overlapped send of the rest of the front packet.  Called with the server lock held.
+//
+HRESULT CFrameServer::StartSend(FrameServerClient* pClient)
+{
+    HRESULT hr = S_OK;
+    WSABUF buffer;
+    CFramePacket* pPacket = pClient->queue.front();
+
+    buffer.buf = (char*)pPacket->Data() + pClient->sentBytes;
+    buffer.len = pPacket->Size() - pClient->sentBytes;
+
+    ZeroMemory(&pClient->overlapped, sizeof(pClient->overlapped));
+
+    if (WSASend(pClient->socket, &buffer, 1, NULL, 0, &pClient->overlapped, NULL) ==
+        SOCKET_ERROR && WSAGetLastError() != WSA_IO_PENDING)
+    {
+        hr = HRESULT_FROM_WIN32(WSAGetLastError());
+        CloseClient(pClient);
+    }
+    else
+    {
+        // the completion is queued to the port even if the send finished right away
+        pClient->sending = true;
+    }
+
+    return hr;
+}
+
+
+//
+// Close the client connection.  If a send is in flight, the client is deleted once its
+// (failed) completion arrives, otherwise immediately.  Called with the server lock held.
+//
+void CFrameServer::CloseClient(FrameServerClient* pClient)
+{
+    if (!pClient->closing)
+    {
+        pClient->closing = true;
+        closesocket(pClient->socket);
+        pClient->socket = INVALID_SOCKET;
+    }
+
+    if (!pClient->sending)
+    {
+        DeleteClient(pClient);
+    }
+}
+
+
+//
+// Remove the client from the list and release its queued packets.  Called with the server
+// lock held, so the metrics of the client are only retired here - RemoveRetiredMetrics()
+// removes them once the lock is released, since a scrape holds the registry lock and the
+// frame path must not wait for it.
+//
+void CFrameServer::DeleteClient(FrameServerClient* pClient)
+{
+    for (size_t i = 0; i < m_clients.size(); i++)
+    {
+        if (m_clients[i] == pClient)
+        {
+            m_clients.erase(m_clients.begin() + i);
+            InterlockedDecrement(&m_clientCount);
+            break;
+        }
+    }
+
+    while (!pClient->queue.empty())
+    {
+        pClient->queue.front()->Release();
+        pClient->queue.pop_front();
+    }
+
+    m_retiredMetrics.push_back(pClient->pQueueDepth);
+    m_retiredMetrics.push_back(pClient->pSentBytes);
+    m_retiredMetrics.push_back(pClient->pDroppedPackets);
+
+    delete pClient;
+}
+
+
+//
+// Remove the metrics of the clients deleted since the last call.  Called without the server
+// lock held.
+//
+void CFrameServer::RemoveRetiredMetrics(void)
+{
+    std::vector<CMetric*> metrics;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_retiredMetrics.empty())
+        {
+            return;
+        }
+
+        metrics.swap(m_retiredMetrics);
+    }
+
+    for (size_t i = 0; i < metrics.size(); i++)
+    {
+        GetMetricsRegistry()->Remove(metrics[i]);
+    }
+}
+
+
+//
+// Handle send completions: advance through the packet, move on to the next packet in the
+// queue, or drop the client if the send failed.  Once the server stops, the loop goes on
+// until the completions of the last clients have been drained.
+//
+void CFrameServer::CompletionLoop(void)
+{
+    bool drained = false;
+
+    while (!drained)
+    {
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* pOverlapped = NULL;
+
+        BOOL ok = GetQueuedCompletionStatus(m_completionPort, &bytes, &key, &pOverlapped,
+            INFINITE);
+
+        if (pOverlapped == NULL)
+        {
+            // a failure of the port itself
+            if (!ok)
+                break;
+
+            // the quit notification - clients with a send in flight still need their
+            // completion
+            if (key == FRAME_SERVER_QUIT_KEY)
+            {
+                CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+                drained = m_clients.empty();
+            }
+            continue;
+        }
+
+        FrameServerClient* pClient = CONTAINING_RECORD(pOverlapped, FrameServerClient,
+            overlapped);
+
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            pClient->sending = false;
+
+            if (!ok || bytes == 0 || pClient->closing)
+            {
+                CloseClient(pClient);
+                drained = m_stopping && m_clients.empty();
+            }
+            else
+            {
+                pClient->sentBytes += bytes;
+
+                if (pClient->pSentBytes != NULL)
+                {
+                    pClient->pSentBytes->Add(bytes);
+                }
+
+                CFramePacket* pPacket = pClient->queue.front();
+                if (pClient->sentBytes >= pPacket->Size())
+                {
+                    pPacket->Release();
+                    pClient->queue.pop_front();
+                    pClient->sentBytes = 0;
+
+                    if (pClient->pQueueDepth != NULL)
+                    {
+                        pClient->pQueueDepth->Set((LONGLONG)pClient->queue.size());
+                    }
+                }
+
+                if (!pClient->queue.empty())
+                {
+                    StartSend(pClient);
+                }
+            }
+        }
+
+        // the client was closed above, or by a failed send
+        RemoveRetiredMetrics();
+    }
+}
@@ -0,0 +1,178 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameSink.h"
+#include "FramePool.h"
+#include "Metrics.h"
+
+#include <vector>
+
+
+
+//
+//  What to do with a new packet when a client's send queue is full.
+//
+enum DropPolicy
+{
+    DropPolicy_DropOldest = 0,  // discard the oldest queued packet that is not being sent
+    DropPolicy_DropNewest,      // discard the new packet, the client keeps its backlog
+    DropPolicy_Disconnect       // the client cannot keep up - close its connection
+};
+
+
+//
+//  Header that precedes every frame sent by CFrameServer.  All fields are little-endian,
+//  and the pixel data follows immediately with the rows of each plane tightly packed.
+//
+#pragma pack(push, 1)
+struct FramePacketHeader
+{
+    DWORD       magic;          // FRAME_PACKET_MAGIC
+    DWORD       headerSize;     // sizeof(FramePacketHeader)
+    GUID        subtype;        // pixel format of the payload
+    UINT32      width;          // frame width in pixels
+    UINT32      height;         // frame height in pixels
+    UINT32      rowBytes;       // bytes per row of the first plane
+    LONGLONG    timestamp;      // presentation time in 100-ns units
+    UINT32      payloadSize;    // bytes of pixel data after the header
+};
+#pragma pack(pop)
+
+#define FRAME_PACKET_MAGIC      0x4643464D      // "MFCF"
+
+
+//
+//  An immutable, reference counted block of serialized data.  A frame is serialized once
+//  into a packet, and the same packet is queued to every client.
+//
+class CFramePacket
+{
+    public:
+        // allocate the packet from the pool if it has a large enough buffer available,
+        // otherwise from the heap - pPool may be NULL
+        static HRESULT Create(DWORD cbCapacity, CFramePool* pPool, CFramePacket** ppPacket);
+
+        ULONG AddRef(void);
+        ULONG Release(void);
+
+        BYTE* Data(void) { return m_pData; }
+        DWORD Size(void) const { return m_cbSize; }
+        DWORD Capacity(void) const { return m_cbCapacity; }
+        void SetSize(DWORD cbSize) { m_cbSize = cbSize; }
+
+    private:
+        CFramePacket(void) : m_cRef(1), m_pData(NULL), m_pPool(NULL), m_cbSize(0), m_cbCapacity(0) {}
+        ~CFramePacket(void);
+
+        volatile long m_cRef;
+        BYTE* m_pData;
+        CFramePool* m_pPool;        // pool the data came from, NULL for the heap
+        DWORD m_cbSize;
+        DWORD m_cbCapacity;
+};
+
+
+struct FrameServerClient;
+
+
+//
+//  Serves the frames of the player to many local clients at once.  Every frame is
+//  serialized once, and the resulting packet is written to all clients through an I/O
+//  completion port, so a slow client never blocks the capture thread or the other clients.
+//  Each client has a bounded send queue, and the drop policy decides what happens when it
+//  is full.
+//
+class CFrameServer : public IFrameConsumer
+{
+    public:
+        CFrameServer(void);
+        virtual ~CFrameServer(void);
+
+        // start listening on the loopback interface
+        HRESULT Start(USHORT port);
+        HRESULT Stop(void);
+
+        // limit of queued packets per client and what to do when it is reached
+        void SetQueueLimit(DWORD maxPackets, DropPolicy policy);
+
+        // cores of the server threads and NUMA node of the packet pool - call before Start()
+        void SetPlacement(const GROUP_AFFINITY& cores, USHORT numaNode);
+
+        // packets allocated up front once the frame format is known - call before Start()
+        void SetPacketPoolSize(DWORD buffers) { m_poolBuffers = buffers; }
+
+        DWORD GetClientCount(void) const { return (DWORD)m_clientCount; }
+        ULONGLONG GetDroppedPackets(void) const { return (ULONGLONG)m_droppedPackets; }
+
+        // IFrameConsumer implementation - serializes the frame once and queues it to every
+        // connected client.  Does nothing if nobody is connected.
+        virtual void OnFrame(CFrameView* pFrame);
+
+        // sizes the packet pool of the default serialization
+        virtual void OnFormat(const FrameFormat& format);
+
+        // queue an already serialized packet to every connected client
+        HRESULT Broadcast(CFramePacket* pPacket);
+
+    protected:
+        // serialize a frame into a new packet - the default is a FramePacketHeader followed
+        // by the raw planes
+        virtual HRESULT SerializeFrame(CFrameView* pFrame, CFramePacket** ppPacket);
+
+        // optional packet sent to a client before any frame, e.g. a protocol preamble
+        virtual HRESULT CreatePreamble(CFramePacket** ppPacket) { *ppPacket = NULL; return S_OK; }
+
+        // optional handshake with a new connection, run on the accept thread before the
+        // client is added, e.g. reading its request - a failure closes the connection
+        virtual HRESULT AcceptClient(SOCKET s) { return S_OK; }
+
+        // pool of serialized frames, sized by the frame format
+        CFramePool m_packetPool;
+
+        void InitializePacketPool(DWORD cbPacket);
+
+    private:
+        static DWORD WINAPI AcceptThreadProc(LPVOID pParam);
+
+        static LONGLONG ReadClientCount(void* pContext)
+            { return ((CFrameServer*)pContext)->m_clientCount; }
+        static LONGLONG ReadDroppedPackets(void* pContext)
+            { return ((CFrameServer*)pContext)->m_droppedPackets; }
+        static DWORD WINAPI CompletionThreadProc(LPVOID pParam);
+
+        void AcceptLoop(void);
+        void CompletionLoop(void);
+
+        HRESULT AddClient(SOCKET s);
+        HRESULT Enqueue(FrameServerClient* pClient, CFramePacket* pPacket);
+        HRESULT StartSend(FrameServerClient* pClient);
+        void CloseClient(FrameServerClient* pClient);
+        void DeleteClient(FrameServerClient* pClient);
+        void RemoveRetiredMetrics(void);
+
+        CComAutoCriticalSection m_critSec;          // protects the client list and queues
+        std::vector<FrameServerClient*> m_clients;
+        std::vector<CMetric*> m_retiredMetrics;     // of deleted clients, removed unlocked
+
+        SOCKET m_listenSocket;
+        HANDLE m_completionPort;
+        HANDLE m_acceptThread;
+        HANDLE m_completionThread;
+        bool m_wsaStarted;
+        bool m_stopping;                            // the completion thread drains the clients
+
+        DWORD m_maxQueuedPackets;
+        DropPolicy m_dropPolicy;
+        GROUP_AFFINITY m_cores;
+        USHORT m_numaNode;
+        DWORD m_poolBuffers;
+
+        volatile long m_clientCount;
+        volatile LONGLONG m_droppedPackets;
+
+        // metrics of the server, labelled with its port
+        USHORT m_port;
+        DWORD m_nextClientId;                       // used by the accept thread only
+        CMetricGauge* m_pClientsMetric;
+        CMetricCounter* m_pDroppedMetric;
+};
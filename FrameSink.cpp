@@ -0,0 +1,1132 @@
+#include "FrameSink.h"
+#include "Startup.h"
+#include "Tracer.h"
+
+#include <new>
+
+
+
+//
+// Uncompressed formats accepted by the frame sink, in order of preference.  The topology
+// resolver inserts a decoder or a color converter if the source produces anything else.
+//
+static const GUID* const s_frameSinkSubtypes[] =
+{
+    &MFVideoFormat_YUY2,
+    &MFVideoFormat_NV12,
+    &MFVideoFormat_RGB32
+};
+
+static const DWORD s_frameSinkSubtypeCount =
+    sizeof(s_frameSinkSubtypes) / sizeof(s_frameSinkSubtypes[0]);
+
+
+
+CFrameConsumerList::CFrameConsumerList(PCSTR labels) :
+    m_lastArrival(0),
+    m_rateStart(0),
+    m_rateFrames(0),
+    m_nextSequence(0)
+{
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+
+    ZeroMemory(&m_deliveryCores, sizeof(m_deliveryCores));
+
+    m_pFrameCount = pMetrics->CreateCounter("mfcp_frames_total",
+        "Frames that reached the frame sink.", labels);
+    m_pFrameInterval = pMetrics->CreateLatencyHistogram("mfcp_frame_interval_seconds",
+        "Time between two frames reaching the frame sink.", labels);
+    m_pDeliveryTime = pMetrics->CreateLatencyHistogram("mfcp_frame_delivery_seconds",
+        "Time the frame consumers take to return from a frame.", labels);
+    m_pFrameRate = pMetrics->CreateGauge("mfcp_frame_rate",
+        "Frames per second reaching the frame sink, over the last second.", labels, 0.001);
+}
+
+
+CFrameConsumerList::~CFrameConsumerList(void)
+{
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+
+    pMetrics->Remove(m_pFrameCount);
+    pMetrics->Remove(m_pFrameInterval);
+    pMetrics->Remove(m_pDeliveryTime);
+    pMetrics->Remove(m_pFrameRate);
+}
+
+
+//
+// Register a frame consumer.  A consumer can only be registered once.
+//
+HRESULT CFrameConsumerList::Add(IFrameConsumer* pConsumer, const RECT* pRegion)
+{
+    HRESULT hr = S_OK;
+    ConsumerEntry entry;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        BREAK_ON_NULL(pConsumer, E_POINTER);
+
+        if (Find(pConsumer) != NULL)
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        entry.pConsumer = pConsumer;
+        entry.hasRegion = (pRegion != NULL);
+        if (pRegion != NULL)
+        {
+            entry.region = *pRegion;
+        }
+
+        m_consumers.push_back(entry);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Unregister a frame consumer.  Once this returns, the consumer will not be called again.
+//
+HRESULT CFrameConsumerList::Remove(IFrameConsumer* pConsumer)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    ConsumerEntry* pEntry = Find(pConsumer);
+
+    if (pEntry == NULL)
+    {
+        return MF_E_NOT_FOUND;
+    }
+
+    m_consumers.erase(m_consumers.begin() + (pEntry - &m_consumers[0]));
+
+    return S_OK;
+}
+
+
+HRESULT CFrameConsumerList::SetRegion(IFrameConsumer* pConsumer, const RECT* pRegion)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    ConsumerEntry* pEntry = Find(pConsumer);
+
+    if (pEntry == NULL)
+    {
+        return MF_E_NOT_FOUND;
+    }
+
+    pEntry->hasRegion = (pRegion != NULL);
+    if (pRegion != NULL)
+    {
+        pEntry->region = *pRegion;
+    }
+
+    return S_OK;
+}
+
+
+// called with the lock held
+CFrameConsumerList::ConsumerEntry* CFrameConsumerList::Find(IFrameConsumer* pConsumer)
+{
+    for (size_t i = 0; i < m_consumers.size(); i++)
+    {
+        if (m_consumers[i].pConsumer == pConsumer)
+        {
+            return &m_consumers[i];
+        }
+    }
+
+    return NULL;
+}
+
+
+void CFrameConsumerList::SetDeliveryAffinity(const GROUP_AFFINITY& cores)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_deliveryCores = cores;
+}
+
+
+//
+// Hand the sample to every consumer.  The lock is held for the duration of the delivery so
+// that a consumer is never called after Remove() returns.  The sample is wrapped in a
+// single locked view shared by all consumers, and only if somebody is listening.  A
+// consumer with a region gets a sub-view of that view - nothing is copied either way.
+//
+HRESULT CFrameConsumerList::Deliver(IMFSample* pSample, const FrameFormat& format)
+{
+    HRESULT hr = S_OK;
+    CFrameView* pFrame = NULL;
+    LONGLONG arrival = GetMetricsTime();
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_consumers.empty())
+        {
+            break;
+        }
+
+        // the session may deliver on any of its work queue threads - pin whichever one it
+        // is, for this frame only
+        CScopedThreadPin pin(m_deliveryCores);
+
+        hr = CFrameView::CreateFromSample(pSample, format, &pFrame);
+        BREAK_ON_FAIL(hr);
+
+        pFrame->SetCaptureInfo(m_nextSequence++, arrival);
+
+        for (size_t i = 0; i < m_consumers.size(); i++)
+        {
+            CFrameView* pRegionView = NULL;
+
+            if (!m_consumers[i].hasRegion)
+            {
+                m_consumers[i].pConsumer->OnFrame(pFrame);
+            }
+            else if (SUCCEEDED(pFrame->CreateSubView(m_consumers[i].region, &pRegionView)))
+            {
+                m_consumers[i].pConsumer->OnFrame(pRegionView);
+                pRegionView->Release();
+            }
+        }
+    }
+    while(false);
+
+    // consumers that still hold the frame keep the sample out of the source pool
+    if (pFrame != NULL)
+    {
+        pFrame->Release();
+    }
+
+    LONGLONG delivered = GetMetricsTime();
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        UpdateMetrics(arrival, delivered);
+    }
+
+    if (CTracer::IsEnabled())
+    {
+        LONGLONG sampleTime = TRACE_NO_FRAME;
+
+        pSample->GetSampleTime(&sampleTime);
+        CTracer::Span("capture", "Deliver", arrival, delivered, sampleTime);
+    }
+
+    return hr;
+}
+
+
+//
+// The format a consumer gets is that of its region - aligned to whole chroma samples
+// exactly as CFrameView::CreateSubView() aligns the views it delivers.
+//
+void CFrameConsumerList::NotifyFormat(const FrameFormat& format)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    for (size_t i = 0; i < m_consumers.size(); i++)
+    {
+        FrameFormat consumerFormat = format;
+        RECT aligned;
+
+        if (m_consumers[i].hasRegion)
+        {
+            if (!CFrameView::AlignRegion(format, m_consumers[i].region, &aligned))
+            {
+                continue;
+            }
+
+            consumerFormat.width = aligned.right - aligned.left;
+            consumerFormat.height = aligned.bottom - aligned.top;
+        }
+
+        m_consumers[i].pConsumer->OnFormat(consumerFormat);
+    }
+}
+
+
+//
+// The frame rate is counted over windows of a second, so the gauge shows what the camera
+// delivers now rather than an average since the start.  Called with the lock held.
+//
+void CFrameConsumerList::UpdateMetrics(LONGLONG arrival, LONGLONG delivered)
+{
+    LONGLONG ticksPerSecond = GetMetricsTicksPerSecond();
+
+    if (m_pFrameCount != NULL)
+        m_pFrameCount->Add(1);
+    if (m_pDeliveryTime != NULL)
+        m_pDeliveryTime->Observe(delivered - arrival);
+    if (m_pFrameInterval != NULL && m_lastArrival != 0)
+        m_pFrameInterval->Observe(arrival - m_lastArrival);
+    if (m_lastArrival == 0)
+        CStartupTimeline::Mark(StartupPhase_FirstFrame);
+
+    m_lastArrival = arrival;
+
+    if (m_rateFrames++ == 0)
+    {
+        m_rateStart = arrival;
+    }
+    else if (arrival - m_rateStart >= ticksPerSecond)
+    {
+        if (m_pFrameRate != NULL)
+        {
+            m_pFrameRate->Set((LONGLONG)(m_rateFrames - 1) * ticksPerSecond * 1000 /
+                (arrival - m_rateStart));
+        }
+
+        m_rateStart = arrival;
+        m_rateFrames = 1;
+    }
+}
+
+
+
+
+
+//
+//  CFrameStreamSink constructor - creates the event queue of the stream.
+//
+CFrameStreamSink::CFrameStreamSink(CFrameSink* pSink, CFrameConsumerList* pConsumers,
+    REFGUID subtype, HRESULT* pHr) :
+    m_cRef(1),
+    m_pSink(pSink),
+    m_pConsumers(pConsumers),
+    m_ppSubtypes(s_frameSinkSubtypes),
+    m_subtypeCount(s_frameSinkSubtypeCount),
+    m_subtype(subtype),
+    m_pSubtype(&m_subtype),
+    m_isShutdown(false)
+{
+    ZeroMemory(&m_format, sizeof(m_format));
+
+    // the resolver converts to the one format the pipeline asked for
+    if (subtype != GUID_NULL)
+    {
+        m_ppSubtypes = &m_pSubtype;
+        m_subtypeCount = 1;
+    }
+
+    *pHr = MFCreateEventQueue(&m_pEventQueue);
+}
+
+
+CFrameStreamSink::~CFrameStreamSink(void)
+{
+    Shutdown();
+}
+
+
+//
+// IUnknown methods
+//
+HRESULT CFrameStreamSink::QueryInterface(REFIID riid, void** ppv)
+{
+    HRESULT hr = S_OK;
+
+    if(ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if(riid == IID_IUnknown || riid == IID_IMFStreamSink)
+    {
+        *ppv = static_cast<IMFStreamSink*>(this);
+    }
+    else if(riid == IID_IMFMediaEventGenerator)
+    {
+        *ppv = static_cast<IMFMediaEventGenerator*>(this);
+    }
+    else if(riid == IID_IMFMediaTypeHandler)
+    {
+        *ppv = static_cast<IMFMediaTypeHandler*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        hr = E_NOINTERFACE;
+    }
+
+    if(SUCCEEDED(hr))
+        AddRef();
+
+    return hr;
+}
+
+ULONG CFrameStreamSink::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CFrameStreamSink::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+//
+// IMFMediaEventGenerator methods - all of them are delegated to the event queue.
+//
+HRESULT CFrameStreamSink::BeginGetEvent(IMFAsyncCallback* pCallback, IUnknown* punkState)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->BeginGetEvent(pCallback, punkState);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameStreamSink::EndGetEvent(IMFAsyncResult* pResult, IMFMediaEvent** ppEvent)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->EndGetEvent(pResult, ppEvent);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameStreamSink::GetEvent(DWORD dwFlags, IMFMediaEvent** ppEvent)
+{
+    CComPtr<IMFMediaEventQueue> pQueue;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        HRESULT hr = CheckShutdown();
+        if (FAILED(hr))
+        {
+            return hr;
+        }
+
+        pQueue = m_pEventQueue;
+    }
+
+    // GetEvent() can block indefinitely, so it must not be called while holding the lock
+    return pQueue->GetEvent(dwFlags, ppEvent);
+}
+
+HRESULT CFrameStreamSink::QueueEvent(MediaEventType met, REFGUID guidExtendedType,
+    HRESULT hrStatus, const PROPVARIANT* pvValue)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pEventQueue->QueueEventParamVar(met, guidExtendedType, hrStatus, pvValue);
+    }
+
+    return hr;
+}
+
+
+
+//
+// IMFStreamSink methods
+//
+HRESULT CFrameStreamSink::GetMediaSink(IMFMediaSink** ppMediaSink)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (ppMediaSink == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        *ppMediaSink = static_cast<IMFMediaSink*>(m_pSink);
+        (*ppMediaSink)->AddRef();
+    }
+
+    return hr;
+}
+
+HRESULT CFrameStreamSink::GetIdentifier(DWORD* pdwIdentifier)
+{
+    if (pdwIdentifier == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pdwIdentifier = 0;
+
+    return CheckShutdown();
+}
+
+HRESULT CFrameStreamSink::GetMediaTypeHandler(IMFMediaTypeHandler** ppHandler)
+{
+    if (ppHandler == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = QueryInterface(IID_IMFMediaTypeHandler, (void**)ppHandler);
+    }
+
+    return hr;
+}
+
+
+//
+// Receive a sample from the media session, hand it to the consumers, and immediately ask
+// for the next one.  The sink is rateless, so the session delivers samples as soon as the
+// source produces them and no time is spent waiting on the presentation clock.
+//
+HRESULT CFrameStreamSink::ProcessSample(IMFSample* pSample)
+{
+    HRESULT hr = S_OK;
+    FrameFormat format;
+    CFrameConsumerList* pConsumers = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pSample, E_POINTER);
+
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            hr = CheckShutdown();
+            BREAK_ON_FAIL(hr);
+
+            format = m_format;
+            pConsumers = m_pConsumers;
+        }
+
+        // deliver outside of the stream lock - consumers may take as long as they like
+        // without blocking the event queue
+        if (pConsumers != NULL)
+        {
+            pConsumers->Deliver(pSample, format);
+        }
+
+        hr = QueueEvent(MEStreamSinkRequestSample, GUID_NULL, S_OK, NULL);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The frame sink does not queue samples, so any marker can be acknowledged right away.
+//
+HRESULT CFrameStreamSink::PlaceMarker(MFSTREAMSINK_MARKER_TYPE eMarkerType,
+    const PROPVARIANT* pvarMarkerValue, const PROPVARIANT* pvarContextValue)
+{
+    return QueueEvent(MEStreamSinkMarker, GUID_NULL, S_OK, pvarContextValue);
+}
+
+HRESULT CFrameStreamSink::Flush(void)
+{
+    return CheckShutdown();
+}
+
+
+
+//
+// IMFMediaTypeHandler methods
+//
+HRESULT CFrameStreamSink::IsMediaTypeSupported(IMFMediaType* pMediaType,
+    IMFMediaType** ppMediaType)
+{
+    HRESULT hr = S_OK;
+    GUID majorType = GUID_NULL;
+    GUID subtype = GUID_NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pMediaType, E_POINTER);
+
+        if (ppMediaType != NULL)
+        {
+            *ppMediaType = NULL;
+        }
+
+        hr = CheckShutdown();
+        BREAK_ON_FAIL(hr);
+
+        hr = pMediaType->GetGUID(MF_MT_MAJOR_TYPE, &majorType);
+        BREAK_ON_FAIL(hr);
+
+        hr = pMediaType->GetGUID(MF_MT_SUBTYPE, &subtype);
+        BREAK_ON_FAIL(hr);
+
+        hr = MF_E_INVALIDMEDIATYPE;
+
+        if (majorType != MFMediaType_Video)
+        {
+            break;
+        }
+
+        for (DWORD i = 0; i < m_subtypeCount; i++)
+        {
+            if (subtype == *m_ppSubtypes[i])
+            {
+                hr = S_OK;
+                break;
+            }
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+HRESULT CFrameStreamSink::GetMediaTypeCount(DWORD* pdwTypeCount)
+{
+    if (pdwTypeCount == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pdwTypeCount = m_subtypeCount;
+
+    return CheckShutdown();
+}
+
+
+//
+// Return a partial media type - the resolver fills in the frame size and rate from the
+// upstream type.
+//
+HRESULT CFrameStreamSink::GetMediaTypeByIndex(DWORD dwIndex, IMFMediaType** ppType)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaType> pType;
+
+    do
+    {
+        BREAK_ON_NULL(ppType, E_POINTER);
+
+        hr = CheckShutdown();
+        BREAK_ON_FAIL(hr);
+
+        if (dwIndex >= m_subtypeCount)
+        {
+            hr = MF_E_NO_MORE_TYPES;
+            break;
+        }
+
+        hr = MFCreateMediaType(&pType);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetGUID(MF_MT_MAJOR_TYPE, MFMediaType_Video);
+        BREAK_ON_FAIL(hr);
+
+        hr = pType->SetGUID(MF_MT_SUBTYPE, *m_ppSubtypes[dwIndex]);
+        BREAK_ON_FAIL(hr);
+
+        *ppType = pType.Detach();
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Store the negotiated media type and cache the frame description handed to consumers.
+//
+HRESULT CFrameStreamSink::SetCurrentMediaType(IMFMediaType* pMediaType)
+{
+    HRESULT hr = S_OK;
+    FrameFormat format;
+    UINT32 stride = 0;
+    CFrameConsumerList* pConsumers = NULL;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        hr = IsMediaTypeSupported(pMediaType, NULL);
+        BREAK_ON_FAIL(hr);
+
+        hr = pMediaType->GetGUID(MF_MT_SUBTYPE, &format.subtype);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFGetAttributeSize(pMediaType, MF_MT_FRAME_SIZE, &format.width, &format.height);
+        BREAK_ON_FAIL(hr);
+
+        // the default stride attribute is optional - compute it from the format if the
+        // upstream component did not specify it
+        hr = pMediaType->GetUINT32(MF_MT_DEFAULT_STRIDE, &stride);
+        if (SUCCEEDED(hr))
+        {
+            format.stride = (LONG)stride;
+        }
+        else
+        {
+            hr = MFGetStrideForBitmapInfoHeader(format.subtype.Data1, format.width,
+                &format.stride);
+            BREAK_ON_FAIL(hr);
+        }
+
+        m_pCurrentType = pMediaType;
+        m_format = format;
+
+        // Shutdown() clears the list under the lock, so it is picked up here like in
+        // ProcessSample()
+        pConsumers = m_pConsumers;
+    }
+    while(false);
+
+    // outside the lock - the consumers may take their time allocating
+    if (SUCCEEDED(hr) && pConsumers != NULL)
+    {
+        pConsumers->NotifyFormat(format);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameStreamSink::GetCurrentMediaType(IMFMediaType** ppMediaType)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (ppMediaType == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        if (m_pCurrentType == NULL)
+        {
+            hr = MF_E_NOT_INITIALIZED;
+        }
+        else
+        {
+            *ppMediaType = m_pCurrentType;
+            (*ppMediaType)->AddRef();
+        }
+    }
+
+    return hr;
+}
+
+HRESULT CFrameStreamSink::GetMajorType(GUID* pguidMajorType)
+{
+    if (pguidMajorType == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pguidMajorType = MFMediaType_Video;
+
+    return CheckShutdown();
+}
+
+
+
+//
+// Clock state changes - the stream acknowledges the new state and, when running, requests
+// the first sample from the session.
+//
+HRESULT CFrameStreamSink::OnStarted(void)
+{
+    HRESULT hr = QueueEvent(MEStreamSinkStarted, GUID_NULL, S_OK, NULL);
+
+    if (SUCCEEDED(hr))
+    {
+        hr = QueueEvent(MEStreamSinkRequestSample, GUID_NULL, S_OK, NULL);
+    }
+
+    return hr;
+}
+
+HRESULT CFrameStreamSink::OnStopped(void)
+{
+    return QueueEvent(MEStreamSinkStopped, GUID_NULL, S_OK, NULL);
+}
+
+HRESULT CFrameStreamSink::OnPaused(void)
+{
+    return QueueEvent(MEStreamSinkPaused, GUID_NULL, S_OK, NULL);
+}
+
+
+//
+// Shut down the event queue and detach from the parent sink and the consumers.
+//
+HRESULT CFrameStreamSink::Shutdown(void)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (!m_isShutdown)
+    {
+        if (m_pEventQueue != NULL)
+        {
+            m_pEventQueue->Shutdown();
+        }
+
+        m_pEventQueue.Release();
+        m_pCurrentType.Release();
+        m_pSink = NULL;
+        m_pConsumers = NULL;
+        m_isShutdown = true;
+    }
+
+    return S_OK;
+}
+
+
+
+
+
+//
+// Create a frame sink with a single stream that delivers frames to the specified consumers.
+//
+HRESULT CFrameSink::CreateInstance(CFrameConsumerList* pConsumers, REFGUID subtype,
+    CFrameSink** ppSink)
+{
+    HRESULT hr = S_OK;
+    CFrameSink* pSink = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(ppSink, E_POINTER);
+
+        pSink = new (std::nothrow) CFrameSink();
+        BREAK_ON_NULL(pSink, E_OUTOFMEMORY);
+
+        pSink->m_pStream = new (std::nothrow) CFrameStreamSink(pSink, pConsumers, subtype,
+            &hr);
+        BREAK_ON_NULL(pSink->m_pStream, E_OUTOFMEMORY);
+        BREAK_ON_FAIL(hr);
+
+        *ppSink = pSink;
+        pSink = NULL;
+    }
+    while(false);
+
+    if (pSink != NULL)
+    {
+        pSink->Shutdown();
+        pSink->Release();
+    }
+
+    return hr;
+}
+
+
+CFrameSink::CFrameSink(void) :
+    m_cRef(1),
+    m_pStream(NULL),
+    m_isShutdown(false)
+{
+}
+
+
+CFrameSink::~CFrameSink(void)
+{
+    Shutdown();
+}
+
+
+//
+// IUnknown methods
+//
+HRESULT CFrameSink::QueryInterface(REFIID riid, void** ppv)
+{
+    HRESULT hr = S_OK;
+
+    if(ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if(riid == IID_IUnknown || riid == IID_IMFMediaSink)
+    {
+        *ppv = static_cast<IMFMediaSink*>(this);
+    }
+    else if(riid == IID_IMFClockStateSink)
+    {
+        *ppv = static_cast<IMFClockStateSink*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        hr = E_NOINTERFACE;
+    }
+
+    if(SUCCEEDED(hr))
+        AddRef();
+
+    return hr;
+}
+
+ULONG CFrameSink::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CFrameSink::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+//
+// IMFMediaSink methods
+//
+HRESULT CFrameSink::GetCharacteristics(DWORD* pdwCharacteristics)
+{
+    if (pdwCharacteristics == NULL)
+    {
+        return E_POINTER;
+    }
+
+    // the sink has exactly one stream, and it consumes samples as fast as they arrive
+    *pdwCharacteristics = MEDIASINK_FIXED_STREAMS | MEDIASINK_RATELESS;
+
+    return CheckShutdown();
+}
+
+HRESULT CFrameSink::AddStreamSink(DWORD dwStreamSinkIdentifier, IMFMediaType* pMediaType,
+    IMFStreamSink** ppStreamSink)
+{
+    return MF_E_STREAMSINKS_FIXED;
+}
+
+HRESULT CFrameSink::RemoveStreamSink(DWORD dwStreamSinkIdentifier)
+{
+    return MF_E_STREAMSINKS_FIXED;
+}
+
+HRESULT CFrameSink::GetStreamSinkCount(DWORD* pcStreamSinkCount)
+{
+    if (pcStreamSinkCount == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pcStreamSinkCount = 1;
+
+    return CheckShutdown();
+}
+
+HRESULT CFrameSink::GetStreamSinkByIndex(DWORD dwIndex, IMFStreamSink** ppStreamSink)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (ppStreamSink == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        if (dwIndex != 0)
+        {
+            hr = MF_E_INVALIDINDEX;
+        }
+        else
+        {
+            *ppStreamSink = m_pStream;
+            (*ppStreamSink)->AddRef();
+        }
+    }
+
+    return hr;
+}
+
+HRESULT CFrameSink::GetStreamSinkById(DWORD dwStreamSinkIdentifier,
+    IMFStreamSink** ppStreamSink)
+{
+    if (dwStreamSinkIdentifier != 0)
+    {
+        return MF_E_INVALIDSTREAMNUMBER;
+    }
+
+    return GetStreamSinkByIndex(0, ppStreamSink);
+}
+
+
+//
+// Register with the presentation clock of the session in order to receive clock state
+// notifications.
+//
+HRESULT CFrameSink::SetPresentationClock(IMFPresentationClock* pPresentationClock)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        hr = CheckShutdown();
+        BREAK_ON_FAIL(hr);
+
+        if (m_pClock != NULL)
+        {
+            hr = m_pClock->RemoveClockStateSink(this);
+            BREAK_ON_FAIL(hr);
+        }
+
+        if (pPresentationClock != NULL)
+        {
+            hr = pPresentationClock->AddClockStateSink(this);
+            BREAK_ON_FAIL(hr);
+        }
+
+        m_pClock = pPresentationClock;
+    }
+    while(false);
+
+    return hr;
+}
+
+HRESULT CFrameSink::GetPresentationClock(IMFPresentationClock** ppPresentationClock)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (ppPresentationClock == NULL)
+    {
+        return E_POINTER;
+    }
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        if (m_pClock == NULL)
+        {
+            hr = MF_E_NO_CLOCK;
+        }
+        else
+        {
+            *ppPresentationClock = m_pClock;
+            (*ppPresentationClock)->AddRef();
+        }
+    }
+
+    return hr;
+}
+
+
+//
+// Shut down the stream and release the clock.  Since the sink is handed to the topology
+// directly and not through an activation object, the owner of the topology is responsible
+// for calling this.
+//
+HRESULT CFrameSink::Shutdown(void)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (!m_isShutdown)
+    {
+        if (m_pClock != NULL)
+        {
+            m_pClock->RemoveClockStateSink(this);
+            m_pClock.Release();
+        }
+
+        if (m_pStream != NULL)
+        {
+            m_pStream->Shutdown();
+            m_pStream->Release();
+            m_pStream = NULL;
+        }
+
+        m_isShutdown = true;
+    }
+
+    return S_OK;
+}
+
+
+
+//
+// IMFClockStateSink methods
+//
+HRESULT CFrameSink::OnClockStart(MFTIME hnsSystemTime, LONGLONG llClockStartOffset)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pStream->OnStarted();
+    }
+
+    return hr;
+}
+
+HRESULT CFrameSink::OnClockStop(MFTIME hnsSystemTime)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pStream->OnStopped();
+    }
+
+    return hr;
+}
+
+HRESULT CFrameSink::OnClockPause(MFTIME hnsSystemTime)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pStream->OnPaused();
+    }
+
+    return hr;
+}
+
+HRESULT CFrameSink::OnClockRestart(MFTIME hnsSystemTime)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    HRESULT hr = CheckShutdown();
+    if (SUCCEEDED(hr))
+    {
+        hr = m_pStream->OnStarted();
+    }
+
+    return hr;
+}
+
+HRESULT CFrameSink::OnClockSetRate(MFTIME hnsSystemTime, float flRate)
+{
+    return CheckShutdown();
+}
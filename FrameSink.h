@@ -0,0 +1,212 @@
+#pragma once
+
+#include "Common.h"
+
+// Media Foundation headers
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mferror.h>
+
+#include <vector>
+
+#include "FrameView.h"
+#include "Metrics.h"
+#include "ThreadAffinity.h"
+
+
+
+//
+//  Interface implemented by anybody that wants to receive frames from the frame sink.
+//
+class IFrameConsumer
+{
+    public:
+        virtual ~IFrameConsumer(void) {}
+
+        // Called on the media session streaming thread for every frame that reaches the
+        // frame sink.  The frame is locked and valid for the duration of the call - to use it
+        // asynchronously, AddRef() it and Release() it when done.  No copy is made either way.
+        virtual void OnFrame(CFrameView* pFrame) = 0;
+
+        // Called when the topology is resolved, before the first frame, with the format of
+        // the frames the consumer will get - its region if it has one.  Buffers sized for
+        // the format are best allocated here, where they do not delay the first frame.
+        virtual void OnFormat(const FrameFormat& format) {}
+};
+
+
+//
+//  Thread-safe list of frame consumers.  The list is owned by the player, so consumers
+//  stay registered when the topology (and with it the frame sink) is rebuilt.  It also
+//  keeps the frame rate and delivery metrics of the player.
+//
+class CFrameConsumerList
+{
+    public:
+        // labels of the metrics of the list, e.g. those of its player
+        CFrameConsumerList(PCSTR labels = NULL);
+        ~CFrameConsumerList(void);
+
+        // pRegion limits the consumer to a rectangle of the frame, NULL for the whole frame
+        HRESULT Add(IFrameConsumer* pConsumer, const RECT* pRegion = NULL);
+        HRESULT Remove(IFrameConsumer* pConsumer);
+
+        // change the region of a registered consumer, NULL for the whole frame
+        HRESULT SetRegion(IFrameConsumer* pConsumer, const RECT* pRegion);
+
+        // cores of the capture thread that delivers the frames - an empty mask leaves it alone
+        void SetDeliveryAffinity(const GROUP_AFFINITY& cores);
+
+        // wrap the sample in a frame view and deliver it to every registered consumer
+        HRESULT Deliver(IMFSample* pSample, const FrameFormat& format);
+
+        // tell every registered consumer the format of the coming frames
+        void NotifyFormat(const FrameFormat& format);
+
+    private:
+        struct ConsumerEntry
+        {
+            IFrameConsumer* pConsumer;
+            RECT region;
+            bool hasRegion;
+        };
+
+        ConsumerEntry* Find(IFrameConsumer* pConsumer);
+
+        void UpdateMetrics(LONGLONG arrival, LONGLONG delivered);
+
+        CComAutoCriticalSection m_critSec;
+        std::vector<ConsumerEntry> m_consumers;
+        GROUP_AFFINITY m_deliveryCores;
+
+        // frame metrics, updated under m_critSec by the delivering thread
+        CMetricCounter* m_pFrameCount;
+        CMetricHistogram* m_pFrameInterval;         // time between two frames
+        CMetricHistogram* m_pDeliveryTime;          // time the consumers take per frame
+        CMetricGauge* m_pFrameRate;                 // frames per second, in thousandths
+        LONGLONG m_lastArrival;
+        LONGLONG m_rateStart;                       // start of the frame rate window
+        UINT32 m_rateFrames;                        // frames in the window
+        UINT64 m_nextSequence;                      // sequence number of the next frame
+};
+
+
+class CFrameSink;
+
+
+//
+//  The single stream of the frame sink.  Pulls samples from the media session and hands them
+//  to the frame consumers instead of presenting them.
+//
+class CFrameStreamSink : public IMFStreamSink, public IMFMediaTypeHandler
+{
+    public:
+        CFrameStreamSink(CFrameSink* pSink, CFrameConsumerList* pConsumers, REFGUID subtype,
+            HRESULT* pHr);
+        ~CFrameStreamSink(void);
+
+        // IUnknown interface implementation
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void);
+        STDMETHODIMP_(ULONG) Release(void);
+
+        // IMFMediaEventGenerator interface implementation
+        STDMETHODIMP BeginGetEvent(IMFAsyncCallback* pCallback, IUnknown* punkState);
+        STDMETHODIMP EndGetEvent(IMFAsyncResult* pResult, IMFMediaEvent** ppEvent);
+        STDMETHODIMP GetEvent(DWORD dwFlags, IMFMediaEvent** ppEvent);
+        STDMETHODIMP QueueEvent(MediaEventType met, REFGUID guidExtendedType,
+            HRESULT hrStatus, const PROPVARIANT* pvValue);
+
+        // IMFStreamSink interface implementation
+        STDMETHODIMP GetMediaSink(IMFMediaSink** ppMediaSink);
+        STDMETHODIMP GetIdentifier(DWORD* pdwIdentifier);
+        STDMETHODIMP GetMediaTypeHandler(IMFMediaTypeHandler** ppHandler);
+        STDMETHODIMP ProcessSample(IMFSample* pSample);
+        STDMETHODIMP PlaceMarker(MFSTREAMSINK_MARKER_TYPE eMarkerType,
+            const PROPVARIANT* pvarMarkerValue, const PROPVARIANT* pvarContextValue);
+        STDMETHODIMP Flush(void);
+
+        // IMFMediaTypeHandler interface implementation
+        STDMETHODIMP IsMediaTypeSupported(IMFMediaType* pMediaType, IMFMediaType** ppMediaType);
+        STDMETHODIMP GetMediaTypeCount(DWORD* pdwTypeCount);
+        STDMETHODIMP GetMediaTypeByIndex(DWORD dwIndex, IMFMediaType** ppType);
+        STDMETHODIMP SetCurrentMediaType(IMFMediaType* pMediaType);
+        STDMETHODIMP GetCurrentMediaType(IMFMediaType** ppMediaType);
+        STDMETHODIMP GetMajorType(GUID* pguidMajorType);
+
+        // clock state notifications forwarded by the frame sink
+        HRESULT OnStarted(void);
+        HRESULT OnStopped(void);
+        HRESULT OnPaused(void);
+
+        HRESULT Shutdown(void);
+
+    private:
+        volatile long m_cRef;
+        CComAutoCriticalSection m_critSec;
+
+        CFrameSink* m_pSink;                        // parent sink - not reference counted
+        CFrameConsumerList* m_pConsumers;           // consumers owned by the player
+        CComPtr<IMFMediaEventQueue> m_pEventQueue;  // stream sink event queue
+        CComPtr<IMFMediaType> m_pCurrentType;       // negotiated media type
+        FrameFormat m_format;                       // cached description of m_pCurrentType
+        const GUID* const* m_ppSubtypes;            // accepted subtypes, in order of preference
+        DWORD m_subtypeCount;
+        GUID m_subtype;                             // the only accepted subtype, if one was set
+        const GUID* m_pSubtype;                     // &m_subtype, as a one-entry list
+        bool m_isShutdown;
+
+        HRESULT CheckShutdown(void) const { return m_isShutdown ? MF_E_SHUTDOWN : S_OK; }
+};
+
+
+//
+//  A rateless media sink with a single video stream that delivers uncompressed frames to
+//  registered consumers.  Used instead of the EVR when the player runs without a window.
+//
+class CFrameSink : public IMFMediaSink, public IMFClockStateSink
+{
+    public:
+        // subtype restricts the stream to one format - GUID_NULL accepts every format the
+        // sink supports
+        static HRESULT CreateInstance(CFrameConsumerList* pConsumers, REFGUID subtype,
+            CFrameSink** ppSink);
+
+        // IUnknown interface implementation
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void);
+        STDMETHODIMP_(ULONG) Release(void);
+
+        // IMFMediaSink interface implementation
+        STDMETHODIMP GetCharacteristics(DWORD* pdwCharacteristics);
+        STDMETHODIMP AddStreamSink(DWORD dwStreamSinkIdentifier, IMFMediaType* pMediaType,
+            IMFStreamSink** ppStreamSink);
+        STDMETHODIMP RemoveStreamSink(DWORD dwStreamSinkIdentifier);
+        STDMETHODIMP GetStreamSinkCount(DWORD* pcStreamSinkCount);
+        STDMETHODIMP GetStreamSinkByIndex(DWORD dwIndex, IMFStreamSink** ppStreamSink);
+        STDMETHODIMP GetStreamSinkById(DWORD dwStreamSinkIdentifier,
+            IMFStreamSink** ppStreamSink);
+        STDMETHODIMP SetPresentationClock(IMFPresentationClock* pPresentationClock);
+        STDMETHODIMP GetPresentationClock(IMFPresentationClock** ppPresentationClock);
+        STDMETHODIMP Shutdown(void);
+
+        // IMFClockStateSink interface implementation
+        STDMETHODIMP OnClockStart(MFTIME hnsSystemTime, LONGLONG llClockStartOffset);
+        STDMETHODIMP OnClockStop(MFTIME hnsSystemTime);
+        STDMETHODIMP OnClockPause(MFTIME hnsSystemTime);
+        STDMETHODIMP OnClockRestart(MFTIME hnsSystemTime);
+        STDMETHODIMP OnClockSetRate(MFTIME hnsSystemTime, float flRate);
+
+    private:
+        CFrameSink(void);
+        ~CFrameSink(void);
+
+        volatile long m_cRef;
+        CComAutoCriticalSection m_critSec;
+
+        CFrameStreamSink* m_pStream;                // the only stream of this sink
+        CComPtr<IMFPresentationClock> m_pClock;     // presentation clock of the session
+        bool m_isShutdown;
+
+        HRESULT CheckShutdown(void) const { return m_isShutdown ? MF_E_SHUTDOWN : S_OK; }
+};
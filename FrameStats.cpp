@@ -0,0 +1,320 @@
+#include "FrameStats.h"
+#include "PixelKernels.h"
+
+#include <emmintrin.h>
+
+
+
+// rows of the frame analyzed by one tile
+#define FRAME_STATS_BAND_HEIGHT         128
+
+// default sampling grid - one pixel out of 4x4
+#define FRAME_STATS_DEFAULT_DECIMATION  4
+
+// luma values that count as crushed blacks and blown highlights (video range)
+#define FRAME_STATS_DARK_LEVEL          16
+#define FRAME_STATS_BRIGHT_LEVEL        235
+
+
+
+CFrameStatsStage::CFrameStatsStage(void) :
+    m_decimation(FRAME_STATS_DEFAULT_DECIMATION),
+    m_preparedFrame((ULONGLONG)-1),
+    m_lumaWidth(0),
+    m_lumaHeight(0),
+    m_frameCount(0),
+    m_sequence(0)
+{
+    ZeroMemory(&m_snapshot, sizeof(m_snapshot));
+}
+
+
+CFrameStatsStage::~CFrameStatsStage(void)
+{
+}
+
+
+//
+// One tile per band of rows.
+//
+UINT32 CFrameStatsStage::GetTileCount(CFrameView* pFrame)
+{
+    return (pFrame->Format().height + FRAME_STATS_BAND_HEIGHT - 1) / FRAME_STATS_BAND_HEIGHT;
+}
+
+
+//
+// Size and clear the per-frame state.  The tiles of the previous frame are all done by the
+// time any tile of this frame runs, so only the tiles of this frame race for it.
+//
+void CFrameStatsStage::PrepareFrame(const FrameFormat& format)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_prepareLock);
+
+    if (m_preparedFrame == m_frameCount)
+    {
+        return;
+    }
+
+    m_lumaWidth = format.width / m_decimation;
+    m_lumaHeight = format.height / m_decimation;
+
+    m_bands.resize((format.height + FRAME_STATS_BAND_HEIGHT - 1) / FRAME_STATS_BAND_HEIGHT);
+    m_luma.resize(m_lumaWidth * m_lumaHeight);
+
+    for (size_t i = 0; i < m_bands.size(); i++)
+    {
+        ZeroMemory(&m_bands[i], sizeof(BandStats));
+    }
+
+    m_preparedFrame = m_frameCount;
+}
+
+
+//
+// Sample the rows of one band.  A band starts at the first row of the decimated grid at or
+// below its first row, so every decimated row belongs to exactly one band.
+//
+void CFrameStatsStage::ProcessTile(CFrameView* pFrame, UINT32 tile)
+{
+    const FrameFormat& format = pFrame->Format();
+    const GUID& subtype = format.subtype;
+    const FramePlane& plane = pFrame->Plane(0);
+
+    PrepareFrame(format);
+
+    BandStats& band = m_bands[tile];
+    UINT32 firstRow = tile * FRAME_STATS_BAND_HEIGHT;
+    UINT32 lastRow = min(firstRow + FRAME_STATS_BAND_HEIGHT, m_lumaHeight * m_decimation);
+    Yuy2Reader yuy2(pFrame);
+    Nv12Reader nv12(pFrame);
+    Rgb32Reader rgb32(pFrame);
+
+    // start on the first row of the band that is on the decimated grid
+    UINT32 y = (firstRow + m_decimation - 1) / m_decimation * m_decimation;
+
+    for (; y < lastRow; y += m_decimation)
+    {
+        const BYTE* pRow = plane.pData + (LONG)y * plane.stride;
+        BYTE* pLuma = &m_luma[(y / m_decimation) * m_lumaWidth];
+        Bgra pixel;
+        BYTE luma;
+
+        yuy2.SetRow(y);
+        nv12.SetRow(y);
+        rgb32.SetRow(y);
+
+        for (UINT32 x = 0; x < m_lumaWidth; x++)
+        {
+            UINT32 srcX = x * m_decimation;
+
+            if (subtype == MFVideoFormat_YUY2)
+            {
+                pixel = yuy2.Read(srcX);
+                luma = pRow[srcX * 2];
+            }
+            else if (subtype == MFVideoFormat_NV12)
+            {
+                pixel = nv12.Read(srcX);
+                luma = pRow[srcX];
+            }
+            else if (subtype == FrameSubtype_Gray8)
+            {
+                luma = pRow[srcX];
+                pixel.b = pixel.g = pixel.r = luma;
+                pixel.a = 0xFF;
+            }
+            else
+            {
+                // BT.601 luma in video range, to match the YUV formats
+                pixel = rgb32.Read(srcX);
+                luma = (BYTE)((66 * pixel.r + 129 * pixel.g + 25 * pixel.b + 128 + 4096) >> 8);
+            }
+
+            pLuma[x] = luma;
+
+            band.luma[luma]++;
+            band.red[pixel.r]++;
+            band.green[pixel.g]++;
+            band.blue[pixel.b]++;
+            band.lumaSum += luma;
+            band.lumaSquareSum += luma * luma;
+        }
+
+        band.samples += m_lumaWidth;
+    }
+}
+
+
+//
+// Merge the bands, compute the focus score and publish.
+//
+void CFrameStatsStage::EndFrame(CFrameView* pFrame)
+{
+    FrameStats stats;
+    ULONGLONG lumaSum = 0;
+    ULONGLONG lumaSquareSum = 0;
+    UINT32 dark = 0;
+    UINT32 bright = 0;
+
+    ZeroMemory(&stats, sizeof(stats));
+
+    // a frame without tiles never prepared the state
+    PrepareFrame(pFrame->Format());
+
+    stats.frameNumber = m_frameCount++;
+    stats.timestamp = pFrame->Timestamp();
+    stats.width = pFrame->Format().width;
+    stats.height = pFrame->Format().height;
+
+    for (size_t i = 0; i < m_bands.size(); i++)
+    {
+        const BandStats& band = m_bands[i];
+
+        for (int v = 0; v < 256; v++)
+        {
+            stats.lumaHistogram[v] += band.luma[v];
+            stats.redHistogram[v] += band.red[v];
+            stats.greenHistogram[v] += band.green[v];
+            stats.blueHistogram[v] += band.blue[v];
+        }
+
+        lumaSum += band.lumaSum;
+        lumaSquareSum += band.lumaSquareSum;
+        stats.sampleCount += band.samples;
+    }
+
+    if (stats.sampleCount > 0)
+    {
+        for (int v = 0; v <= FRAME_STATS_DARK_LEVEL; v++)
+            dark += stats.lumaHistogram[v];
+        for (int v = FRAME_STATS_BRIGHT_LEVEL; v < 256; v++)
+            bright += stats.lumaHistogram[v];
+
+        stats.lumaMean = (double)lumaSum / stats.sampleCount;
+        stats.lumaVariance = (double)lumaSquareSum / stats.sampleCount -
+            stats.lumaMean * stats.lumaMean;
+        stats.clippedDark = (double)dark / stats.sampleCount;
+        stats.clippedBright = (double)bright / stats.sampleCount;
+        stats.focus = ComputeFocus();
+    }
+
+    pFrame->SetMetadata(FRAME_METADATA_STATS, &stats, sizeof(stats));
+
+    Publish(stats);
+}
+
+
+//
+// Variance of the 4-neighbour Laplacian over the decimated luma.  SSE2 handles eight
+// pixels per step in 16-bit lanes - the Laplacian of 8-bit data fits in [-1020, 1020], so
+// its square fits the 32-bit lanes of _mm_madd_epi16, which are flushed to 64 bits on every
+// row.
+//
+double CFrameStatsStage::ComputeFocus(void) const
+{
+    const UINT32 width = m_lumaWidth;
+    const UINT32 height = m_lumaHeight;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i ones = _mm_set1_epi16(1);
+    LONGLONG sum = 0;
+    LONGLONG squareSum = 0;
+    ULONGLONG count = 0;
+
+    if (width < 3 || height < 3)
+    {
+        return 0.0;
+    }
+
+    for (UINT32 y = 1; y < height - 1; y++)
+    {
+        const BYTE* pUp = &m_luma[(y - 1) * width];
+        const BYTE* pRow = &m_luma[y * width];
+        const BYTE* pDown = &m_luma[(y + 1) * width];
+        __m128i rowSum = _mm_setzero_si128();
+        __m128i rowSquareSum = _mm_setzero_si128();
+        UINT32 x = 1;
+
+        for (; x + 8 < width; x += 8)
+        {
+            __m128i center = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + x)), zero);
+            __m128i left = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + x - 1)), zero);
+            __m128i right = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pRow + x + 1)), zero);
+            __m128i up = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pUp + x)), zero);
+            __m128i down = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pDown + x)), zero);
+
+            __m128i laplacian = _mm_sub_epi16(_mm_slli_epi16(center, 2),
+                _mm_add_epi16(_mm_add_epi16(left, right), _mm_add_epi16(up, down)));
+
+            rowSum = _mm_add_epi32(rowSum, _mm_madd_epi16(laplacian, ones));
+            rowSquareSum = _mm_add_epi32(rowSquareSum, _mm_madd_epi16(laplacian, laplacian));
+        }
+
+        __declspec(align(16)) INT32 lanes[4];
+
+        _mm_store_si128((__m128i*)lanes, rowSum);
+        sum += (LONGLONG)lanes[0] + lanes[1] + lanes[2] + lanes[3];
+
+        // the squares are positive, but can exceed INT32 once the lanes are added
+        _mm_store_si128((__m128i*)lanes, rowSquareSum);
+        squareSum += (LONGLONG)(UINT32)lanes[0] + (UINT32)lanes[1] + (UINT32)lanes[2] +
+            (UINT32)lanes[3];
+
+        for (; x < width - 1; x++)
+        {
+            int laplacian = 4 * pRow[x] - pRow[x - 1] - pRow[x + 1] - pUp[x] - pDown[x];
+
+            sum += laplacian;
+            squareSum += laplacian * laplacian;
+        }
+
+        count += width - 2;
+    }
+
+    double mean = (double)sum / count;
+    return (double)squareSum / count - mean * mean;
+}
+
+
+void CFrameStatsStage::Publish(const FrameStats& stats)
+{
+    InterlockedIncrement(&m_sequence);
+    CopyMemory(&m_snapshot, &stats, sizeof(stats));
+    InterlockedIncrement(&m_sequence);
+}
+
+
+//
+// Copy the snapshot between two reads of the sequence number.  An odd number, or a number
+// that changed during the copy, means the stage was publishing - try again.
+//
+HRESULT CFrameStatsStage::GetSnapshot(FrameStats* pStats) const
+{
+    long before;
+    long after;
+
+    if (pStats == NULL)
+    {
+        return E_POINTER;
+    }
+
+    do
+    {
+        before = m_sequence;
+        MemoryBarrier();
+
+        if (before & 1)
+        {
+            YieldProcessor();
+            continue;
+        }
+
+        CopyMemory(pStats, (const void*)&m_snapshot, sizeof(*pStats));
+
+        MemoryBarrier();
+        after = m_sequence;
+    }
+    while ((before & 1) || before != after);
+
+    return (before == 0) ? MF_E_NOT_INITIALIZED : S_OK;
+}
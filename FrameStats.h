@@ -0,0 +1,100 @@
+#pragma once
+
+#include "Common.h"
+#include "FramePipeline.h"
+
+
+
+// key of the FrameStats of a frame among its metadata, for the stages after the statistics
+// {2F4A8C61-7B3E-4D95-A0C2-1E6B9D4F8A53}
+static const GUID FRAME_METADATA_STATS =
+    { 0x2f4a8c61, 0x7b3e, 0x4d95, { 0xa0, 0xc2, 0x1e, 0x6b, 0x9d, 0x4f, 0x8a, 0x53 } };
+
+
+//
+//  Statistics of one frame, computed on a decimated grid of its pixels.
+//
+struct FrameStats
+{
+    ULONGLONG   frameNumber;            // frames analyzed before this one
+    LONGLONG    timestamp;              // presentation time of the frame, 100-ns units
+    UINT32      width;                  // frame size
+    UINT32      height;
+    UINT32      sampleCount;            // pixels that went into the statistics
+
+    UINT32      lumaHistogram[256];
+    UINT32      redHistogram[256];
+    UINT32      greenHistogram[256];
+    UINT32      blueHistogram[256];
+
+    double      lumaMean;
+    double      lumaVariance;
+    double      clippedDark;            // share of samples with luma at or below 16
+    double      clippedBright;          // share of samples with luma at or above 235
+
+    double      focus;                  // variance of the Laplacian of the luma - higher is sharper
+};
+
+
+//
+//  Pipeline stage that computes FrameStats for every frame.  The frame is split into bands
+//  of rows that are analyzed in parallel; every band samples one pixel out of
+//  decimation x decimation, keeps a histogram of its own, and stores its luma samples into
+//  a small decimated frame.  Once all bands are done the histograms are merged, the focus
+//  score is computed on the decimated frame, and the result is published - and attached to
+//  the frame as FRAME_METADATA_STATS, so later stages see the statistics of their own frame.
+//  A plane view of the luma works too, as a gray frame without color.
+//
+//  Publishing uses a sequence lock: the stage is the only writer, and readers copy the
+//  snapshot and retry if the stage published a new frame meanwhile, so neither side ever
+//  blocks the other.
+//
+class CFrameStatsStage : public IFrameStage
+{
+    public:
+        CFrameStatsStage(void);
+        virtual ~CFrameStatsStage(void);
+
+        // sample one pixel out of decimation x decimation - call before frames flow
+        void SetDecimation(UINT32 decimation) { m_decimation = (decimation > 0) ? decimation : 1; }
+
+        // copy the statistics of the latest frame, MF_E_NOT_INITIALIZED before the first one
+        HRESULT GetSnapshot(FrameStats* pStats) const;
+
+        // IFrameStage implementation
+        virtual UINT32 GetTileCount(CFrameView* pFrame);
+        virtual void ProcessTile(CFrameView* pFrame, UINT32 tile);
+        virtual void EndFrame(CFrameView* pFrame);
+
+    private:
+        // partial statistics of one band of rows
+        struct BandStats
+        {
+            UINT32 luma[256];
+            UINT32 red[256];
+            UINT32 green[256];
+            UINT32 blue[256];
+            ULONGLONG lumaSum;
+            ULONGLONG lumaSquareSum;
+            UINT32 samples;
+        };
+
+        void PrepareFrame(const FrameFormat& format);
+        double ComputeFocus(void) const;
+        void Publish(const FrameStats& stats);
+
+        UINT32 m_decimation;
+
+        // per-frame work state - only one frame is in this stage at a time
+        CComAutoCriticalSection m_prepareLock;  // the first tile of a frame prepares the state
+        ULONGLONG m_preparedFrame;              // m_frameCount of the frame it was prepared for
+        std::vector<BandStats> m_bands;
+        std::vector<BYTE> m_luma;               // decimated luma of the frame
+        UINT32 m_lumaWidth;
+        UINT32 m_lumaHeight;
+        ULONGLONG m_frameCount;
+
+        // published snapshot
+        volatile long m_sequence;               // odd while the snapshot is being written
+        FrameStats m_snapshot;
+};
@@ -0,0 +1,478 @@
+#include "FrameSync.h"
+#include "FrameView.h"
+#include "Tracer.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+
+
+// an offset estimate rises by this share of the difference per frame - 1/128
+#define FRAME_SYNC_OFFSET_RISE_SHIFT    7
+
+// a clock offset that moves by more than this at once restarts the estimate - 1 s
+#define FRAME_SYNC_RESYNC_THRESHOLD     (1000 * 10000)
+
+
+
+CFrameSynchronizer::CFrameSynchronizer(void) :
+    m_inputCount(0),
+    m_tolerance(FRAME_SYNC_DEFAULT_TOLERANCE),
+    m_origin(0),
+    m_ticksTo100ns(0.0),
+    m_matching(0),
+    m_pendingWork(0),
+    m_lastSetTime(0),
+    m_hasSet(false),
+    m_sets(0),
+    m_skewSum(0),
+    m_maxSkew(0),
+    m_pSkewMetric(NULL)
+{
+    for (UINT32 i = 0; i < FRAME_SYNC_MAX_INPUTS; i++)
+    {
+        InputState& input = m_inputs[i];
+
+        ZeroMemory(input.queue, sizeof(input.queue));
+        input.head = 0;
+        input.tail = 0;
+        input.hasOffset = false;
+        input.lastTimestamp = 0;
+        input.clockOffset = 0;
+        input.frames = 0;
+        input.matched = 0;
+        input.dropped = 0;
+        input.late = 0;
+        input.consumer.Attach(this, i);
+    }
+}
+
+
+CFrameSynchronizer::~CFrameSynchronizer(void)
+{
+    Flush();
+    RemoveMetrics();
+}
+
+
+HRESULT CFrameSynchronizer::Initialize(UINT32 inputCount, LONGLONG tolerance)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        if (m_inputCount != 0)
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        if (inputCount == 0 || inputCount > FRAME_SYNC_MAX_INPUTS || tolerance < 0)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        m_inputCount = inputCount;
+        m_tolerance = tolerance;
+
+        // the common clock counts from here, so its times stay small
+        m_origin = GetMetricsTime();
+        m_ticksTo100ns = 10000000.0 / (double)GetMetricsTicksPerSecond();
+
+        ExportMetrics();
+    }
+    while(false);
+
+    return hr;
+}
+
+
+IFrameConsumer* CFrameSynchronizer::GetInput(UINT32 index)
+{
+    return (index < m_inputCount) ? &m_inputs[index].consumer : NULL;
+}
+
+
+HRESULT CFrameSynchronizer::AddConsumer(IFrameSetConsumer* pConsumer)
+{
+    if (pConsumer == NULL)
+    {
+        return E_POINTER;
+    }
+
+    m_consumers.push_back(pConsumer);
+
+    return S_OK;
+}
+
+
+HRESULT CFrameSynchronizer::RemoveConsumer(IFrameSetConsumer* pConsumer)
+{
+    m_consumers.erase(std::remove(m_consumers.begin(), m_consumers.end(), pConsumer),
+        m_consumers.end());
+
+    return S_OK;
+}
+
+
+void CFrameSynchronizer::Push(UINT32 input, CFrameView* pFrame, LONGLONG timestamp,
+    LONGLONG arrival)
+{
+    if (input >= m_inputCount || pFrame == NULL)
+    {
+        return;
+    }
+
+    InputState& state = m_inputs[input];
+    LONG tail = state.tail;
+    LONGLONG captureTime = ToCaptureTime(state, timestamp, arrival);
+
+    InterlockedIncrement64(&state.frames);
+
+    // the matcher keeps the queues short, so a full queue means it is stuck in a consumer
+    if ((ULONG)tail - (ULONG)state.head >= FRAME_SYNC_QUEUE_SIZE)
+    {
+        InterlockedIncrement64(&state.dropped);
+        CTracer::Instant("sync", "queue full", "input", input);
+    }
+    else
+    {
+        QueuedFrame& queued = state.queue[tail & (FRAME_SYNC_QUEUE_SIZE - 1)];
+
+        pFrame->AddRef();
+        queued.pFrame = pFrame;
+        queued.captureTime = captureTime;
+
+        // publishes the frame to the matcher
+        InterlockedExchange(&state.tail, tail + 1);
+    }
+
+    Match();
+}
+
+
+//
+// Called by the producer of the input only.  The arrival time is late by the delivery
+// latency and never early, so the smallest difference of the two clocks is the best estimate
+// of their offset.
+//
+LONGLONG CFrameSynchronizer::ToCaptureTime(InputState& input, LONGLONG timestamp,
+    LONGLONG arrival)
+{
+    LONGLONG difference = (LONGLONG)((double)(arrival - m_origin) * m_ticksTo100ns) - timestamp;
+    LONGLONG offset = input.clockOffset;
+
+    if (!input.hasOffset || timestamp <= input.lastTimestamp ||
+        _abs64(difference - offset) > FRAME_SYNC_RESYNC_THRESHOLD)
+    {
+        // the first frame, a restarted source, or one without time stamps, which then goes
+        // by its arrival times
+        offset = difference;
+        input.hasOffset = true;
+    }
+    else if (difference < offset)
+    {
+        offset = difference;
+    }
+    else
+    {
+        offset += (difference - offset) >> FRAME_SYNC_OFFSET_RISE_SHIFT;
+    }
+
+    input.lastTimestamp = timestamp;
+    InterlockedExchange64(&input.clockOffset, offset);
+
+    return timestamp + offset;
+}
+
+
+//
+// Become the matcher, or leave the work to the thread that is.  A thread that pushes while
+// the matcher finishes fails to take over, but the matcher sees its pending work once it has
+// let go, and takes over again.
+//
+void CFrameSynchronizer::Match(void)
+{
+    InterlockedIncrement(&m_pendingWork);
+
+    while (InterlockedCompareExchange(&m_matching, 1, 0) == 0)
+    {
+        while (InterlockedExchange(&m_pendingWork, 0) != 0)
+        {
+            while (MatchOnce())
+            {
+            }
+        }
+
+        InterlockedExchange(&m_matching, 0);
+
+        if (m_pendingWork == 0)
+        {
+            break;
+        }
+    }
+}
+
+
+//
+// Emit a set, or drop one head frame - false if the queues have to wait for more frames.
+//
+bool CFrameSynchronizer::MatchOnce(void)
+{
+    UINT32 ready = 0;
+    UINT32 earliest = 0;
+    int fullest = -1;
+    LONGLONG minTime = 0;
+    LONGLONG maxTime = 0;
+    LONGLONG sum = 0;
+    FrameSet set;
+
+    for (UINT32 i = 0; i < m_inputCount; i++)
+    {
+        InputState& input = m_inputs[i];
+        ULONG queued = (ULONG)input.tail - (ULONG)input.head;
+        LONGLONG time = 0;
+
+        if (queued == 0)
+        {
+            continue;
+        }
+
+        time = input.queue[input.head & (FRAME_SYNC_QUEUE_SIZE - 1)].captureTime;
+
+        if (ready == 0 || time < minTime)
+        {
+            minTime = time;
+            earliest = i;
+        }
+
+        if (ready == 0 || time > maxTime)
+        {
+            maxTime = time;
+        }
+
+        if (queued >= FRAME_SYNC_QUEUE_SIZE - 1)
+        {
+            fullest = (int)i;
+        }
+
+        ready++;
+    }
+
+    if (ready == 0)
+    {
+        return false;
+    }
+
+    // the input with the latest head has nothing as early as the earliest head any more
+    if (maxTime - minTime > m_tolerance)
+    {
+        DropHead(m_inputs[earliest], m_hasSet && minTime <= m_lastSetTime);
+        return true;
+    }
+
+    if (ready < m_inputCount)
+    {
+        // an input that stopped must not hold the samples of the others
+        if (fullest >= 0)
+        {
+            DropHead(m_inputs[fullest], false);
+            return true;
+        }
+
+        return false;
+    }
+
+    set.count = m_inputCount;
+    set.skew = maxTime - minTime;
+    set.sequence = (UINT64)m_sets;
+
+    for (UINT32 i = 0; i < m_inputCount; i++)
+    {
+        InputState& input = m_inputs[i];
+        QueuedFrame& queued = input.queue[input.head & (FRAME_SYNC_QUEUE_SIZE - 1)];
+
+        set.frames[i] = queued.pFrame;
+        set.captureTimes[i] = queued.captureTime;
+        sum += queued.captureTime;
+
+        // the slot is free for the producer once the head moves on
+        queued.pFrame = NULL;
+        InterlockedExchange(&input.head, input.head + 1);
+        InterlockedIncrement64(&input.matched);
+    }
+
+    set.time = sum / (LONGLONG)m_inputCount;
+
+    m_lastSetTime = maxTime;
+    m_hasSet = true;
+
+    InterlockedIncrement64(&m_sets);
+    InterlockedExchangeAdd64(&m_skewSum, set.skew);
+    if (set.skew > m_maxSkew)
+    {
+        InterlockedExchange64(&m_maxSkew, set.skew);
+    }
+
+    if (m_pSkewMetric != NULL)
+    {
+        m_pSkewMetric->Observe(set.skew);
+    }
+
+    for (size_t i = 0; i < m_consumers.size(); i++)
+    {
+        m_consumers[i]->OnFrameSet(set);
+    }
+
+    for (UINT32 i = 0; i < m_inputCount; i++)
+    {
+        set.frames[i]->Release();
+    }
+
+    return true;
+}
+
+
+void CFrameSynchronizer::DropHead(InputState& input, bool late)
+{
+    QueuedFrame& queued = input.queue[input.head & (FRAME_SYNC_QUEUE_SIZE - 1)];
+    CFrameView* pFrame = queued.pFrame;
+
+    queued.pFrame = NULL;
+    InterlockedExchange(&input.head, input.head + 1);
+
+    InterlockedIncrement64(late ? &input.late : &input.dropped);
+    CTracer::Instant("sync", late ? "late frame" : "unmatched frame", "input",
+        (LONGLONG)(&input - m_inputs));
+
+    pFrame->Release();
+}
+
+
+//
+// Not a matcher of its own - no input may push meanwhile.
+//
+void CFrameSynchronizer::Flush(void)
+{
+    for (UINT32 i = 0; i < m_inputCount; i++)
+    {
+        InputState& input = m_inputs[i];
+
+        while (input.head != input.tail)
+        {
+            QueuedFrame& queued = input.queue[input.head & (FRAME_SYNC_QUEUE_SIZE - 1)];
+
+            queued.pFrame->Release();
+            queued.pFrame = NULL;
+            input.head++;
+        }
+
+        input.hasOffset = false;
+    }
+
+    m_hasSet = false;
+}
+
+
+void CFrameSynchronizer::GetStats(FrameSyncStats* pStats) const
+{
+    ZeroMemory(pStats, sizeof(*pStats));
+
+    pStats->inputCount = m_inputCount;
+    pStats->sets = (ULONGLONG)m_sets;
+    pStats->meanSkew = (m_sets != 0) ? m_skewSum / m_sets : 0;
+    pStats->maxSkew = m_maxSkew;
+
+    for (UINT32 i = 0; i < m_inputCount; i++)
+    {
+        const InputState& input = m_inputs[i];
+
+        pStats->inputs[i].frames = (ULONGLONG)input.frames;
+        pStats->inputs[i].matched = (ULONGLONG)input.matched;
+        pStats->inputs[i].dropped = (ULONGLONG)input.dropped;
+        pStats->inputs[i].late = (ULONGLONG)input.late;
+        pStats->inputs[i].clockOffset = input.clockOffset;
+    }
+}
+
+
+void CFrameSynchronizer::Report(void) const
+{
+    FrameSyncStats stats;
+    char line[768];
+
+    GetStats(&stats);
+
+    sprintf_s(line, "sync: %I64u sets, skew %.2f ms mean, %.2f ms max",
+        stats.sets, stats.meanSkew / 10000.0, stats.maxSkew / 10000.0);
+
+    for (UINT32 i = 0; i < stats.inputCount; i++)
+    {
+        const FrameSyncInputStats& input = stats.inputs[i];
+
+        sprintf_s(line + strlen(line), sizeof(line) - strlen(line),
+            "; input %u: %I64u frames, %I64u matched, %I64u dropped, %I64u late, offset %.1f ms",
+            i, input.frames, input.matched, input.dropped, input.late,
+            input.clockOffset / 10000.0);
+    }
+
+    strcat_s(line, "\n");
+    OutputDebugStringA(line);
+}
+
+
+LONGLONG CFrameSynchronizer::ReadValue(void* pContext)
+{
+    return *static_cast<volatile LONGLONG*>(pContext);
+}
+
+
+void CFrameSynchronizer::ExportMetrics(void)
+{
+    static const double skewBounds[] = { 0.0005, 0.001, 0.002, 0.005, 0.01, 0.02, 0.05 };
+    static const PCSTR results[] = { "matched", "dropped", "late" };
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+    char labels[64];
+
+    m_metrics.push_back(pMetrics->CreateCounter("mfcp_sync_sets_total",
+        "Sets of frames captured at the same time emitted by the synchronizer.", NULL, 1.0,
+        ReadValue, (void*)&m_sets));
+
+    // stored in 100-ns units
+    m_pSkewMetric = pMetrics->CreateHistogram("mfcp_sync_skew_seconds",
+        "Latest minus earliest capture time of the frames of a set.", NULL, skewBounds,
+        ARRAYSIZE(skewBounds), 1e-7);
+    m_metrics.push_back(m_pSkewMetric);
+
+    for (UINT32 i = 0; i < m_inputCount; i++)
+    {
+        volatile LONGLONG* counts[] =
+            { &m_inputs[i].matched, &m_inputs[i].dropped, &m_inputs[i].late };
+
+        for (UINT32 result = 0; result < ARRAYSIZE(results); result++)
+        {
+            sprintf_s(labels, "input=\"%u\",result=\"%s\"", i, results[result]);
+            m_metrics.push_back(pMetrics->CreateCounter("mfcp_sync_frames_total",
+                "Frames of each input of the synchronizer, by what became of them.", labels,
+                1.0, ReadValue, (void*)counts[result]));
+        }
+
+        sprintf_s(labels, "input=\"%u\"", i);
+        m_metrics.push_back(pMetrics->CreateGauge("mfcp_sync_clock_offset_seconds",
+            "Estimated offset of the clock of each input from the common clock.", labels,
+            1e-7, ReadValue, (void*)&m_inputs[i].clockOffset));
+    }
+}
+
+
+void CFrameSynchronizer::RemoveMetrics(void)
+{
+    for (size_t i = 0; i < m_metrics.size(); i++)
+    {
+        GetMetricsRegistry()->Remove(m_metrics[i]);
+    }
+
+    m_metrics.clear();
+    m_pSkewMetric = NULL;
+}
@@ -0,0 +1,194 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameSink.h"
+#include "Metrics.h"
+
+#include <vector>
+
+
+
+// largest number of cameras synchronized together
+#define FRAME_SYNC_MAX_INPUTS           8
+
+// frames queued per input, waiting for the frames of the other inputs - a power of two.
+// Queued frames hold samples of the capture source, whose pool is small.
+#define FRAME_SYNC_QUEUE_SIZE           4
+
+// default largest difference of the capture times of a set, in 100-ns units
+#define FRAME_SYNC_DEFAULT_TOLERANCE    (10 * 10000)
+
+
+//
+//  A set of frames captured at the same time, one from each input.  The frames are valid
+//  for the duration of the OnFrameSet() call - AddRef() them to keep them.
+//
+struct FrameSet
+{
+    UINT32      count;                                  // inputs of the synchronizer
+    CFrameView* frames[FRAME_SYNC_MAX_INPUTS];          // frame of each input
+    LONGLONG    captureTimes[FRAME_SYNC_MAX_INPUTS];    // on the common clock, 100-ns units
+    LONGLONG    time;                                   // mean of the capture times
+    LONGLONG    skew;                                   // latest minus earliest capture time
+    UINT64      sequence;                               // sets emitted before this one
+};
+
+
+class IFrameSetConsumer
+{
+    public:
+        virtual ~IFrameSetConsumer(void) {}
+
+        // Called on the capture thread of whichever input completed the set.  The capture
+        // threads of the other inputs keep queueing frames meanwhile, but the queues are
+        // short - a consumer with work to do hands the frames to a thread of its own.
+        virtual void OnFrameSet(const FrameSet& set) = 0;
+};
+
+
+struct FrameSyncInputStats
+{
+    ULONGLONG   frames;         // frames pushed
+    ULONGLONG   matched;        // frames emitted in a set
+    ULONGLONG   dropped;        // frames no frame of some other input could match
+    ULONGLONG   late;           // frames whose set was emitted without them
+    LONGLONG    clockOffset;    // arrival clock minus sample clock, 100-ns units
+};
+
+
+struct FrameSyncStats
+{
+    UINT32      inputCount;
+    ULONGLONG   sets;
+    LONGLONG    meanSkew;       // 100-ns units
+    LONGLONG    maxSkew;
+    FrameSyncInputStats inputs[FRAME_SYNC_MAX_INPUTS];
+};
+
+
+//
+//  Gathers the frames of several capture pipelines - the cameras of a stereo or multi-view
+//  station - into sets of frames captured at the same time.
+//
+//  Every camera stamps its samples on a clock of its own, so the frames are first put on a
+//  common clock: the time the frame reached the frame sink, in GetMetricsTime() ticks, is on
+//  one clock for all cameras, but is late by a delivery latency that jitters from frame to
+//  frame.  The sample time does not jitter, and the difference of the two is the offset of
+//  the clock of the camera plus the latency.  The smallest difference seen is the frame
+//  delivered fastest, so the offset follows the lower envelope of the differences - at once
+//  downwards, and slowly upwards to follow a drifting clock - and the capture time of a frame
+//  is its sample time plus the offset.  A sample time that goes backwards, or an offset that
+//  jumps, restarts the estimate.
+//
+//  Each input has a single-producer, single-consumer queue.  The capture thread of the
+//  input pushes the frame and then tries to become the matcher with an interlocked
+//  compare-exchange; the thread that succeeds matches the heads of all queues until no work
+//  is left, and a thread that fails leaves its frame to it.  Nothing waits for a lock.
+//
+//  The head frames form a set when their capture times are within the tolerance.  When they
+//  are not, the earliest head cannot match any frame of the input with the latest head and
+//  is dropped - as late if a set after it was already emitted.  When an input has nothing
+//  queued, the others wait for it until their queues are almost full.
+//
+class CFrameSynchronizer
+{
+    public:
+        CFrameSynchronizer(void);
+        ~CFrameSynchronizer(void);
+
+        // tolerance in 100-ns units - about half the frame interval of the cameras
+        HRESULT Initialize(UINT32 inputCount, LONGLONG tolerance = FRAME_SYNC_DEFAULT_TOLERANCE);
+
+        // consumer of the frames of one camera, for the frame consumers of its player.  Each
+        // input is fed from one thread at a time, in capture order.
+        IFrameConsumer* GetInput(UINT32 index);
+
+        // only while no frames are flowing
+        HRESULT AddConsumer(IFrameSetConsumer* pConsumer);
+        HRESULT RemoveConsumer(IFrameSetConsumer* pConsumer);
+
+        // push a frame with its sample time in 100-ns units and its arrival time in
+        // GetMetricsTime() ticks - what the inputs do with the times of the frame, and what a
+        // synthetic source does with times of its own
+        void Push(UINT32 input, CFrameView* pFrame, LONGLONG timestamp, LONGLONG arrival);
+
+        // release the queued frames - once no frames are flowing
+        void Flush(void);
+
+        void GetStats(FrameSyncStats* pStats) const;
+
+        // write the statistics to the debugger output
+        void Report(void) const;
+
+    private:
+        class CInput : public IFrameConsumer
+        {
+            public:
+                CInput(void) : m_pOwner(NULL), m_index(0) {}
+
+                void Attach(CFrameSynchronizer* pOwner, UINT32 index)
+                    { m_pOwner = pOwner; m_index = index; }
+
+                virtual void OnFrame(CFrameView* pFrame)
+                    { m_pOwner->Push(m_index, pFrame, pFrame->Timestamp(), pFrame->ArrivalTime()); }
+
+            private:
+                CFrameSynchronizer* m_pOwner;
+                UINT32 m_index;
+        };
+
+        struct QueuedFrame
+        {
+            CFrameView* pFrame;
+            LONGLONG captureTime;               // common clock
+        };
+
+        struct InputState
+        {
+            CInput consumer;
+
+            // the queue - the producer writes m_tail, the matcher m_head
+            QueuedFrame queue[FRAME_SYNC_QUEUE_SIZE];
+            volatile LONG head;
+            volatile LONG tail;
+
+            // clock estimate - producer only
+            bool hasOffset;
+            LONGLONG lastTimestamp;
+            volatile LONGLONG clockOffset;
+
+            volatile LONGLONG frames;
+            volatile LONGLONG matched;
+            volatile LONGLONG dropped;
+            volatile LONGLONG late;
+        };
+
+        LONGLONG ToCaptureTime(InputState& input, LONGLONG timestamp, LONGLONG arrival);
+        void Match(void);
+        bool MatchOnce(void);
+        void DropHead(InputState& input, bool late);
+
+        void ExportMetrics(void);
+        void RemoveMetrics(void);
+        static LONGLONG ReadValue(void* pContext);
+
+        UINT32 m_inputCount;
+        LONGLONG m_tolerance;
+        LONGLONG m_origin;                      // GetMetricsTime() at Initialize()
+        double m_ticksTo100ns;
+        InputState m_inputs[FRAME_SYNC_MAX_INPUTS];
+        std::vector<IFrameSetConsumer*> m_consumers;
+
+        // matcher state - only the thread holding m_matching touches it
+        volatile LONG m_matching;               // 1 while a thread is the matcher
+        volatile LONG m_pendingWork;            // frames pushed since the matcher looked
+        LONGLONG m_lastSetTime;                 // latest capture time of the last set
+        bool m_hasSet;
+
+        volatile LONGLONG m_sets;
+        volatile LONGLONG m_skewSum;
+        volatile LONGLONG m_maxSkew;
+
+        std::vector<CMetric*> m_metrics;
+        CMetricHistogram* m_pSkewMetric;
+};
@@ -0,0 +1,820 @@
+#include "FrameView.h"
+
+#include <malloc.h>
+#include <new>
+
+
+
+// rows of a copy start on a cache line - the pixel kernels load 16 bytes at a time
+#define FRAME_COPY_ALIGNMENT        64
+
+
+
+//
+// Wrap a media sample in a locked frame view.  The returned view has a reference count of
+// one.
+//
+HRESULT CFrameView::CreateFromSample(IMFSample* pSample, const FrameFormat& format,
+    CFrameView** ppFrame)
+{
+    HRESULT hr = S_OK;
+    CFrameView* pFrame = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pSample, E_POINTER);
+        BREAK_ON_NULL(ppFrame, E_POINTER);
+
+        pFrame = new (std::nothrow) CFrameView();
+        BREAK_ON_NULL(pFrame, E_OUTOFMEMORY);
+
+        hr = pFrame->Lock(pSample, format);
+        BREAK_ON_FAIL(hr);
+
+        *ppFrame = pFrame;
+        pFrame = NULL;
+    }
+    while(false);
+
+    if (pFrame != NULL)
+    {
+        pFrame->Release();
+    }
+
+    return hr;
+}
+
+
+//
+// Planes are laid out like in a sample, with every row aligned for SIMD loads.
+//
+HRESULT CFrameView::CreateImage(const FrameFormat& format, const CFrameView* pSource,
+    MemoryAccount account, CFrameView** ppFrame)
+{
+    HRESULT hr = S_OK;
+    CFrameView* pView = NULL;
+    DWORD rowBytes = format.width;
+    DWORD stride = 0;
+    DWORD rows = format.height;
+
+    do
+    {
+        BREAK_ON_NULL(ppFrame, E_POINTER);
+
+        if (format.width == 0 || format.height == 0)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        if (format.subtype == MFVideoFormat_YUY2)
+        {
+            rowBytes = format.width * 2;
+        }
+        else if (format.subtype == MFVideoFormat_RGB32)
+        {
+            rowBytes = format.width * 4;
+        }
+        else if (format.subtype == MFVideoFormat_NV12)
+        {
+            // the chroma plane covers two luma rows per row
+            if ((format.width | format.height) & 1)
+            {
+                hr = E_INVALIDARG;
+                break;
+            }
+
+            rows += format.height / 2;
+        }
+        else if (format.subtype != FrameSubtype_Gray8)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        stride = (rowBytes + FRAME_COPY_ALIGNMENT - 1) & ~(FRAME_COPY_ALIGNMENT - 1);
+
+        pView = new (std::nothrow) CFrameView();
+        BREAK_ON_NULL(pView, E_OUTOFMEMORY);
+
+        hr = pView->AllocatePixels(stride * rows, account);
+        BREAK_ON_FAIL(hr);
+
+        pView->m_format = format;
+        pView->m_format.stride = (LONG)stride;
+        SetRect(&pView->m_region, 0, 0, format.width, format.height);
+
+        if (pSource != NULL)
+        {
+            pView->m_timestamp = pSource->m_timestamp;
+            pView->m_duration = pSource->m_duration;
+            pView->m_sequence = pSource->m_sequence;
+            pView->m_arrival = pSource->m_arrival;
+        }
+
+        pView->m_planes[0].pData = pView->m_pCopy;
+        pView->m_planes[0].stride = (LONG)stride;
+        pView->m_planes[0].width = format.width;
+        pView->m_planes[0].height = format.height;
+        pView->m_planeCount = 1;
+
+        if (format.subtype == MFVideoFormat_NV12)
+        {
+            pView->m_planes[1].pData = pView->m_pCopy + stride * format.height;
+            pView->m_planes[1].stride = (LONG)stride;
+            pView->m_planes[1].width = format.width / 2;
+            pView->m_planes[1].height = format.height / 2;
+            pView->m_planeCount = 2;
+        }
+
+        *ppFrame = pView;
+        pView = NULL;
+    }
+    while(false);
+
+    if (pView != NULL)
+    {
+        pView->Release();
+    }
+
+    return hr;
+}
+
+
+CFrameView::CFrameView(void) :
+    m_cRef(1),
+    m_pParent(NULL),
+    m_pCopy(NULL),
+    m_cbCopy(0),
+    m_copyAccount(MemoryAccount_FrameCopies),
+    m_pAttachments(NULL),
+    m_timestamp(0),
+    m_duration(0),
+    m_sequence(0),
+    m_arrival(0),
+    m_planeCount(0)
+{
+    ZeroMemory(&m_format, sizeof(m_format));
+    ZeroMemory(&m_region, sizeof(m_region));
+    ZeroMemory(m_planes, sizeof(m_planes));
+}
+
+
+//
+// Unlock the buffer - releasing the sample afterwards hands it back to the source pool.
+//
+CFrameView::~CFrameView(void)
+{
+    if (m_p2DBuffer != NULL)
+    {
+        m_p2DBuffer->Unlock2D();
+    }
+    else if (m_pBuffer != NULL && m_planeCount > 0)
+    {
+        m_pBuffer->Unlock();
+    }
+
+    if (m_pAttachments != NULL)
+    {
+        m_pAttachments->Release();
+    }
+
+    if (m_pCopy != NULL)
+    {
+        _aligned_free(m_pCopy);
+        GetMemoryBudget()->Release(m_copyAccount, m_cbCopy);
+    }
+
+    // a sub-view only borrowed the lock of its parent
+    if (m_pParent != NULL)
+    {
+        m_pParent->Release();
+    }
+}
+
+
+ULONG CFrameView::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CFrameView::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+//
+// Lock the buffer of the sample and describe its planes.  The 2D lock is preferred since it
+// returns the actual pitch of the surface, which may differ from the default stride.
+//
+HRESULT CFrameView::Lock(IMFSample* pSample, const FrameFormat& format)
+{
+    HRESULT hr = S_OK;
+    DWORD bufferCount = 0;
+    BYTE* pData = NULL;
+    LONG stride = format.stride;
+    DWORD maxLength = 0;
+    DWORD currentLength = 0;
+    ULONGLONG rowBytes = format.width;
+    ULONGLONG rows = format.height;
+
+    do
+    {
+        m_pSample = pSample;
+        m_format = format;
+
+        hr = pSample->GetBufferCount(&bufferCount);
+        BREAK_ON_FAIL(hr);
+
+        // capture sources deliver a single buffer per sample - only a multi-buffer sample
+        // has to be merged, which costs a copy
+        if (bufferCount == 1)
+        {
+            hr = pSample->GetBufferByIndex(0, &m_pBuffer);
+        }
+        else
+        {
+            hr = pSample->ConvertToContiguousBuffer(&m_pBuffer);
+        }
+        BREAK_ON_FAIL(hr);
+
+        m_p2DBuffer = m_pBuffer;
+        if (m_p2DBuffer != NULL)
+        {
+            hr = m_p2DBuffer->Lock2D(&pData, &stride);
+            if (FAILED(hr))
+            {
+                m_p2DBuffer.Release();
+            }
+        }
+
+        if (m_p2DBuffer == NULL)
+        {
+            hr = m_pBuffer->Lock(&pData, &maxLength, &currentLength);
+            BREAK_ON_FAIL(hr);
+
+            // a 2D lock hands out the surface with its own pitch, but here the rows are laid
+            // out by the media type - a short buffer would let the planes run past its end
+            if (format.subtype == MFVideoFormat_YUY2)
+            {
+                rowBytes *= 2;
+            }
+            else if (format.subtype == MFVideoFormat_RGB32)
+            {
+                rowBytes *= 4;
+            }
+            else if (format.subtype == MFVideoFormat_NV12)
+            {
+                rows += format.height / 2;
+            }
+
+            if ((ULONGLONG)abs(stride) < rowBytes ||
+                (ULONGLONG)abs(stride) * rows > currentLength)
+            {
+                m_pBuffer->Unlock();
+                hr = MF_E_BUFFERTOOSMALL;
+                break;
+            }
+
+            // a negative default stride means a bottom-up bitmap
+            if (stride < 0)
+            {
+                pData += (format.height - 1) * (DWORD)(-stride);
+            }
+        }
+
+        SetRect(&m_region, 0, 0, format.width, format.height);
+
+        m_planes[0].pData = pData;
+        m_planes[0].stride = stride;
+        m_planes[0].width = format.width;
+        m_planes[0].height = format.height;
+        m_planeCount = 1;
+
+        // NV12 keeps the interleaved chroma plane right after the luma plane
+        if (format.subtype == MFVideoFormat_NV12)
+        {
+            m_planes[1].pData = pData + stride * (LONG)format.height;
+            m_planes[1].stride = stride;
+            m_planes[1].width = format.width / 2;
+            m_planes[1].height = format.height / 2;
+            m_planeCount = 2;
+        }
+
+        hr = pSample->GetSampleTime(&m_timestamp);
+        if (FAILED(hr))
+        {
+            m_timestamp = 0;
+        }
+
+        hr = pSample->GetSampleDuration(&m_duration);
+        if (FAILED(hr))
+        {
+            m_duration = 0;
+        }
+
+        hr = S_OK;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// A child starts out as a view of everything its parent shows.
+//
+HRESULT CFrameView::CreateChild(CFrameView** ppView)
+{
+    CFrameView* pView = new (std::nothrow) CFrameView();
+
+    if (pView == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    AddRef();
+    pView->m_pParent = this;
+    pView->m_pSample = m_pSample;
+    pView->m_format = m_format;
+    pView->m_region = m_region;
+    pView->m_timestamp = m_timestamp;
+    pView->m_duration = m_duration;
+    pView->m_sequence = m_sequence;
+    pView->m_arrival = m_arrival;
+    pView->m_planeCount = m_planeCount;
+    CopyMemory(pView->m_planes, m_planes, sizeof(m_planes));
+
+    *ppView = pView;
+
+    return S_OK;
+}
+
+
+//
+// YUY2 and NV12 share chroma between two columns, and NV12 also between two rows, so the
+// rectangle is widened to even coordinates.
+//
+bool CFrameView::AlignRegion(const FrameFormat& format, const RECT& region, RECT* pAligned)
+{
+    RECT bounds = { 0, 0, (LONG)format.width, (LONG)format.height };
+
+    if (!IntersectRect(pAligned, &region, &bounds))
+    {
+        return false;
+    }
+
+    if (format.subtype == MFVideoFormat_YUY2 || format.subtype == MFVideoFormat_NV12)
+    {
+        pAligned->left &= ~1;
+        pAligned->right = min(pAligned->right + (pAligned->right & 1), bounds.right);
+    }
+    if (format.subtype == MFVideoFormat_NV12)
+    {
+        pAligned->top &= ~1;
+        pAligned->bottom = min(pAligned->bottom + (pAligned->bottom & 1), bounds.bottom);
+    }
+
+    return true;
+}
+
+
+//
+// Describe a rectangle of this view, aligned by AlignRegion().
+//
+HRESULT CFrameView::CreateSubView(const RECT& region, CFrameView** ppView)
+{
+    HRESULT hr = S_OK;
+    CFrameView* pView = NULL;
+    RECT clipped;
+    UINT32 bytesPerPixel = (m_format.subtype == MFVideoFormat_RGB32) ? 4 :
+        ((m_format.subtype == MFVideoFormat_YUY2) ? 2 : 1);
+
+    do
+    {
+        BREAK_ON_NULL(ppView, E_POINTER);
+
+        if (!AlignRegion(m_format, region, &clipped))
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        hr = CreateChild(&pView);
+        BREAK_ON_FAIL(hr);
+
+        pView->m_format.width = clipped.right - clipped.left;
+        pView->m_format.height = clipped.bottom - clipped.top;
+
+        // the region is kept relative to the captured frame, even for a view of a view
+        SetRect(&pView->m_region, m_region.left + clipped.left, m_region.top + clipped.top,
+            m_region.left + clipped.right, m_region.top + clipped.bottom);
+
+        pView->m_planes[0].pData += clipped.top * m_planes[0].stride +
+            clipped.left * (LONG)bytesPerPixel;
+        pView->m_planes[0].width = pView->m_format.width;
+        pView->m_planes[0].height = pView->m_format.height;
+
+        // interleaved U/V - one byte per column, one row per two luma rows
+        if (m_planeCount == 2)
+        {
+            pView->m_planes[1].pData += (clipped.top / 2) * m_planes[1].stride + clipped.left;
+            pView->m_planes[1].width = pView->m_format.width / 2;
+            pView->m_planes[1].height = pView->m_format.height / 2;
+        }
+
+        *ppView = pView;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// A plane view is a gray image of the bytes of the plane: the chroma plane of NV12 has as
+// many bytes per row as the luma plane.  The region stays the part of the captured frame
+// the plane covers.
+//
+HRESULT CFrameView::CreatePlaneView(UINT32 index, CFrameView** ppView)
+{
+    HRESULT hr = S_OK;
+    CFrameView* pView = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(ppView, E_POINTER);
+
+        if (m_format.subtype != MFVideoFormat_NV12 || index >= m_planeCount)
+        {
+            hr = MF_E_INVALIDREQUEST;
+            break;
+        }
+
+        hr = CreateChild(&pView);
+        BREAK_ON_FAIL(hr);
+
+        pView->m_format.subtype = FrameSubtype_Gray8;
+        pView->m_format.width = GetRowBytes(index);
+        pView->m_format.height = m_planes[index].height;
+        pView->m_format.stride = m_planes[index].stride;
+
+        pView->m_planes[0] = m_planes[index];
+        pView->m_planes[0].width = pView->m_format.width;
+        ZeroMemory(&pView->m_planes[1], sizeof(pView->m_planes[1]));
+        pView->m_planeCount = 1;
+
+        *ppView = pView;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Skipping rows is only a longer stride.  The region is the rectangle the rows are taken
+// from.
+//
+HRESULT CFrameView::CreateRowView(UINT32 firstRow, UINT32 rowStep, CFrameView** ppView)
+{
+    HRESULT hr = S_OK;
+    CFrameView* pView = NULL;
+    UINT32 rowCount = 0;
+
+    do
+    {
+        BREAK_ON_NULL(ppView, E_POINTER);
+
+        if (rowStep == 0 || firstRow >= m_format.height ||
+            (m_format.subtype == MFVideoFormat_NV12 && ((firstRow | rowStep) & 1) != 0))
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        rowCount = (m_format.height - firstRow + rowStep - 1) / rowStep;
+
+        hr = CreateChild(&pView);
+        BREAK_ON_FAIL(hr);
+
+        pView->m_format.height = rowCount;
+        pView->m_format.stride = m_format.stride * (LONG)rowStep;
+        pView->m_region.top += firstRow;
+
+        pView->m_planes[0].pData += (LONG)firstRow * m_planes[0].stride;
+        pView->m_planes[0].stride *= (LONG)rowStep;
+        pView->m_planes[0].height = rowCount;
+
+        // chroma row i goes with luma rows 2i and 2i + 1 of the view
+        if (m_planeCount == 2)
+        {
+            pView->m_planes[1].pData += (LONG)(firstRow / 2) * m_planes[1].stride;
+            pView->m_planes[1].stride *= (LONG)rowStep;
+            pView->m_planes[1].height = rowCount / 2;
+        }
+
+        *ppView = pView;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Every view holds a reference to its parent, so the pixels are private to the caller only
+// if the caller holds the only reference of every view up to the one that owns them.
+//
+bool CFrameView::IsShared(void) const
+{
+    for (const CFrameView* pView = this; pView != NULL; pView = pView->m_pParent)
+    {
+        if (pView->m_cRef != 1)
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+HRESULT CFrameView::GetWritable(CFrameView** ppView)
+{
+    if (ppView == NULL)
+    {
+        return E_POINTER;
+    }
+
+    // nobody else can get to this view any more, so the answer cannot change meanwhile
+    if (!IsShared())
+    {
+        AddRef();
+        *ppView = this;
+        return S_OK;
+    }
+
+    return CreateCopy(ppView);
+}
+
+
+//
+// Copy the visible pixels into memory of the new view, which stands alone - it has no
+// parent and no sample, so holding it does not keep a capture buffer from the source.
+//
+HRESULT CFrameView::CreateCopy(CFrameView** ppView)
+{
+    HRESULT hr = S_OK;
+    CFrameView* pView = NULL;
+    DWORD strides[2] = { 0, 0 };
+    DWORD cbCopy = 0;
+    BYTE* pDest = NULL;
+
+    do
+    {
+        pView = new (std::nothrow) CFrameView();
+        BREAK_ON_NULL(pView, E_OUTOFMEMORY);
+
+        for (UINT32 i = 0; i < m_planeCount; i++)
+        {
+            strides[i] = (GetRowBytes(i) + FRAME_COPY_ALIGNMENT - 1) &
+                ~(FRAME_COPY_ALIGNMENT - 1);
+            cbCopy += strides[i] * m_planes[i].height;
+        }
+
+        hr = pView->AllocatePixels(cbCopy, MemoryAccount_FrameCopies);
+        BREAK_ON_FAIL(hr);
+
+        pView->m_format = m_format;
+        pView->m_format.stride = (LONG)strides[0];
+        pView->m_region = m_region;
+        pView->m_timestamp = m_timestamp;
+        pView->m_duration = m_duration;
+        pView->m_sequence = m_sequence;
+        pView->m_arrival = m_arrival;
+        pView->m_planeCount = m_planeCount;
+
+        pDest = pView->m_pCopy;
+        for (UINT32 i = 0; i < m_planeCount; i++)
+        {
+            pView->m_planes[i] = m_planes[i];
+            pView->m_planes[i].pData = pDest;
+            pView->m_planes[i].stride = (LONG)strides[i];
+
+            hr = CopyPlane(i, pDest, (LONG)strides[i]);
+            BREAK_ON_FAIL(hr);
+
+            pDest += strides[i] * m_planes[i].height;
+        }
+        BREAK_ON_FAIL(hr);
+
+        // the attachments describe the pixels as they were copied
+        if (m_pAttachments != NULL)
+        {
+            hr = pView->CreateAttachments();
+            BREAK_ON_FAIL(hr);
+
+            hr = m_pAttachments->CopyAllItems(pView->m_pAttachments);
+            BREAK_ON_FAIL(hr);
+        }
+
+        *ppView = pView;
+        pView = NULL;
+    }
+    while(false);
+
+    if (pView != NULL)
+    {
+        pView->Release();
+    }
+
+    return hr;
+}
+
+
+HRESULT CFrameView::AllocatePixels(DWORD cbPixels, MemoryAccount account)
+{
+    cbPixels = max(cbPixels, 1);
+
+    if (!GetMemoryBudget()->Reserve(account, cbPixels))
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    m_pCopy = (BYTE*)_aligned_malloc(cbPixels, FRAME_COPY_ALIGNMENT);
+    if (m_pCopy == NULL)
+    {
+        GetMemoryBudget()->Release(account, cbPixels);
+        return E_OUTOFMEMORY;
+    }
+
+    m_cbCopy = cbPixels;
+    m_copyAccount = account;
+
+    return S_OK;
+}
+
+
+//
+// The visible width of a row in bytes - NV12 chroma rows are as wide as luma rows, and a
+// gray image has a byte per pixel.
+//
+DWORD CFrameView::GetRowBytes(UINT32 index) const
+{
+    if (m_format.subtype == MFVideoFormat_YUY2)
+    {
+        return m_planes[index].width * 2;
+    }
+    else if (m_format.subtype == MFVideoFormat_RGB32)
+    {
+        return m_planes[index].width * 4;
+    }
+
+    return m_format.width;
+}
+
+
+//
+// Copy one plane of the frame into caller memory.
+//
+HRESULT CFrameView::CopyPlane(UINT32 index, BYTE* pDest, LONG destStride) const
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        BREAK_ON_NULL(pDest, E_POINTER);
+
+        if (index >= m_planeCount)
+        {
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        const FramePlane& plane = m_planes[index];
+
+        hr = MFCopyImage(pDest, destStride, plane.pData, plane.stride, GetRowBytes(index),
+            plane.height);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The attribute store is thread safe by itself - only its creation needs care, since two
+// stages may attach to the same frame at once.
+//
+HRESULT CFrameView::CreateAttachments(void)
+{
+    HRESULT hr = S_OK;
+    IMFAttributes* pAttachments = NULL;
+
+    if (m_pAttachments == NULL)
+    {
+        hr = MFCreateAttributes(&pAttachments, 1);
+
+        // somebody else was faster - use theirs
+        if (SUCCEEDED(hr) && InterlockedCompareExchangePointer(
+            (PVOID volatile*)&m_pAttachments, pAttachments, NULL) != NULL)
+        {
+            pAttachments->Release();
+        }
+    }
+
+    return hr;
+}
+
+
+HRESULT CFrameView::SetAttachment(REFGUID key, IUnknown* pValue)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        BREAK_ON_NULL(pValue, E_POINTER);
+
+        hr = CreateAttachments();
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pAttachments->SetUnknown(key, pValue);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CFrameView::GetAttachment(REFGUID key, REFIID riid, void** ppValue)
+{
+    if (ppValue == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *ppValue = NULL;
+
+    if (m_pAttachments == NULL)
+    {
+        return MF_E_ATTRIBUTENOTFOUND;
+    }
+
+    return m_pAttachments->GetUnknown(key, riid, ppValue);
+}
+
+
+HRESULT CFrameView::SetMetadata(REFGUID key, const void* pData, UINT32 cbData)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        BREAK_ON_NULL(pData, E_POINTER);
+
+        hr = CreateAttachments();
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pAttachments->SetBlob(key, (const UINT8*)pData, cbData);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The metadata must have exactly the size asked for - a mismatch means a different type.
+//
+HRESULT CFrameView::GetMetadata(REFGUID key, void* pData, UINT32 cbData)
+{
+    HRESULT hr = S_OK;
+    UINT32 cbStored = 0;
+
+    do
+    {
+        BREAK_ON_NULL(pData, E_POINTER);
+        BREAK_ON_NULL(m_pAttachments, MF_E_ATTRIBUTENOTFOUND);
+
+        hr = m_pAttachments->GetBlobSize(key, &cbStored);
+        BREAK_ON_FAIL(hr);
+
+        if (cbStored != cbData)
+        {
+            hr = MF_E_INVALIDTYPE;
+            break;
+        }
+
+        hr = m_pAttachments->GetBlob(key, (UINT8*)pData, cbData, NULL);
+    }
+    while(false);
+
+    return hr;
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include "Common.h"
+#include "MemoryBudget.h"
+
+// Media Foundation headers
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mferror.h>
+
+
+
+//
+//  8 bits of a single channel per pixel - the subtype of plane views.  The media subtype
+//  GUID of the 'Y800' FOURCC.
+//
+static const GUID FrameSubtype_Gray8 =
+    { FCC('Y800'), 0x0000, 0x0010, { 0x80, 0x00, 0x00, 0xaa, 0x00, 0x38, 0x9b, 0x71 } };
+
+
+//
+//  Description of an uncompressed video frame.
+//
+struct FrameFormat
+{
+    GUID    subtype;        // MFVideoFormat_YUY2, MFVideoFormat_NV12, MFVideoFormat_RGB32
+    UINT32  width;          // frame width in pixels
+    UINT32  height;         // frame height in pixels
+    LONG    stride;         // default stride of the first plane in bytes
+};
+
+
+//
+//  One plane of a locked frame.
+//
+struct FramePlane
+{
+    BYTE*   pData;          // first byte of the top row
+    LONG    stride;         // distance between two rows in bytes, may be negative
+    UINT32  width;          // plane width in samples
+    UINT32  height;         // plane height in rows
+};
+
+
+//
+//  A locked, reference counted view of a captured frame.  The view keeps the media sample
+//  and its buffer alive and locked for as long as anybody holds a reference to it - no
+//  pixel data is copied.  When the last reference is released, the buffer is unlocked and
+//  the sample is released, which returns it to the sample pool of the source.
+//
+//  Consumers that hold a frame beyond the OnFrame() call must AddRef() it, and should
+//  release it promptly - the capture source has a small pool, and stops producing frames
+//  when every sample of the pool is held downstream.
+//
+//  A sub-view describes a rectangle, a single plane or a subset of the rows of another view.
+//  It points into the same locked buffer and keeps its parent alive, so a region of
+//  interest, the luma plane alone or every other row cost no copy either.
+//
+//  Views are shared, so their pixels are read only.  A stage that has to change them asks
+//  for a writable view, which is the view itself if nobody else can see the pixels, and a
+//  private copy otherwise.
+//
+class CFrameView
+{
+    public:
+        static HRESULT CreateFromSample(IMFSample* pSample, const FrameFormat& format,
+            CFrameView** ppFrame);
+
+        // a frame in memory of its own, reserved from the memory budget under the account,
+        // for a stage that makes new pixels from pSource - the image gets the time stamps
+        // and capture info of pSource, but its pixels are not initialized.  The format may be
+        // FrameSubtype_Gray8, and its stride is ignored.
+        static HRESULT CreateImage(const FrameFormat& format, const CFrameView* pSource,
+            MemoryAccount account, CFrameView** ppFrame);
+
+        // view of a rectangle of this frame - the rectangle is clipped to the frame, and
+        // aligned outwards to the chroma subsampling of the format
+        HRESULT CreateSubView(const RECT& region, CFrameView** ppView);
+
+        // the rectangle CreateSubView() makes of a region of a frame of the format - false
+        // if the region is outside of the frame
+        static bool AlignRegion(const FrameFormat& format, const RECT& region, RECT* pAligned);
+
+        // view of one plane of an NV12 frame as a FrameSubtype_Gray8 image - the luma plane,
+        // or the chroma plane with the U and V bytes side by side
+        HRESULT CreatePlaneView(UINT32 index, CFrameView** ppView);
+
+        // view of every rowStep-th row from firstRow on - a field, or a vertical decimation.
+        // Both must be even for NV12, whose chroma rows cover two luma rows.
+        HRESULT CreateRowView(UINT32 firstRow, UINT32 rowStep, CFrameView** ppView);
+
+        // a view whose pixels the caller may change - copy on write.  E_OUTOFMEMORY if the
+        // memory budget has no room for the copy.
+        HRESULT GetWritable(CFrameView** ppView);
+
+        // somebody besides the caller holds this view, one of its parents, or another view
+        // of the same pixels
+        bool IsShared(void) const;
+
+        ULONG AddRef(void);
+        ULONG Release(void);
+
+        const FrameFormat& Format(void) const { return m_format; }
+        LONGLONG Timestamp(void) const { return m_timestamp; }     // 100-ns units
+        LONGLONG Duration(void) const { return m_duration; }       // 100-ns units
+        IMFSample* Sample(void) const { return m_pSample; }     // NULL for a copy
+
+        // capture order of the frame, and GetMetricsTime() when it reached the frame sink
+        UINT64 Sequence(void) const { return m_sequence; }
+        LONGLONG ArrivalTime(void) const { return m_arrival; }
+
+        // set by the frame sink before anybody else sees the frame
+        void SetCaptureInfo(UINT64 sequence, LONGLONG arrival)
+            { m_sequence = sequence; m_arrival = arrival; }
+
+        // rectangle of the captured frame covered by this view
+        const RECT& Region(void) const { return m_region; }
+
+        // number of planes in the frame (2 for NV12, 1 for packed formats)
+        UINT32 PlaneCount(void) const { return m_planeCount; }
+        const FramePlane& Plane(UINT32 index) const { return m_planes[index]; }
+
+        // copy the visible pixels of one plane into caller memory - used by consumers that
+        // cannot hold on to the capture buffer
+        HRESULT CopyPlane(UINT32 index, BYTE* pDest, LONG destStride) const;
+
+        // objects derived from the frame, attached by a stage for everybody after it - safe
+        // to call from any thread
+        HRESULT SetAttachment(REFGUID key, IUnknown* pValue);
+        HRESULT GetAttachment(REFGUID key, REFIID riid, void** ppValue);
+
+        // plain data attached the same way, e.g. the statistics of the frame - copied in
+        // and out
+        HRESULT SetMetadata(REFGUID key, const void* pData, UINT32 cbData);
+        HRESULT GetMetadata(REFGUID key, void* pData, UINT32 cbData);
+
+    private:
+        CFrameView(void);
+        ~CFrameView(void);
+
+        HRESULT Lock(IMFSample* pSample, const FrameFormat& format);
+        HRESULT CreateAttachments(void);
+
+        // a new view of the same pixels and metadata, with this view as its parent
+        HRESULT CreateChild(CFrameView** ppView);
+
+        // a view of a private copy of the pixels
+        HRESULT CreateCopy(CFrameView** ppView);
+
+        // allocate m_pCopy, if the budget allows it
+        HRESULT AllocatePixels(DWORD cbPixels, MemoryAccount account);
+
+        // visible bytes of a row of the plane
+        DWORD GetRowBytes(UINT32 index) const;
+
+        volatile long m_cRef;
+
+        CFrameView* m_pParent;              // view that owns the lock, for a sub-view
+        CComPtr<IMFSample> m_pSample;       // the captured sample
+        CComPtr<IMFMediaBuffer> m_pBuffer;  // locked buffer of the sample
+        CComPtr<IMF2DBuffer> m_p2DBuffer;   // same buffer, if it supports 2D locking
+        BYTE* m_pCopy;                      // pixels of a copy, instead of the sample
+        DWORD m_cbCopy;                     // reserved from the memory budget for m_pCopy
+        MemoryAccount m_copyAccount;        // account m_cbCopy is reserved under
+        IMFAttributes* volatile m_pAttachments;     // created with the first attachment
+
+        FrameFormat m_format;
+        RECT m_region;
+        LONGLONG m_timestamp;
+        LONGLONG m_duration;
+        UINT64 m_sequence;
+        LONGLONG m_arrival;
+
+        UINT32 m_planeCount;
+        FramePlane m_planes[2];
+};
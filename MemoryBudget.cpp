@@ -0,0 +1,280 @@
+#include "MemoryBudget.h"
+#include "Metrics.h"
+#include "Tracer.h"
+
+#include <algorithm>
+#include <stdio.h>
+
+
+
+// share of the physical memory the budget allows by default
+#define MEMORY_BUDGET_DEFAULT_SHARE     2       // one half
+
+// a 32-bit process runs out of address space long before it runs out of memory
+#define MEMORY_BUDGET_MAX_32BIT         (1024ULL * 1024 * 1024)
+
+
+
+// names in the report, and the labels of the metrics
+static const PCSTR s_accountNames[MemoryAccount_Count] =
+{
+    "frame pools", "server packets", "recording", "read-ahead", "frame copies",
+    "analysis cache", "frame outputs", "audio"
+};
+
+static const PCSTR s_accountLabels[MemoryAccount_Count] =
+{
+    "account=\"frame_pools\"", "account=\"server_packets\"", "account=\"recording\"",
+    "account=\"read_ahead\"", "account=\"frame_copies\"", "account=\"analysis_cache\"",
+    "account=\"frame_outputs\"", "account=\"audio\""
+};
+
+static CMemoryBudget s_budget;
+
+
+
+CMemoryBudget* GetMemoryBudget(void)
+{
+    return &s_budget;
+}
+
+
+//
+// Nothing here may use another global - the budget is constructed before wWinMain(), in no
+// particular order with the metrics registry.
+//
+CMemoryBudget::CMemoryBudget(void) :
+    m_limit(0),
+    m_used(0),
+    m_peak(0),
+    m_metricsExported(0)
+{
+    MEMORYSTATUSEX status;
+    ULONGLONG limit = 0;
+
+    ZeroMemory((void*)m_accountBytes, sizeof(m_accountBytes));
+    ZeroMemory((void*)m_deniedCount, sizeof(m_deniedCount));
+
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+    {
+        limit = status.ullTotalPhys / MEMORY_BUDGET_DEFAULT_SHARE;
+    }
+
+#ifndef _WIN64
+    limit = (limit == 0) ? MEMORY_BUDGET_MAX_32BIT : min(limit, MEMORY_BUDGET_MAX_32BIT);
+#endif
+
+    m_limit = (LONGLONG)limit;
+}
+
+
+void CMemoryBudget::SetLimit(ULONGLONG limitBytes)
+{
+    InterlockedExchange64(&m_limit, (LONGLONG)limitBytes);
+}
+
+
+bool CMemoryBudget::Reserve(MemoryAccount account, ULONGLONG bytes)
+{
+    if (account < 0 || account >= MemoryAccount_Count)
+    {
+        return false;
+    }
+
+    if (!TryReserve(bytes))
+    {
+        Reclaim(bytes);
+
+        if (!TryReserve(bytes))
+        {
+            InterlockedIncrement64(&m_deniedCount[account]);
+            CTracer::Instant("memory", "reservation denied", "bytes", (LONGLONG)bytes);
+            return false;
+        }
+    }
+
+    InterlockedExchangeAdd64(&m_accountBytes[account], (LONGLONG)bytes);
+
+    return true;
+}
+
+
+void CMemoryBudget::Release(MemoryAccount account, ULONGLONG bytes)
+{
+    if (account < 0 || account >= MemoryAccount_Count || bytes == 0)
+    {
+        return;
+    }
+
+    InterlockedExchangeAdd64(&m_accountBytes[account], -(LONGLONG)bytes);
+    InterlockedExchangeAdd64(&m_used, -(LONGLONG)bytes);
+}
+
+
+//
+// Add to the total unless that takes it over the limit.  The peak is only a statistic, so
+// a racing reservation may leave it a little low.
+//
+bool CMemoryBudget::TryReserve(ULONGLONG bytes)
+{
+    LONGLONG used = m_used;
+    LONGLONG peak = 0;
+
+    while (true)
+    {
+        LONGLONG limit = m_limit;
+        LONGLONG previous = 0;
+
+        if (limit != 0 && used + (LONGLONG)bytes > limit)
+        {
+            return false;
+        }
+
+        previous = InterlockedCompareExchange64(&m_used, used + (LONGLONG)bytes, used);
+        if (previous == used)
+        {
+            break;
+        }
+
+        used = previous;
+    }
+
+    used += (LONGLONG)bytes;
+
+    peak = m_peak;
+    while (used > peak)
+    {
+        LONGLONG previous = InterlockedCompareExchange64(&m_peak, used, peak);
+        if (previous == peak)
+        {
+            break;
+        }
+
+        peak = previous;
+    }
+
+    return true;
+}
+
+
+//
+// One thread reclaims at a time.  The reclaimers only try their own locks, so calling them
+// with whatever locks the reserving thread holds cannot deadlock.
+//
+void CMemoryBudget::Reclaim(ULONGLONG cbWanted)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_reclaimLock);
+
+    for (size_t i = 0; i < m_reclaimers.size(); i++)
+    {
+        LONGLONG limit = m_limit;
+
+        if (limit == 0 || m_used + (LONGLONG)cbWanted <= limit)
+        {
+            break;
+        }
+
+        m_reclaimers[i]->Reclaim(cbWanted);
+    }
+}
+
+
+void CMemoryBudget::AddReclaimer(IMemoryReclaimer* pReclaimer)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_reclaimLock);
+
+    if (pReclaimer != NULL)
+    {
+        m_reclaimers.push_back(pReclaimer);
+    }
+}
+
+
+void CMemoryBudget::RemoveReclaimer(IMemoryReclaimer* pReclaimer)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_reclaimLock);
+
+    m_reclaimers.erase(std::remove(m_reclaimers.begin(), m_reclaimers.end(), pReclaimer),
+        m_reclaimers.end());
+}
+
+
+void CMemoryBudget::GetStats(MemoryBudgetStats* pStats) const
+{
+    pStats->limitBytes = (ULONGLONG)m_limit;
+    pStats->usedBytes = (ULONGLONG)m_used;
+    pStats->peakBytes = (ULONGLONG)m_peak;
+
+    for (int i = 0; i < MemoryAccount_Count; i++)
+    {
+        pStats->accountBytes[i] = (ULONGLONG)m_accountBytes[i];
+        pStats->deniedCount[i] = (ULONGLONG)m_deniedCount[i];
+    }
+}
+
+
+void CMemoryBudget::Report(void) const
+{
+    MemoryBudgetStats stats;
+    char line[768];
+
+    GetStats(&stats);
+
+    sprintf_s(line, "memory: %.1f MB used of %.1f MB (peak %.1f MB)",
+        stats.usedBytes / (1024.0 * 1024.0), stats.limitBytes / (1024.0 * 1024.0),
+        stats.peakBytes / (1024.0 * 1024.0));
+
+    for (int i = 0; i < MemoryAccount_Count; i++)
+    {
+        sprintf_s(line + strlen(line), sizeof(line) - strlen(line), ", %s %.1f MB",
+            s_accountNames[i], stats.accountBytes[i] / (1024.0 * 1024.0));
+
+        if (stats.deniedCount[i] != 0)
+        {
+            sprintf_s(line + strlen(line), sizeof(line) - strlen(line), " (%I64u denied)",
+                stats.deniedCount[i]);
+        }
+    }
+
+    strcat_s(line, "\n");
+    OutputDebugStringA(line);
+}
+
+
+LONGLONG CMemoryBudget::ReadValue(void* pContext)
+{
+    return *static_cast<volatile LONGLONG*>(pContext);
+}
+
+
+//
+// Every metric reads a value the budget keeps anyway.  The budget lives as long as the
+// process, so the metrics are never removed.
+//
+void CMemoryBudget::ExportMetrics(void)
+{
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+
+    if (InterlockedCompareExchange(&m_metricsExported, 1, 0) != 0)
+    {
+        return;
+    }
+
+    pMetrics->CreateGauge("mfcp_memory_limit_bytes",
+        "Memory the budget allows the frame buffers of the process, 0 if unlimited.", NULL,
+        1.0, ReadValue, (void*)&m_limit);
+    pMetrics->CreateGauge("mfcp_memory_peak_bytes",
+        "Highest memory reserved from the budget at once.", NULL, 1.0, ReadValue,
+        (void*)&m_peak);
+
+    for (int i = 0; i < MemoryAccount_Count; i++)
+    {
+        pMetrics->CreateGauge("mfcp_memory_used_bytes",
+            "Memory reserved from the budget, by subsystem.", s_accountLabels[i], 1.0,
+            ReadValue, (void*)&m_accountBytes[i]);
+        pMetrics->CreateCounter("mfcp_memory_denied_total",
+            "Reservations the budget denied, by subsystem.", s_accountLabels[i], 1.0,
+            ReadValue, (void*)&m_deniedCount[i]);
+    }
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Common.h"
+
+#include <vector>
+
+
+
+//
+//  Process-wide memory budget.  Every pool, queue, recording buffer and cache that holds
+//  frame memory reserves it from the budget before allocating it and gives it back when it
+//  frees it, so the usage of every subsystem is known at any time and their sum stays under
+//  one limit - one slow consumer on a host with several cameras cannot grow the process
+//  until the machine swaps.
+//
+//  A reservation is an interlocked compare-exchange on the total, no lock.  When it would
+//  take the total over the limit, the budget first asks the reclaimers - pools holding idle
+//  buffers - to give memory back, and denies the reservation if that is not enough.  The
+//  owner of the memory then degrades instead of allocating anyway: a queue drops the frame,
+//  a pool stays smaller, a cache evicts.
+//
+
+enum MemoryAccount
+{
+    MemoryAccount_FramePool = 0,    // buffers of pipeline stages, e.g. pyramids
+    MemoryAccount_ServerPackets,    // serialized frames of the frame and preview servers
+    MemoryAccount_Recording,        // frames queued for the recorder
+    MemoryAccount_ReadAhead,        // frames read ahead from frame files
+    MemoryAccount_FrameCopies,      // copies made by CFrameView::GetWritable()
+    MemoryAccount_AnalysisCache,    // cached analysis results
+    MemoryAccount_FrameOutputs,     // frames scaled or converted for other outputs
+    MemoryAccount_Audio,            // captured audio kept for the frames
+    MemoryAccount_Count
+};
+
+
+struct MemoryBudgetStats
+{
+    ULONGLONG   limitBytes;                         // 0 if unlimited
+    ULONGLONG   usedBytes;
+    ULONGLONG   peakBytes;
+    ULONGLONG   accountBytes[MemoryAccount_Count];
+    ULONGLONG   deniedCount[MemoryAccount_Count];   // reservations denied
+};
+
+
+//
+//  Holder of memory it can give back on request.  Reclaim() runs on the thread whose
+//  reservation failed, which may hold locks of its own - a reclaimer must not wait for a
+//  lock, and frees nothing if it cannot take its lock straight away.
+//
+class IMemoryReclaimer
+{
+    public:
+        virtual ~IMemoryReclaimer(void) {}
+
+        // free idle memory, about cbWanted bytes if it has that much, and release it from
+        // the budget
+        virtual void Reclaim(ULONGLONG cbWanted) = 0;
+};
+
+
+class CMemoryBudget
+{
+    public:
+        CMemoryBudget(void);
+        ~CMemoryBudget(void) {}
+
+        // 0 removes the limit.  A limit below the usage denies new reservations until enough
+        // memory is given back - nothing held already is taken away.
+        void SetLimit(ULONGLONG limitBytes);
+        ULONGLONG GetLimit(void) const { return (ULONGLONG)m_limit; }
+
+        // false if the bytes would take the process over the limit even after reclaiming -
+        // the caller must not allocate them
+        bool Reserve(MemoryAccount account, ULONGLONG bytes);
+        void Release(MemoryAccount account, ULONGLONG bytes);
+
+        // once removed, a reclaimer is not called again - removing waits for a reclaim that
+        // is in progress
+        void AddReclaimer(IMemoryReclaimer* pReclaimer);
+        void RemoveReclaimer(IMemoryReclaimer* pReclaimer);
+
+        void GetStats(MemoryBudgetStats* pStats) const;
+
+        // write the usage of every account to the debugger output
+        void Report(void) const;
+
+        // register the metrics of the budget - called once at startup
+        void ExportMetrics(void);
+
+    private:
+        bool TryReserve(ULONGLONG bytes);
+        void Reclaim(ULONGLONG cbWanted);
+
+        static LONGLONG ReadValue(void* pContext);
+
+        volatile LONGLONG m_limit;
+        volatile LONGLONG m_used;
+        volatile LONGLONG m_peak;
+        volatile LONGLONG m_accountBytes[MemoryAccount_Count];
+        volatile LONGLONG m_deniedCount[MemoryAccount_Count];
+
+        CComAutoCriticalSection m_reclaimLock;      // held while the reclaimers run
+        std::vector<IMemoryReclaimer*> m_reclaimers;
+        volatile LONG m_metricsExported;
+};
+
+
+// the budget of the process
+CMemoryBudget* GetMemoryBudget(void);
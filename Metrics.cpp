@@ -0,0 +1,652 @@
+#include "Metrics.h"
+
+#include <mferror.h>
+#include <math.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <string.h>
+#include <new>
+
+
+
+#define METRIC_CACHE_LINE           64
+
+// bytes of a request the metrics server reads before answering
+#define METRICS_MAX_REQUEST         4096
+
+// a scraper that connects and sends nothing is dropped after this long, in ms
+#define METRICS_RECEIVE_TIMEOUT     2000
+
+// latency buckets in seconds, 100 us to 1 s
+static const double s_latencyBounds[] =
+{
+    0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1.0
+};
+
+static CMetricsRegistry s_registry;
+static LONGLONG s_ticksPerSecond = 0;
+
+
+
+LONGLONG GetMetricsTime(void)
+{
+    LARGE_INTEGER now;
+
+    QueryPerformanceCounter(&now);
+    return now.QuadPart;
+}
+
+
+LONGLONG GetMetricsTicksPerSecond(void)
+{
+    LARGE_INTEGER frequency;
+
+    // the frequency is fixed at boot, so racing threads store the same value
+    if (s_ticksPerSecond == 0)
+    {
+        QueryPerformanceFrequency(&frequency);
+        s_ticksPerSecond = frequency.QuadPart;
+    }
+
+    return s_ticksPerSecond;
+}
+
+
+CMetricsRegistry* GetMetricsRegistry(void)
+{
+    return &s_registry;
+}
+
+
+
+
+
+CMetric::CMetric(MetricType type, PCSTR name, PCSTR help, PCSTR labels, double scale) :
+    m_type(type),
+    m_name(name),
+    m_help((help != NULL) ? help : ""),
+    m_labels((labels != NULL) ? labels : ""),
+    m_scale(scale),
+    m_pShardMemory(NULL),
+    m_shardBytes(0)
+{
+}
+
+
+CMetric::~CMetric(void)
+{
+    if (m_pShardMemory != NULL)
+    {
+        _aligned_free(m_pShardMemory);
+    }
+}
+
+
+//
+// Every shard starts on a cache line of its own, so two processors never write the same
+// line - the interlocked adds of the frame path stay in the caches of their processors.
+//
+HRESULT CMetric::AllocateShards(UINT32 slotCount)
+{
+    m_shardBytes = (slotCount * sizeof(LONGLONG) + METRIC_CACHE_LINE - 1) &
+        ~(METRIC_CACHE_LINE - 1);
+
+    m_pShardMemory = (BYTE*)_aligned_malloc(m_shardBytes * METRIC_SHARDS, METRIC_CACHE_LINE);
+    if (m_pShardMemory == NULL)
+    {
+        return E_OUTOFMEMORY;
+    }
+
+    ZeroMemory(m_pShardMemory, m_shardBytes * METRIC_SHARDS);
+
+    return S_OK;
+}
+
+
+volatile LONGLONG* CMetric::GetShardSlot(UINT32 slot) const
+{
+    UINT32 shard = GetCurrentProcessorNumber() & (METRIC_SHARDS - 1);
+
+    return (volatile LONGLONG*)(m_pShardMemory + shard * m_shardBytes) + slot;
+}
+
+
+LONGLONG CMetric::SumShards(UINT32 slot) const
+{
+    LONGLONG sum = 0;
+
+    for (UINT32 shard = 0; shard < METRIC_SHARDS; shard++)
+    {
+        sum += ((volatile LONGLONG*)(m_pShardMemory + shard * m_shardBytes))[slot];
+    }
+
+    return sum;
+}
+
+
+//
+// One sample line - name{labels} value.  Whole values are written without an exponent, so
+// large counters keep every digit.
+//
+void CMetric::AppendSample(std::string* pText, PCSTR suffix, PCSTR extraLabel,
+    double value) const
+{
+    char number[64];
+    bool hasLabels = !m_labels.empty();
+    bool hasExtra = (extraLabel != NULL && extraLabel[0] != '\0');
+
+    pText->append(m_name);
+    pText->append(suffix);
+
+    if (hasLabels || hasExtra)
+    {
+        pText->append("{");
+        pText->append(m_labels);
+        if (hasLabels && hasExtra)
+        {
+            pText->append(",");
+        }
+        if (hasExtra)
+        {
+            pText->append(extraLabel);
+        }
+        pText->append("}");
+    }
+
+    if (value == floor(value) && fabs(value) < 1e15)
+    {
+        sprintf_s(number, " %.0f\n", value);
+    }
+    else
+    {
+        sprintf_s(number, " %.9g\n", value);
+    }
+
+    pText->append(number);
+}
+
+
+
+
+
+CMetricCounter::CMetricCounter(PCSTR name, PCSTR help, PCSTR labels, double scale,
+    MetricReadProc pRead, void* pContext) :
+    CMetric(MetricType_Counter, name, help, labels, scale),
+    m_pRead(pRead),
+    m_pContext(pContext)
+{
+}
+
+
+LONGLONG CMetricCounter::Value(void) const
+{
+    return (m_pRead != NULL) ? m_pRead(m_pContext) : SumShards(0);
+}
+
+
+void CMetricCounter::Format(std::string* pText) const
+{
+    AppendSample(pText, "", NULL, (double)Value() * m_scale);
+}
+
+
+
+
+
+CMetricGauge::CMetricGauge(PCSTR name, PCSTR help, PCSTR labels, double scale,
+    MetricReadProc pRead, void* pContext) :
+    CMetric(MetricType_Gauge, name, help, labels, scale),
+    m_value(0),
+    m_pRead(pRead),
+    m_pContext(pContext)
+{
+}
+
+
+LONGLONG CMetricGauge::Value(void) const
+{
+    return (m_pRead != NULL) ? m_pRead(m_pContext) : m_value;
+}
+
+
+void CMetricGauge::Format(std::string* pText) const
+{
+    AppendSample(pText, "", NULL, (double)Value() * m_scale);
+}
+
+
+
+
+
+CMetricHistogram::CMetricHistogram(PCSTR name, PCSTR help, PCSTR labels, double scale) :
+    CMetric(MetricType_Histogram, name, help, labels, scale),
+    m_boundCount(0)
+{
+}
+
+
+HRESULT CMetricHistogram::SetBounds(const double* pBounds, UINT32 boundCount)
+{
+    if (pBounds == NULL || boundCount == 0 || boundCount > METRIC_MAX_BUCKETS)
+    {
+        return E_INVALIDARG;
+    }
+
+    for (UINT32 i = 0; i < boundCount; i++)
+    {
+        if (i > 0 && pBounds[i] <= pBounds[i - 1])
+        {
+            return E_INVALIDARG;
+        }
+
+        // a stored value v falls into the bucket if v * scale <= bound
+        m_exportBounds[i] = pBounds[i];
+        m_bounds[i] = (LONGLONG)floor(pBounds[i] / m_scale);
+    }
+
+    m_boundCount = boundCount;
+
+    // the buckets, +Inf, and the sum
+    return AllocateShards(boundCount + 2);
+}
+
+
+void CMetricHistogram::Observe(LONGLONG value)
+{
+    UINT32 bucket = 0;
+
+    while (bucket < m_boundCount && value > m_bounds[bucket])
+    {
+        bucket++;
+    }
+
+    InterlockedIncrement64(GetShardSlot(bucket));
+    InterlockedExchangeAdd64(GetShardSlot(m_boundCount + 1), value);
+}
+
+
+//
+// The buckets are exported cumulative, as the format wants them.  The count is the +Inf
+// bucket, so it always agrees with the buckets even while observations go on.
+//
+void CMetricHistogram::Format(std::string* pText) const
+{
+    char label[64];
+    LONGLONG count = 0;
+
+    for (UINT32 i = 0; i < m_boundCount; i++)
+    {
+        count += SumShards(i);
+
+        sprintf_s(label, "le=\"%.9g\"", m_exportBounds[i]);
+        AppendSample(pText, "_bucket", label, (double)count);
+    }
+
+    count += SumShards(m_boundCount);
+
+    AppendSample(pText, "_bucket", "le=\"+Inf\"", (double)count);
+    AppendSample(pText, "_sum", NULL, (double)SumShards(m_boundCount + 1) * m_scale);
+    AppendSample(pText, "_count", NULL, (double)count);
+}
+
+
+
+
+
+CMetricsRegistry::~CMetricsRegistry(void)
+{
+    for (size_t i = 0; i < m_metrics.size(); i++)
+    {
+        delete m_metrics[i];
+    }
+}
+
+
+CMetricCounter* CMetricsRegistry::CreateCounter(PCSTR name, PCSTR help, PCSTR labels,
+    double scale, MetricReadProc pRead, void* pContext)
+{
+    CMetricCounter* pCounter = new (std::nothrow) CMetricCounter(name, help, labels, scale,
+        pRead, pContext);
+
+    if (pCounter != NULL && FAILED(pCounter->AllocateShards(1)))
+    {
+        delete pCounter;
+        pCounter = NULL;
+    }
+
+    return (CMetricCounter*)Add(pCounter);
+}
+
+
+CMetricGauge* CMetricsRegistry::CreateGauge(PCSTR name, PCSTR help, PCSTR labels,
+    double scale, MetricReadProc pRead, void* pContext)
+{
+    return (CMetricGauge*)Add(new (std::nothrow) CMetricGauge(name, help, labels, scale,
+        pRead, pContext));
+}
+
+
+CMetricHistogram* CMetricsRegistry::CreateHistogram(PCSTR name, PCSTR help, PCSTR labels,
+    const double* pBounds, UINT32 boundCount, double scale)
+{
+    CMetricHistogram* pHistogram = new (std::nothrow) CMetricHistogram(name, help, labels,
+        scale);
+
+    if (pHistogram != NULL && FAILED(pHistogram->SetBounds(pBounds, boundCount)))
+    {
+        delete pHistogram;
+        pHistogram = NULL;
+    }
+
+    return (CMetricHistogram*)Add(pHistogram);
+}
+
+
+CMetricHistogram* CMetricsRegistry::CreateLatencyHistogram(PCSTR name, PCSTR help,
+    PCSTR labels)
+{
+    return CreateHistogram(name, help, labels, s_latencyBounds, ARRAYSIZE(s_latencyBounds),
+        1.0 / (double)GetMetricsTicksPerSecond());
+}
+
+
+//
+// A second metric with the name and labels of a registered one would export the series
+// twice, which makes a scraper reject the whole scrape - it is deleted instead.
+//
+CMetric* CMetricsRegistry::Add(CMetric* pMetric)
+{
+    if (pMetric != NULL)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        for (size_t i = 0; i < m_metrics.size(); i++)
+        {
+            if (m_metrics[i]->m_name == pMetric->m_name &&
+                m_metrics[i]->m_labels == pMetric->m_labels)
+            {
+                OutputDebugStringA("metrics: duplicate series ");
+                OutputDebugStringA(pMetric->m_name.c_str());
+                OutputDebugStringA("\n");
+
+                delete pMetric;
+                return NULL;
+            }
+        }
+
+        m_metrics.push_back(pMetric);
+    }
+
+    return pMetric;
+}
+
+
+void CMetricsRegistry::Remove(CMetric* pMetric)
+{
+    if (pMetric == NULL)
+    {
+        return;
+    }
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        for (size_t i = 0; i < m_metrics.size(); i++)
+        {
+            if (m_metrics[i] == pMetric)
+            {
+                m_metrics.erase(m_metrics.begin() + i);
+                break;
+            }
+        }
+    }
+
+    // no scrape can be formatting it any more
+    delete pMetric;
+}
+
+
+//
+// Metrics are written in the order of registration, except that every family is written
+// in one piece under a single HELP and TYPE line, where its first member was registered.
+//
+HRESULT CMetricsRegistry::Format(std::string* pText) const
+{
+    static const PCSTR typeNames[] = { "counter", "gauge", "histogram" };
+
+    if (pText == NULL)
+    {
+        return E_POINTER;
+    }
+
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    pText->clear();
+
+    for (size_t i = 0; i < m_metrics.size(); i++)
+    {
+        bool written = false;
+
+        for (size_t j = 0; j < i && !written; j++)
+        {
+            written = (m_metrics[j]->Name() == m_metrics[i]->Name());
+        }
+
+        if (written)
+        {
+            continue;
+        }
+
+        pText->append("# HELP " + m_metrics[i]->Name() + " " + m_metrics[i]->Help() + "\n");
+        pText->append("# TYPE " + m_metrics[i]->Name() + " " +
+            typeNames[m_metrics[i]->Type()] + "\n");
+
+        for (size_t j = i; j < m_metrics.size(); j++)
+        {
+            if (m_metrics[j]->Name() == m_metrics[i]->Name())
+            {
+                m_metrics[j]->Format(pText);
+            }
+        }
+    }
+
+    return S_OK;
+}
+
+
+
+
+
+CMetricsServer::CMetricsServer(void) :
+    m_pRegistry(NULL),
+    m_listenSocket(INVALID_SOCKET),
+    m_thread(NULL),
+    m_wsaStarted(false)
+{
+}
+
+
+CMetricsServer::~CMetricsServer(void)
+{
+    Stop();
+}
+
+
+HRESULT CMetricsServer::Start(USHORT port, CMetricsRegistry* pRegistry)
+{
+    HRESULT hr = S_OK;
+    WSADATA wsaData;
+    sockaddr_in address;
+
+    do
+    {
+        if (m_listenSocket != INVALID_SOCKET)
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        m_pRegistry = (pRegistry != NULL) ? pRegistry : GetMetricsRegistry();
+
+        if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            break;
+        }
+        m_wsaStarted = true;
+
+        m_listenSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+        if (m_listenSocket == INVALID_SOCKET)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            break;
+        }
+
+        // local scrapers only
+        ZeroMemory(&address, sizeof(address));
+        address.sin_family = AF_INET;
+        address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        address.sin_port = htons(port);
+
+        if (bind(m_listenSocket, (SOCKADDR*)&address, sizeof(address)) == SOCKET_ERROR ||
+            listen(m_listenSocket, SOMAXCONN) == SOCKET_ERROR)
+        {
+            hr = HRESULT_FROM_WIN32(WSAGetLastError());
+            break;
+        }
+
+        m_thread = CreateThread(NULL, 0, ServerThreadProc, this, 0, NULL);
+        BREAK_ON_NULL(m_thread, HRESULT_FROM_WIN32(GetLastError()));
+    }
+    while(false);
+
+    if (FAILED(hr))
+    {
+        Stop();
+    }
+
+    return hr;
+}
+
+
+HRESULT CMetricsServer::Stop(void)
+{
+    // closing the listening socket makes the blocking accept() fail, which ends the thread
+    if (m_listenSocket != INVALID_SOCKET)
+    {
+        closesocket(m_listenSocket);
+        m_listenSocket = INVALID_SOCKET;
+    }
+
+    if (m_thread != NULL)
+    {
+        WaitForSingleObject(m_thread, INFINITE);
+        CloseHandle(m_thread);
+        m_thread = NULL;
+    }
+
+    if (m_wsaStarted)
+    {
+        WSACleanup();
+        m_wsaStarted = false;
+    }
+
+    return S_OK;
+}
+
+
+DWORD WINAPI CMetricsServer::ServerThreadProc(LPVOID pParam)
+{
+    static_cast<CMetricsServer*>(pParam)->ServeLoop();
+    return 0;
+}
+
+
+void CMetricsServer::ServeLoop(void)
+{
+    while (true)
+    {
+        SOCKET s = accept(m_listenSocket, NULL, NULL);
+        if (s == INVALID_SOCKET)
+        {
+            break;
+        }
+
+        HandleRequest(s);
+        closesocket(s);
+    }
+}
+
+
+//
+// Read the request head, and answer "GET /metrics" (and "GET /") with the metrics and
+// anything else with 404.  The connection is closed after every answer.
+//
+void CMetricsServer::HandleRequest(SOCKET s)
+{
+    char request[METRICS_MAX_REQUEST];
+    char header[256];
+    DWORD timeout = METRICS_RECEIVE_TIMEOUT;
+    std::string body;
+    std::string response;
+    int received = 0;
+    bool found = false;
+
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+
+    while (received < (int)sizeof(request) - 1)
+    {
+        int bytes = recv(s, request + received, sizeof(request) - 1 - received, 0);
+        if (bytes <= 0)
+        {
+            break;
+        }
+
+        received += bytes;
+        request[received] = '\0';
+
+        if (strstr(request, "\r\n\r\n") != NULL)
+        {
+            break;
+        }
+    }
+
+    if (received == 0)
+    {
+        return;
+    }
+    request[received] = '\0';
+
+    found = (strncmp(request, "GET /metrics ", 13) == 0 ||
+        strncmp(request, "GET /metrics?", 13) == 0 || strncmp(request, "GET / ", 6) == 0);
+
+    if (found)
+    {
+        m_pRegistry->Format(&body);
+        sprintf_s(header, "HTTP/1.1 200 OK\r\n"
+            "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+            "Content-Length: %u\r\nConnection: close\r\n\r\n", (UINT32)body.size());
+    }
+    else
+    {
+        body = "not found\n";
+        sprintf_s(header, "HTTP/1.1 404 Not Found\r\nContent-Type: text/plain\r\n"
+            "Content-Length: %u\r\nConnection: close\r\n\r\n", (UINT32)body.size());
+    }
+
+    response = header;
+    response += body;
+
+    for (size_t sent = 0; sent < response.size(); )
+    {
+        int bytes = send(s, response.c_str() + sent, (int)(response.size() - sent), 0);
+        if (bytes == SOCKET_ERROR)
+        {
+            break;
+        }
+
+        sent += bytes;
+    }
+
+    shutdown(s, SD_SEND);
+}
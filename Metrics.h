@@ -0,0 +1,229 @@
+#pragma once
+
+#include "Common.h"
+
+#include <string>
+#include <vector>
+
+
+
+//
+//  Process-wide metrics - counters, gauges and histograms that the player, the pipeline and
+//  the servers update as frames go through, exported in the Prometheus text format.
+//
+//  Updating a metric never takes a lock: counters and histograms are sharded per processor,
+//  one cache line per shard, so the threads of the frame path add to their own shard with
+//  a single interlocked instruction and never contend.  Only registering, removing and
+//  scraping metrics lock the registry.
+//
+//  A counter or gauge can also read a value the owner keeps anyway - a scrape then calls
+//  the read function, and the frame path does nothing at all.
+//
+
+#define METRIC_SHARDS               16      // power of two
+#define METRIC_MAX_BUCKETS          16
+
+typedef LONGLONG (*MetricReadProc)(void* pContext);
+
+enum MetricType
+{
+    MetricType_Counter = 0,
+    MetricType_Gauge,
+    MetricType_Histogram
+};
+
+
+//
+//  Time for latency metrics - QueryPerformanceCounter() ticks, which GetMetricsTicksPerSecond()
+//  converts to seconds.
+//
+LONGLONG GetMetricsTime(void);
+LONGLONG GetMetricsTicksPerSecond(void);
+
+
+//
+//  Base of all metrics.  The name, labels and scale are fixed when the metric is created;
+//  values are stored in integer units and multiplied by the scale when exported, so that
+//  e.g. a latency measured in ticks is exported in seconds.
+//
+class CMetric
+{
+    public:
+        virtual ~CMetric(void);
+
+        MetricType Type(void) const { return m_type; }
+        const std::string& Name(void) const { return m_name; }
+        const std::string& Help(void) const { return m_help; }
+
+    protected:
+        friend class CMetricsRegistry;
+
+        CMetric(MetricType type, PCSTR name, PCSTR help, PCSTR labels, double scale);
+
+        // allocate the shards, slotCount values each
+        HRESULT AllocateShards(UINT32 slotCount);
+
+        // slot of the shard of the current processor
+        volatile LONGLONG* GetShardSlot(UINT32 slot) const;
+
+        // slot summed over all shards
+        LONGLONG SumShards(UINT32 slot) const;
+
+        // append the sample lines of the metric
+        virtual void Format(std::string* pText) const = 0;
+
+        void AppendSample(std::string* pText, PCSTR suffix, PCSTR extraLabel,
+            double value) const;
+
+        MetricType m_type;
+        std::string m_name;
+        std::string m_help;
+        std::string m_labels;               // 'name="value",...' without braces, may be empty
+        double m_scale;
+
+    private:
+        BYTE* m_pShardMemory;               // shards, one or more cache lines each
+        UINT32 m_shardBytes;
+};
+
+
+//
+//  Monotonic count, e.g. frames or dropped packets.
+//
+class CMetricCounter : public CMetric
+{
+    public:
+        void Add(LONGLONG value = 1) { InterlockedExchangeAdd64(GetShardSlot(0), value); }
+        LONGLONG Value(void) const;
+
+    protected:
+        friend class CMetricsRegistry;
+
+        CMetricCounter(PCSTR name, PCSTR help, PCSTR labels, double scale,
+            MetricReadProc pRead, void* pContext);
+
+        virtual void Format(std::string* pText) const;
+
+        MetricReadProc m_pRead;
+        void* m_pContext;
+};
+
+
+//
+//  Value that goes up and down, e.g. a queue depth.
+//
+class CMetricGauge : public CMetric
+{
+    public:
+        void Set(LONGLONG value) { InterlockedExchange64(&m_value, value); }
+        void Add(LONGLONG value) { InterlockedExchangeAdd64(&m_value, value); }
+        LONGLONG Value(void) const;
+
+    protected:
+        friend class CMetricsRegistry;
+
+        CMetricGauge(PCSTR name, PCSTR help, PCSTR labels, double scale,
+            MetricReadProc pRead, void* pContext);
+
+        virtual void Format(std::string* pText) const;
+
+        volatile LONGLONG m_value;
+        MetricReadProc m_pRead;
+        void* m_pContext;
+};
+
+
+//
+//  Distribution of a value over fixed buckets, e.g. a latency.  Observe() costs a scan of
+//  the bucket bounds and two interlocked adds.
+//
+class CMetricHistogram : public CMetric
+{
+    public:
+        void Observe(LONGLONG value);
+
+    protected:
+        friend class CMetricsRegistry;
+
+        CMetricHistogram(PCSTR name, PCSTR help, PCSTR labels, double scale);
+
+        // bounds in exported units, rising
+        HRESULT SetBounds(const double* pBounds, UINT32 boundCount);
+
+        virtual void Format(std::string* pText) const;
+
+        LONGLONG m_bounds[METRIC_MAX_BUCKETS];      // upper bounds in stored units
+        double m_exportBounds[METRIC_MAX_BUCKETS];
+        UINT32 m_boundCount;                        // slot m_boundCount is +Inf, the next the sum
+};
+
+
+//
+//  The metrics of the process.  Metrics with the same name and different labels form one
+//  family in the export; a metric with the name and labels of a registered one is not
+//  created.  The owner of a metric removes it before it goes away - a removed metric is
+//  deleted, and any read function it had is never called again.
+//
+//  Objects a process may have several of label their metrics with their instance, e.g.
+//  'player="1"' for the second player.
+//
+class CMetricsRegistry
+{
+    public:
+        CMetricsRegistry(void) {}
+        ~CMetricsRegistry(void);
+
+        // NULL if out of memory - updating code checks for it
+        CMetricCounter* CreateCounter(PCSTR name, PCSTR help, PCSTR labels = NULL,
+            double scale = 1.0, MetricReadProc pRead = NULL, void* pContext = NULL);
+        CMetricGauge* CreateGauge(PCSTR name, PCSTR help, PCSTR labels = NULL,
+            double scale = 1.0, MetricReadProc pRead = NULL, void* pContext = NULL);
+        CMetricHistogram* CreateHistogram(PCSTR name, PCSTR help, PCSTR labels,
+            const double* pBounds, UINT32 boundCount, double scale = 1.0);
+
+        // histogram of GetMetricsTime() differences, exported in seconds from 100 us to 1 s
+        CMetricHistogram* CreateLatencyHistogram(PCSTR name, PCSTR help, PCSTR labels = NULL);
+
+        // remove and delete a metric - NULL is ignored
+        void Remove(CMetric* pMetric);
+
+        // all metrics in the Prometheus text exposition format, version 0.0.4
+        HRESULT Format(std::string* pText) const;
+
+    private:
+        CMetric* Add(CMetric* pMetric);
+
+        mutable CComAutoCriticalSection m_critSec;
+        std::vector<CMetric*> m_metrics;
+};
+
+
+// the registry of the process
+CMetricsRegistry* GetMetricsRegistry(void);
+
+
+//
+//  Serves the metrics of a registry over HTTP on the loopback interface, for a Prometheus
+//  scraper or curl - "GET /metrics" returns the text format.  Requests are answered one at
+//  a time on a thread of the server; a scrape only reads the metrics.
+//
+class CMetricsServer
+{
+    public:
+        CMetricsServer(void);
+        ~CMetricsServer(void);
+
+        HRESULT Start(USHORT port, CMetricsRegistry* pRegistry = NULL);
+        HRESULT Stop(void);
+
+    private:
+        static DWORD WINAPI ServerThreadProc(LPVOID pParam);
+
+        void ServeLoop(void);
+        void HandleRequest(SOCKET s);
+
+        CMetricsRegistry* m_pRegistry;
+        SOCKET m_listenSocket;
+        HANDLE m_thread;
+        bool m_wsaStarted;
+};
@@ -0,0 +1,363 @@
+#include "MjpegServer.h"
+#include "PixelKernels.h"
+
+#include <stdio.h>
+
+#pragma comment(lib, "windowscodecs.lib")
+
+
+
+// multipart boundary between two JPEG frames
+#define MJPEG_BOUNDARY      "mjpegframe"
+
+// bytes of a request the preview server reads before answering
+#define MJPEG_MAX_REQUEST           4096
+
+// a viewer that has not sent its whole request after this long is dropped, in ms - it
+// holds up the accept thread meanwhile
+#define MJPEG_REQUEST_TIMEOUT       2000
+
+
+
+CMjpegServer::CMjpegServer(void) :
+    m_maxWidth(640),
+    m_maxHeight(360),
+    m_quality(0.75f),
+    m_gamma(1.0f),
+    m_minFrameInterval(0),
+    m_lastFrameTime(0)
+{
+}
+
+
+CMjpegServer::~CMjpegServer(void)
+{
+    // stop the server before the encoder state goes away
+    Stop();
+}
+
+
+void CMjpegServer::SetOutputSize(UINT32 maxWidth, UINT32 maxHeight)
+{
+    m_maxWidth = maxWidth;
+    m_maxHeight = maxHeight;
+}
+
+
+void CMjpegServer::SetGamma(float gamma)
+{
+    m_gamma = (gamma > 0.0f) ? gamma : 1.0f;
+    BuildGammaLut(m_gamma, m_gammaLut);
+}
+
+
+void CMjpegServer::SetMaxFrameRate(UINT32 framesPerSecond)
+{
+    m_minFrameInterval = (framesPerSecond > 0) ? (10000000 / framesPerSecond) : 0;
+}
+
+
+//
+// Read the request head of a new viewer before anything is sent, so that no unread request
+// bytes are left on the socket when it is closed - Winsock would reset the connection then.
+// Only "GET /" gets the stream; any other method is answered with 405, any other path with
+// 404, and the connection is closed.
+//
+// The whole request must arrive within one deadline, not each piece of it within a timeout,
+// or a client sending a byte at a time could keep the accept thread from everybody else.
+//
+HRESULT CMjpegServer::AcceptClient(SOCKET s)
+{
+    HRESULT hr = S_OK;
+    char request[MJPEG_MAX_REQUEST];
+    ULONGLONG deadline = GetTickCount64() + MJPEG_REQUEST_TIMEOUT;
+    int received = 0;
+    const char* response = NULL;
+
+    do
+    {
+        while (received < (int)sizeof(request) - 1)
+        {
+            ULONGLONG now = GetTickCount64();
+            fd_set readable;
+            timeval timeout;
+
+            if (now >= deadline)
+            {
+                break;
+            }
+
+            timeout.tv_sec = (long)((deadline - now) / 1000);
+            timeout.tv_usec = (long)((deadline - now) % 1000) * 1000;
+
+            FD_ZERO(&readable);
+            FD_SET(s, &readable);
+
+            if (select(0, &readable, NULL, NULL, &timeout) != 1)
+            {
+                break;
+            }
+
+            int bytes = recv(s, request + received, sizeof(request) - 1 - received, 0);
+            if (bytes <= 0)
+            {
+                break;
+            }
+
+            received += bytes;
+            request[received] = '\0';
+
+            if (strstr(request, "\r\n\r\n") != NULL)
+            {
+                break;
+            }
+        }
+
+        // closed, timed out, or a request head too large for a viewer
+        if (received == 0 || strstr(request, "\r\n\r\n") == NULL)
+        {
+            hr = E_FAIL;
+            break;
+        }
+
+        if (strncmp(request, "GET ", 4) != 0)
+        {
+            response = "HTTP/1.0 405 Method Not Allowed\r\nAllow: GET\r\n"
+                "Content-Type: text/plain\r\nContent-Length: 19\r\nConnection: close\r\n"
+                "\r\nmethod not allowed\n";
+        }
+        else if (strncmp(request, "GET / ", 6) != 0 && strncmp(request, "GET /?", 6) != 0)
+        {
+            response = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n"
+                "Content-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+        }
+
+        if (response != NULL)
+        {
+            send(s, response, (int)strlen(response), 0);
+            shutdown(s, SD_SEND);
+
+            // answered - the connection does not get the stream
+            hr = E_ABORT;
+            break;
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The HTTP response header sent to every viewer once its request has been accepted - the
+// stream is served on "/" only.
+//
+HRESULT CMjpegServer::CreatePreamble(CFramePacket** ppPacket)
+{
+    HRESULT hr = S_OK;
+    CFramePacket* pPacket = NULL;
+
+    static const char response[] =
+        "HTTP/1.0 200 OK\r\n"
+        "Content-Type: multipart/x-mixed-replace; boundary=" MJPEG_BOUNDARY "\r\n"
+        "Cache-Control: no-cache\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
+    do
+    {
+        hr = CFramePacket::Create(sizeof(response) - 1, NULL, &pPacket);
+        BREAK_ON_FAIL(hr);
+
+        CopyMemory(pPacket->Data(), response, sizeof(response) - 1);
+        pPacket->SetSize(sizeof(response) - 1);
+
+        *ppPacket = pPacket;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Downscale and encode the frame, and wrap it into one part of the multipart stream.  This
+// is only called while at least one viewer is connected.
+//
+HRESULT CMjpegServer::SerializeFrame(CFrameView* pFrame, CFramePacket** ppPacket)
+{
+    HRESULT hr = S_OK;
+    UINT32 width = 0;
+    UINT32 height = 0;
+
+    do
+    {
+        *ppPacket = NULL;
+
+        // skip frames that arrive faster than the preview rate
+        if (m_minFrameInterval > 0 && m_lastFrameTime != 0 &&
+            pFrame->Timestamp() - m_lastFrameTime < m_minFrameInterval &&
+            pFrame->Timestamp() >= m_lastFrameTime)
+        {
+            break;
+        }
+        m_lastFrameTime = pFrame->Timestamp();
+
+        // fit the frame into the preview size, keeping the aspect ratio
+        const FrameFormat& format = pFrame->Format();
+        width = format.width;
+        height = format.height;
+
+        if (m_maxWidth > 0 && width > m_maxWidth)
+        {
+            height = (UINT32)((ULONGLONG)height * m_maxWidth / width);
+            width = m_maxWidth;
+        }
+        if (m_maxHeight > 0 && height > m_maxHeight)
+        {
+            width = (UINT32)((ULONGLONG)width * m_maxHeight / height);
+            height = m_maxHeight;
+        }
+
+        // JPEG chroma subsampling prefers even sizes
+        width = max(2u, width & ~1u);
+        height = max(2u, height & ~1u);
+
+        hr = ConvertFrame(pFrame, width, height);
+        BREAK_ON_FAIL(hr);
+
+        hr = EncodeJpeg(width, height, ppPacket);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Convert the frame to 24-bit BGR at the preview size in a single fused pass, sampling the
+// nearest source pixel - the preview does not need a better filter, and this touches only
+// the source rows and pixels that end up in the output.
+//
+HRESULT CMjpegServer::ConvertFrame(CFrameView* pFrame, UINT32 width, UINT32 height)
+{
+    m_bgr.resize(width * height * 3);
+
+    if (m_gamma != 1.0f)
+    {
+        return ConvertScaleFrame<Bgr24Writer>(pFrame, &m_bgr[0], width * 3, width, height,
+            0, height, LutOp(m_gammaLut));
+    }
+
+    return ConvertScaleFrame<Bgr24Writer>(pFrame, &m_bgr[0], width * 3, width, height, 0,
+        height, NoOp());
+}
+
+
+//
+// Encode m_bgr with the WIC JPEG encoder and build one multipart part around it.
+//
+HRESULT CMjpegServer::EncodeJpeg(UINT32 width, UINT32 height, CFramePacket** ppPacket)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IStream> pStream;
+    CComPtr<IWICBitmapEncoder> pEncoder;
+    CComPtr<IWICBitmapFrameEncode> pFrameEncode;
+    CComPtr<IPropertyBag2> pProperties;
+    WICPixelFormatGUID pixelFormat = GUID_WICPixelFormat24bppBGR;
+    PROPBAG2 option = { 0 };
+    VARIANT value;
+    STATSTG stat;
+    HGLOBAL hGlobal = NULL;
+    CFramePacket* pPacket = NULL;
+    char partHeader[128];
+    int partHeaderSize = 0;
+    DWORD jpegSize = 0;
+
+    do
+    {
+        if (m_pFactory == NULL)
+        {
+            hr = m_pFactory.CoCreateInstance(CLSID_WICImagingFactory);
+            BREAK_ON_FAIL(hr);
+        }
+
+        hr = CreateStreamOnHGlobal(NULL, TRUE, &pStream);
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pFactory->CreateEncoder(GUID_ContainerFormatJpeg, NULL, &pEncoder);
+        BREAK_ON_FAIL(hr);
+
+        hr = pEncoder->Initialize(pStream, WICBitmapEncoderNoCache);
+        BREAK_ON_FAIL(hr);
+
+        hr = pEncoder->CreateNewFrame(&pFrameEncode, &pProperties);
+        BREAK_ON_FAIL(hr);
+
+        option.pstrName = L"ImageQuality";
+        VariantInit(&value);
+        value.vt = VT_R4;
+        value.fltVal = m_quality;
+        hr = pProperties->Write(1, &option, &value);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFrameEncode->Initialize(pProperties);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFrameEncode->SetSize(width, height);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFrameEncode->SetPixelFormat(&pixelFormat);
+        BREAK_ON_FAIL(hr);
+
+        if (pixelFormat != GUID_WICPixelFormat24bppBGR)
+        {
+            hr = MF_E_INVALIDMEDIATYPE;
+            break;
+        }
+
+        hr = pFrameEncode->WritePixels(height, width * 3, (UINT)m_bgr.size(), &m_bgr[0]);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFrameEncode->Commit();
+        BREAK_ON_FAIL(hr);
+
+        hr = pEncoder->Commit();
+        BREAK_ON_FAIL(hr);
+
+        hr = pStream->Stat(&stat, STATFLAG_NONAME);
+        BREAK_ON_FAIL(hr);
+        jpegSize = stat.cbSize.LowPart;
+
+        partHeaderSize = sprintf_s(partHeader,
+            "--" MJPEG_BOUNDARY "\r\nContent-Type: image/jpeg\r\nContent-Length: %u\r\n\r\n",
+            jpegSize);
+
+        hr = CFramePacket::Create(partHeaderSize + jpegSize + 2, NULL, &pPacket);
+        BREAK_ON_FAIL(hr);
+
+        hr = GetHGlobalFromStream(pStream, &hGlobal);
+        BREAK_ON_FAIL(hr);
+
+        BYTE* pJpeg = (BYTE*)GlobalLock(hGlobal);
+        BREAK_ON_NULL(pJpeg, E_UNEXPECTED);
+
+        CopyMemory(pPacket->Data(), partHeader, partHeaderSize);
+        CopyMemory(pPacket->Data() + partHeaderSize, pJpeg, jpegSize);
+        CopyMemory(pPacket->Data() + partHeaderSize + jpegSize, "\r\n", 2);
+        pPacket->SetSize(partHeaderSize + jpegSize + 2);
+
+        GlobalUnlock(hGlobal);
+
+        *ppPacket = pPacket;
+        pPacket = NULL;
+    }
+    while(false);
+
+    if (pPacket != NULL)
+    {
+        pPacket->Release();
+    }
+
+    return hr;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "FrameServer.h"
+
+#include <wincodec.h>
+#include <vector>
+
+
+
+//
+//  Live preview over HTTP.  Every connected viewer receives the same multipart MJPEG stream
+//  (multipart/x-mixed-replace), so a browser or curl can watch the camera without a window
+//  on the capture box.  A frame is downscaled and encoded once per server no matter how many
+//  viewers are connected, and nothing at all is encoded while nobody is watching.  Run one
+//  server per preview resolution.
+//
+class CMjpegServer : public CFrameServer
+{
+    public:
+        CMjpegServer(void);
+        virtual ~CMjpegServer(void);
+
+        // size of the preview - the frames are downscaled to fit inside it, keeping the
+        // aspect ratio.  Zero means the size of the captured frame.
+        void SetOutputSize(UINT32 maxWidth, UINT32 maxHeight);
+
+        // limit the encoding rate, zero for every captured frame
+        void SetMaxFrameRate(UINT32 framesPerSecond);
+
+        // JPEG quality between 0.0 and 1.0
+        void SetQuality(float quality) { m_quality = quality; }
+
+        // gamma applied to the preview in the conversion pass, 1.0 for none
+        void SetGamma(float gamma);
+
+        // the JPEG images vary in size and come from the heap - there is no pool to size
+        virtual void OnFormat(const FrameFormat& format) {}
+
+    protected:
+        virtual HRESULT SerializeFrame(CFrameView* pFrame, CFramePacket** ppPacket);
+        virtual HRESULT CreatePreamble(CFramePacket** ppPacket);
+        virtual HRESULT AcceptClient(SOCKET s);
+
+    private:
+        HRESULT ConvertFrame(CFrameView* pFrame, UINT32 width, UINT32 height);
+        HRESULT EncodeJpeg(UINT32 width, UINT32 height, CFramePacket** ppPacket);
+
+        CComPtr<IWICImagingFactory> m_pFactory;     // created on the first encoded frame
+
+        UINT32 m_maxWidth;
+        UINT32 m_maxHeight;
+        float m_quality;
+        float m_gamma;
+        BYTE m_gammaLut[256];                       // gamma curve applied while converting
+        LONGLONG m_minFrameInterval;                // 100-ns units
+        LONGLONG m_lastFrameTime;
+
+        std::vector<BYTE> m_bgr;                    // downscaled 24-bit BGR frame
+};
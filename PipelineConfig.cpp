@@ -0,0 +1,653 @@
+#include "PipelineConfig.h"
+
+#include <mfidl.h>
+#include <mftransform.h>
+#include <mferror.h>
+#include <shlwapi.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+#pragma comment(lib, "shlwapi.lib")
+
+
+
+//
+// Header of the cached plan file, followed by the PipelinePlan itself.
+//
+struct PipelinePlanCacheHeader
+{
+    DWORD       magic;          // PIPELINE_PLAN_MAGIC
+    DWORD       planSize;       // sizeof(PipelinePlan) when the plan was written
+    FILETIME    sourceTime;     // last write time of the pipeline file that was planned
+};
+
+#define PIPELINE_PLAN_MAGIC         0x4E4C5050      // "PPLN"
+
+// extension of the cached plan, appended to the pipeline file name
+#define PIPELINE_PLAN_EXTENSION     L".plan"
+
+// default buffer plan
+#define PIPELINE_DEFAULT_FRAMES_IN_FLIGHT   3
+#define PIPELINE_DEFAULT_CLIENT_QUEUE       4
+
+
+
+//
+// Pixel formats a pipeline file can name for the frame sink.
+//
+struct PipelineFormatName
+{
+    PCWSTR name;
+    const GUID* pSubtype;
+    UINT32 bitsPerPixel;
+};
+
+static const PipelineFormatName s_pipelineFormats[] =
+{
+    { L"YUY2",  &MFVideoFormat_YUY2,    16 },
+    { L"NV12",  &MFVideoFormat_NV12,    12 },
+    { L"RGB32", &MFVideoFormat_RGB32,   32 }
+};
+
+static const DWORD s_pipelineFormatCount =
+    sizeof(s_pipelineFormats) / sizeof(s_pipelineFormats[0]);
+
+
+
+//
+// The cached plan sits next to the pipeline file.  swprintf_s() would abort on a path
+// too long for the buffer, so the length is checked first.
+//
+static HRESULT GetPlanPath(PCWSTR path, WCHAR* pPlanPath, size_t cchPlanPath)
+{
+    if (wcslen(path) + wcslen(PIPELINE_PLAN_EXTENSION) >= cchPlanPath)
+    {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+
+    swprintf_s(pPlanPath, cchPlanPath, L"%s%s", path, PIPELINE_PLAN_EXTENSION);
+
+    return S_OK;
+}
+
+
+
+CPipelineCompiler::CPipelineCompiler(void)
+{
+    m_error[0] = L'\0';
+}
+
+
+//
+// Compile the pipeline file, or load its plan from the cache if the file has not been
+// modified since.  The transform names are resolved against the installed MFTs, which is
+// the expensive part of planning - delete the .plan file after installing new effects.
+//
+HRESULT CPipelineCompiler::Compile(PCWSTR path, PipelinePlan* pPlan)
+{
+    HRESULT hr = S_OK;
+    WIN32_FILE_ATTRIBUTE_DATA attributes;
+    WCHAR fullPath[MAX_PATH];
+
+    m_error[0] = L'\0';
+
+    do
+    {
+        BREAK_ON_NULL(path, E_POINTER);
+        BREAK_ON_NULL(pPlan, E_POINTER);
+
+        // the profile functions look for relative paths in the Windows directory
+        if (GetFullPathName(path, ARRAYSIZE(fullPath), fullPath, NULL) == 0)
+        {
+            hr = Fail(HRESULT_FROM_WIN32(GetLastError()), L"invalid path %s", path);
+            break;
+        }
+        path = fullPath;
+
+        if (!GetFileAttributesEx(path, GetFileExInfoStandard, &attributes))
+        {
+            hr = Fail(HRESULT_FROM_WIN32(GetLastError()), L"cannot open %s", path);
+            break;
+        }
+
+        if (SUCCEEDED(LoadCachedPlan(path, attributes.ftLastWriteTime, pPlan)))
+        {
+            break;
+        }
+
+        // a cached plan that did not pass its check may have left an error behind
+        m_error[0] = L'\0';
+
+        hr = Parse(path, pPlan);
+        BREAK_ON_FAIL(hr);
+
+        hr = PlanBuffers(pPlan);
+        BREAK_ON_FAIL(hr);
+
+        // a plan that cannot be cached is still a good plan
+        SaveCachedPlan(path, attributes.ftLastWriteTime, *pPlan);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Read and validate every section of the file.
+//
+HRESULT CPipelineCompiler::Parse(PCWSTR path, PipelinePlan* pPlan)
+{
+    HRESULT hr = S_OK;
+    WCHAR value[128];
+    WCHAR section[32];
+
+    ZeroMemory(pPlan, sizeof(*pPlan));
+    pPlan->version = PIPELINE_PLAN_VERSION;
+
+    do
+    {
+        //
+        // [source]
+        //
+        hr = ReadNumber(path, L"source", L"device", 0, 0, 63, &pPlan->deviceIndex);
+        BREAK_ON_FAIL(hr);
+
+        GetPrivateProfileString(L"source", L"deviceName", L"", pPlan->deviceName,
+            ARRAYSIZE(pPlan->deviceName), path);
+
+        hr = ReadNumber(path, L"source", L"width", 0, 0, 16384, &pPlan->width);
+        BREAK_ON_FAIL(hr);
+
+        hr = ReadNumber(path, L"source", L"height", 0, 0, 16384, &pPlan->height);
+        BREAK_ON_FAIL(hr);
+
+        if ((pPlan->width == 0) != (pPlan->height == 0))
+        {
+            hr = Fail(E_INVALIDARG, L"[source] needs both width and height, or neither");
+            break;
+        }
+
+        hr = ParseCrop(path, pPlan);
+        BREAK_ON_FAIL(hr);
+
+        //
+        // [transform0] .. [transformN] - the list ends at the first missing section
+        //
+        for (DWORD i = 0; ; i++)
+        {
+            swprintf_s(section, L"transform%u", i);
+
+            if (GetPrivateProfileSection(section, value, ARRAYSIZE(value), path) == 0)
+            {
+                break;
+            }
+
+            if (i == PIPELINE_MAX_TRANSFORMS)
+            {
+                hr = Fail(E_INVALIDARG, L"more than %u transforms", PIPELINE_MAX_TRANSFORMS);
+                break;
+            }
+
+            hr = ParseTransform(path, i, &pPlan->transforms[i]);
+            BREAK_ON_FAIL(hr);
+
+            pPlan->transformCount++;
+        }
+        BREAK_ON_FAIL(hr);
+
+        //
+        // [sink]
+        //
+        GetPrivateProfileString(L"sink", L"type", L"window", value, ARRAYSIZE(value), path);
+
+        if (_wcsicmp(value, L"window") == 0)
+        {
+            pPlan->sinkType = PipelineSink_Window;
+        }
+        else if (_wcsicmp(value, L"frames") == 0)
+        {
+            pPlan->sinkType = PipelineSink_Frames;
+        }
+        else
+        {
+            hr = Fail(E_INVALIDARG, L"[sink] unknown type \"%s\"", value);
+            break;
+        }
+
+        GetPrivateProfileString(L"sink", L"format", L"", value, ARRAYSIZE(value), path);
+
+        if (value[0] != L'\0')
+        {
+            // the EVR negotiates its own format
+            if (pPlan->sinkType != PipelineSink_Frames)
+            {
+                hr = Fail(E_INVALIDARG, L"[sink] format is only valid with type=frames");
+                break;
+            }
+
+            for (DWORD i = 0; i < s_pipelineFormatCount; i++)
+            {
+                if (_wcsicmp(value, s_pipelineFormats[i].name) == 0)
+                {
+                    pPlan->sinkSubtype = *s_pipelineFormats[i].pSubtype;
+                    break;
+                }
+            }
+
+            if (pPlan->sinkSubtype == GUID_NULL)
+            {
+                hr = Fail(E_INVALIDARG, L"[sink] unknown format \"%s\"", value);
+                break;
+            }
+        }
+
+        //
+        // [buffers]
+        //
+        hr = ReadNumber(path, L"buffers", L"framesInFlight", PIPELINE_DEFAULT_FRAMES_IN_FLIGHT,
+            1, 64, &pPlan->framesInFlight);
+        BREAK_ON_FAIL(hr);
+
+        hr = ReadNumber(path, L"buffers", L"workers", 0, 0, 256, &pPlan->workerCount);
+        BREAK_ON_FAIL(hr);
+
+        hr = ReadNumber(path, L"buffers", L"clientQueue", PIPELINE_DEFAULT_CLIENT_QUEUE,
+            1, 1024, &pPlan->clientQueueDepth);
+        BREAK_ON_FAIL(hr);
+
+        // 0 lets PlanBuffers() derive the pool size from the queue depth
+        hr = ReadNumber(path, L"buffers", L"poolBuffers", 0, 0, 1024, &pPlan->poolBuffers);
+        BREAK_ON_FAIL(hr);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The crop region is given as left,top,width,height.  The resizer that crops works on
+// whole chroma samples, so every value must be even.
+//
+HRESULT CPipelineCompiler::ParseCrop(PCWSTR path, PipelinePlan* pPlan)
+{
+    HRESULT hr = S_OK;
+    WCHAR value[64];
+    int left = 0;
+    int top = 0;
+    int width = 0;
+    int height = 0;
+
+    do
+    {
+        GetPrivateProfileString(L"source", L"crop", L"", value, ARRAYSIZE(value), path);
+
+        if (value[0] == L'\0')
+        {
+            break;
+        }
+
+        if (swscanf_s(value, L"%d,%d,%d,%d", &left, &top, &width, &height) != 4 ||
+            left < 0 || top < 0 || width <= 0 || height <= 0 ||
+            ((left | top | width | height) & 1) != 0)
+        {
+            hr = Fail(E_INVALIDARG, L"[source] crop must be four even numbers: left,top,width,height");
+            break;
+        }
+
+        if (pPlan->width != 0 &&
+            ((UINT32)(left + width) > pPlan->width || (UINT32)(top + height) > pPlan->height))
+        {
+            hr = Fail(E_INVALIDARG, L"[source] crop does not fit into %ux%u", pPlan->width,
+                pPlan->height);
+            break;
+        }
+
+        SetRect(&pPlan->crop, left, top, left + width, top + height);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// A transform is named either by its CLSID or by part of its friendly name.
+//
+HRESULT CPipelineCompiler::ParseTransform(PCWSTR path, DWORD index, CLSID* pClsid)
+{
+    HRESULT hr = S_OK;
+    WCHAR section[32];
+    WCHAR name[128];
+    WCHAR clsid[64];
+
+    do
+    {
+        swprintf_s(section, L"transform%u", index);
+
+        GetPrivateProfileString(section, L"name", L"", name, ARRAYSIZE(name), path);
+        GetPrivateProfileString(section, L"clsid", L"", clsid, ARRAYSIZE(clsid), path);
+
+        if ((name[0] == L'\0') == (clsid[0] == L'\0'))
+        {
+            hr = Fail(E_INVALIDARG, L"[%s] needs either name or clsid", section);
+            break;
+        }
+
+        if (clsid[0] != L'\0')
+        {
+            if (FAILED(CLSIDFromString(clsid, pClsid)))
+            {
+                hr = Fail(E_INVALIDARG, L"[%s] invalid clsid %s", section, clsid);
+            }
+            break;
+        }
+
+        hr = ResolveTransform(name, pClsid);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Find the one installed video effect whose friendly name contains the name.
+//
+HRESULT CPipelineCompiler::ResolveTransform(PCWSTR name, CLSID* pClsid)
+{
+    HRESULT hr = S_OK;
+    IMFActivate** ppActivate = NULL;
+    UINT32 count = 0;
+    DWORD matches = 0;
+
+    do
+    {
+        hr = MFTEnumEx(MFT_CATEGORY_VIDEO_EFFECT, MFT_ENUM_FLAG_ALL, NULL, NULL,
+            &ppActivate, &count);
+        BREAK_ON_FAIL(hr);
+
+        for (UINT32 i = 0; i < count; i++)
+        {
+            LPWSTR friendlyName = NULL;
+            UINT32 length = 0;
+
+            if (FAILED(ppActivate[i]->GetAllocatedString(MFT_FRIENDLY_NAME_Attribute,
+                &friendlyName, &length)))
+            {
+                continue;
+            }
+
+            if (StrStrIW(friendlyName, name) != NULL &&
+                SUCCEEDED(ppActivate[i]->GetGUID(MFT_TRANSFORM_CLSID_Attribute, pClsid)))
+            {
+                matches++;
+            }
+
+            CoTaskMemFree(friendlyName);
+        }
+
+        if (matches == 0)
+        {
+            hr = Fail(MF_E_TOPO_CODEC_NOT_FOUND, L"no video effect named \"%s\"", name);
+        }
+        else if (matches > 1)
+        {
+            hr = Fail(E_INVALIDARG, L"\"%s\" matches %u video effects", name, matches);
+        }
+    }
+    while(false);
+
+    for (UINT32 i = 0; i < count; i++)
+    {
+        ppActivate[i]->Release();
+    }
+    CoTaskMemFree(ppActivate);
+
+    return hr;
+}
+
+
+//
+// Derive the buffer sizes from the formats.  Without a sink format the frame size is
+// planned for the widest format the frame sink accepts.
+//
+HRESULT CPipelineCompiler::PlanBuffers(PipelinePlan* pPlan)
+{
+    HRESULT hr = S_OK;
+    UINT32 bitsPerPixel = 32;
+
+    do
+    {
+        for (DWORD i = 0; i < s_pipelineFormatCount; i++)
+        {
+            if (pPlan->sinkSubtype == *s_pipelineFormats[i].pSubtype)
+            {
+                bitsPerPixel = s_pipelineFormats[i].bitsPerPixel;
+            }
+        }
+
+        // the chroma of the YUV formats is subsampled horizontally
+        if (bitsPerPixel < 32 && pPlan->sinkSubtype != GUID_NULL &&
+            (pPlan->width % 2 != 0 || pPlan->height % 2 != 0))
+        {
+            hr = Fail(E_INVALIDARG, L"%ux%u is not a valid size for a YUV format",
+                pPlan->width, pPlan->height);
+            break;
+        }
+
+        // the sink only ever sees the cropped region
+        if (!IsRectEmpty(&pPlan->crop))
+        {
+            pPlan->frameBytes = (DWORD)((ULONGLONG)(pPlan->crop.right - pPlan->crop.left) *
+                (pPlan->crop.bottom - pPlan->crop.top) * bitsPerPixel / 8);
+        }
+        else
+        {
+            pPlan->frameBytes = (DWORD)((ULONGLONG)pPlan->width * pPlan->height * bitsPerPixel / 8);
+        }
+
+        // a full queue of one client plus the frame being serialized
+        if (pPlan->poolBuffers == 0)
+        {
+            pPlan->poolBuffers = pPlan->clientQueueDepth + 1;
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// The limits Parse() and PlanBuffers() put on a plan, for a plan that was not compiled here.
+//
+bool CPipelineCompiler::IsValidPlan(const PipelinePlan& plan)
+{
+    PipelinePlan planned = plan;
+    bool knownFormat = (plan.sinkSubtype == GUID_NULL);
+    LONG cropWidth = plan.crop.right - plan.crop.left;
+    LONG cropHeight = plan.crop.bottom - plan.crop.top;
+
+    for (DWORD i = 0; i < s_pipelineFormatCount; i++)
+    {
+        knownFormat = knownFormat || (plan.sinkSubtype == *s_pipelineFormats[i].pSubtype);
+    }
+
+    if (plan.deviceIndex > 63 ||
+        wmemchr(plan.deviceName, L'\0', ARRAYSIZE(plan.deviceName)) == NULL ||
+        plan.width > 16384 || plan.height > 16384 || (plan.width == 0) != (plan.height == 0) ||
+        plan.transformCount > PIPELINE_MAX_TRANSFORMS ||
+        (plan.sinkType != PipelineSink_Window && plan.sinkType != PipelineSink_Frames) ||
+        !knownFormat || (plan.sinkSubtype != GUID_NULL && plan.sinkType != PipelineSink_Frames) ||
+        plan.framesInFlight < 1 || plan.framesInFlight > 64 || plan.workerCount > 256 ||
+        plan.clientQueueDepth < 1 || plan.clientQueueDepth > 1024 ||
+        plan.poolBuffers < 1 || plan.poolBuffers > 1025)
+    {
+        return false;
+    }
+
+    if (!IsRectEmpty(&plan.crop) &&
+        (plan.crop.left < 0 || plan.crop.top < 0 || cropWidth <= 0 || cropHeight <= 0 ||
+         ((plan.crop.left | plan.crop.top | cropWidth | cropHeight) & 1) != 0 ||
+         (plan.width != 0 &&
+          ((UINT32)plan.crop.right > plan.width || (UINT32)plan.crop.bottom > plan.height))))
+    {
+        return false;
+    }
+
+    // the frame size is derived from the rest
+    if (FAILED(PlanBuffers(&planned)) || planned.frameBytes != plan.frameBytes)
+    {
+        return false;
+    }
+
+    return true;
+}
+
+
+HRESULT CPipelineCompiler::ReadNumber(PCWSTR path, PCWSTR section, PCWSTR key,
+    UINT32 defaultValue, UINT32 minValue, UINT32 maxValue, UINT32* pValue)
+{
+    WCHAR value[32];
+    WCHAR* pEnd = NULL;
+
+    GetPrivateProfileString(section, key, L"", value, ARRAYSIZE(value), path);
+
+    if (value[0] == L'\0')
+    {
+        *pValue = defaultValue;
+        return S_OK;
+    }
+
+    *pValue = wcstoul(value, &pEnd, 10);
+
+    if (*pEnd != L'\0' || *pValue < minValue || *pValue > maxValue)
+    {
+        return Fail(E_INVALIDARG, L"[%s] %s must be a number from %u to %u", section, key,
+            minValue, maxValue);
+    }
+
+    return S_OK;
+}
+
+
+HRESULT CPipelineCompiler::LoadCachedPlan(PCWSTR path, const FILETIME& sourceTime,
+    PipelinePlan* pPlan)
+{
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    WCHAR planPath[MAX_PATH];
+    PipelinePlanCacheHeader header;
+    DWORD cbRead = 0;
+
+    do
+    {
+        hr = GetPlanPath(path, planPath, ARRAYSIZE(planPath));
+        BREAK_ON_FAIL(hr);
+
+        file = CreateFile(planPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!ReadFile(file, &header, sizeof(header), &cbRead, NULL) ||
+            cbRead != sizeof(header) ||
+            header.magic != PIPELINE_PLAN_MAGIC ||
+            header.planSize != sizeof(PipelinePlan) ||
+            CompareFileTime(&header.sourceTime, &sourceTime) != 0)
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        // the plan is used as it is, e.g. transformCount to index the transforms - check it
+        // like a compiled one, and compile the file again if it does not pass
+        if (!ReadFile(file, pPlan, sizeof(*pPlan), &cbRead, NULL) ||
+            cbRead != sizeof(*pPlan) ||
+            pPlan->version != PIPELINE_PLAN_VERSION ||
+            !IsValidPlan(*pPlan))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+    }
+    while(false);
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
+
+HRESULT CPipelineCompiler::SaveCachedPlan(PCWSTR path, const FILETIME& sourceTime,
+    const PipelinePlan& plan)
+{
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    WCHAR planPath[MAX_PATH];
+    PipelinePlanCacheHeader header;
+    DWORD cbWritten = 0;
+
+    do
+    {
+        hr = GetPlanPath(path, planPath, ARRAYSIZE(planPath));
+        BREAK_ON_FAIL(hr);
+
+        file = CreateFile(planPath, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+            FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        header.magic = PIPELINE_PLAN_MAGIC;
+        header.planSize = sizeof(PipelinePlan);
+        header.sourceTime = sourceTime;
+
+        if (!WriteFile(file, &header, sizeof(header), &cbWritten, NULL) ||
+            !WriteFile(file, &plan, sizeof(plan), &cbWritten, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+    }
+    while(false);
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+
+        // never leave a half written plan behind
+        if (FAILED(hr))
+        {
+            DeleteFile(planPath);
+        }
+    }
+
+    return hr;
+}
+
+
+HRESULT CPipelineCompiler::Fail(HRESULT hr, PCWSTR format, ...)
+{
+    va_list args;
+
+    // keep the first error - it is the one that explains the others
+    if (m_error[0] == L'\0')
+    {
+        va_start(args, format);
+        vswprintf_s(m_error, format, args);
+        va_end(args);
+    }
+
+    return hr;
+}
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "Common.h"
+
+#include <mfapi.h>
+
+
+
+// largest number of effect transforms a pipeline file can chain
+#define PIPELINE_MAX_TRANSFORMS     8
+
+// version of the PipelinePlan layout - a cached plan of another version is re-planned
+#define PIPELINE_PLAN_VERSION       2
+
+
+//
+//  Where the video of the pipeline goes.
+//
+enum PipelineSinkType
+{
+    PipelineSink_Window = 0,    // the EVR in the application window
+    PipelineSink_Frames         // the frame sink - the player runs headless
+};
+
+
+//
+//  The compiled form of a pipeline file: every name resolved, every value validated, and
+//  the buffer plan derived from the formats.  A plan is plain data, so it is cached next to
+//  the pipeline file as is and loaded without re-planning while the file is unchanged.
+//
+struct PipelinePlan
+{
+    DWORD       version;                    // PIPELINE_PLAN_VERSION
+
+    // source
+    UINT32      deviceIndex;                // capture device to open if no name is given
+    WCHAR       deviceName[128];            // part of the device friendly name, may be empty
+    UINT32      width;                      // capture size, 0 for the device default
+    UINT32      height;
+    RECT        crop;                       // region cropped right after the source, empty for none
+
+    // transforms, in the order the video goes through them
+    DWORD       transformCount;
+    CLSID       transforms[PIPELINE_MAX_TRANSFORMS];
+
+    // sink
+    PipelineSinkType sinkType;
+    GUID        sinkSubtype;                // format delivered to the frame sink, GUID_NULL for any
+
+    // buffer plan
+    DWORD       frameBytes;                 // bytes of one frame in the sink format, 0 if unknown
+    UINT32      framesInFlight;             // frames the pipeline stages may hold at once
+    UINT32      workerCount;                // scheduler workers, 0 for one per core
+    UINT32      poolBuffers;                // buffers preallocated by the frame servers
+    UINT32      clientQueueDepth;           // packets queued per frame server client
+};
+
+
+//
+//  Turns a pipeline file into a PipelinePlan.  The file is an INI file:
+//
+//      [source]
+//      device=0                    ; index of the capture device
+//      deviceName=Logitech         ; or part of its friendly name
+//      width=1280                  ; optional capture size
+//      height=720
+//      crop=320,180,640,360        ; optional region: left,top,width,height
+//
+//      [transform0]                ; effects, numbered from 0 without gaps
+//      name=Stabilization          ; part of the MFT friendly name
+//      clsid={...}                 ; or its CLSID
+//
+//      [sink]
+//      type=frames                 ; "window" or "frames"
+//      format=NV12                 ; YUY2, NV12 or RGB32 - frames only
+//
+//      [buffers]
+//      framesInFlight=3
+//      workers=0
+//      poolBuffers=4
+//      clientQueue=4
+//
+//  Compile() reuses the cached plan when the file has not changed since it was planned.
+//
+class CPipelineCompiler
+{
+    public:
+        CPipelineCompiler(void);
+
+        HRESULT Compile(PCWSTR path, PipelinePlan* pPlan);
+
+        // description of the first error found by the last Compile() call
+        PCWSTR GetError(void) const { return m_error; }
+
+    private:
+        HRESULT Parse(PCWSTR path, PipelinePlan* pPlan);
+        HRESULT ParseCrop(PCWSTR path, PipelinePlan* pPlan);
+        HRESULT ParseTransform(PCWSTR path, DWORD index, CLSID* pClsid);
+        HRESULT ResolveTransform(PCWSTR name, CLSID* pClsid);
+        HRESULT PlanBuffers(PipelinePlan* pPlan);
+        bool IsValidPlan(const PipelinePlan& plan);
+        HRESULT ReadNumber(PCWSTR path, PCWSTR section, PCWSTR key, UINT32 defaultValue,
+            UINT32 minValue, UINT32 maxValue, UINT32* pValue);
+
+        HRESULT LoadCachedPlan(PCWSTR path, const FILETIME& sourceTime, PipelinePlan* pPlan);
+        HRESULT SaveCachedPlan(PCWSTR path, const FILETIME& sourceTime, const PipelinePlan& plan);
+
+        HRESULT Fail(HRESULT hr, PCWSTR format, ...);
+
+        WCHAR m_error[256];
+};
@@ -0,0 +1,14 @@
+#include "PixelKernels.h"
+
+#include <math.h>
+
+
+
+void BuildGammaLut(float gamma, BYTE* pTable)
+{
+    for (int i = 0; i < 256; i++)
+    {
+        float value = 255.0f * powf(i / 255.0f, 1.0f / gamma);
+        pTable[i] = ClipByte((int)(value + 0.5f));
+    }
+}
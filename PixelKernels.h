@@ -0,0 +1,285 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameView.h"
+
+
+
+//
+//  Fused pixel kernels.  A kernel reads a frame in its capture format, converts every pixel
+//  to BGRA, runs it through a chain of per-pixel operations and writes it in the output
+//  format, scaling with the nearest source pixel on the way - all in one pass over the
+//  output, so no intermediate frame is ever written.  Downscaling a 4K frame this way reads
+//  only the source pixels that are used and writes only the small output, instead of
+//  writing and re-reading a full size BGRA frame and a full size effect output.
+//
+//  The reader, the operation chain and the writer are template parameters, so every
+//  combination is compiled into its own loop with the operations inlined.  Operations that
+//  are only known at run time go through CallbackOp, which still runs in the same single
+//  pass at the cost of an indirect call per pixel.
+//
+
+
+
+//
+//  One pixel in the common format of the operations.
+//
+struct Bgra
+{
+    BYTE b;
+    BYTE g;
+    BYTE r;
+    BYTE a;
+};
+
+
+static inline BYTE ClipByte(int value)
+{
+    return (BYTE)((value < 0) ? 0 : ((value > 255) ? 255 : value));
+}
+
+
+//
+// BT.601 limited range YCbCr to BGRA.
+//
+static inline Bgra YuvToBgra(int y, int u, int v)
+{
+    Bgra pixel;
+    int c = 298 * (y - 16);
+    int d = u - 128;
+    int e = v - 128;
+
+    pixel.b = ClipByte((c + 516 * d + 128) >> 8);
+    pixel.g = ClipByte((c - 100 * d - 208 * e + 128) >> 8);
+    pixel.r = ClipByte((c + 409 * e + 128) >> 8);
+    pixel.a = 255;
+
+    return pixel;
+}
+
+
+
+//
+//  Readers - return the BGRA value of a source pixel on the current row.
+//
+class Yuy2Reader
+{
+    public:
+        Yuy2Reader(CFrameView* pFrame) : m_plane(pFrame->Plane(0)), m_pRow(NULL) {}
+
+        void SetRow(UINT32 y) { m_pRow = m_plane.pData + (LONG)y * m_plane.stride; }
+
+        Bgra Read(UINT32 x) const
+        {
+            // Y0 U Y1 V - one U/V pair for every two pixels
+            const BYTE* pPair = m_pRow + (x & ~1u) * 2;
+            return YuvToBgra(pPair[(x & 1) * 2], pPair[1], pPair[3]);
+        }
+
+    private:
+        FramePlane m_plane;
+        const BYTE* m_pRow;
+};
+
+
+class Nv12Reader
+{
+    public:
+        Nv12Reader(CFrameView* pFrame) :
+            m_luma(pFrame->Plane(0)), m_chroma(pFrame->Plane(1)), m_pRow(NULL), m_pUV(NULL) {}
+
+        void SetRow(UINT32 y)
+        {
+            m_pRow = m_luma.pData + (LONG)y * m_luma.stride;
+            m_pUV = m_chroma.pData + (LONG)(y / 2) * m_chroma.stride;
+        }
+
+        Bgra Read(UINT32 x) const
+        {
+            const BYTE* pUV = m_pUV + (x & ~1u);
+            return YuvToBgra(m_pRow[x], pUV[0], pUV[1]);
+        }
+
+    private:
+        FramePlane m_luma;
+        FramePlane m_chroma;
+        const BYTE* m_pRow;
+        const BYTE* m_pUV;
+};
+
+
+class Rgb32Reader
+{
+    public:
+        Rgb32Reader(CFrameView* pFrame) : m_plane(pFrame->Plane(0)), m_pRow(NULL) {}
+
+        void SetRow(UINT32 y) { m_pRow = m_plane.pData + (LONG)y * m_plane.stride; }
+
+        Bgra Read(UINT32 x) const
+        {
+            Bgra pixel = ((const Bgra*)m_pRow)[x];
+            pixel.a = 255;
+            return pixel;
+        }
+
+    private:
+        FramePlane m_plane;
+        const BYTE* m_pRow;
+};
+
+
+
+//
+//  Operations - map one BGRA pixel to another.
+//
+struct NoOp
+{
+    Bgra operator()(const Bgra& pixel) const { return pixel; }
+};
+
+
+// apply a 256-entry table to the color channels, e.g. a gamma or contrast curve
+struct LutOp
+{
+    LutOp(const BYTE* pTable) : pTable(pTable) {}
+
+    Bgra operator()(const Bgra& pixel) const
+    {
+        Bgra result;
+        result.b = pTable[pixel.b];
+        result.g = pTable[pixel.g];
+        result.r = pTable[pixel.r];
+        result.a = pixel.a;
+        return result;
+    }
+
+    const BYTE* pTable;
+};
+
+
+// run First, then Second
+template <class First, class Second>
+struct ChainOp
+{
+    ChainOp(const First& first, const Second& second) : first(first), second(second) {}
+
+    Bgra operator()(const Bgra& pixel) const { return second(first(pixel)); }
+
+    First first;
+    Second second;
+};
+
+template <class First, class Second>
+inline ChainOp<First, Second> Chain(const First& first, const Second& second)
+{
+    return ChainOp<First, Second>(first, second);
+}
+
+
+// operation chosen at run time
+typedef Bgra (*PixelOpProc)(const Bgra& pixel, void* pContext);
+
+struct CallbackOp
+{
+    CallbackOp(PixelOpProc pProc, void* pContext) : pProc(pProc), pContext(pContext) {}
+
+    Bgra operator()(const Bgra& pixel) const { return pProc(pixel, pContext); }
+
+    PixelOpProc pProc;
+    void* pContext;
+};
+
+
+
+//
+//  Writers - store a BGRA pixel in the output format.
+//
+struct Bgr24Writer
+{
+    enum { BytesPerPixel = 3 };
+
+    static void Write(BYTE* pDest, const Bgra& pixel)
+    {
+        pDest[0] = pixel.b;
+        pDest[1] = pixel.g;
+        pDest[2] = pixel.r;
+    }
+};
+
+
+struct Bgra32Writer
+{
+    enum { BytesPerPixel = 4 };
+
+    static void Write(BYTE* pDest, const Bgra& pixel) { *(Bgra*)pDest = pixel; }
+};
+
+
+
+//
+//  Output rows [firstRow, firstRow + rowCount) of the fused kernel - disjoint row ranges can
+//  run in parallel.  The source coordinates are stepped in 16.16 fixed point.
+//
+template <class Reader, class Op, class Writer>
+void FusedConvertScale(CFrameView* pFrame, BYTE* pDest, LONG destStride, UINT32 destWidth,
+    UINT32 destHeight, UINT32 firstRow, UINT32 rowCount, const Op& op)
+{
+    const FrameFormat& format = pFrame->Format();
+    ULONGLONG stepX = ((ULONGLONG)format.width << 16) / destWidth;
+    Reader reader(pFrame);
+
+    for (UINT32 y = firstRow; y < firstRow + rowCount && y < destHeight; y++)
+    {
+        BYTE* pOut = pDest + (LONG)y * destStride;
+        ULONGLONG srcX = 0;
+
+        reader.SetRow((UINT32)((ULONGLONG)y * format.height / destHeight));
+
+        for (UINT32 x = 0; x < destWidth; x++, srcX += stepX, pOut += Writer::BytesPerPixel)
+        {
+            Writer::Write(pOut, op(reader.Read((UINT32)(srcX >> 16))));
+        }
+    }
+}
+
+
+//
+//  Pick the reader for the pixel format of the frame.
+//
+template <class Writer, class Op>
+HRESULT ConvertScaleFrame(CFrameView* pFrame, BYTE* pDest, LONG destStride, UINT32 destWidth,
+    UINT32 destHeight, UINT32 firstRow, UINT32 rowCount, const Op& op)
+{
+    const GUID& subtype = pFrame->Format().subtype;
+
+    if (destWidth == 0 || destHeight == 0)
+    {
+        return E_INVALIDARG;
+    }
+
+    if (subtype == MFVideoFormat_YUY2)
+    {
+        FusedConvertScale<Yuy2Reader, Op, Writer>(pFrame, pDest, destStride, destWidth,
+            destHeight, firstRow, rowCount, op);
+    }
+    else if (subtype == MFVideoFormat_NV12)
+    {
+        FusedConvertScale<Nv12Reader, Op, Writer>(pFrame, pDest, destStride, destWidth,
+            destHeight, firstRow, rowCount, op);
+    }
+    else if (subtype == MFVideoFormat_RGB32)
+    {
+        FusedConvertScale<Rgb32Reader, Op, Writer>(pFrame, pDest, destStride, destWidth,
+            destHeight, firstRow, rowCount, op);
+    }
+    else
+    {
+        return MF_E_INVALIDMEDIATYPE;
+    }
+
+    return S_OK;
+}
+
+
+// fill a LutOp table with a gamma curve - values above 1.0 brighten the mid tones
+void BuildGammaLut(float gamma, BYTE* pTable);
@@ -1,18 +1,45 @@
 
 #include "Player.h"
+#include "Startup.h"
+#include "Tracer.h"
+
+#include <stdio.h>
 
 
 
 //
-//  CPlayer constructor - instantiates internal objects and initializes MF
+//  CPlayer constructor - instantiates internal objects and initializes MF.  If videoWindow
+//  is NULL the player runs headless: no renderer is created, and the video frames are
+//  delivered to the registered frame consumers instead.
 //
 CPlayer::CPlayer(HWND videoWindow, HRESULT* pHr) :
+    m_metricLabels(CreateMetricLabels()),
+    m_frameConsumers(m_metricLabels.c_str()),
     m_pSession(NULL),
+    m_pipeline(&m_scheduler, m_metricLabels.c_str()),
+    m_workerCount(0),
+    m_hasPipelineRegion(false),
+    m_frameStatsEnabled(false),
+    m_framePyramidEnabled(false),
+    m_audioEnabled(false),
     m_hwndVideo(videoWindow),
     m_state(PlayerState_Closed),
+    m_closeCompleteEvent(NULL),
+    m_endOfPresentationEvent(NULL),
+    m_eventBus(m_metricLabels.c_str()),
+    m_controlThread(NULL),
     m_nRefCount(1)
 {
     HRESULT hr = S_OK;
+    CMetricsRegistry* pMetrics = GetMetricsRegistry();
+
+    m_pSessionsMetric = pMetrics->CreateCounter("mfcp_sessions_total",
+        "Media sessions created by the player.", m_metricLabels.c_str());
+    m_pSessionErrorsMetric = pMetrics->CreateCounter("mfcp_session_errors_total",
+        "Media session events that reported a failure.", m_metricLabels.c_str());
+    m_pStateMetric = pMetrics->CreateGauge("mfcp_player_state",
+        "State of the player - 0 closed, 1 ready, 2 opening, 3 started, 4 paused, "
+        "5 stopped, 6 closing.", m_metricLabels.c_str(), 1.0, ReadState, this);
 
     do
     {
@@ -24,10 +51,23 @@ CPlayer::CPlayer(HWND videoWindow, HRESULT* pHr) :
         hr = MFStartup(MF_VERSION);
         BREAK_ON_FAIL(hr);
 
+        CStartupTimeline::Mark(StartupPhase_Platform);
+
         // create an event that will be fired when the asynchronous IMFMediaSession::Close() 
         // operation is complete
         m_closeCompleteEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
         BREAK_ON_NULL(m_closeCompleteEvent, E_UNEXPECTED);
+
+        // the topology builder hands the consumers to the frame sink it creates
+        m_topoBuilder.SetFrameConsumers(&m_frameConsumers);
+
+        // the pipeline reports its failures to the control thread
+        m_pipeline.SetEventBus(&m_eventBus);
+
+        BREAK_ON_NULL(m_eventBus.GetWaitHandle(), E_UNEXPECTED);
+
+        m_controlThread = CreateThread(NULL, 0, ControlThreadProc, this, 0, NULL);
+        BREAK_ON_NULL(m_controlThread, HRESULT_FROM_WIN32(GetLastError()));
     }
     while(false);
 
@@ -36,9 +76,34 @@ CPlayer::CPlayer(HWND videoWindow, HRESULT* pHr) :
 
 
 
+//
+// Every player labels its metrics, and those of its frame path, with its own number - with
+// a second camera in the process they would export the same series twice otherwise.
+//
+std::string CPlayer::CreateMetricLabels(void)
+{
+    static volatile long s_playerCount = 0;
+    char labels[32];
+
+    sprintf_s(labels, "player=\"%ld\"", InterlockedIncrement(&s_playerCount) - 1);
+
+    return std::string(labels);
+}
+
+
 CPlayer::~CPlayer(void)
 {
-    CloseSession();
+    Shutdown();
+
+    // the control thread is needed until the session is closed - it signals the close
+    if (m_controlThread != NULL)
+    {
+        if (SUCCEEDED(PostCommand(PlayerCommand_Quit)))
+        {
+            WaitForSingleObject(m_controlThread, INFINITE);
+        }
+        CloseHandle(m_controlThread);
+    }
 
     // Shutdown the Media Foundation platform
     MFShutdown();
@@ -48,41 +113,83 @@ CPlayer::~CPlayer(void)
 
     // close the event
     CloseHandle(m_closeCompleteEvent);
+
+    GetMetricsRegistry()->Remove(m_pSessionsMetric);
+    GetMetricsRegistry()->Remove(m_pSessionErrorsMetric);
+    GetMetricsRegistry()->Remove(m_pStateMetric);
+}
+
+
+//
+// Close the session, which releases the reference it holds through BeginGetEvent(), and
+// let the frames still in the pipeline finish before the workers go away.  Calling it
+// again, e.g. from the destructor, does nothing.
+//
+HRESULT CPlayer::Shutdown(void)
+{
+    HRESULT hr = CloseSession();
+
+    m_frameConsumers.Remove(&m_pipeline);
+    m_pipeline.Drain();
+    m_scheduler.Stop();
+
+    return hr;
 }
 
 
 //
-// Receive asynchronous event.
+// Receive asynchronous event.  The event is only posted to the control thread, without
+// taking the lock of the player, so the session can deliver its next event right away.
 //
 HRESULT CPlayer::Invoke(IMFAsyncResult* pAsyncResult)
 {
+    CComPtr<IUnknown> pState;
+    CComPtr<IMFMediaEventGenerator> pSession;
     CComPtr<IMFMediaEvent> pEvent;
+    MediaEventType eventType = MEUnknown;
     HRESULT hr = S_OK;
 
     do
     {
-        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
-
         BREAK_ON_NULL(pAsyncResult, E_UNEXPECTED);
 
+        // The session that asked for the event is the state of the request - m_pSession
+        // may change under the control thread.
+        hr = pAsyncResult->GetState(&pState);
+        BREAK_ON_FAIL(hr);
+
+        hr = pState->QueryInterface(IID_IMFMediaEventGenerator, (void**)&pSession);
+        BREAK_ON_FAIL(hr);
+
         // Get the event from the event queue.
-        hr = m_pSession->EndGetEvent(pAsyncResult, &pEvent);
+        hr = pSession->EndGetEvent(pAsyncResult, &pEvent);
         BREAK_ON_FAIL(hr);
 
-        // If the player is not closing, process the media event - if it is, do nothing.
-        if (m_state != PlayerState_Closing)
+        hr = pEvent->GetType(&eventType);
+        BREAK_ON_FAIL(hr);
+
+        // CloseSession() waits for this event holding the lock, which the control thread
+        // may be waiting for with an earlier batch - signal it from here
+        if (eventType == MESessionClosed)
         {
-            hr = ProcessMediaEvent(pEvent);
-            BREAK_ON_FAIL(hr);
+            SetEvent(m_closeCompleteEvent);
         }
 
-        // If the media event is MESessionClosed, it is guaranteed to be the last event.  If
-        // the event is MESessionClosed, ProcessMediaEvent() will return S_FALSE.  In that 
-        // case do not request the next event - otherwise tell the media session that this 
-        // player is the object that will handle the next event in the queue.
-        if(hr != S_FALSE)
+        // The event is lost if it cannot be posted, but the session must still be asked for
+        // the next one - otherwise the player would never hear from it again.
+        hr = m_eventBus.Post(BusEvent_Session, eventType, S_OK, 0, pEvent);
+        if (FAILED(hr))
         {
-            hr = m_pSession->BeginGetEvent(this, NULL);
+            OutputDebugString(L"player: session event dropped, it could not be posted\n");
+            CTracer::Instant("player", "session event dropped", "type", eventType);
+        }
+
+        // If the media event is MESessionClosed, it is guaranteed to be the last event - do
+        // not request the next event.  Otherwise tell the media session that this player
+        // is the object that will handle the next event in the queue.
+        if (eventType != MESessionClosed)
+        {
+            hr = pSession->BeginGetEvent(this, pSession);
             BREAK_ON_FAIL(hr);
         }
     }
@@ -93,6 +200,154 @@ HRESULT CPlayer::Invoke(IMFAsyncResult* pAsyncResult)
 
 
 
+DWORD WINAPI CPlayer::ControlThreadProc(LPVOID pParam)
+{
+    CPlayer* pPlayer = (CPlayer*)pParam;
+
+    // the session events were handled on Media Foundation work queue threads before - keep
+    // the same apartment
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+
+    CTracer::SetThreadName("player control");
+
+    pPlayer->ControlLoop();
+
+    if (SUCCEEDED(hr))
+    {
+        CoUninitialize();
+    }
+
+    return 0;
+}
+
+
+//
+// Wait for events and handle everything that is pending as one batch, under one lock.
+//
+// MESessionClosed is signaled to CloseSession() by Invoke().  It is the last event of its
+// session, so any session event ahead of it in the batch belongs to the closed session too
+// and is skipped.
+//
+void CPlayer::ControlLoop(void)
+{
+    bool quit = false;
+
+    while (!quit)
+    {
+        BusEvent* pBatch = NULL;
+        const BusEvent* pLastClosed = NULL;
+        bool staleSession = false;
+        UINT32 count = 0;
+
+        WaitForSingleObject(m_eventBus.GetWaitHandle(), INFINITE);
+
+        pBatch = m_eventBus.Drain(&count);
+        if (pBatch == NULL)
+        {
+            continue;
+        }
+
+        for (const BusEvent* pEvent = pBatch; pEvent != NULL; pEvent = pEvent->pNext)
+        {
+            if (pEvent->type == BusEvent_Session && pEvent->code == MESessionClosed)
+            {
+                pLastClosed = pEvent;
+            }
+        }
+
+        staleSession = (pLastClosed != NULL);
+
+        {
+            CTraceSpan span("player", "event batch", count);
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            for (const BusEvent* pEvent = pBatch; pEvent != NULL; pEvent = pEvent->pNext)
+            {
+                if (pEvent->type == BusEvent_Command && pEvent->code == PlayerCommand_Quit)
+                {
+                    quit = true;
+                }
+                else if (pEvent->type != BusEvent_Session || !staleSession)
+                {
+                    HandleBusEvent(pEvent);
+                }
+
+                if (pEvent == pLastClosed)
+                {
+                    staleSession = false;
+                }
+            }
+        }
+
+        m_eventBus.Free(pBatch);
+    }
+}
+
+
+//
+// Handle one event of the bus - called on the control thread with the lock held.
+//
+void CPlayer::HandleBusEvent(const BusEvent* pEvent)
+{
+    CComPtr<IMFMediaEvent> pMediaEvent;
+    WCHAR message[96];
+
+    switch (pEvent->type)
+    {
+    case BusEvent_Session:
+        // If the player is not closing, process the media event - if it is, do nothing.
+        if (m_state != PlayerState_Closing && pEvent->pObject != NULL &&
+            SUCCEEDED(pEvent->pObject->QueryInterface(IID_IMFMediaEvent, (void**)&pMediaEvent)))
+        {
+            ProcessMediaEvent(pMediaEvent);
+        }
+        break;
+
+    case BusEvent_Command:
+        RunCommand((PlayerCommand)pEvent->code);
+        break;
+
+    case BusEvent_Device:
+        // a removed camera fails the session, which reports it with its own events
+        CTracer::Instant("player", "device change", "change", pEvent->code);
+        break;
+
+    case BusEvent_PipelineError:
+        CTracer::Instant("pipeline", "error", "stage", pEvent->code);
+
+        swprintf_s(message, L"pipeline: stage %u failed, hr 0x%08x\n", pEvent->code,
+            pEvent->status);
+        OutputDebugString(message);
+        break;
+    }
+}
+
+
+void CPlayer::RunCommand(PlayerCommand command)
+{
+    if (command == PlayerCommand_Play)
+    {
+        Play();
+    }
+    else if (command == PlayerCommand_Pause)
+    {
+        Pause();
+    }
+    else if (command == PlayerCommand_TogglePause)
+    {
+        if (m_state == PlayerState_Started)
+        {
+            Pause();
+        }
+        else if (m_state == PlayerState_Paused)
+        {
+            Play();
+        }
+    }
+}
+
+
+
 //
 //  Called by Invoke() to do the actual event processing, and determine what, if anything,
 //  needs to be done.  Returns S_FALSE if the media event type is MESessionClosed.
@@ -112,6 +367,8 @@ HRESULT CPlayer::ProcessMediaEvent(CComPtr<IMFMediaEvent>& pMediaEvent)
         hr = pMediaEvent->GetType(&eventType);
         BREAK_ON_FAIL(hr);
 
+        CTracer::Instant("player", "session event", "type", eventType);
+
         // Get the event status. If the operation that triggered the event did
         // not succeed, the status is a failure code.
         hr = pMediaEvent->GetStatus(&hrStatus);
@@ -120,6 +377,11 @@ HRESULT CPlayer::ProcessMediaEvent(CComPtr<IMFMediaEvent>& pMediaEvent)
         // Check if the async operation succeeded.
         if (FAILED(hrStatus))
         {
+            if (m_pSessionErrorsMetric != NULL)
+            {
+                m_pSessionErrorsMetric->Add(1);
+            }
+
             hr = hrStatus;
             break;
         }
@@ -133,19 +395,36 @@ HRESULT CPlayer::ProcessMediaEvent(CComPtr<IMFMediaEvent>& pMediaEvent)
 
             if (TopoStatus == MF_TOPOSTATUS_READY)
             {
-                m_state = PlayerState_Stopped;
+                CStartupTimeline::Mark(StartupPhase_Topology);
+
+                SetState(PlayerState_Stopped);
 
                 hr = OnTopologyReady();
             }
         }
+        else if(eventType == MESessionStarted)
+        {
+            CStartupTimeline::Mark(StartupPhase_Started);
+
+            // the EVR presents the first frame as the session starts - without it, the
+            // frame sink marks the first frame it delivers
+            if (!IsHeadless())
+            {
+                CStartupTimeline::Mark(StartupPhase_FirstFrame);
+            }
+        }
         else if(eventType == MEEndOfPresentation)
         {
-            m_state = PlayerState_Stopped;
+            SetState(PlayerState_Stopped);
+
+            if (m_endOfPresentationEvent != NULL)
+            {
+                SetEvent(m_endOfPresentationEvent);
+            }
         }
         else if (eventType == MESessionClosed)
         {
-            // signal to anybody listening that the session is closed
-            SetEvent(m_closeCompleteEvent);
+            // Invoke() has already signaled m_closeCompleteEvent
             hr = S_FALSE;
         }
     }
@@ -219,6 +498,8 @@ HRESULT CPlayer::OpenURL(PCWSTR sURL)
     {
         CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
 
+        CStartupTimeline::Mark(StartupPhase_Open);
+
         // create a media session if one doesn't exist already
         if(m_pSession == NULL)
         {
@@ -242,14 +523,14 @@ HRESULT CPlayer::OpenURL(PCWSTR sURL)
         // - not playing yet, but ready to begin.
         if(m_state == PlayerState_Ready)
         {
-            m_state = PlayerState_OpenPending;
+            SetState(PlayerState_OpenPending);
         }
     }
     while(false);
 
     if (FAILED(hr))
     {
-        m_state = PlayerState_Closed;
+        SetState(PlayerState_Closed);
     }
 
     return hr;
@@ -282,7 +563,7 @@ HRESULT CPlayer::Play(void)
         BREAK_ON_FAIL(hr);
 
         // if we got here, everything was properly started
-        m_state = PlayerState_Started;
+        SetState(PlayerState_Started);
     }
     while(false);
 
@@ -316,13 +597,64 @@ HRESULT CPlayer::Pause(void)
         BREAK_ON_FAIL(hr);
 
         // if we got here, everything is properly paused
-        m_state = PlayerState_Paused;
+        SetState(PlayerState_Paused);
+    }
+    while(false);
+
+    return hr;
+}
+
+//
+//  Continue playback at the given time - frame files only, a camera cannot seek.
+//
+HRESULT CPlayer::Seek(LONGLONG time)
+{
+    HRESULT hr = S_OK;
+    PROPVARIANT varStart;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_state != PlayerState_Started && m_state != PlayerState_Paused &&
+            m_state != PlayerState_Stopped)
+        {
+            hr = MF_E_INVALIDREQUEST;
+            break;
+        }
+
+        BREAK_ON_NULL(m_pSession, E_UNEXPECTED);
+
+        PropVariantInit(&varStart);
+        varStart.vt = VT_I8;
+        varStart.hVal.QuadPart = time;
+
+        // the session seeks the source, flushes the pipeline and plays from the new position
+        hr = m_pSession->Start(&GUID_NULL, &varStart);
+
+        PropVariantClear(&varStart);
+        BREAK_ON_FAIL(hr);
+
+        SetState(PlayerState_Started);
     }
     while(false);
 
     return hr;
 }
 
+
+//
+//  Read the frame of the open frame file shown at the given time.
+//
+HRESULT CPlayer::GetSnapshot(LONGLONG time, IMFSample** ppSample)
+{
+    CTraceSpan span("snapshot", "GetSnapshot", time);
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    return m_topoBuilder.GetSnapshot(time, ppSample);
+}
+
+
 //
 //  Repaints the video window - called from main windows message loop when WM_PAINT
 // is received.
@@ -330,6 +662,7 @@ HRESULT CPlayer::Pause(void)
 HRESULT CPlayer::Repaint(void)
 {
     HRESULT hr = S_OK;
+    CTraceSpan span("render", "Repaint");
 
     if (m_pVideoDisplay)
     {
@@ -344,6 +677,262 @@ HRESULT CPlayer::Repaint(void)
 
 
 
+//
+//  Register a consumer that will receive every video frame in headless mode - or only a
+//  region of every frame, as a view into the captured buffer.
+//
+HRESULT CPlayer::AddFrameConsumer(IFrameConsumer* pConsumer, const RECT* pRegion)
+{
+    return m_frameConsumers.Add(pConsumer, pRegion);
+}
+
+
+//
+//  Unregister a frame consumer.  The consumer is not called again after this returns.
+//
+HRESULT CPlayer::RemoveFrameConsumer(IFrameConsumer* pConsumer)
+{
+    return m_frameConsumers.Remove(pConsumer);
+}
+
+
+
+//
+//  Add a processing stage at the end of the frame pipeline.  The scheduler workers are only
+//  started when the first stage is added.
+//
+HRESULT CPlayer::AddFrameStage(IFrameStage* pStage)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_scheduler.GetWorkerCount() == 0)
+        {
+            // by default one worker per logical processor, or per core of the transform
+            // affinity
+            hr = m_scheduler.Start(m_workerCount);
+            BREAK_ON_FAIL(hr);
+        }
+
+        hr = m_pipeline.AddStage(pStage);
+        BREAK_ON_FAIL(hr);
+
+        if (m_pipeline.GetStageCount() == 1)
+        {
+            hr = m_frameConsumers.Add(&m_pipeline,
+                m_hasPipelineRegion ? &m_pipelineRegion : NULL);
+            BREAK_ON_FAIL(hr);
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+//  Remove a processing stage from the frame pipeline.  The pipeline is taken off the frame
+//  consumers while the frames in flight drain, and put back if stages are left.
+//
+HRESULT CPlayer::RemoveFrameStage(IFrameStage* pStage)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        BREAK_ON_NULL(pStage, E_POINTER);
+
+        m_frameConsumers.Remove(&m_pipeline);
+        m_pipeline.Drain();
+
+        hr = m_pipeline.RemoveStage(pStage);
+
+        if (m_pipeline.GetStageCount() > 0)
+        {
+            HRESULT hrAdd = m_frameConsumers.Add(&m_pipeline,
+                m_hasPipelineRegion ? &m_pipelineRegion : NULL);
+            hr = FAILED(hr) ? hr : hrAdd;
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Run the frame stages on a region of the frame only, NULL for the whole frame.
+//
+HRESULT CPlayer::SetPipelineRegion(const RECT* pRegion)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_hasPipelineRegion = (pRegion != NULL);
+    if (pRegion != NULL)
+    {
+        m_pipelineRegion = *pRegion;
+    }
+
+    // the pipeline is registered with the first stage
+    if (m_pipeline.GetStageCount() == 0)
+    {
+        return S_OK;
+    }
+
+    return m_frameConsumers.SetRegion(&m_pipeline, pRegion);
+}
+
+
+
+//
+// Add the statistics stage to the frame pipeline.  Enabling it twice is harmless.
+//
+HRESULT CPlayer::EnableFrameStats(void)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_frameStatsEnabled)
+        {
+            break;
+        }
+
+        hr = AddFrameStage(&m_frameStats);
+        BREAK_ON_FAIL(hr);
+
+        m_frameStatsEnabled = true;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Add the pyramid stage to the frame pipeline.  Stages added after it find the pyramid of
+// the frame with CFramePyramid::FromFrame().
+//
+HRESULT CPlayer::EnableFramePyramid(UINT32 levelCount, PyramidFilter filter)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (m_framePyramidEnabled)
+        {
+            break;
+        }
+
+        m_framePyramid.SetLevelCount(levelCount);
+        m_framePyramid.SetFilter(filter);
+
+        hr = AddFrameStage(&m_framePyramid);
+        BREAK_ON_FAIL(hr);
+
+        m_framePyramidEnabled = true;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Size the audio ring and have the next topology capture into it.  Only the first call
+// sets the format of the ring; the device can be changed by calling again.
+//
+HRESULT CPlayer::EnableAudioCapture(UINT32 deviceIndex, UINT32 sampleRate, UINT32 channels)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (!m_audioEnabled)
+        {
+            hr = m_audioRing.Initialize(sampleRate, channels, sampleRate * AUDIO_RING_SECONDS,
+                m_metricLabels.c_str());
+            BREAK_ON_FAIL(hr);
+
+            m_audioEnabled = true;
+        }
+
+        m_topoBuilder.SetAudioCapture(&m_audioRing, deviceIndex);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Lock-free - may be called from any thread at any rate.
+//
+HRESULT CPlayer::GetFrameStats(FrameStats* pStats) const
+{
+    if (!m_frameStatsEnabled)
+    {
+        return MF_E_NOT_INITIALIZED;
+    }
+
+    return m_frameStats.GetSnapshot(pStats);
+}
+
+
+
+//
+// Apply the plan of a pipeline file.  The topology part takes effect on the next OpenURL(),
+// and the worker count when the first frame stage is added.
+//
+HRESULT CPlayer::SetPipelinePlan(const PipelinePlan& plan)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    m_topoBuilder.SetPipelinePlan(plan);
+    m_pipeline.SetMaxFramesInFlight(plan.framesInFlight);
+    m_workerCount = plan.workerCount;
+
+    return S_OK;
+}
+
+
+
+//
+// Deliver the captured frames on the capture cores and run the stages on the transform
+// cores.  The consumer cores are for the frame consumers that own threads, which the
+// application places itself.
+//
+HRESULT CPlayer::SetPipelineAffinity(const PipelineAffinity& affinity)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        m_frameConsumers.SetDeliveryAffinity(affinity.captureCores);
+
+        hr = m_scheduler.SetAffinity(affinity.transformCores);
+        BREAK_ON_FAIL(hr);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
 //
 // Handler for MESessionTopologyReady event - starts video playback.
 //
@@ -356,6 +945,13 @@ HRESULT CPlayer::OnTopologyReady(void)
         // release any previous instance of the m_pVideoDisplay interface
         m_pVideoDisplay.Release();
 
+        // A headless topology has no EVR, so there is nothing to repaint - just start.
+        if (IsHeadless())
+        {
+            hr = Play();
+            break;
+        }
+
         // Ask the session for the IMFVideoDisplayControl interface. This interface is 
         // implemented by the EVR (Enhanced Video Renderer) and is exposed by the media 
         // session as a service.  The session will query the topology for the right 
@@ -375,6 +971,18 @@ HRESULT CPlayer::OnTopologyReady(void)
 
 
 
+//
+//  Change the state of the player, and show the change in the trace.
+//
+void CPlayer::SetState(PlayerState state)
+{
+    m_state = state;
+
+    CTracer::Counter("player", "state", state);
+}
+
+
+
 //
 //  Creates a new instance of the media session.
 //
@@ -401,11 +1009,16 @@ HRESULT CPlayer::CreateSession(void)
         BREAK_ON_FAIL(hr);
         BREAK_ON_NULL(m_pSession, E_UNEXPECTED);
 
-        m_state = PlayerState_Ready;
+        SetState(PlayerState_Ready);
+
+        if (m_pSessionsMetric != NULL)
+        {
+            m_pSessionsMetric->Add(1);
+        }
 
         // designate this class as the one that will be handling events from the media 
-        // session
-        hr = m_pSession->BeginGetEvent((IMFAsyncCallback*)this, NULL);
+        // session - the session is the state of the request, for Invoke()
+        hr = m_pSession->BeginGetEvent((IMFAsyncCallback*)this, m_pSession);
         BREAK_ON_FAIL(hr);
     }
     while(false);
@@ -426,7 +1039,7 @@ HRESULT CPlayer::CloseSession(void)
     {
         CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
 
-        m_state = PlayerState_Closing;
+        SetState(PlayerState_Closing);
 
         // release the video display object
         m_pVideoDisplay = NULL;
@@ -435,7 +1048,7 @@ HRESULT CPlayer::CloseSession(void)
         // operation to complete on another thread
         if (m_pSession != NULL)
         {
-            m_state = PlayerState_Closing;
+            SetState(PlayerState_Closing);
 
             hr = m_pSession->Close();
             
@@ -443,14 +1056,14 @@ HRESULT CPlayer::CloseSession(void)
             // shut down. That's expected and acceptable.
             if (SUCCEEDED(hr))
             {
-                // Begin waiting for the Win32 close event, fired in CPlayer::Invoke(). The 
-                // close event will indicate that the close operation is finished, and the 
-                // session can be shut down.
+                // Begin waiting for the Win32 close event, fired in Invoke(). The close
+                // event will indicate that the close operation is finished, and the 
+                // session can be shut down - which is done after a timeout too, so the
+                // session is not leaked.
                 dwWaitResult = WaitForSingleObject(m_closeCompleteEvent, 5000);
                 if (dwWaitResult == WAIT_TIMEOUT)
                 {
                     hr = E_UNEXPECTED;
-                    break;
                 }
             }
         }
@@ -462,10 +1075,13 @@ HRESULT CPlayer::CloseSession(void)
             m_pSession->Shutdown();
         }
 
+        // the session does not shut down the source it was given
+        m_topoBuilder.ShutdownSource();
+
         // release the session
         m_pSession = NULL;
 
-        m_state = PlayerState_Closed;
+        SetState(PlayerState_Closed);
     }
     while(false);
 
@@ -4,6 +4,11 @@
 #include <Mferror.h>
 
 #include "TopoBuilder.h"
+#include "FramePipeline.h"
+#include "FrameStats.h"
+#include "FramePyramid.h"
+#include "AudioRing.h"
+#include "EventBus.h"
 
 
 
@@ -21,6 +26,15 @@ enum PlayerState
                                 // MESessionClosed.
 };
 
+// Commands carried out on the control thread of the player
+enum PlayerCommand
+{
+    PlayerCommand_Play = 0,
+    PlayerCommand_Pause,
+    PlayerCommand_TogglePause,  // pause if playing, play if paused
+    PlayerCommand_Quit          // stop the control thread - used by the destructor
+};
+
 //
 //  The CPlayer class wraps MediaSession functionality and hides it from a calling 
 //  application.
@@ -31,16 +45,85 @@ class CPlayer : public IMFAsyncCallback
         CPlayer(HWND videoWindow, HRESULT* pHr);
         ~CPlayer();
 
-        // Playback control
+        // Playback control - sURL is the path of a recorded frame file, NULL for the camera
         HRESULT       OpenURL(PCWSTR sURL);
         HRESULT       Play();
         HRESULT       Pause();
+        HRESULT       Seek(LONGLONG time);
         PlayerState   GetState() const { return m_state; }
 
+        // Close the session and stop the frame pipeline - after this nothing calls the frame
+        // consumers and stages any more.  The session holds a reference to the player until
+        // it is closed, so call this before the last Release().
+        HRESULT       Shutdown();
+
+        // Event set when the presentation ends - a camera or a looped file never ends
+        void          SetEndOfPresentationEvent(HANDLE hEvent)
+                          { m_endOfPresentationEvent = hEvent; }
+
+        // Asynchronous control from any thread - the UI posts its commands and the camera
+        // hot-plug notifications of its window, and the control thread carries them out
+        // in order with the media session events
+        HRESULT       PostCommand(PlayerCommand command)
+                          { return m_eventBus.Post(BusEvent_Command, command); }
+        HRESULT       PostDeviceChange(DWORD change)
+                          { return m_eventBus.Post(BusEvent_Device, change); }
+
         // Video functionality
         HRESULT       Repaint();
         BOOL          HasVideo() const { return (m_pVideoDisplay != NULL);  }
 
+        // Frame delivery - used when the player is created without a video window
+        BOOL          IsHeadless() const { return (m_hwndVideo == NULL); }
+        HRESULT       AddFrameConsumer(IFrameConsumer* pConsumer, const RECT* pRegion = NULL);
+        HRESULT       RemoveFrameConsumer(IFrameConsumer* pConsumer);
+
+        // Per-frame processing - stages run on the work-stealing scheduler of the player
+        HRESULT       AddFrameStage(IFrameStage* pStage);
+        HRESULT       RemoveFrameStage(IFrameStage* pStage);
+        HRESULT       SetPipelineRegion(const RECT* pRegion);
+
+        // Crop the video to a region right after the source - takes effect on OpenURL()
+        void          SetCaptureRegion(const RECT* pRegion) { m_topoBuilder.SetCaptureRegion(pRegion); }
+
+        // Capture device to open - takes effect on OpenURL(), and replaces the device of the
+        // pipeline plan
+        void          SetCaptureDevice(UINT32 deviceIndex, PCWSTR deviceName = NULL)
+                          { m_topoBuilder.SetCaptureDevice(deviceIndex, deviceName); }
+
+        // With a window, also deliver the frames to the frame consumers and stages - takes
+        // effect on OpenURL()
+        void          SetFrameTap(bool tap) { m_topoBuilder.SetFrameTap(tap); }
+
+        // Pacing of the frame files passed to OpenURL() - takes effect on OpenURL()
+        void          SetReplayOptions(const FrameReplayOptions& options)
+                          { m_topoBuilder.SetReplayOptions(options); }
+
+        // Frame of the open frame file at a time in 100-ns units, read while playback goes on
+        HRESULT       GetSnapshot(LONGLONG time, IMFSample** ppSample);
+        CTaskScheduler* GetScheduler() { return &m_scheduler; }
+
+        // Per-frame statistics - exposure and focus of the latest frame, without copying it
+        HRESULT       EnableFrameStats(void);
+        HRESULT       GetFrameStats(FrameStats* pStats) const;
+
+        // Capture an audio device with the camera into a ring, on the clock of the frames -
+        // takes effect on OpenURL()
+        HRESULT       EnableAudioCapture(UINT32 deviceIndex, UINT32 sampleRate = 48000,
+                          UINT32 channels = 2);
+        CAudioRing*   GetAudioRing() { return m_audioEnabled ? &m_audioRing : NULL; }
+
+        // Luma pyramid of every frame, shared by the stages added after it
+        HRESULT       EnableFramePyramid(UINT32 levelCount, PyramidFilter filter);
+
+        // Build the next topology and size the frame pipeline from a compiled pipeline file
+        HRESULT       SetPipelinePlan(const PipelinePlan& plan);
+
+        // Placement of the capture delivery and the pipeline workers on cores
+        HRESULT       SetPipelineAffinity(const PipelineAffinity& affinity);
+        HRESULT       GetStageNumaStats(DWORD stageIndex, NumaTrafficStats* pStats)
+                          { return m_pipeline.GetStageNumaStats(stageIndex, pStats); }
+
         //
         // IMFAsyncCallback implementation.
         //
@@ -48,7 +131,7 @@ class CPlayer : public IMFAsyncCallback
         // Returning the E_NOTIMPL error code causes the system to use default parameters.
         STDMETHODIMP GetParameters(DWORD *pdwFlags, DWORD *pdwQueue)   { return E_NOTIMPL; }
 
-        // Main MF event handling function
+        // Main MF event handling function - posts the event to the control thread
         STDMETHODIMP Invoke(IMFAsyncResult* pAsyncResult);
 
         //
@@ -70,20 +153,54 @@ class CPlayer : public IMFAsyncCallback
 
         // MF event handling functionality
         HRESULT ProcessMediaEvent(CComPtr<IMFMediaEvent>& mediaEvent);    
+
+        // control thread - drains the event bus and handles every batch under one lock
+        static DWORD WINAPI ControlThreadProc(LPVOID pParam);
+        void ControlLoop(void);
+        void HandleBusEvent(const BusEvent* pEvent);
+        void RunCommand(PlayerCommand command);
     
         // Media event handlers
         HRESULT OnTopologyReady(void);
 
+        void SetState(PlayerState state);
+
+        static LONGLONG ReadState(void* pContext) { return ((CPlayer*)pContext)->m_state; }
+
+        // 'player="N"', N counting the players of the process from 0
+        static std::string CreateMetricLabels(void);
+
         volatile long m_nRefCount;                  // COM reference count.
         CComAutoCriticalSection m_critSec;          // critical section
 
+        std::string m_metricLabels;             // of the metrics of the player and its parts
         CTopoBuilder m_topoBuilder;
+        CFrameConsumerList m_frameConsumers;    // receivers of the frames in headless mode
+        CTaskScheduler m_scheduler;             // workers of the frame pipeline
+        CFramePipeline m_pipeline;              // stages run on every frame, in order
+        DWORD m_workerCount;                    // scheduler workers, 0 for one per core
+        RECT m_pipelineRegion;                  // region the stages see
+        bool m_hasPipelineRegion;               // m_pipelineRegion is valid
+        CFrameStatsStage m_frameStats;          // statistics stage, once enabled
+        bool m_frameStatsEnabled;
+        CFramePyramidStage m_framePyramid;      // pyramid stage, once enabled
+        bool m_framePyramidEnabled;
+        CAudioRing m_audioRing;                 // captured audio, once enabled
+        bool m_audioEnabled;
 
         CComPtr<IMFMediaSession> m_pSession;    
         CComPtr<IMFVideoDisplayControl> m_pVideoDisplay;
 
-        HWND m_hwndVideo;        // Video window.
+        HWND m_hwndVideo;        // Video window, NULL when running headless.
         PlayerState m_state;            // Current state of the media session.
 
         HANDLE m_closeCompleteEvent;   // event fired when session colse is complete
+        HANDLE m_endOfPresentationEvent;   // set on MEEndOfPresentation, not owned
+
+        CEventBus m_eventBus;           // session events, commands, device changes, errors
+        HANDLE m_controlThread;         // drains m_eventBus
+
+        CMetricCounter* m_pSessionsMetric;      // media sessions created
+        CMetricCounter* m_pSessionErrorsMetric; // session events that carried a failure
+        CMetricGauge* m_pStateMetric;           // m_state
 };
\ No newline at end of file
@@ -0,0 +1,285 @@
+#include "Startup.h"
+#include "Metrics.h"
+#include "Tracer.h"
+#include "TopoBuilder.h"
+
+#include <mfapi.h>
+#include <stdio.h>
+
+
+
+// names in the report and the trace, and the labels of the metric
+static const PCSTR s_phaseNames[StartupPhase_Count] =
+{
+    "platform", "window", "device", "open", "topology", "started", "first frame"
+};
+
+static const PCSTR s_phaseLabels[StartupPhase_Count] =
+{
+    "phase=\"platform\"", "phase=\"window\"", "phase=\"device\"", "phase=\"open\"",
+    "phase=\"topology\"", "phase=\"started\"", "phase=\"first_frame\""
+};
+
+static LONGLONG s_origin = 0;
+static volatile LONGLONG s_phaseTimes[StartupPhase_Count];     // from s_origin, 0 if pending
+
+
+//
+// The capture device activated in the background.  The thread writes the result before it
+// exits, and the others read it only after waiting for the thread.
+//
+struct CapturePrefetch
+{
+    HANDLE thread;
+    UINT32 deviceIndex;
+    WCHAR deviceName[128];
+    IMFMediaSource* pSource;        // NULL once taken
+    HRESULT hr;
+    bool platformStarted;           // MFStartup() succeeded on the thread
+};
+
+static CComAutoCriticalSection s_prefetchLock;
+static CapturePrefetch s_prefetch;
+
+
+
+void CStartupTimeline::Begin(void)
+{
+    s_origin = GetMetricsTime();
+}
+
+
+void CStartupTimeline::Mark(StartupPhase phase)
+{
+    LONGLONG elapsed = GetMetricsTime() - s_origin;
+    CMetricGauge* pMetric = NULL;
+
+    if (s_origin == 0 || phase < 0 || phase >= StartupPhase_Count)
+    {
+        return;
+    }
+
+    // 0 means pending - a phase completed at the origin still counts as completed
+    elapsed = max(elapsed, 1);
+
+    if (InterlockedCompareExchange64(&s_phaseTimes[phase], elapsed, 0) != 0)
+    {
+        return;
+    }
+
+    CTracer::Instant("startup", s_phaseNames[phase]);
+
+    // created on completion, so a scrape shows only the phases that completed
+    pMetric = GetMetricsRegistry()->CreateGauge("mfcp_startup_seconds",
+        "Time from the process starting to the completion of each startup phase.",
+        s_phaseLabels[phase], 1.0 / (double)GetMetricsTicksPerSecond());
+    if (pMetric != NULL)
+    {
+        pMetric->Set(elapsed);
+    }
+
+    if (phase == StartupPhase_FirstFrame)
+    {
+        Report();
+    }
+}
+
+
+double CStartupTimeline::GetPhaseTime(StartupPhase phase)
+{
+    if (phase < 0 || phase >= StartupPhase_Count || s_phaseTimes[phase] == 0)
+    {
+        return -1.0;
+    }
+
+    return (double)s_phaseTimes[phase] / (double)GetMetricsTicksPerSecond();
+}
+
+
+void CStartupTimeline::Report(void)
+{
+    char line[512] = "startup:";
+    double open = GetPhaseTime(StartupPhase_Open);
+    double firstFrame = GetPhaseTime(StartupPhase_FirstFrame);
+
+    for (int phase = 0; phase < StartupPhase_Count; phase++)
+    {
+        double time = GetPhaseTime((StartupPhase)phase);
+
+        if (time >= 0.0)
+        {
+            sprintf_s(line + strlen(line), sizeof(line) - strlen(line), " %s %.1f ms,",
+                s_phaseNames[phase], time * 1000.0);
+        }
+    }
+
+    // the camera may be opened long after the start - this part is the player alone
+    if (open >= 0.0 && firstFrame >= open)
+    {
+        sprintf_s(line + strlen(line), sizeof(line) - strlen(line),
+            " open to first frame %.1f ms", (firstFrame - open) * 1000.0);
+    }
+
+    strcat_s(line, "\n");
+    OutputDebugStringA(line);
+}
+
+
+
+
+
+static bool IsPrefetchedDevice(UINT32 deviceIndex, PCWSTR deviceName)
+{
+    bool named = (deviceName != NULL && deviceName[0] != L'\0');
+
+    if (named || s_prefetch.deviceName[0] != L'\0')
+    {
+        return named && _wcsicmp(deviceName, s_prefetch.deviceName) == 0;
+    }
+
+    return deviceIndex == s_prefetch.deviceIndex;
+}
+
+
+//
+// Start the platform and activate the device.  Media Foundation counts MFStartup() calls,
+// so the player starting it again on the UI thread later costs nothing.
+//
+static DWORD WINAPI CapturePrefetchThreadProc(LPVOID pParam)
+{
+    HRESULT hr = CoInitializeEx(NULL, COINIT_MULTITHREADED);
+    bool comInitialized = SUCCEEDED(hr);
+    IMFMediaSource* pSource = NULL;
+
+    CTracer::SetThreadName("startup prefetch");
+
+    do
+    {
+        BREAK_ON_FAIL(hr);
+
+        {
+            CTraceSpan span("startup", "MFStartup");
+            hr = MFStartup(MF_VERSION);
+        }
+        BREAK_ON_FAIL(hr);
+
+        s_prefetch.platformStarted = true;
+        CStartupTimeline::Mark(StartupPhase_Platform);
+
+        {
+            CTraceSpan span("startup", "activate device");
+            hr = CreateVideoDeviceSource(s_prefetch.deviceIndex, s_prefetch.deviceName,
+                &pSource);
+        }
+        BREAK_ON_FAIL(hr);
+
+        CStartupTimeline::Mark(StartupPhase_Device);
+    }
+    while(false);
+
+    s_prefetch.pSource = pSource;
+    s_prefetch.hr = hr;
+
+    // the source is free threaded, and the platform keeps the apartment of its work
+    // queues alive
+    if (comInitialized)
+    {
+        CoUninitialize();
+    }
+
+    return 0;
+}
+
+
+HRESULT StartCapturePrefetch(UINT32 deviceIndex, PCWSTR deviceName)
+{
+    HRESULT hr = S_OK;
+    CComCritSecLock<CComAutoCriticalSection> lock(s_prefetchLock);
+
+    do
+    {
+        if (s_prefetch.thread != NULL)
+        {
+            hr = MF_E_INVALIDREQUEST;
+            break;
+        }
+
+        ZeroMemory(&s_prefetch, sizeof(s_prefetch));
+        s_prefetch.deviceIndex = deviceIndex;
+        if (deviceName != NULL)
+        {
+            wcsncpy_s(s_prefetch.deviceName, deviceName, _TRUNCATE);
+        }
+
+        s_prefetch.thread = CreateThread(NULL, 0, CapturePrefetchThreadProc, NULL, 0, NULL);
+        BREAK_ON_NULL(s_prefetch.thread, HRESULT_FROM_WIN32(GetLastError()));
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT TakePrefetchedCaptureSource(UINT32 deviceIndex, PCWSTR deviceName,
+    IMFMediaSource** ppSource)
+{
+    HRESULT hr = S_OK;
+    CComCritSecLock<CComAutoCriticalSection> lock(s_prefetchLock);
+
+    do
+    {
+        BREAK_ON_NULL(ppSource, E_POINTER);
+        BREAK_ON_NULL(s_prefetch.thread, HRESULT_FROM_WIN32(ERROR_NOT_FOUND));
+
+        {
+            CTraceSpan span("startup", "wait for prefetch");
+            WaitForSingleObject(s_prefetch.thread, INFINITE);
+        }
+
+        hr = s_prefetch.hr;
+        BREAK_ON_FAIL(hr);
+
+        BREAK_ON_NULL(s_prefetch.pSource, HRESULT_FROM_WIN32(ERROR_NOT_FOUND));
+
+        if (!IsPrefetchedDevice(deviceIndex, deviceName))
+        {
+            hr = HRESULT_FROM_WIN32(ERROR_NOT_FOUND);
+            break;
+        }
+
+        // the caller owns the reference now
+        *ppSource = s_prefetch.pSource;
+        s_prefetch.pSource = NULL;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+void EndCapturePrefetch(void)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(s_prefetchLock);
+
+    if (s_prefetch.thread == NULL)
+    {
+        return;
+    }
+
+    WaitForSingleObject(s_prefetch.thread, INFINITE);
+    CloseHandle(s_prefetch.thread);
+    s_prefetch.thread = NULL;
+
+    if (s_prefetch.pSource != NULL)
+    {
+        s_prefetch.pSource->Shutdown();
+        s_prefetch.pSource->Release();
+        s_prefetch.pSource = NULL;
+    }
+
+    if (s_prefetch.platformStarted)
+    {
+        MFShutdown();
+        s_prefetch.platformStarted = false;
+    }
+}
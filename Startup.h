@@ -0,0 +1,70 @@
+#pragma once
+
+#include "Common.h"
+
+#include <mfidl.h>
+
+
+
+//
+//  Startup of the player, from the process starting to the first frame.
+//
+//  The timeline records when each phase of the startup completed, relative to wWinMain(),
+//  and reports the time to first frame once it is known - to the debugger output, to the
+//  trace, and as the mfcp_startup_seconds metric.  A phase is recorded the first time it
+//  completes only, so a camera opened again later does not move it.
+//
+//  The capture prefetch takes the slow part of opening the camera off the critical path:
+//  a background thread starts Media Foundation, enumerates the capture devices and
+//  activates the camera while the window comes up, and the first OpenURL() of the camera
+//  takes the activated source instead of activating it again.
+//
+
+enum StartupPhase
+{
+    StartupPhase_Platform = 0,  // Media Foundation started
+    StartupPhase_Window,        // main window shown
+    StartupPhase_Device,        // capture device enumerated and activated
+    StartupPhase_Open,          // player asked to open the camera or a file
+    StartupPhase_Topology,      // topology resolved by the media session
+    StartupPhase_Started,       // media session started
+    StartupPhase_FirstFrame,    // first frame delivered or rendered
+    StartupPhase_Count
+};
+
+
+class CStartupTimeline
+{
+    public:
+        // the origin of the timeline - called first thing in wWinMain()
+        static void Begin(void);
+
+        // the phase completed now - ignored if it completed before
+        static void Mark(StartupPhase phase);
+
+        // seconds from the origin to the phase, negative if it has not completed yet
+        static double GetPhaseTime(StartupPhase phase);
+
+        // write the completed phases to the debugger output
+        static void Report(void);
+};
+
+
+//
+//  Start activating the capture device in the background - deviceName selects the device
+//  by friendly name, as CreateVideoDeviceSource() does, NULL for the device at deviceIndex.
+//
+HRESULT StartCapturePrefetch(UINT32 deviceIndex, PCWSTR deviceName);
+
+//
+//  Take the source the prefetch activated, waiting for it if needed.  Fails if there was
+//  no prefetch, it failed, it was for another device, or the source was taken already -
+//  the caller then activates the device itself.
+//
+HRESULT TakePrefetchedCaptureSource(UINT32 deviceIndex, PCWSTR deviceName,
+    IMFMediaSource** ppSource);
+
+//
+//  Wait for the prefetch and shut down a source nobody took - called before exiting.
+//
+void EndCapturePrefetch(void);
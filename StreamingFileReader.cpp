@@ -0,0 +1,1070 @@
+#include "StreamingFileReader.h"
+
+#include <shlwapi.h>
+#include <emmintrin.h>
+#include <stdio.h>
+#include <string.h>
+
+
+
+// frames read ahead of the one being played
+#define FILE_READ_AHEAD_FRAMES      4
+
+// buffers of the pool - the frames read ahead, plus the frames held downstream
+#define FILE_POOL_FRAMES            16
+
+// longest Y4M header line accepted
+#define Y4M_MAX_HEADER              256
+
+// "FRAME\n" in front of every Y4M frame
+#define Y4M_FRAME_HEADER_BYTES      6
+
+
+
+//
+// Planar 4:2:0 to NV12 - the luma plane is copied as is, the chroma planes are interleaved.
+//
+static void I420ToNv12(const BYTE* pSource, UINT32 width, UINT32 height, BYTE* pDest)
+{
+    const BYTE* pU = pSource + width * height;
+    const BYTE* pV = pU + (width / 2) * (height / 2);
+    BYTE* pUV = pDest + width * height;
+    UINT32 chromaWidth = width / 2;
+
+    CopyMemory(pDest, pSource, width * height);
+
+    for (UINT32 y = 0; y < height / 2; y++)
+    {
+        UINT32 x = 0;
+
+        for (; x + 16 <= chromaWidth; x += 16)
+        {
+            __m128i u = _mm_loadu_si128((const __m128i*)(pU + x));
+            __m128i v = _mm_loadu_si128((const __m128i*)(pV + x));
+
+            _mm_storeu_si128((__m128i*)(pUV + x * 2), _mm_unpacklo_epi8(u, v));
+            _mm_storeu_si128((__m128i*)(pUV + x * 2 + 16), _mm_unpackhi_epi8(u, v));
+        }
+
+        for (; x < chromaWidth; x++)
+        {
+            pUV[x * 2] = pU[x];
+            pUV[x * 2 + 1] = pV[x];
+        }
+
+        pU += chromaWidth;
+        pV += chromaWidth;
+        pUV += width;
+    }
+}
+
+
+//
+// Planar 4:2:2 to YUY2 - Y0 U Y1 V, sixteen pixels per step.
+//
+static void I422ToYuy2(const BYTE* pSource, UINT32 width, UINT32 height, BYTE* pDest)
+{
+    const BYTE* pY = pSource;
+    const BYTE* pU = pSource + width * height;
+    const BYTE* pV = pU + (width / 2) * height;
+
+    for (UINT32 y = 0; y < height; y++)
+    {
+        UINT32 x = 0;
+
+        for (; x + 16 <= width; x += 16)
+        {
+            __m128i luma = _mm_loadu_si128((const __m128i*)(pY + x));
+            __m128i uv = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(pU + x / 2)),
+                _mm_loadl_epi64((const __m128i*)(pV + x / 2)));
+
+            _mm_storeu_si128((__m128i*)(pDest + x * 2), _mm_unpacklo_epi8(luma, uv));
+            _mm_storeu_si128((__m128i*)(pDest + x * 2 + 16), _mm_unpackhi_epi8(luma, uv));
+        }
+
+        for (; x < width; x += 2)
+        {
+            pDest[x * 2] = pY[x];
+            pDest[x * 2 + 1] = pU[x / 2];
+            pDest[x * 2 + 2] = pY[x + 1];
+            pDest[x * 2 + 3] = pV[x / 2];
+        }
+
+        pY += width;
+        pU += width / 2;
+        pV += width / 2;
+        pDest += width * 2;
+    }
+}
+
+
+
+//
+//  A media buffer over a pooled buffer of a read-ahead stream - the buffer goes back to the
+//  pool when the sample that holds it is released.
+//
+class CPooledFrameBuffer : public IMFMediaBuffer
+{
+    public:
+        CPooledFrameBuffer(CReadAheadStream* pStream, BYTE* pData, DWORD cbData) :
+            m_cRef(1), m_pStream(pStream), m_pData(pData), m_cbData(cbData),
+            m_cbCurrent(cbData) {}
+
+        // IUnknown interface implementation
+        STDMETHODIMP QueryInterface(REFIID riid, void** ppv);
+        STDMETHODIMP_(ULONG) AddRef(void) { return InterlockedIncrement(&m_cRef); }
+        STDMETHODIMP_(ULONG) Release(void);
+
+        // IMFMediaBuffer interface implementation
+        STDMETHODIMP Lock(BYTE** ppbBuffer, DWORD* pcbMaxLength, DWORD* pcbCurrentLength);
+        STDMETHODIMP Unlock(void) { return S_OK; }
+        STDMETHODIMP GetCurrentLength(DWORD* pcbCurrentLength);
+        STDMETHODIMP SetCurrentLength(DWORD cbCurrentLength);
+        STDMETHODIMP GetMaxLength(DWORD* pcbMaxLength);
+
+    private:
+        // the reference to the stream taken by Next() goes with the buffer
+        ~CPooledFrameBuffer(void) { m_pStream->ReturnBuffer(m_pData); }
+
+        volatile long m_cRef;
+        CReadAheadStream* m_pStream;
+        BYTE* m_pData;
+        DWORD m_cbData;
+        DWORD m_cbCurrent;
+};
+
+
+HRESULT CPooledFrameBuffer::QueryInterface(REFIID riid, void** ppv)
+{
+    if (ppv == NULL)
+    {
+        return E_POINTER;
+    }
+
+    if (riid == IID_IUnknown || riid == IID_IMFMediaBuffer)
+    {
+        *ppv = static_cast<IMFMediaBuffer*>(this);
+    }
+    else
+    {
+        *ppv = NULL;
+        return E_NOINTERFACE;
+    }
+
+    AddRef();
+    return S_OK;
+}
+
+
+ULONG CPooledFrameBuffer::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+HRESULT CPooledFrameBuffer::Lock(BYTE** ppbBuffer, DWORD* pcbMaxLength,
+    DWORD* pcbCurrentLength)
+{
+    if (ppbBuffer == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *ppbBuffer = m_pData;
+
+    if (pcbMaxLength != NULL)
+    {
+        *pcbMaxLength = m_cbData;
+    }
+
+    if (pcbCurrentLength != NULL)
+    {
+        *pcbCurrentLength = m_cbCurrent;
+    }
+
+    return S_OK;
+}
+
+
+HRESULT CPooledFrameBuffer::GetCurrentLength(DWORD* pcbCurrentLength)
+{
+    if (pcbCurrentLength == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pcbCurrentLength = m_cbCurrent;
+    return S_OK;
+}
+
+
+HRESULT CPooledFrameBuffer::SetCurrentLength(DWORD cbCurrentLength)
+{
+    if (cbCurrentLength > m_cbData)
+    {
+        return E_INVALIDARG;
+    }
+
+    m_cbCurrent = cbCurrentLength;
+    return S_OK;
+}
+
+
+HRESULT CPooledFrameBuffer::GetMaxLength(DWORD* pcbMaxLength)
+{
+    if (pcbMaxLength == NULL)
+    {
+        return E_POINTER;
+    }
+
+    *pcbMaxLength = m_cbData;
+    return S_OK;
+}
+
+
+
+
+
+CReadAheadStream::CReadAheadStream(HANDLE file) :
+    m_cRef(1),
+    m_hFile(file),
+    m_hThread(NULL),
+    m_hWakeEvent(NULL),
+    m_hReadyEvent(NULL),
+    m_firstFrame(0),
+    m_frameCount(0),
+    m_cbStoredFrame(0),
+    m_cbFrameHeader(0),
+    m_cbFrame(0),
+    m_layout(StoredFrame_Packed),
+    m_width(0),
+    m_height(0),
+    m_needsStaging(false),
+    m_readIndex(0),
+    m_generation(0),
+    m_readResult(S_OK),
+    m_stopping(false)
+{
+}
+
+
+CReadAheadStream::~CReadAheadStream(void)
+{
+    Stop();
+
+    m_pool.Shutdown();
+
+    if (m_hWakeEvent != NULL)
+    {
+        CloseHandle(m_hWakeEvent);
+    }
+
+    if (m_hReadyEvent != NULL)
+    {
+        CloseHandle(m_hReadyEvent);
+    }
+
+    CloseHandle(m_hFile);
+}
+
+
+HRESULT CReadAheadStream::Create(HANDLE file, ULONGLONG firstFrame, DWORD cbStoredFrame,
+    DWORD cbFrameHeader, StoredFrameLayout layout, const FrameFileInfo& info,
+    CReadAheadStream** ppStream)
+{
+    HRESULT hr = S_OK;
+    CReadAheadStream* pStream = NULL;
+
+    do
+    {
+        pStream = new (std::nothrow) CReadAheadStream(file);
+        if (pStream == NULL)
+        {
+            CloseHandle(file);
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        hr = pStream->Initialize(firstFrame, cbStoredFrame, cbFrameHeader, layout, info);
+        BREAK_ON_FAIL(hr);
+
+        *ppStream = pStream;
+        pStream = NULL;
+    }
+    while(false);
+
+    if (pStream != NULL)
+    {
+        pStream->Release();
+    }
+
+    return hr;
+}
+
+
+ULONG CReadAheadStream::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+HRESULT CReadAheadStream::Initialize(ULONGLONG firstFrame, DWORD cbStoredFrame,
+    DWORD cbFrameHeader, StoredFrameLayout layout, const FrameFileInfo& info)
+{
+    HRESULT hr = S_OK;
+    LARGE_INTEGER fileSize;
+
+    do
+    {
+        if (!GetFileSizeEx(m_hFile, &fileSize))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        m_firstFrame = firstFrame;
+        m_cbStoredFrame = cbStoredFrame;
+        m_cbFrameHeader = cbFrameHeader;
+        m_layout = layout;
+        m_width = info.width;
+        m_height = info.height;
+        m_cbFrame = GetPackedFrameBytes(info.subtype, info.width, info.height);
+
+        // a partial frame at the end of the file is ignored
+        if ((ULONGLONG)fileSize.QuadPart > firstFrame)
+        {
+            m_frameCount = ((ULONGLONG)fileSize.QuadPart - firstFrame) / cbStoredFrame;
+        }
+
+        // only frames stored exactly as handed out are read straight into the pool buffers
+        m_needsStaging = (layout != StoredFrame_Packed || cbFrameHeader != 0);
+
+        hr = m_pool.Initialize(m_cbFrame, FILE_READ_AHEAD_FRAMES, FILE_POOL_FRAMES,
+            NUMA_NODE_ANY, MemoryAccount_ReadAhead);
+        BREAK_ON_FAIL(hr);
+
+        m_hWakeEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        BREAK_ON_NULL(m_hWakeEvent, HRESULT_FROM_WIN32(GetLastError()));
+
+        m_hReadyEvent = CreateEvent(NULL, FALSE, FALSE, NULL);
+        BREAK_ON_NULL(m_hReadyEvent, HRESULT_FROM_WIN32(GetLastError()));
+
+        m_hThread = CreateThread(NULL, 0, ReadThreadProc, this, 0, NULL);
+        BREAK_ON_NULL(m_hThread, HRESULT_FROM_WIN32(GetLastError()));
+    }
+    while(false);
+
+    return hr;
+}
+
+
+void CReadAheadStream::Stop(void)
+{
+    HANDLE thread = NULL;
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        m_stopping = true;
+        thread = m_hThread;
+        m_hThread = NULL;
+
+        if (m_hWakeEvent != NULL)
+        {
+            SetEvent(m_hWakeEvent);
+        }
+
+        if (m_hReadyEvent != NULL)
+        {
+            SetEvent(m_hReadyEvent);
+        }
+    }
+
+    if (thread != NULL)
+    {
+        WaitForSingleObject(thread, INFINITE);
+        CloseHandle(thread);
+    }
+
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    ClearFrames();
+}
+
+
+HRESULT CReadAheadStream::Next(BYTE** ppBuffer, ULONGLONG* pFrameIndex)
+{
+    while (true)
+    {
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            if (!m_frames.empty())
+            {
+                *ppBuffer = m_frames.front().pBuffer;
+                *pFrameIndex = m_frames.front().index;
+                m_frames.pop_front();
+
+                // the buffer keeps the stream alive until it is returned
+                AddRef();
+                SetEvent(m_hWakeEvent);
+
+                return S_OK;
+            }
+
+            if (m_readResult != S_OK)
+            {
+                return m_readResult;
+            }
+
+            if (m_stopping)
+            {
+                return MF_E_SHUTDOWN;
+            }
+        }
+
+        WaitForSingleObject(m_hReadyEvent, INFINITE);
+    }
+}
+
+
+HRESULT CReadAheadStream::Seek(ULONGLONG frameIndex)
+{
+    CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+    if (frameIndex > m_frameCount)
+    {
+        return E_INVALIDARG;
+    }
+
+    // a read in progress belongs to the old generation and is thrown away
+    ClearFrames();
+    m_readIndex = frameIndex;
+    m_generation++;
+    m_readResult = S_OK;
+
+    SetEvent(m_hWakeEvent);
+
+    return S_OK;
+}
+
+
+void CReadAheadStream::ReturnBuffer(BYTE* pBuffer)
+{
+    m_pool.Return(pBuffer);
+    SetEvent(m_hWakeEvent);
+
+    Release();
+}
+
+
+//
+// A snapshot reads on the thread that asks for it, through the same positioned reads as the
+// read-ahead thread - the ring and its read position are left alone.
+//
+HRESULT CReadAheadStream::ReadAt(ULONGLONG frameIndex, BYTE** ppBuffer)
+{
+    HRESULT hr = S_OK;
+    BYTE* pBuffer = NULL;
+    std::vector<BYTE> staging;
+
+    do
+    {
+        if (frameIndex >= m_frameCount)
+        {
+            hr = MF_E_END_OF_STREAM;
+            break;
+        }
+
+        pBuffer = m_pool.Acquire();
+        BREAK_ON_NULL(pBuffer, MF_E_SAMPLEALLOCATOR_EMPTY);
+
+        hr = ReadStoredFrame(frameIndex, pBuffer, staging);
+        if (FAILED(hr))
+        {
+            m_pool.Return(pBuffer);
+            break;
+        }
+
+        // the buffer keeps the stream alive until it is returned
+        AddRef();
+        *ppBuffer = pBuffer;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Called with the lock held.
+//
+void CReadAheadStream::ClearFrames(void)
+{
+    for (size_t i = 0; i < m_frames.size(); i++)
+    {
+        m_pool.Return(m_frames[i].pBuffer);
+    }
+
+    m_frames.clear();
+}
+
+
+
+DWORD WINAPI CReadAheadStream::ReadThreadProc(LPVOID pParam)
+{
+    CReadAheadStream* pStream = static_cast<CReadAheadStream*>(pParam);
+
+    pStream->ReadLoop();
+
+    return 0;
+}
+
+
+//
+// Keep the ring full.  The file is read outside the lock, so Next() can hand out the frames
+// already read while the disk works on the following one.
+//
+void CReadAheadStream::ReadLoop(void)
+{
+    while (true)
+    {
+        BYTE* pBuffer = NULL;
+        ULONGLONG index = 0;
+        DWORD generation = 0;
+        HRESULT hr = S_OK;
+
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+            if (m_stopping)
+            {
+                break;
+            }
+
+            if (m_frames.size() < FILE_READ_AHEAD_FRAMES && m_readResult == S_OK)
+            {
+                if (m_readIndex >= m_frameCount)
+                {
+                    m_readResult = MF_E_END_OF_STREAM;
+                    SetEvent(m_hReadyEvent);
+                }
+                else
+                {
+                    // NULL while every buffer is held downstream, or the memory budget is
+                    // short - wait for one to return
+                    pBuffer = m_pool.Acquire();
+                    index = m_readIndex;
+                    generation = m_generation;
+                }
+            }
+        }
+
+        if (pBuffer == NULL)
+        {
+            WaitForSingleObject(m_hWakeEvent, INFINITE);
+            continue;
+        }
+
+        hr = ReadStoredFrame(index, pBuffer, m_staging);
+
+        CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+
+        if (generation != m_generation || FAILED(hr))
+        {
+            m_pool.Return(pBuffer);
+        }
+        else
+        {
+            ReadFrame frame = { pBuffer, index };
+
+            m_frames.push_back(frame);
+            m_readIndex++;
+        }
+
+        if (generation == m_generation && FAILED(hr))
+        {
+            m_readResult = hr;
+        }
+
+        SetEvent(m_hReadyEvent);
+    }
+}
+
+
+//
+// Read one stored frame at its offset - positioned reads, so a seek needs no file pointer
+// bookkeeping - and convert it into the pool buffer.
+//
+HRESULT CReadAheadStream::ReadStoredFrame(ULONGLONG index, BYTE* pBuffer,
+    std::vector<BYTE>& staging)
+{
+    ULONGLONG offset = m_firstFrame + index * m_cbStoredFrame;
+    BYTE* pTarget = pBuffer;
+    const BYTE* pPixels = NULL;
+    OVERLAPPED overlapped;
+    DWORD read = 0;
+
+    if (m_needsStaging)
+    {
+        staging.resize(m_cbStoredFrame);
+        pTarget = &staging[0];
+    }
+
+    pPixels = pTarget + m_cbFrameHeader;
+
+    ZeroMemory(&overlapped, sizeof(overlapped));
+    overlapped.Offset = (DWORD)offset;
+    overlapped.OffsetHigh = (DWORD)(offset >> 32);
+
+    if (!ReadFile(m_hFile, pTarget, m_cbStoredFrame, &read, &overlapped))
+    {
+        DWORD error = GetLastError();
+        return (error == ERROR_HANDLE_EOF) ? MF_E_END_OF_STREAM : HRESULT_FROM_WIN32(error);
+    }
+
+    if (read != m_cbStoredFrame)
+    {
+        return MF_E_END_OF_STREAM;
+    }
+
+    // Y4M frame parameters are not supported - the header must be a bare "FRAME\n"
+    if (m_cbFrameHeader != 0 && (memcmp(pTarget, "FRAME", 5) != 0 ||
+        pTarget[m_cbFrameHeader - 1] != '\n'))
+    {
+        return MF_E_INVALID_FILE_FORMAT;
+    }
+
+    if (m_layout == StoredFrame_I420)
+    {
+        I420ToNv12(pPixels, m_width, m_height, pBuffer);
+    }
+    else if (m_layout == StoredFrame_I422)
+    {
+        I422ToYuy2(pPixels, m_width, m_height, pBuffer);
+    }
+    else if (pTarget != pBuffer)
+    {
+        CopyMemory(pBuffer, pPixels, m_cbFrame);
+    }
+
+    return S_OK;
+}
+
+
+
+
+
+CStreamingFileReader::CStreamingFileReader(void) :
+    m_pStream(NULL)
+{
+    ZeroMemory(&m_info, sizeof(m_info));
+}
+
+
+//
+// The stream lives on as long as samples hold its buffers - only its thread goes now.
+//
+CStreamingFileReader::~CStreamingFileReader(void)
+{
+    if (m_pStream != NULL)
+    {
+        m_pStream->Stop();
+        m_pStream->Release();
+    }
+}
+
+
+HRESULT CStreamingFileReader::Open(PCWSTR path, IFrameFileReader** ppReader)
+{
+    HRESULT hr = S_OK;
+    CStreamingFileReader* pReader = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(ppReader, E_POINTER);
+
+        pReader = new (std::nothrow) CStreamingFileReader();
+        BREAK_ON_NULL(pReader, E_OUTOFMEMORY);
+
+        hr = pReader->Load(path);
+        BREAK_ON_FAIL(hr);
+
+        *ppReader = pReader;
+        pReader = NULL;
+    }
+    while(false);
+
+    delete pReader;
+
+    return hr;
+}
+
+
+//
+// Recognize the file - Y4M by its signature, raw frames by their name - and start streaming
+// it.
+//
+HRESULT CStreamingFileReader::Load(PCWSTR path)
+{
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    char header[Y4M_MAX_HEADER];
+    DWORD read = 0;
+    DWORD firstFrame = 0;
+    DWORD cbFrameHeader = 0;
+    ULONGLONG cbPixels = 0;
+    StoredFrameLayout layout = StoredFrame_Packed;
+
+    do
+    {
+        file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+            FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (!ReadFile(file, header, sizeof(header), &read, NULL))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        if (read >= 10 && memcmp(header, "YUV4MPEG2 ", 10) == 0)
+        {
+            hr = ParseY4mHeader(header, read, &firstFrame, &layout);
+            cbFrameHeader = Y4M_FRAME_HEADER_BYTES;
+        }
+        else
+        {
+            hr = ParseRawName(path, &layout);
+        }
+        BREAK_ON_FAIL(hr);
+
+        // the size was bounded by the parser - computed in 64 bits all the same, since the
+        // stored frames are not the packed frames
+        if (layout == StoredFrame_I420)
+        {
+            cbPixels = (ULONGLONG)m_info.width * m_info.height * 3 / 2;
+        }
+        else if (layout == StoredFrame_I422)
+        {
+            cbPixels = (ULONGLONG)m_info.width * m_info.height * 2;
+        }
+        else
+        {
+            cbPixels = GetPackedFrameBytes(m_info.subtype, m_info.width, m_info.height);
+        }
+
+        if (cbFrameHeader + cbPixels > MAXDWORD)
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        // the stream owns the handle from here on
+        hr = CReadAheadStream::Create(file, firstFrame, (DWORD)(cbFrameHeader + cbPixels),
+            cbFrameHeader, layout, m_info, &m_pStream);
+        file = INVALID_HANDLE_VALUE;
+        BREAK_ON_FAIL(hr);
+
+        m_info.startTime = 0;
+        m_info.duration = GetFrameTime(m_pStream->GetFrameCount());
+    }
+    while(false);
+
+    if (file != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(file);
+    }
+
+    return hr;
+}
+
+
+//
+// "YUV4MPEG2 W1280 H720 F30000:1001 Ip A1:1 C420jpeg\n" - the size is required, the rate
+// defaults to 30 and the chroma layout to 4:2:0.
+//
+HRESULT CStreamingFileReader::ParseY4mHeader(const char* pHeader, DWORD cbHeader,
+    DWORD* pcbLine, StoredFrameLayout* pLayout)
+{
+    HRESULT hr = S_OK;
+    char line[Y4M_MAX_HEADER + 1];
+    const char* pEnd = (const char*)memchr(pHeader, '\n', cbHeader);
+    char* pContext = NULL;
+    char* pToken = NULL;
+
+    do
+    {
+        BREAK_ON_NULL(pEnd, MF_E_INVALID_FILE_FORMAT);
+
+        CopyMemory(line, pHeader, pEnd - pHeader);
+        line[pEnd - pHeader] = '\0';
+
+        *pcbLine = (DWORD)(pEnd - pHeader) + 1;
+        *pLayout = StoredFrame_I420;
+        m_info.frameRateNumerator = 30;
+        m_info.frameRateDenominator = 1;
+
+        // the first token is the signature
+        strtok_s(line, " ", &pContext);
+
+        while ((pToken = strtok_s(NULL, " ", &pContext)) != NULL)
+        {
+            switch (pToken[0])
+            {
+            case 'W':
+                m_info.width = (UINT32)atoi(pToken + 1);
+                break;
+
+            case 'H':
+                m_info.height = (UINT32)atoi(pToken + 1);
+                break;
+
+            case 'F':
+                if (sscanf_s(pToken + 1, "%u:%u", &m_info.frameRateNumerator,
+                    &m_info.frameRateDenominator) != 2 || m_info.frameRateNumerator == 0 ||
+                    m_info.frameRateDenominator == 0)
+                {
+                    hr = MF_E_INVALID_FILE_FORMAT;
+                }
+                break;
+
+            case 'C':
+                if (strncmp(pToken + 1, "420", 3) == 0)
+                {
+                    *pLayout = StoredFrame_I420;
+                }
+                else if (strcmp(pToken + 1, "422") == 0)
+                {
+                    *pLayout = StoredFrame_I422;
+                }
+                else
+                {
+                    hr = MF_E_INVALIDMEDIATYPE;
+                }
+                break;
+            }
+        }
+        BREAK_ON_FAIL(hr);
+
+        m_info.subtype = (*pLayout == StoredFrame_I420) ? MFVideoFormat_NV12 : MFVideoFormat_YUY2;
+
+        // atoi() of a negative or huge size wraps around - bound it like a frame dump
+        hr = CheckFrameFileSize(m_info.subtype, m_info.width, m_info.height);
+        BREAK_ON_FAIL(hr);
+
+        // both layouts share chroma between two columns, 4:2:0 also between two rows
+        if ((m_info.width & 1) || (*pLayout == StoredFrame_I420 && (m_info.height & 1)))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CStreamingFileReader::ParseRawName(PCWSTR path, StoredFrameLayout* pLayout)
+{
+    HRESULT hr = S_OK;
+    PCWSTR pName = PathFindFileName(path);
+    PCWSTR pExtension = PathFindExtension(path);
+
+    do
+    {
+        *pLayout = StoredFrame_Packed;
+
+        if (_wcsicmp(pExtension, L".nv12") == 0)
+        {
+            m_info.subtype = MFVideoFormat_NV12;
+        }
+        else if (_wcsicmp(pExtension, L".yuy2") == 0)
+        {
+            m_info.subtype = MFVideoFormat_YUY2;
+        }
+        else if (_wcsicmp(pExtension, L".rgb32") == 0)
+        {
+            m_info.subtype = MFVideoFormat_RGB32;
+        }
+        else if (_wcsicmp(pExtension, L".yuv") == 0)
+        {
+            m_info.subtype = MFVideoFormat_NV12;
+            *pLayout = StoredFrame_I420;
+        }
+        else
+        {
+            hr = MF_E_UNSUPPORTED_BYTESTREAM_TYPE;
+            break;
+        }
+
+        // the first "<width>x<height>" in the name
+        for (PCWSTR p = pName; *p != L'\0' && p < pExtension; p++)
+        {
+            if (iswdigit(*p) && (p == pName || !iswdigit(p[-1])) &&
+                swscanf_s(p, L"%ux%u", &m_info.width, &m_info.height) == 2)
+            {
+                break;
+            }
+        }
+
+        hr = CheckFrameFileSize(m_info.subtype, m_info.width, m_info.height);
+        BREAK_ON_FAIL(hr);
+
+        if ((m_info.width & 1) || (m_info.subtype == MFVideoFormat_NV12 && (m_info.height & 1)))
+        {
+            hr = MF_E_INVALID_FILE_FORMAT;
+            break;
+        }
+
+        m_info.frameRateNumerator = 30;
+        m_info.frameRateDenominator = 1;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Time stamps come from the frame rate - computed from the index rather than accumulated, so
+// they do not drift over hours of 29.97 fps video.
+//
+LONGLONG CStreamingFileReader::GetFrameTime(ULONGLONG frameIndex) const
+{
+    return (LONGLONG)(frameIndex * 10000000 * m_info.frameRateDenominator /
+        m_info.frameRateNumerator);
+}
+
+
+//
+// Frame shown at the given time - past the end of the last frame, the frame count.  Frames
+// are evenly spaced, so no index is needed.
+//
+ULONGLONG CStreamingFileReader::FindFrame(LONGLONG time) const
+{
+    ULONGLONG frameCount = m_pStream->GetFrameCount();
+    ULONGLONG frameIndex = 0;
+
+    if (time <= 0)
+    {
+        return 0;
+    }
+
+    if (time >= m_info.duration)
+    {
+        return frameCount;
+    }
+
+    frameIndex = (ULONGLONG)time * m_info.frameRateNumerator /
+        ((ULONGLONG)10000000 * m_info.frameRateDenominator);
+
+    // GetFrameTime() rounds down, the division above may land one frame short
+    if (frameIndex + 1 < frameCount && GetFrameTime(frameIndex + 1) <= time)
+    {
+        frameIndex++;
+    }
+
+    return frameIndex;
+}
+
+
+HRESULT CStreamingFileReader::ReadFrame(IMFSample** ppSample)
+{
+    HRESULT hr = S_OK;
+    BYTE* pData = NULL;
+    ULONGLONG index = 0;
+
+    do
+    {
+        BREAK_ON_NULL(ppSample, E_POINTER);
+
+        hr = m_pStream->Next(&pData, &index);
+        BREAK_ON_FAIL(hr);
+
+        hr = CreateSample(pData, index, ppSample);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT CStreamingFileReader::ReadFrameAt(LONGLONG time, IMFSample** ppSample)
+{
+    HRESULT hr = S_OK;
+    BYTE* pData = NULL;
+    ULONGLONG index = FindFrame(time);
+
+    do
+    {
+        BREAK_ON_NULL(ppSample, E_POINTER);
+
+        hr = m_pStream->ReadAt(index, &pData);
+        BREAK_ON_FAIL(hr);
+
+        hr = CreateSample(pData, index, ppSample);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Wrap a buffer of the stream in a sample - the buffer goes back to the stream on failure.
+//
+HRESULT CStreamingFileReader::CreateSample(BYTE* pData, ULONGLONG index, IMFSample** ppSample)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaBuffer> pBuffer;
+    CComPtr<IMFSample> pSample;
+
+    do
+    {
+        // the buffer returns pData to the stream when it is released
+        pBuffer.Attach(new (std::nothrow) CPooledFrameBuffer(m_pStream, pData,
+            m_pStream->GetFrameBytes()));
+        if (pBuffer == NULL)
+        {
+            m_pStream->ReturnBuffer(pData);
+            hr = E_OUTOFMEMORY;
+            break;
+        }
+
+        hr = MFCreateSample(&pSample);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->AddBuffer(pBuffer);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->SetSampleTime(GetFrameTime(index));
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->SetSampleDuration(GetFrameTime(index + 1) - GetFrameTime(index));
+        BREAK_ON_FAIL(hr);
+
+        hr = pSample->SetUINT32(MFSampleExtension_CleanPoint, TRUE);
+        BREAK_ON_FAIL(hr);
+
+        *ppSample = pSample.Detach();
+    }
+    while(false);
+
+    return hr;
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+#include "Common.h"
+#include "FrameFileSource.h"
+#include "FramePool.h"
+
+#include <deque>
+#include <vector>
+
+
+
+//
+//  How the frames are stored in the file, relative to the format handed out.
+//
+enum StoredFrameLayout
+{
+    StoredFrame_Packed = 0,     // already in the output format
+    StoredFrame_I420,           // planar 4:2:0, handed out as NV12
+    StoredFrame_I422            // planar 4:2:2, handed out as YUY2
+};
+
+
+//
+//  Reads fixed size frames from a file ahead of their use, on a thread of its own, into a
+//  ring of pooled buffers.  Playback of a large recording then streams from the disk at the
+//  rate the disk allows - the file is opened for sequential scan, so the cache manager reads
+//  ahead aggressively and drops the pages once they were read, and the pool bounds the
+//  memory held to a few frames no matter how large the file is.
+//
+//  The stream is reference counted, and every buffer handed out holds a reference, so the
+//  buffers stay valid after the reader that handed them out is gone.
+//
+class CReadAheadStream
+{
+    public:
+        // takes ownership of the file handle, even on failure
+        static HRESULT Create(HANDLE file, ULONGLONG firstFrame, DWORD cbStoredFrame,
+            DWORD cbFrameHeader, StoredFrameLayout layout, const FrameFileInfo& info,
+            CReadAheadStream** ppStream);
+
+        ULONG AddRef(void) { return InterlockedIncrement(&m_cRef); }
+        ULONG Release(void);
+
+        // stop the read-ahead thread - buffers handed out stay valid
+        void Stop(void);
+
+        // the next frame, blocking until it was read - MF_E_END_OF_STREAM after the last one
+        HRESULT Next(BYTE** ppBuffer, ULONGLONG* pFrameIndex);
+
+        // drop the frames read ahead and continue reading at the given frame
+        HRESULT Seek(ULONGLONG frameIndex);
+
+        // read one frame right away, past the ring and without moving the read position -
+        // MF_E_SAMPLEALLOCATOR_EMPTY while every buffer is held
+        HRESULT ReadAt(ULONGLONG frameIndex, BYTE** ppBuffer);
+
+        // give a buffer handed out by Next() or ReadAt() back to the pool
+        void ReturnBuffer(BYTE* pBuffer);
+
+        DWORD GetFrameBytes(void) const { return m_cbFrame; }
+        ULONGLONG GetFrameCount(void) const { return m_frameCount; }
+
+    private:
+        struct ReadFrame
+        {
+            BYTE* pBuffer;
+            ULONGLONG index;
+        };
+
+        CReadAheadStream(HANDLE file);
+        ~CReadAheadStream(void);
+
+        HRESULT Initialize(ULONGLONG firstFrame, DWORD cbStoredFrame, DWORD cbFrameHeader,
+            StoredFrameLayout layout, const FrameFileInfo& info);
+
+        static DWORD WINAPI ReadThreadProc(LPVOID pParam);
+        void ReadLoop(void);
+        HRESULT ReadStoredFrame(ULONGLONG index, BYTE* pBuffer, std::vector<BYTE>& staging);
+        void ClearFrames(void);
+
+        volatile long m_cRef;
+        CComAutoCriticalSection m_critSec;
+
+        HANDLE m_hFile;
+        HANDLE m_hThread;
+        HANDLE m_hWakeEvent;                    // room in the ring, a seek, or stop
+        HANDLE m_hReadyEvent;                   // a frame was read, or the end was reached
+        CFramePool m_pool;
+
+        // file layout
+        ULONGLONG m_firstFrame;                 // file offset of the first stored frame
+        ULONGLONG m_frameCount;
+        DWORD m_cbStoredFrame;                  // bytes of a frame in the file, with its header
+        DWORD m_cbFrameHeader;                  // bytes before the pixels of a stored frame
+        DWORD m_cbFrame;                        // bytes of a frame handed out
+        StoredFrameLayout m_layout;
+        UINT32 m_width;
+        UINT32 m_height;
+        bool m_needsStaging;                    // stored frames are converted after the read
+        std::vector<BYTE> m_staging;            // stored frame before conversion
+
+        // ring of frames read ahead
+        std::deque<ReadFrame> m_frames;
+        ULONGLONG m_readIndex;                  // next frame the thread reads
+        DWORD m_generation;                     // bumped by every seek
+        HRESULT m_readResult;                   // MF_E_END_OF_STREAM or the read error, once hit
+        bool m_stopping;
+};
+
+
+//
+//  Frame file reader for Y4M files and headerless raw frame files, streamed through a
+//  CReadAheadStream.
+//
+//  Y4M files carry their size, rate and chroma layout in the header; 4:2:0 is handed out as
+//  NV12 and 4:2:2 as YUY2.  Raw files name their format by extension - .nv12, .yuy2, .rgb32,
+//  or .yuv for planar 4:2:0 - and their size in the file name, as in "hall_1280x720.nv12",
+//  and play at 30 frames per second.
+//
+class CStreamingFileReader : public IFrameFileReader
+{
+    public:
+        // MF_E_UNSUPPORTED_BYTESTREAM_TYPE if the file is neither Y4M nor a named raw file
+        static HRESULT Open(PCWSTR path, IFrameFileReader** ppReader);
+
+        virtual ~CStreamingFileReader(void);
+
+        // IFrameFileReader implementation
+        virtual const FrameFileInfo& GetInfo(void) const { return m_info; }
+        virtual HRESULT ReadFrame(IMFSample** ppSample);
+        virtual HRESULT Rewind(void) { return m_pStream->Seek(0); }
+        virtual HRESULT Seek(LONGLONG time) { return m_pStream->Seek(FindFrame(time)); }
+        virtual HRESULT ReadFrameAt(LONGLONG time, IMFSample** ppSample);
+
+    private:
+        CStreamingFileReader(void);
+
+        HRESULT Load(PCWSTR path);
+        HRESULT ParseY4mHeader(const char* pHeader, DWORD cbHeader, DWORD* pcbLine,
+            StoredFrameLayout* pLayout);
+        HRESULT ParseRawName(PCWSTR path, StoredFrameLayout* pLayout);
+
+        LONGLONG GetFrameTime(ULONGLONG frameIndex) const;
+        ULONGLONG FindFrame(LONGLONG time) const;
+        HRESULT CreateSample(BYTE* pData, ULONGLONG index, IMFSample** ppSample);
+
+        CReadAheadStream* m_pStream;
+        FrameFileInfo m_info;
+};
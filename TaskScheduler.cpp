@@ -0,0 +1,443 @@
+#include "TaskScheduler.h"
+#include "Tracer.h"
+
+#include <new>
+
+
+
+// worker that is running on the current thread, NULL on any other thread
+static __declspec(thread) void* s_pCurrentWorker = NULL;
+
+// how long an idle worker sleeps before it looks for work to steal again
+#define TASK_WORKER_IDLE_TIMEOUT        10
+
+
+
+//
+// Create a task.  The returned task has a reference count of one, which the caller releases
+// after submitting it.
+//
+HRESULT CTask::Create(TaskProc pProc, void* pContext, UINT32 index, CTask** ppTask)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        BREAK_ON_NULL(pProc, E_POINTER);
+        BREAK_ON_NULL(ppTask, E_POINTER);
+
+        *ppTask = new (std::nothrow) CTask(pProc, pContext, index);
+        BREAK_ON_NULL(*ppTask, E_OUTOFMEMORY);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+CTask::CTask(TaskProc pProc, void* pContext, UINT32 index) :
+    m_cRef(1),
+    m_pending(1),
+    m_complete(0),
+    m_pProc(pProc),
+    m_pContext(pContext),
+    m_index(index)
+{
+}
+
+
+ULONG CTask::AddRef(void)
+{
+    return InterlockedIncrement(&m_cRef);
+}
+
+ULONG CTask::Release(void)
+{
+    ULONG uCount = InterlockedDecrement(&m_cRef);
+    if (uCount == 0)
+    {
+        delete this;
+    }
+    return uCount;
+}
+
+
+//
+// Register this task as a continuation of pPrerequisite.  If the prerequisite is already
+// complete there is nothing to wait for.
+//
+HRESULT CTask::AddDependency(CTask* pPrerequisite)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        BREAK_ON_NULL(pPrerequisite, E_POINTER);
+
+        CComCritSecLock<CComAutoCriticalSection> lock(pPrerequisite->m_critSec);
+
+        if (pPrerequisite->m_complete)
+        {
+            break;
+        }
+
+        // the prerequisite holds a reference until it releases this task
+        AddRef();
+        InterlockedIncrement(&m_pending);
+        pPrerequisite->m_continuations.push_back(this);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
+
+
+CTaskScheduler::CTaskScheduler(void) :
+    m_wakeSemaphore(NULL),
+    m_sleepingWorkers(0),
+    m_nextWorker(0),
+    m_stopping(0)
+{
+    ZeroMemory(&m_cores, sizeof(m_cores));
+}
+
+
+CTaskScheduler::~CTaskScheduler(void)
+{
+    Stop();
+}
+
+
+//
+// Create the worker deques and threads.
+//
+HRESULT CTaskScheduler::Start(DWORD workerCount)
+{
+    HRESULT hr = S_OK;
+    SYSTEM_INFO systemInfo;
+
+    do
+    {
+        if (!m_workers.empty())
+        {
+            hr = MF_E_ALREADY_INITIALIZED;
+            break;
+        }
+
+        if (workerCount == 0 && m_cores.Mask != 0)
+        {
+            workerCount = CountCores(m_cores);
+        }
+        else if (workerCount == 0)
+        {
+            GetSystemInfo(&systemInfo);
+            workerCount = systemInfo.dwNumberOfProcessors;
+        }
+
+        m_stopping = 0;
+
+        m_wakeSemaphore = CreateSemaphore(NULL, 0, MAXLONG, NULL);
+        BREAK_ON_NULL(m_wakeSemaphore, HRESULT_FROM_WIN32(GetLastError()));
+
+        // all deques must exist before the first worker starts stealing from them
+        for (DWORD i = 0; i < workerCount; i++)
+        {
+            Worker* pWorker = new (std::nothrow) Worker();
+            BREAK_ON_NULL(pWorker, E_OUTOFMEMORY);
+
+            pWorker->pScheduler = this;
+            pWorker->index = i;
+            pWorker->thread = NULL;
+            m_workers.push_back(pWorker);
+        }
+        BREAK_ON_FAIL(hr);
+
+        // the workers are pinned before they run, so their stacks and the first frames they
+        // touch are allocated on the right node
+        for (DWORD i = 0; i < workerCount; i++)
+        {
+            m_workers[i]->thread = CreateThread(NULL, 0, WorkerThreadProc, m_workers[i],
+                CREATE_SUSPENDED, NULL);
+            BREAK_ON_NULL(m_workers[i]->thread, HRESULT_FROM_WIN32(GetLastError()));
+
+            PinThread(m_workers[i]->thread, m_cores);
+            ResumeThread(m_workers[i]->thread);
+        }
+    }
+    while(false);
+
+    if (FAILED(hr))
+    {
+        Stop();
+    }
+
+    return hr;
+}
+
+
+HRESULT CTaskScheduler::SetAffinity(const GROUP_AFFINITY& cores)
+{
+    HRESULT hr = S_OK;
+
+    m_cores = cores;
+
+    for (size_t i = 0; i < m_workers.size() && SUCCEEDED(hr); i++)
+    {
+        if (m_workers[i]->thread != NULL)
+        {
+            hr = PinThread(m_workers[i]->thread, cores);
+        }
+    }
+
+    return hr;
+}
+
+
+//
+// Stop the workers.  Tasks that have not started yet are run here, on the calling thread,
+// with the continuations they make ready - a task that was dropped instead would never
+// release its continuations, nor the frames its context holds.
+//
+HRESULT CTaskScheduler::Stop(void)
+{
+    InterlockedExchange(&m_stopping, 1);
+
+    if (m_wakeSemaphore != NULL)
+    {
+        ReleaseSemaphore(m_wakeSemaphore, (LONG)m_workers.size() + 1, NULL);
+    }
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        if (m_workers[i]->thread != NULL)
+        {
+            WaitForSingleObject(m_workers[i]->thread, INFINITE);
+            CloseHandle(m_workers[i]->thread);
+        }
+    }
+
+    // the deques stay until they are empty - Execute() queues continuations to them
+    for (CTask* pTask = FindTask(NULL); pTask != NULL; pTask = FindTask(NULL))
+    {
+        Execute(pTask);
+    }
+
+    for (size_t i = 0; i < m_workers.size(); i++)
+    {
+        delete m_workers[i];
+    }
+    m_workers.clear();
+
+    if (m_wakeSemaphore != NULL)
+    {
+        CloseHandle(m_wakeSemaphore);
+        m_wakeSemaphore = NULL;
+    }
+
+    return S_OK;
+}
+
+
+//
+// Drop the submission reference of the task - if no prerequisite is outstanding, it is
+// ready to run.
+//
+HRESULT CTaskScheduler::Submit(CTask* pTask)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        BREAK_ON_NULL(pTask, E_POINTER);
+
+        if (m_workers.empty())
+        {
+            hr = MF_E_NOT_INITIALIZED;
+            break;
+        }
+
+        if (InterlockedDecrement(&pTask->m_pending) == 0)
+        {
+            pTask->AddRef();
+            Enqueue(pTask);
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+//
+// Put a ready task on a deque.  A worker keeps the tasks it spawns on its own deque, other
+// threads spread their tasks round robin.
+//
+void CTaskScheduler::Enqueue(CTask* pTask)
+{
+    Worker* pWorker = (Worker*)s_pCurrentWorker;
+
+    if (pWorker == NULL || pWorker->pScheduler != this)
+    {
+        DWORD index = (DWORD)InterlockedIncrement(&m_nextWorker) % (DWORD)m_workers.size();
+        pWorker = m_workers[index];
+    }
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(pWorker->critSec);
+        pWorker->tasks.push_back(pTask);
+    }
+
+    if (m_sleepingWorkers > 0)
+    {
+        ReleaseSemaphore(m_wakeSemaphore, 1, NULL);
+    }
+}
+
+
+//
+// Take the newest task from the worker's own deque, or steal the oldest task of another
+// worker.  Stealing from the front takes the task whose data is least likely to still be
+// in the owner's cache.
+//
+CTask* CTaskScheduler::FindTask(Worker* pWorker)
+{
+    CTask* pTask = NULL;
+    size_t count = m_workers.size();
+
+    if (pWorker != NULL)
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(pWorker->critSec);
+
+        if (!pWorker->tasks.empty())
+        {
+            pTask = pWorker->tasks.back();
+            pWorker->tasks.pop_back();
+            return pTask;
+        }
+    }
+
+    size_t start = (pWorker != NULL) ? pWorker->index + 1 : 0;
+
+    for (size_t i = 0; i < count && pTask == NULL; i++)
+    {
+        Worker* pVictim = m_workers[(start + i) % count];
+
+        if (pVictim == pWorker)
+            continue;
+
+        CComCritSecLock<CComAutoCriticalSection> lock(pVictim->critSec);
+
+        if (!pVictim->tasks.empty())
+        {
+            pTask = pVictim->tasks.front();
+            pVictim->tasks.pop_front();
+        }
+    }
+
+    return pTask;
+}
+
+
+//
+// Run the task, mark it complete, and queue every continuation that no longer waits for
+// anything.
+//
+void CTaskScheduler::Execute(CTask* pTask)
+{
+    std::vector<CTask*> continuations;
+
+    pTask->m_pProc(pTask->m_pContext, pTask->m_index);
+
+    {
+        CComCritSecLock<CComAutoCriticalSection> lock(pTask->m_critSec);
+
+        InterlockedExchange(&pTask->m_complete, 1);
+        continuations.swap(pTask->m_continuations);
+    }
+
+    for (size_t i = 0; i < continuations.size(); i++)
+    {
+        if (InterlockedDecrement(&continuations[i]->m_pending) == 0)
+        {
+            continuations[i]->AddRef();
+            Enqueue(continuations[i]);
+        }
+        continuations[i]->Release();
+    }
+
+    // the reference taken when the task was queued
+    pTask->Release();
+}
+
+
+void CTaskScheduler::Wait(CTask* pTask)
+{
+    Worker* pWorker = (Worker*)s_pCurrentWorker;
+
+    if (pWorker != NULL && pWorker->pScheduler != this)
+    {
+        pWorker = NULL;
+    }
+
+    while (!pTask->IsComplete())
+    {
+        CTask* pOther = FindTask(pWorker);
+        if (pOther != NULL)
+        {
+            Execute(pOther);
+        }
+        else
+        {
+            SwitchToThread();
+        }
+    }
+}
+
+
+DWORD WINAPI CTaskScheduler::WorkerThreadProc(LPVOID pParam)
+{
+    Worker* pWorker = (Worker*)pParam;
+
+    s_pCurrentWorker = pWorker;
+    CTracer::SetThreadName("pipeline worker");
+
+    pWorker->pScheduler->WorkerLoop(pWorker);
+    s_pCurrentWorker = NULL;
+
+    return 0;
+}
+
+
+//
+// Run tasks until the scheduler stops.  A worker that finds nothing to do announces that it
+// is going to sleep, checks once more, and waits for a wake-up - the timeout covers the
+// window in which a task is queued between the last check and the wait.
+//
+void CTaskScheduler::WorkerLoop(Worker* pWorker)
+{
+    while (!m_stopping)
+    {
+        CTask* pTask = FindTask(pWorker);
+
+        if (pTask == NULL)
+        {
+            InterlockedIncrement(&m_sleepingWorkers);
+
+            pTask = FindTask(pWorker);
+            if (pTask == NULL && !m_stopping)
+            {
+                WaitForSingleObject(m_wakeSemaphore, TASK_WORKER_IDLE_TIMEOUT);
+            }
+
+            InterlockedDecrement(&m_sleepingWorkers);
+        }
+
+        if (pTask != NULL)
+        {
+            Execute(pTask);
+        }
+    }
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "Common.h"
+#include "ThreadAffinity.h"
+
+#include <vector>
+#include <deque>
+
+
+
+//
+//  Function executed by a task.  index is the tile (or any other sub-item) the task was
+//  created for.
+//
+typedef void (*TaskProc)(void* pContext, UINT32 index);
+
+
+class CTaskScheduler;
+
+
+//
+//  A unit of work with dependencies.  A task runs once all of its prerequisites have
+//  completed - this is what lets the stages of successive frames overlap while the stages of
+//  a single frame still run in order.
+//
+class CTask
+{
+    public:
+        static HRESULT Create(TaskProc pProc, void* pContext, UINT32 index, CTask** ppTask);
+
+        ULONG AddRef(void);
+        ULONG Release(void);
+
+        // make this task wait for pPrerequisite - must be called before the task is submitted
+        HRESULT AddDependency(CTask* pPrerequisite);
+
+        bool IsComplete(void) const { return m_complete != 0; }
+
+    private:
+        friend class CTaskScheduler;
+
+        CTask(TaskProc pProc, void* pContext, UINT32 index);
+        ~CTask(void) {}
+
+        volatile long m_cRef;
+        volatile long m_pending;                // unfinished prerequisites, plus one until submitted
+        volatile long m_complete;
+
+        TaskProc m_pProc;
+        void* m_pContext;
+        UINT32 m_index;
+
+        CComAutoCriticalSection m_critSec;      // protects m_continuations and m_complete
+        std::vector<CTask*> m_continuations;    // tasks waiting for this one
+};
+
+
+//
+//  Work-stealing task scheduler.  Each worker thread owns a deque: it pushes and pops its
+//  own tasks at the back, which keeps the data of a frame hot in that core's cache, and
+//  idle workers steal from the front of the other deques.
+//
+class CTaskScheduler
+{
+    public:
+        CTaskScheduler(void);
+        ~CTaskScheduler(void);
+
+        // start the workers - zero means one worker per logical processor, or per core of
+        // the affinity mask if one is set
+        HRESULT Start(DWORD workerCount);
+        HRESULT Stop(void);
+
+        // restrict the workers to a set of cores - applies to running workers immediately
+        HRESULT SetAffinity(const GROUP_AFFINITY& cores);
+
+        DWORD GetWorkerCount(void) const { return (DWORD)m_workers.size(); }
+
+        // queue the task - it runs as soon as all of its dependencies are complete
+        HRESULT Submit(CTask* pTask);
+
+        // block until the task is complete - executes other tasks while waiting, so it is
+        // safe to call from a worker
+        void Wait(CTask* pTask);
+
+    private:
+        struct Worker
+        {
+            CTaskScheduler* pScheduler;
+            DWORD index;
+            HANDLE thread;
+            CComAutoCriticalSection critSec;    // protects tasks
+            std::deque<CTask*> tasks;
+        };
+
+        static DWORD WINAPI WorkerThreadProc(LPVOID pParam);
+
+        void WorkerLoop(Worker* pWorker);
+        void Enqueue(CTask* pTask);
+        CTask* FindTask(Worker* pWorker);
+        void Execute(CTask* pTask);
+
+        std::vector<Worker*> m_workers;
+        GROUP_AFFINITY m_cores;                 // worker affinity, empty mask for none
+        HANDLE m_wakeSemaphore;                 // released once per queued task with sleepers
+        volatile long m_sleepingWorkers;
+        volatile long m_nextWorker;             // round robin target for external submissions
+        volatile long m_stopping;
+};
@@ -0,0 +1,244 @@
+#include "Tests.h"
+#include "AudioRing.h"
+
+#include <new>
+#include <vector>
+
+
+
+// 10 ms chunks of a 48 kHz capture
+#define TEST_AUDIO_RATE         48000
+#define TEST_AUDIO_CHUNK        480
+#define TEST_AUDIO_CHUNK_TIME   100000
+
+
+
+//
+// Reads by time on one thread - the frames of a time, a gap filled with silence, a read
+// running past the last frame, and a jump that restarts the timeline.
+//
+void TestAudioRing(void)
+{
+    CAudioRing ring;
+    std::vector<float> chunk(TEST_AUDIO_CHUNK);
+    std::vector<float> output(TEST_AUDIO_CHUNK);
+    AudioRingStats stats;
+    LONGLONG time = 1000000;
+    LONGLONG endTime = 0;
+    UINT32 available = 0;
+    float value = 0.0f;
+
+    CHECK(!ring.GetEndTime(&endTime));
+    CHECK(ring.Read(time, &output[0], TEST_AUDIO_CHUNK) == S_FALSE);
+
+    CHECK_HR(ring.Initialize(TEST_AUDIO_RATE, 1, TEST_AUDIO_RATE));
+
+    // one second of a ramp, one value per frame
+    for (int i = 0; i < 100; i++)
+    {
+        for (UINT32 j = 0; j < TEST_AUDIO_CHUNK; j++)
+        {
+            chunk[j] = value++;
+        }
+
+        ring.Write(&chunk[0], TEST_AUDIO_CHUNK, time);
+        time += TEST_AUDIO_CHUNK_TIME;
+    }
+
+    CHECK(ring.Read(1000000 + 50 * TEST_AUDIO_CHUNK_TIME, &output[0], TEST_AUDIO_CHUNK,
+        &available) == S_OK);
+    CHECK(available == TEST_AUDIO_CHUNK);
+    CHECK(output[0] == 50.0f * TEST_AUDIO_CHUNK);
+    CHECK(output[TEST_AUDIO_CHUNK - 1] == 51.0f * TEST_AUDIO_CHUNK - 1);
+
+    CHECK(ring.GetEndTime(&endTime));
+    CHECK(endTime == time);
+
+    // 20 ms lost by the device - the next chunk stays at its time, after silence
+    time += 2 * TEST_AUDIO_CHUNK_TIME;
+    for (UINT32 j = 0; j < TEST_AUDIO_CHUNK; j++)
+    {
+        chunk[j] = value++;
+    }
+    ring.Write(&chunk[0], TEST_AUDIO_CHUNK, time);
+
+    CHECK(ring.Read(time, &output[0], TEST_AUDIO_CHUNK) == S_OK);
+    CHECK(output[0] == chunk[0]);
+
+    CHECK(ring.Read(time - TEST_AUDIO_CHUNK_TIME, &output[0], TEST_AUDIO_CHUNK) == S_OK);
+    CHECK(output[0] == 0.0f && output[TEST_AUDIO_CHUNK - 1] == 0.0f);
+
+    ring.GetStats(&stats);
+    CHECK(stats.framesWritten == 101 * TEST_AUDIO_CHUNK);
+    CHECK(stats.silenceFrames == 2 * TEST_AUDIO_CHUNK);
+
+    // half of the frames are still to come
+    CHECK(ring.Read(time + TEST_AUDIO_CHUNK_TIME / 2, &output[0], TEST_AUDIO_CHUNK,
+        &available) == S_FALSE);
+    CHECK(available == TEST_AUDIO_CHUNK / 2);
+    CHECK(output[TEST_AUDIO_CHUNK / 2 - 1] == chunk[TEST_AUDIO_CHUNK - 1]);
+    CHECK(output[TEST_AUDIO_CHUNK / 2] == 0.0f);
+
+    // long before the first frame
+    CHECK(ring.Read(0, &output[0], TEST_AUDIO_CHUNK) == S_FALSE);
+    CHECK(output[0] == 0.0f);
+
+    // a jump of five seconds cannot be filled - the audio before it is gone
+    LONGLONG restart = time + 5 * 10000000LL;
+    ring.Write(&chunk[0], TEST_AUDIO_CHUNK, restart);
+
+    ring.GetStats(&stats);
+    CHECK(stats.discontinuities == 1);
+    CHECK(ring.Read(restart, &output[0], TEST_AUDIO_CHUNK) == S_OK);
+    CHECK(output[0] == chunk[0]);
+    CHECK(ring.Read(time, &output[0], TEST_AUDIO_CHUNK) == S_FALSE);
+    CHECK(output[0] == 0.0f);
+}
+
+
+
+struct AudioRingRun
+{
+    CAudioRing ring;
+    volatile long done;
+    volatile long reads;
+    volatile long complete;
+    volatile long torn;
+};
+
+
+//
+// Writes a stereo ramp, the right channel negated, wrapping around long before the end.
+//
+static DWORD WINAPI AudioWriterProc(LPVOID pParam)
+{
+    AudioRingRun* pRun = (AudioRingRun*)pParam;
+    std::vector<float> chunk(TEST_AUDIO_CHUNK * 2);
+    float value = 1.0f;
+
+    for (LONGLONG k = 0; k < 20000; k++)
+    {
+        for (UINT32 i = 0; i < TEST_AUDIO_CHUNK; i++)
+        {
+            chunk[2 * i] = value;
+            chunk[2 * i + 1] = -value;
+            value = (value >= 8000000.0f) ? 1.0f : value + 1.0f;
+        }
+
+        pRun->ring.Write(&chunk[0], TEST_AUDIO_CHUNK, 1000000 + k * TEST_AUDIO_CHUNK_TIME);
+    }
+
+    InterlockedExchange(&pRun->done, 1);
+
+    return 0;
+}
+
+
+//
+// Reads up to 120 ms back from the end - past the start of the ring as well, where the
+// writer overwrites the frames under the copy.
+//
+static DWORD WINAPI AudioReaderProc(LPVOID pParam)
+{
+    AudioRingRun* pRun = (AudioRingRun*)pParam;
+    std::vector<float> output(1000 * 2);
+    UINT32 seed = GetCurrentThreadId();
+
+    while (pRun->done == 0)
+    {
+        LONGLONG end = 0;
+        UINT32 frameCount = 0;
+
+        if (!pRun->ring.GetEndTime(&end))
+        {
+            continue;
+        }
+
+        seed = seed * 1664525 + 1013904223;
+        frameCount = 1 + (seed >> 4) % 1000;
+
+        InterlockedIncrement(&pRun->reads);
+
+        if (pRun->ring.Read(end - (LONGLONG)((seed >> 8) % 1200000), &output[0],
+            frameCount) != S_OK)
+        {
+            continue;
+        }
+
+        InterlockedIncrement(&pRun->complete);
+
+        for (UINT32 i = 0; i < frameCount; i++)
+        {
+            float left = output[2 * i];
+            bool consecutive = (i == 0) || (left == output[2 * i - 2] + 1.0f) ||
+                (left == 1.0f && output[2 * i - 2] == 8000000.0f);
+
+            if (output[2 * i + 1] != -left || !consecutive)
+            {
+                InterlockedIncrement(&pRun->torn);
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+
+//
+// One writer, three readers: a read that returns S_OK holds consecutive frames, never
+// frames torn by a write that overtook the copy.
+//
+void TestAudioRingConcurrent(void)
+{
+    AudioRingRun* pRun = new (std::nothrow) AudioRingRun();
+    HANDLE threads[4];
+    DWORD threadCount = 0;
+
+    CHECK(pRun != NULL);
+    if (pRun == NULL)
+    {
+        return;
+    }
+
+    pRun->done = 0;
+    pRun->reads = 0;
+    pRun->complete = 0;
+    pRun->torn = 0;
+
+    // a small ring, overwritten every 85 ms
+    CHECK_HR(pRun->ring.Initialize(TEST_AUDIO_RATE, 2, 4096));
+
+    for (int i = 0; i < 3; i++)
+    {
+        threads[threadCount] = CreateThread(NULL, 0, AudioReaderProc, pRun, 0, NULL);
+        CHECK(threads[threadCount] != NULL);
+        if (threads[threadCount] != NULL)
+        {
+            threadCount++;
+        }
+    }
+
+    threads[threadCount] = CreateThread(NULL, 0, AudioWriterProc, pRun, 0, NULL);
+    CHECK(threads[threadCount] != NULL);
+    if (threads[threadCount] == NULL)
+    {
+        InterlockedExchange(&pRun->done, 1);
+    }
+    else
+    {
+        threadCount++;
+    }
+
+    WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+
+    for (DWORD i = 0; i < threadCount; i++)
+    {
+        CloseHandle(threads[i]);
+    }
+
+    printf("    %ld reads, %ld complete, %ld torn\n", pRun->reads, pRun->complete, pRun->torn);
+    CHECK(pRun->torn == 0);
+
+    delete pRun;
+}
@@ -0,0 +1,221 @@
+#include "Tests.h"
+#include "FrameCodec.h"
+#include "FrameFileSource.h"
+#include "TaskScheduler.h"
+
+#include <vector>
+
+
+
+enum TestContent
+{
+    TestContent_Noise = 0,          // incompressible - the slices fall back to stored
+    TestContent_Gradient,           // a ramp with a little noise, like camera video
+    TestContent_White,
+    TestContent_Black,
+    TestContent_Count
+};
+
+
+static UINT32 s_random = 12345;
+
+static BYTE RandomByte(void)
+{
+    s_random = s_random * 1664525 + 1013904223;
+    return (BYTE)(s_random >> 24);
+}
+
+
+static void FillFrame(REFGUID subtype, UINT32 width, TestContent content, std::vector<BYTE>& frame)
+{
+    DWORD rowBytes = GetPackedRowBytes(subtype, width);
+
+    for (size_t i = 0; i < frame.size(); i++)
+    {
+        UINT32 x = (UINT32)(i % rowBytes);
+        UINT32 y = (UINT32)(i / rowBytes);
+
+        switch (content)
+        {
+        case TestContent_Noise:
+            frame[i] = RandomByte();
+            break;
+
+        case TestContent_Gradient:
+            frame[i] = (BYTE)(x / 3 + y * 2 + (RandomByte() & 3));
+            break;
+
+        case TestContent_White:
+            frame[i] = 255;
+            break;
+
+        default:
+            frame[i] = 0;
+            break;
+        }
+    }
+}
+
+
+//
+// Encode and decode one frame, then check that truncated input fails and that damaged input
+// decodes without leaving the frame.
+//
+static void RoundTrip(REFGUID subtype, UINT32 width, UINT32 height, UINT32 sliceCount,
+    TestContent content, CTaskScheduler* pScheduler)
+{
+    FrameFormat format = { subtype, width, height, 0 };
+    DWORD cbFrame = GetPackedFrameBytes(subtype, width, height);
+    std::vector<BYTE> source(cbFrame);
+    std::vector<BYTE> decoded(cbFrame + 64, 0xCD);
+    std::vector<BYTE> encoded(CFrameCodec::GetMaxEncodedBytes(format));
+    FramePlane sourcePlanes[2];
+    FramePlane decodedPlanes[2];
+    CFrameCodec encoder;
+    CFrameCodec decoder;
+    DWORD cbEncoded = 0;
+    HRESULT hr = S_OK;
+
+    FillFrame(subtype, width, content, source);
+
+    CFrameCodec::GetPackedPlanes(format, &source[0], sourcePlanes);
+    CFrameCodec::GetPackedPlanes(format, &decoded[0], decodedPlanes);
+
+    encoder.SetSliceCount(sliceCount);
+    encoder.SetScheduler(pScheduler);
+    decoder.SetScheduler(pScheduler);
+
+    hr = encoder.Encode(format, sourcePlanes, &encoded[0], (DWORD)encoded.size(), &cbEncoded);
+    CHECK_HR(hr);
+    if (FAILED(hr))
+    {
+        return;
+    }
+
+    hr = decoder.Decode(&encoded[0], cbEncoded, format, decodedPlanes);
+    CHECK_HR(hr);
+    CHECK(memcmp(&source[0], &decoded[0], cbFrame) == 0);
+
+    // the decoder wrote nothing past the frame
+    for (DWORD i = cbFrame; i < decoded.size(); i++)
+    {
+        CHECK(decoded[i] == 0xCD);
+    }
+
+    for (DWORD cut = 0; cut < cbEncoded; cut += 1 + cbEncoded / 7)
+    {
+        CHECK(FAILED(decoder.Decode(&encoded[0], cut, format, decodedPlanes)));
+    }
+
+    for (int i = 0; i < 20; i++)
+    {
+        std::vector<BYTE> damaged(encoded.begin(), encoded.begin() + cbEncoded);
+
+        damaged[RandomByte() * cbEncoded / 256] ^= (BYTE)(1 + RandomByte() % 255);
+        decoder.Decode(&damaged[0], cbEncoded, format, decodedPlanes);
+    }
+
+    for (DWORD i = cbFrame; i < decoded.size(); i++)
+    {
+        CHECK(decoded[i] == 0xCD);
+    }
+}
+
+
+void TestFrameCodec(void)
+{
+    static const GUID* const subtypes[] =
+    {
+        &MFVideoFormat_YUY2, &MFVideoFormat_NV12, &MFVideoFormat_RGB32
+    };
+    static const UINT32 sizes[][2] =
+    {
+        { 320, 240 }, { 2, 2 }, { 18, 6 }, { 322, 242 }, { 64, 1 }
+    };
+    static const UINT32 sliceCounts[] = { 1, 2, 4, 7, FRAME_CODEC_MAX_SLICES };
+    CTaskScheduler scheduler;
+
+    CHECK_HR(scheduler.Start(4));
+
+    for (DWORD s = 0; s < ARRAYSIZE(subtypes); s++)
+    {
+        for (DWORD z = 0; z < ARRAYSIZE(sizes); z++)
+        {
+            // NV12 has a chroma row per two luma rows
+            if (*subtypes[s] == MFVideoFormat_NV12 && (sizes[z][1] & 1) != 0)
+            {
+                continue;
+            }
+
+            for (DWORD n = 0; n < ARRAYSIZE(sliceCounts); n++)
+            {
+                for (int c = 0; c < TestContent_Count; c++)
+                {
+                    RoundTrip(*subtypes[s], sizes[z][0], sizes[z][1], sliceCounts[n],
+                        (TestContent)c, (n % 2 == 0) ? NULL : &scheduler);
+                }
+            }
+        }
+    }
+
+    scheduler.Stop();
+}
+
+
+//
+// Frames per second of a 720p NV12 gradient, coded on the workers and on one thread.
+//
+void BenchFrameCodec(void)
+{
+    const UINT32 width = 1280;
+    const UINT32 height = 720;
+    const int frames = 60;
+    FrameFormat format = { MFVideoFormat_NV12, width, height, 0 };
+    DWORD cbFrame = GetPackedFrameBytes(format.subtype, width, height);
+    std::vector<BYTE> source(cbFrame);
+    std::vector<BYTE> decoded(cbFrame);
+    std::vector<BYTE> encoded(CFrameCodec::GetMaxEncodedBytes(format));
+    FramePlane sourcePlanes[2];
+    FramePlane decodedPlanes[2];
+    CTaskScheduler scheduler;
+
+    FillFrame(format.subtype, width, TestContent_Gradient, source);
+    CFrameCodec::GetPackedPlanes(format, &source[0], sourcePlanes);
+    CFrameCodec::GetPackedPlanes(format, &decoded[0], decodedPlanes);
+
+    CHECK_HR(scheduler.Start(0));
+
+    for (int pass = 0; pass < 2; pass++)
+    {
+        CFrameCodec codec;
+        DWORD cbEncoded = 0;
+        double start = 0.0;
+        double encodeTime = 0.0;
+        double decodeTime = 0.0;
+
+        codec.SetScheduler((pass == 0) ? &scheduler : NULL);
+
+        start = GetTestTime();
+        for (int i = 0; i < frames; i++)
+        {
+            CHECK_HR(codec.Encode(format, sourcePlanes, &encoded[0], (DWORD)encoded.size(),
+                &cbEncoded));
+        }
+        encodeTime = GetTestTime() - start;
+
+        start = GetTestTime();
+        for (int i = 0; i < frames; i++)
+        {
+            CHECK_HR(codec.Decode(&encoded[0], cbEncoded, format, decodedPlanes));
+        }
+        decodeTime = GetTestTime() - start;
+
+        CHECK(memcmp(&source[0], &decoded[0], cbFrame) == 0);
+
+        printf("    %s: %u -> %u bytes (%.1f%%), encode %.1f fps, decode %.1f fps\n",
+            (pass == 0) ? "scheduler" : "one thread", cbFrame, cbEncoded,
+            100.0 * cbEncoded / cbFrame, frames / encodeTime, frames / decodeTime);
+    }
+
+    scheduler.Stop();
+}
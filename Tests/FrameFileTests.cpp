@@ -0,0 +1,451 @@
+#include "Tests.h"
+#include "FrameDump.h"
+#include "StreamingFileReader.h"
+
+#include <string.h>
+#include <vector>
+
+
+
+// frames of the test files - the rows are wider than a SIMD step, with a scalar tail
+#define TEST_FILE_WIDTH         40
+#define TEST_FILE_HEIGHT        6
+#define TEST_FILE_FRAMES        5
+#define TEST_FILE_INTERVAL      333333
+
+
+
+static void FillPattern(std::vector<BYTE>& data, UINT32 seed)
+{
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        data[i] = (BYTE)(i * 7 + seed * 31 + (i >> 5));
+    }
+}
+
+
+static void AppendBytes(std::vector<BYTE>& file, const void* pData, size_t cbData)
+{
+    file.insert(file.end(), (const BYTE*)pData, (const BYTE*)pData + cbData);
+}
+
+
+//
+// A dump of NV12 frames, written the way the recorder writes it - coded by the codec if
+// compressed.
+//
+static void BuildDump(bool compressed, std::vector<std::vector<BYTE> >& frames,
+    std::vector<BYTE>& file)
+{
+    FrameDumpHeader header;
+    FrameFormat format = { MFVideoFormat_NV12, TEST_FILE_WIDTH, TEST_FILE_HEIGHT, 0 };
+    DWORD cbFrame = GetPackedFrameBytes(format.subtype, format.width, format.height);
+    std::vector<BYTE> encoded(CFrameCodec::GetMaxEncodedBytes(format));
+    CFrameCodec codec;
+
+    ZeroMemory(&header, sizeof(header));
+    header.magic = FRAME_DUMP_MAGIC;
+    header.version = FRAME_DUMP_VERSION;
+    header.headerBytes = sizeof(header);
+    header.compression = compressed ? FRAME_DUMP_LOSSLESS : FRAME_DUMP_RAW;
+    header.subtype = format.subtype;
+    header.width = format.width;
+    header.height = format.height;
+    header.frameRateNumerator = 30;
+    header.frameRateDenominator = 1;
+
+    file.clear();
+    frames.clear();
+    AppendBytes(file, &header, sizeof(header));
+
+    for (UINT32 i = 0; i < TEST_FILE_FRAMES; i++)
+    {
+        FrameDumpRecord record;
+        FramePlane planes[2];
+        DWORD cbEncoded = 0;
+
+        frames.push_back(std::vector<BYTE>(cbFrame));
+        FillPattern(frames.back(), i);
+
+        record.timestamp = i * TEST_FILE_INTERVAL;
+        record.duration = TEST_FILE_INTERVAL;
+        record.cbFrame = cbFrame;
+        record.flags = 0;
+
+        if (compressed)
+        {
+            CFrameCodec::GetPackedPlanes(format, &frames.back()[0], planes);
+            CHECK_HR(codec.Encode(format, planes, &encoded[0], (DWORD)encoded.size(),
+                &cbEncoded));
+            record.cbFrame = cbEncoded;
+        }
+
+        AppendBytes(file, &record, sizeof(record));
+        AppendBytes(file, compressed ? &encoded[0] : &frames.back()[0], record.cbFrame);
+    }
+}
+
+
+//
+// Read every frame in order, then by time - the frames and their times are those written.
+//
+static void CheckFrames(IFrameFileReader* pReader, const std::vector<std::vector<BYTE> >& frames,
+    size_t frameCount)
+{
+    for (size_t i = 0; i <= frameCount; i++)
+    {
+        CComPtr<IMFSample> pSample;
+        LONGLONG time = 0;
+        HRESULT hr = pReader->ReadFrame(&pSample);
+
+        if (i == frameCount)
+        {
+            CHECK(hr == MF_E_END_OF_STREAM);
+            break;
+        }
+
+        CHECK_HR(hr);
+        if (FAILED(hr))
+        {
+            break;
+        }
+
+        CHECK(SampleEquals(pSample, &frames[i][0], (DWORD)frames[i].size()));
+        CHECK(SUCCEEDED(pSample->GetSampleTime(&time)) &&
+            time == pReader->GetInfo().startTime + (LONGLONG)i * TEST_FILE_INTERVAL);
+    }
+
+    // the frame shown half a frame after the third starts is the third
+    {
+        CComPtr<IMFSample> pSample;
+
+        CHECK_HR(pReader->ReadFrameAt(2 * TEST_FILE_INTERVAL + TEST_FILE_INTERVAL / 2,
+            &pSample));
+        CHECK(SampleEquals(pSample, &frames[2][0], (DWORD)frames[2].size()));
+    }
+
+    CHECK_HR(pReader->Rewind());
+    {
+        CComPtr<IMFSample> pSample;
+
+        CHECK_HR(pReader->ReadFrame(&pSample));
+        CHECK(SampleEquals(pSample, &frames[0][0], (DWORD)frames[0].size()));
+    }
+}
+
+
+static HRESULT OpenDump(PCWSTR path, const std::vector<BYTE>& file, IFrameFileReader** ppReader)
+{
+    HRESULT hr = WriteTestFile(path, &file[0], (DWORD)file.size());
+
+    *ppReader = NULL;
+
+    return SUCCEEDED(hr) ? CFrameDumpReader::Open(path, ppReader) : hr;
+}
+
+
+void TestFrameDump(void)
+{
+    WCHAR path[MAX_PATH];
+    std::vector<std::vector<BYTE> > frames;
+    std::vector<BYTE> file;
+    IFrameFileReader* pReader = NULL;
+    FrameDumpHeader* pHeader = NULL;
+
+    CHECK_HR(GetTestFilePath(L"mfcp_test.fdmp", path, ARRAYSIZE(path)));
+
+    for (int compressed = 0; compressed < 2; compressed++)
+    {
+        BuildDump(compressed != 0, frames, file);
+
+        CHECK_HR(OpenDump(path, file, &pReader));
+        if (pReader != NULL)
+        {
+            const FrameFileInfo& info = pReader->GetInfo();
+
+            CHECK(info.subtype == MFVideoFormat_NV12);
+            CHECK(info.width == TEST_FILE_WIDTH && info.height == TEST_FILE_HEIGHT);
+            CHECK(info.duration == TEST_FILE_FRAMES * TEST_FILE_INTERVAL);
+
+            CheckFrames(pReader, frames, TEST_FILE_FRAMES);
+            delete pReader;
+        }
+
+        // the index the reader wrote is used the next time
+        CHECK_HR(CFrameDumpReader::Open(path, &pReader));
+        if (pReader != NULL)
+        {
+            CheckFrames(pReader, frames, TEST_FILE_FRAMES);
+            delete pReader;
+            pReader = NULL;
+        }
+
+        // a recording cut short is readable up to its last complete record
+        file.resize(file.size() - 10);
+        CHECK_HR(OpenDump(path, file, &pReader));
+        if (pReader != NULL)
+        {
+            CheckFrames(pReader, frames, TEST_FILE_FRAMES - 1);
+            delete pReader;
+        }
+    }
+
+    BuildDump(false, frames, file);
+    pHeader = (FrameDumpHeader*)&file[0];
+
+    // sizes no frame file has - a frame size computed from them would wrap around
+    static const UINT32 badSizes[][2] =
+    {
+        { 0, TEST_FILE_HEIGHT }, { TEST_FILE_WIDTH, 0 }, { 100000, 2 }, { 0x80000000, 2 },
+        { 2, 0xFFFFFFFF }
+    };
+
+    for (DWORD i = 0; i < ARRAYSIZE(badSizes); i++)
+    {
+        pHeader->width = badSizes[i][0];
+        pHeader->height = badSizes[i][1];
+
+        CHECK(OpenDump(path, file, &pReader) == MF_E_INVALID_FILE_FORMAT);
+        CHECK(pReader == NULL);
+    }
+
+    // a record whose frame size does not match the format
+    BuildDump(false, frames, file);
+    ((FrameDumpRecord*)&file[sizeof(FrameDumpHeader)])->cbFrame = 0xFFFFFFF0;
+    CHECK(OpenDump(path, file, &pReader) == MF_E_INVALID_FILE_FORMAT);
+
+    // not a dump at all
+    BuildDump(false, frames, file);
+    ((FrameDumpHeader*)&file[0])->magic = 0;
+    CHECK(OpenDump(path, file, &pReader) == MF_E_UNSUPPORTED_BYTESTREAM_TYPE);
+
+    DeleteTestFile(path);
+}
+
+
+
+//
+// I420 frames as a Y4M file stores them, and the NV12 frames the reader makes of them.
+//
+static void BuildY4m(PCSTR header, std::vector<std::vector<BYTE> >& frames, std::vector<BYTE>& file)
+{
+    const UINT32 width = TEST_FILE_WIDTH;
+    const UINT32 height = TEST_FILE_HEIGHT;
+    const UINT32 lumaBytes = width * height;
+    const UINT32 chromaBytes = (width / 2) * (height / 2);
+
+    file.clear();
+    frames.clear();
+    AppendBytes(file, header, strlen(header));
+
+    for (UINT32 i = 0; i < TEST_FILE_FRAMES; i++)
+    {
+        std::vector<BYTE> planar(lumaBytes + 2 * chromaBytes);
+        std::vector<BYTE> nv12(lumaBytes + 2 * chromaBytes);
+
+        FillPattern(planar, i);
+
+        CopyMemory(&nv12[0], &planar[0], lumaBytes);
+        for (UINT32 c = 0; c < chromaBytes; c++)
+        {
+            nv12[lumaBytes + 2 * c] = planar[lumaBytes + c];
+            nv12[lumaBytes + 2 * c + 1] = planar[lumaBytes + chromaBytes + c];
+        }
+
+        AppendBytes(file, "FRAME\n", 6);
+        AppendBytes(file, &planar[0], planar.size());
+        frames.push_back(nv12);
+    }
+}
+
+
+//
+// Planar 4:2:2 frames as a Y4M file stores them, and the YUY2 frames the reader makes of them.
+//
+static void BuildY4m422(std::vector<std::vector<BYTE> >& frames, std::vector<BYTE>& file)
+{
+    const UINT32 width = TEST_FILE_WIDTH;
+    const UINT32 height = TEST_FILE_HEIGHT;
+    const UINT32 lumaBytes = width * height;
+    const UINT32 chromaBytes = (width / 2) * height;
+    PCSTR header = "YUV4MPEG2 W40 H6 F30:1 Ip C422\n";
+
+    file.clear();
+    frames.clear();
+    AppendBytes(file, header, strlen(header));
+
+    for (UINT32 i = 0; i < TEST_FILE_FRAMES; i++)
+    {
+        std::vector<BYTE> planar(lumaBytes + 2 * chromaBytes);
+        std::vector<BYTE> yuy2(width * 2 * height);
+
+        FillPattern(planar, i);
+
+        for (UINT32 y = 0; y < height; y++)
+        {
+            for (UINT32 x = 0; x < width; x += 2)
+            {
+                BYTE* pDest = &yuy2[(y * width + x) * 2];
+
+                pDest[0] = planar[y * width + x];
+                pDest[1] = planar[lumaBytes + y * (width / 2) + x / 2];
+                pDest[2] = planar[y * width + x + 1];
+                pDest[3] = planar[lumaBytes + chromaBytes + y * (width / 2) + x / 2];
+            }
+        }
+
+        AppendBytes(file, "FRAME\n", 6);
+        AppendBytes(file, &planar[0], planar.size());
+        frames.push_back(yuy2);
+    }
+}
+
+
+static HRESULT OpenStreaming(PCWSTR name, const std::vector<BYTE>& file,
+    IFrameFileReader** ppReader)
+{
+    WCHAR path[MAX_PATH];
+    HRESULT hr = GetTestFilePath(name, path, ARRAYSIZE(path));
+
+    *ppReader = NULL;
+
+    if (SUCCEEDED(hr))
+    {
+        hr = WriteTestFile(path, file.empty() ? "" : (const void*)&file[0], (DWORD)file.size());
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        hr = CStreamingFileReader::Open(path, ppReader);
+    }
+
+    return hr;
+}
+
+
+static void DeleteStreaming(PCWSTR name)
+{
+    WCHAR path[MAX_PATH];
+
+    if (SUCCEEDED(GetTestFilePath(name, path, ARRAYSIZE(path))))
+    {
+        DeleteTestFile(path);
+    }
+}
+
+
+void TestStreamingFileReader(void)
+{
+    static const PCSTR badHeaders[] =
+    {
+        "YUV4MPEG2 H6 F30:1\n",                 // no width
+        "YUV4MPEG2 W-40 H6\n",                  // negative, wraps around
+        "YUV4MPEG2 W100000 H6\n",
+        "YUV4MPEG2 W4294967294 H6\n",
+        "YUV4MPEG2 W41 H6\n",                   // odd width, chroma is shared by two columns
+        "YUV4MPEG2 W40 H5 C420jpeg\n",          // odd height of 4:2:0
+        "YUV4MPEG2 W40 H6 F30:0\n",
+        "YUV4MPEG2 W40 H6 C444\n"
+    };
+    static const PCWSTR badNames[] =
+    {
+        L"mfcp_test_clip.nv12",                 // no size
+        L"mfcp_test_99999x16.nv12",
+        L"mfcp_test_4294967294x2.rgb32",
+        L"mfcp_test_41x16.yuy2"
+    };
+    std::vector<std::vector<BYTE> > frames;
+    std::vector<BYTE> file;
+    IFrameFileReader* pReader = NULL;
+
+    // 4:2:0 is handed out as NV12
+    BuildY4m("YUV4MPEG2 W40 H6 F25:1 Ip A1:1 C420jpeg\n", frames, file);
+    CHECK_HR(OpenStreaming(L"mfcp_test.y4m", file, &pReader));
+    if (pReader != NULL)
+    {
+        const FrameFileInfo& info = pReader->GetInfo();
+
+        CHECK(info.subtype == MFVideoFormat_NV12);
+        CHECK(info.width == TEST_FILE_WIDTH && info.height == TEST_FILE_HEIGHT);
+        CHECK(info.frameRateNumerator == 25 && info.frameRateDenominator == 1);
+
+        for (size_t i = 0; i <= frames.size(); i++)
+        {
+            CComPtr<IMFSample> pSample;
+            HRESULT hr = pReader->ReadFrame(&pSample);
+
+            if (i == frames.size())
+            {
+                CHECK(hr == MF_E_END_OF_STREAM);
+                break;
+            }
+
+            CHECK_HR(hr);
+            CHECK(SampleEquals(pSample, &frames[i][0], (DWORD)frames[i].size()));
+        }
+
+        delete pReader;
+    }
+
+    // 4:2:2 as YUY2
+    BuildY4m422(frames, file);
+    CHECK_HR(OpenStreaming(L"mfcp_test.y4m", file, &pReader));
+    if (pReader != NULL)
+    {
+        CComPtr<IMFSample> pSample;
+
+        CHECK(pReader->GetInfo().subtype == MFVideoFormat_YUY2);
+        CHECK(pReader->GetInfo().frameRateNumerator == 30);
+
+        CHECK_HR(pReader->ReadFrameAt(3 * 10000000LL / 30, &pSample));
+        CHECK(SampleEquals(pSample, &frames[3][0], (DWORD)frames[3].size()));
+
+        pSample.Release();
+        delete pReader;
+    }
+
+    for (DWORD i = 0; i < ARRAYSIZE(badHeaders); i++)
+    {
+        BuildY4m(badHeaders[i], frames, file);
+        CHECK(FAILED(OpenStreaming(L"mfcp_test.y4m", file, &pReader)));
+        CHECK(pReader == NULL);
+    }
+
+    DeleteStreaming(L"mfcp_test.y4m");
+
+    // raw frames named by their size
+    frames.assign(2, std::vector<BYTE>(GetPackedFrameBytes(MFVideoFormat_NV12, 32, 16)));
+    FillPattern(frames[0], 0);
+    FillPattern(frames[1], 1);
+    file = frames[0];
+    file.insert(file.end(), frames[1].begin(), frames[1].end());
+
+    CHECK_HR(OpenStreaming(L"mfcp_test_hall_32x16.nv12", file, &pReader));
+    if (pReader != NULL)
+    {
+        CComPtr<IMFSample> pSample;
+
+        CHECK(pReader->GetInfo().subtype == MFVideoFormat_NV12);
+        CHECK(pReader->GetInfo().width == 32 && pReader->GetInfo().height == 16);
+        CHECK(pReader->GetInfo().duration == 2 * 10000000LL / 30);
+
+        CHECK_HR(pReader->ReadFrameAt(10000000LL / 30, &pSample));
+        CHECK(SampleEquals(pSample, &frames[1][0], (DWORD)frames[1].size()));
+
+        pSample.Release();
+        delete pReader;
+    }
+
+    DeleteStreaming(L"mfcp_test_hall_32x16.nv12");
+
+    for (DWORD i = 0; i < ARRAYSIZE(badNames); i++)
+    {
+        CHECK(OpenStreaming(badNames[i], file, &pReader) == MF_E_INVALID_FILE_FORMAT);
+        CHECK(pReader == NULL);
+        DeleteStreaming(badNames[i]);
+    }
+
+    CHECK(OpenStreaming(L"mfcp_test_32x16.txt", file, &pReader) ==
+        MF_E_UNSUPPORTED_BYTESTREAM_TYPE);
+    DeleteStreaming(L"mfcp_test_32x16.txt");
+}
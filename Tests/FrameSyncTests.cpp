@@ -0,0 +1,309 @@
+#include "Tests.h"
+#include "FrameSync.h"
+#include "MemoryBudget.h"
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+
+
+// cameras at 30 frames per second
+#define TEST_SYNC_INTERVAL      333333
+#define TEST_SYNC_FRAMES        600
+
+
+
+//
+// Collects the sequence numbers of the frames of every set - each camera numbers its frames
+// by the instant they show, so the frames of a good set all have the same number.
+//
+class CTestSetConsumer : public IFrameSetConsumer
+{
+    public:
+        CTestSetConsumer(void) : m_mixed(0), m_unordered(0), m_maxSkew(0), m_lastFrame(-1),
+            m_sets(0) {}
+
+        virtual void OnFrameSet(const FrameSet& set)
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(m_critSec);
+            LONGLONG frame = (LONGLONG)set.frames[0]->Sequence();
+
+            for (UINT32 i = 1; i < set.count; i++)
+            {
+                if ((LONGLONG)set.frames[i]->Sequence() != frame)
+                {
+                    m_mixed++;
+                }
+            }
+
+            if (frame <= m_lastFrame || set.sequence != m_sets)
+            {
+                m_unordered++;
+            }
+
+            m_lastFrame = frame;
+            m_maxSkew = max(m_maxSkew, set.skew);
+            m_sets++;
+        }
+
+        CComAutoCriticalSection m_critSec;
+        ULONGLONG m_mixed;              // frames of another instant than the first of the set
+        ULONGLONG m_unordered;          // sets that went back in time
+        LONGLONG m_maxSkew;
+        LONGLONG m_lastFrame;
+        ULONGLONG m_sets;
+};
+
+
+//
+// Sample time and arrival time of every frame of every camera - each camera has a clock of
+// its own, and the frames arrive with a jittering latency and a rare long delay.
+//
+struct SyncRun
+{
+    CFrameSynchronizer sync;
+    UINT32 inputCount;
+    int missEvery;                  // input 1 loses a frame in every missEvery, 0 for none
+    LONGLONG origin;                // GetMetricsTime() at Initialize()
+    double ticksPer100ns;
+    std::vector<LONGLONG> timestamps[FRAME_SYNC_MAX_INPUTS];
+    std::vector<LONGLONG> arrivals[FRAME_SYNC_MAX_INPUTS];     // 100-ns units
+    volatile LONG progress[FRAME_SYNC_MAX_INPUTS];             // frames pushed, threaded
+    volatile LONG nextInput;                                    // input of the next thread
+};
+
+
+static void PlanSyncRun(SyncRun* pRun, UINT32 inputCount, LONGLONG phaseStep,
+    LONGLONG maxJitter, int missEvery)
+{
+    static const LONGLONG clockOffsets[] = { 5000000000LL, -123456789LL, 42LL, 777777777LL };
+    UINT32 seed = 1;
+
+    pRun->inputCount = inputCount;
+    pRun->missEvery = missEvery;
+    pRun->nextInput = 0;
+
+    for (UINT32 i = 0; i < inputCount; i++)
+    {
+        pRun->timestamps[i].clear();
+        pRun->arrivals[i].clear();
+        pRun->progress[i] = 0;
+
+        for (LONGLONG n = 0; n < TEST_SYNC_FRAMES; n++)
+        {
+            LONGLONG time = 1000000 + n * TEST_SYNC_INTERVAL + i * phaseStep;
+            LONGLONG latency = 20000 + ((n % 97 == 13) ? 150000 : 0);
+
+            seed = seed * 1664525 + 1013904223;
+            latency += (LONGLONG)((seed >> 8) % (UINT32)maxJitter);
+
+            pRun->timestamps[i].push_back(time + clockOffsets[i % ARRAYSIZE(clockOffsets)]);
+            pRun->arrivals[i].push_back(time + latency);
+        }
+    }
+
+    CHECK_HR(pRun->sync.Initialize(inputCount, TEST_SYNC_INTERVAL / 2));
+
+    pRun->origin = GetMetricsTime();
+    pRun->ticksPer100ns = (double)GetMetricsTicksPerSecond() / 10000000.0;
+}
+
+
+static void PushSyncFrame(SyncRun* pRun, UINT32 input, LONGLONG n)
+{
+    FrameFormat format = { FrameSubtype_Gray8, 2, 2, 0 };
+    CFrameView* pFrame = NULL;
+    LONGLONG arrival = pRun->origin +
+        (LONGLONG)((double)pRun->arrivals[input][(size_t)n] * pRun->ticksPer100ns);
+
+    if (pRun->missEvery != 0 && input == 1 && n % pRun->missEvery == 5)
+    {
+        return;
+    }
+
+    if (FAILED(CFrameView::CreateImage(format, NULL, MemoryAccount_FrameCopies, &pFrame)))
+    {
+        CHECK(pFrame != NULL);
+        return;
+    }
+
+    pFrame->SetCaptureInfo((UINT64)n, arrival);
+    pRun->sync.Push(input, pFrame, pRun->timestamps[input][(size_t)n], arrival);
+    pFrame->Release();
+}
+
+
+static void CheckSyncRun(SyncRun* pRun, CTestSetConsumer* pConsumer, ULONGLONG minSets)
+{
+    FrameSyncStats stats;
+    MemoryBudgetStats budget;
+
+    pRun->sync.GetStats(&stats);
+
+    printf("    %u inputs: %llu sets, max skew %.2f ms, input 0: %llu matched, %llu dropped, "
+        "%llu late\n", pRun->inputCount, stats.sets, pConsumer->m_maxSkew / 10000.0,
+        stats.inputs[0].matched, stats.inputs[0].dropped, stats.inputs[0].late);
+
+    CHECK(pConsumer->m_mixed == 0);
+    CHECK(pConsumer->m_unordered == 0);
+    CHECK(pConsumer->m_maxSkew <= TEST_SYNC_INTERVAL / 2);
+    CHECK(stats.sets == pConsumer->m_sets);
+    CHECK(stats.sets >= minSets);
+
+    pRun->sync.Flush();
+    pRun->sync.RemoveConsumer(pConsumer);
+    pRun->sync.GetStats(&stats);
+
+    for (UINT32 i = 0; i < pRun->inputCount; i++)
+    {
+        const FrameSyncInputStats& input = stats.inputs[i];
+
+        CHECK(input.matched + input.dropped + input.late <= input.frames);
+    }
+
+    // every frame went back once the queues were flushed
+    GetMemoryBudget()->GetStats(&budget);
+    CHECK(budget.accountBytes[MemoryAccount_FrameCopies] == 0);
+}
+
+
+//
+// One thread pushes the frames of every camera in the order they arrive.
+//
+static void RunSync(UINT32 inputCount, LONGLONG phaseStep, LONGLONG maxJitter, int missEvery)
+{
+    SyncRun* pRun = new (std::nothrow) SyncRun();
+    CTestSetConsumer consumer;
+    std::vector<std::pair<LONGLONG, std::pair<UINT32, LONGLONG> > > order;
+    LONGLONG expected = missEvery ? TEST_SYNC_FRAMES - TEST_SYNC_FRAMES / missEvery :
+        TEST_SYNC_FRAMES;
+
+    CHECK(pRun != NULL);
+    if (pRun == NULL)
+    {
+        return;
+    }
+
+    PlanSyncRun(pRun, inputCount, phaseStep, maxJitter, missEvery);
+    pRun->sync.AddConsumer(&consumer);
+
+    for (UINT32 i = 0; i < inputCount; i++)
+    {
+        for (LONGLONG n = 0; n < TEST_SYNC_FRAMES; n++)
+        {
+            order.push_back(std::make_pair(pRun->arrivals[i][(size_t)n], std::make_pair(i, n)));
+        }
+    }
+
+    std::sort(order.begin(), order.end());
+
+    for (size_t i = 0; i < order.size(); i++)
+    {
+        PushSyncFrame(pRun, order[i].second.first, order[i].second.second);
+    }
+
+    CheckSyncRun(pRun, &consumer, (ULONGLONG)(expected - 8));
+
+    delete pRun;
+}
+
+
+void TestFrameSync(void)
+{
+    RunSync(2, 0, 30000, 0);
+    RunSync(3, 20000, 30000, 0);
+    RunSync(4, 10000, 80000, 0);
+    RunSync(3, 5000, 30000, 10);
+}
+
+
+//
+// A capture thread of one camera - real cameras are paced by their frame rate, so no thread
+// runs more than a frame ahead of the slowest.
+//
+static DWORD WINAPI SyncInputProc(LPVOID pParam)
+{
+    SyncRun* pRun = (SyncRun*)pParam;
+    UINT32 input = (UINT32)InterlockedIncrement(&pRun->nextInput) - 1;
+
+    for (LONG n = 0; n < TEST_SYNC_FRAMES; n++)
+    {
+        for (;;)
+        {
+            LONG slowest = TEST_SYNC_FRAMES;
+
+            for (UINT32 i = 0; i < pRun->inputCount; i++)
+            {
+                slowest = min(slowest, pRun->progress[i]);
+            }
+
+            if (n <= slowest + 1)
+            {
+                break;
+            }
+
+            SwitchToThread();
+        }
+
+        PushSyncFrame(pRun, input, n);
+        InterlockedExchange(&pRun->progress[input], n + 1);
+    }
+
+    return 0;
+}
+
+
+//
+// Every camera pushes from a thread of its own, so the matcher changes hands all the time.
+//
+void TestFrameSyncConcurrent(void)
+{
+    for (int run = 0; run < 20; run++)
+    {
+        SyncRun* pRun = new (std::nothrow) SyncRun();
+        CTestSetConsumer consumer;
+        HANDLE threads[FRAME_SYNC_MAX_INPUTS];
+        DWORD threadCount = 0;
+        int missEvery = (run % 2 == 0) ? 0 : 10;
+        LONGLONG expected = missEvery ? TEST_SYNC_FRAMES - TEST_SYNC_FRAMES / missEvery :
+            TEST_SYNC_FRAMES;
+
+        CHECK(pRun != NULL);
+        if (pRun == NULL)
+        {
+            return;
+        }
+
+        PlanSyncRun(pRun, 3, (missEvery != 0) ? 5000 : 20000, 30000, missEvery);
+        pRun->sync.AddConsumer(&consumer);
+
+        for (UINT32 i = 0; i < pRun->inputCount; i++)
+        {
+            threads[threadCount] = CreateThread(NULL, 0, SyncInputProc, pRun, 0, NULL);
+            CHECK(threads[threadCount] != NULL);
+            if (threads[threadCount] != NULL)
+            {
+                threadCount++;
+            }
+        }
+
+        // the inputs without a thread must not hold up the others
+        for (UINT32 i = threadCount; i < pRun->inputCount; i++)
+        {
+            InterlockedExchange(&pRun->progress[i], TEST_SYNC_FRAMES);
+        }
+
+        WaitForMultipleObjects(threadCount, threads, TRUE, INFINITE);
+
+        for (DWORD i = 0; i < threadCount; i++)
+        {
+            CloseHandle(threads[i]);
+        }
+
+        // the threads overtake each other by up to a frame, which costs a few sets
+        CheckSyncRun(pRun, &consumer, (ULONGLONG)(expected - expected / 5));
+
+        delete pRun;
+    }
+}
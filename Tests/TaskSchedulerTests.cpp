@@ -0,0 +1,250 @@
+#include "Tests.h"
+#include "TaskScheduler.h"
+
+#include <vector>
+
+
+
+#define TEST_TASK_COUNT         1000
+
+
+
+struct TaskRun
+{
+    CTaskScheduler* pScheduler;
+    volatile LONG finished;             // tasks that ran
+    volatile LONG order;                // next position in a chain
+    std::vector<LONG> positions;        // position each task of a chain ran at
+    LONG finishedAtJoin;                // finished when the join task ran
+    volatile LONG failures;             // nested submissions that failed
+};
+
+
+static void CountProc(void* pContext, UINT32 index)
+{
+    InterlockedIncrement(&((TaskRun*)pContext)->finished);
+}
+
+
+static void ChainProc(void* pContext, UINT32 index)
+{
+    TaskRun* pRun = (TaskRun*)pContext;
+
+    pRun->positions[index] = InterlockedIncrement(&pRun->order) - 1;
+}
+
+
+static void JoinProc(void* pContext, UINT32 index)
+{
+    TaskRun* pRun = (TaskRun*)pContext;
+
+    pRun->finishedAtJoin = pRun->finished;
+}
+
+
+//
+// A task that spawns tasks of its own and waits for them - Wait() on a worker runs other
+// tasks meanwhile, so this must not deadlock even with every worker doing it.
+//
+static void SpawnProc(void* pContext, UINT32 index)
+{
+    TaskRun* pRun = (TaskRun*)pContext;
+    CTask* pChildren[8];
+    UINT32 created = 0;
+
+    for (UINT32 i = 0; i < ARRAYSIZE(pChildren); i++)
+    {
+        if (FAILED(CTask::Create(CountProc, pRun, i, &pChildren[created])))
+        {
+            InterlockedIncrement(&pRun->failures);
+            continue;
+        }
+
+        if (FAILED(pRun->pScheduler->Submit(pChildren[created])))
+        {
+            InterlockedIncrement(&pRun->failures);
+        }
+
+        created++;
+    }
+
+    for (UINT32 i = 0; i < created; i++)
+    {
+        pRun->pScheduler->Wait(pChildren[i]);
+        pChildren[i]->Release();
+    }
+}
+
+
+//
+// Fan out, chain and nest tasks, and check that every task ran once and after its
+// prerequisites.
+//
+void TestTaskScheduler(void)
+{
+    CTaskScheduler scheduler;
+    TaskRun run;
+    std::vector<CTask*> tasks;
+    CTask* pJoin = NULL;
+    CTask* pTask = NULL;
+
+    run.pScheduler = &scheduler;
+    run.finished = 0;
+    run.order = 0;
+    run.finishedAtJoin = -1;
+    run.failures = 0;
+
+    // nothing runs before the workers do
+    CHECK_HR(CTask::Create(CountProc, &run, 0, &pTask));
+    CHECK(scheduler.Submit(pTask) == MF_E_NOT_INITIALIZED);
+    pTask->Release();
+
+    CHECK_HR(scheduler.Start(4));
+
+    // fan out and join - the join task waits for all of them
+    CHECK_HR(CTask::Create(JoinProc, &run, 0, &pJoin));
+
+    for (UINT32 i = 0; i < TEST_TASK_COUNT; i++)
+    {
+        CHECK_HR(CTask::Create(CountProc, &run, i, &pTask));
+        CHECK_HR(pJoin->AddDependency(pTask));
+        tasks.push_back(pTask);
+    }
+
+    CHECK_HR(scheduler.Submit(pJoin));
+    CHECK(!pJoin->IsComplete());
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        CHECK_HR(scheduler.Submit(tasks[i]));
+    }
+
+    scheduler.Wait(pJoin);
+    CHECK(run.finishedAtJoin == TEST_TASK_COUNT);
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        CHECK(tasks[i]->IsComplete());
+        tasks[i]->Release();
+    }
+    tasks.clear();
+    pJoin->Release();
+
+    // a chain, submitted back to front - every task runs after the one before it
+    run.positions.assign(TEST_TASK_COUNT / 10, -1);
+
+    for (UINT32 i = 0; i < run.positions.size(); i++)
+    {
+        CHECK_HR(CTask::Create(ChainProc, &run, i, &pTask));
+        if (i > 0)
+        {
+            CHECK_HR(pTask->AddDependency(tasks[i - 1]));
+        }
+        tasks.push_back(pTask);
+    }
+
+    for (size_t i = tasks.size(); i > 0; i--)
+    {
+        CHECK_HR(scheduler.Submit(tasks[i - 1]));
+    }
+
+    scheduler.Wait(tasks.back());
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        CHECK(run.positions[i] == (LONG)i);
+        tasks[i]->Release();
+    }
+    tasks.clear();
+
+    // nested waits on every worker at once
+    run.finished = 0;
+
+    for (UINT32 i = 0; i < 64; i++)
+    {
+        CHECK_HR(CTask::Create(SpawnProc, &run, i, &pTask));
+        CHECK_HR(scheduler.Submit(pTask));
+        tasks.push_back(pTask);
+    }
+
+    for (size_t i = 0; i < tasks.size(); i++)
+    {
+        scheduler.Wait(tasks[i]);
+        tasks[i]->Release();
+    }
+    tasks.clear();
+
+    CHECK(run.failures == 0);
+    CHECK(run.finished == 64 * 8);
+
+    CHECK_HR(scheduler.Stop());
+
+    CHECK_HR(CTask::Create(CountProc, &run, 0, &pTask));
+    CHECK(scheduler.Submit(pTask) == MF_E_NOT_INITIALIZED);
+    pTask->Release();
+}
+
+
+//
+// Tasks per second through a join, for the overhead of a task against the work of a stage.
+//
+void BenchTaskScheduler(void)
+{
+    const UINT32 rounds = 200;
+    CTaskScheduler scheduler;
+    TaskRun run;
+    double start = 0.0;
+    double elapsed = 0.0;
+
+    run.pScheduler = &scheduler;
+    run.finished = 0;
+    run.order = 0;
+    run.finishedAtJoin = -1;
+    run.failures = 0;
+
+    CHECK_HR(scheduler.Start(0));
+
+    start = GetTestTime();
+
+    for (UINT32 r = 0; r < rounds; r++)
+    {
+        std::vector<CTask*> tasks;
+        CTask* pJoin = NULL;
+        CTask* pTask = NULL;
+
+        if (FAILED(CTask::Create(JoinProc, &run, 0, &pJoin)))
+        {
+            CHECK(pJoin != NULL);
+            break;
+        }
+
+        for (UINT32 i = 0; i < TEST_TASK_COUNT; i++)
+        {
+            if (SUCCEEDED(CTask::Create(CountProc, &run, i, &pTask)))
+            {
+                pJoin->AddDependency(pTask);
+                tasks.push_back(pTask);
+            }
+        }
+
+        scheduler.Submit(pJoin);
+
+        for (size_t i = 0; i < tasks.size(); i++)
+        {
+            scheduler.Submit(tasks[i]);
+            tasks[i]->Release();
+        }
+
+        scheduler.Wait(pJoin);
+        pJoin->Release();
+    }
+
+    elapsed = GetTestTime() - start;
+
+    CHECK(run.finished == (LONG)(rounds * TEST_TASK_COUNT));
+
+    printf("    %u tasks in %.3f s, %.2f us per task\n", rounds * TEST_TASK_COUNT, elapsed,
+        elapsed * 1000000.0 / (rounds * TEST_TASK_COUNT));
+
+    scheduler.Stop();
+}
@@ -0,0 +1,192 @@
+#include "Tests.h"
+#include "FrameIndex.h"
+
+
+
+struct TestEntry
+{
+    PCWSTR name;
+    TestProc pProc;
+    bool bench;                 // only run with -bench
+};
+
+static const TestEntry s_tests[] =
+{
+    { L"codec",             TestFrameCodec,             false },
+    { L"audioring",         TestAudioRing,              false },
+    { L"audioring-mt",      TestAudioRingConcurrent,    false },
+    { L"framesync",         TestFrameSync,              false },
+    { L"framesync-mt",      TestFrameSyncConcurrent,    false },
+    { L"scheduler",         TestTaskScheduler,          false },
+    { L"framedump",         TestFrameDump,              false },
+    { L"streamingreader",   TestStreamingFileReader,    false },
+    { L"codec-bench",       BenchFrameCodec,            true },
+    { L"scheduler-bench",   BenchTaskScheduler,         true }
+};
+
+static volatile long s_failures = 0;
+
+
+
+void ReportFailure(PCSTR file, int line, PCSTR expression)
+{
+    InterlockedIncrement(&s_failures);
+    printf("    %s(%d): check failed: %s\n", file, line, expression);
+}
+
+
+double GetTestTime(void)
+{
+    LARGE_INTEGER now;
+    LARGE_INTEGER frequency;
+
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&frequency);
+
+    return (double)now.QuadPart / (double)frequency.QuadPart;
+}
+
+
+HRESULT GetTestFilePath(PCWSTR name, WCHAR* pPath, DWORD cchPath)
+{
+    DWORD cchTemp = GetTempPath(cchPath, pPath);
+
+    if (cchTemp == 0 || cchTemp >= cchPath)
+    {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+
+    if (wcslen(pPath) + wcslen(name) >= cchPath)
+    {
+        return HRESULT_FROM_WIN32(ERROR_FILENAME_EXCED_RANGE);
+    }
+
+    wcscat_s(pPath, cchPath, name);
+
+    return S_OK;
+}
+
+
+HRESULT WriteTestFile(PCWSTR path, const void* pData, DWORD cbData)
+{
+    HRESULT hr = S_OK;
+    HANDLE file = INVALID_HANDLE_VALUE;
+    DWORD cbWritten = 0;
+
+    // a stale index of an earlier run describes other records
+    DeleteTestFile(path);
+
+    file = CreateFile(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    if (!WriteFile(file, pData, cbData, &cbWritten, NULL) || cbWritten != cbData)
+    {
+        hr = HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    CloseHandle(file);
+
+    return hr;
+}
+
+
+void DeleteTestFile(PCWSTR path)
+{
+    WCHAR indexPath[MAX_PATH];
+
+    DeleteFile(path);
+
+    if (SUCCEEDED(GetFrameIndexPath(path, indexPath, ARRAYSIZE(indexPath))))
+    {
+        DeleteFile(indexPath);
+    }
+}
+
+
+bool SampleEquals(IMFSample* pSample, const BYTE* pExpected, DWORD cbExpected)
+{
+    CComPtr<IMFMediaBuffer> pBuffer;
+    BYTE* pData = NULL;
+    DWORD cbData = 0;
+    bool equal = false;
+
+    if (pSample == NULL || FAILED(pSample->ConvertToContiguousBuffer(&pBuffer)) ||
+        FAILED(pBuffer->Lock(&pData, NULL, &cbData)))
+    {
+        return false;
+    }
+
+    equal = (cbData == cbExpected && memcmp(pData, pExpected, cbExpected) == 0);
+
+    pBuffer->Unlock();
+
+    return equal;
+}
+
+
+
+//
+// MF_BasicPlaybackTests [-bench] [test ...] - without names, every test runs, and with
+// -bench the benchmarks as well.  The exit code is the number of failed checks.
+//
+int wmain(int argc, wchar_t* argv[])
+{
+    HRESULT hr = S_OK;
+    bool bench = false;
+    bool named = false;
+    DWORD run = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (_wcsicmp(argv[i], L"-bench") == 0)
+        {
+            bench = true;
+        }
+        else
+        {
+            named = true;
+        }
+    }
+
+    hr = MFStartup(MF_VERSION, MFSTARTUP_LITE);
+    if (FAILED(hr))
+    {
+        printf("MFStartup failed: 0x%08lx\n", hr);
+        return 1;
+    }
+
+    for (DWORD i = 0; i < ARRAYSIZE(s_tests); i++)
+    {
+        bool selected = !named && (!s_tests[i].bench || bench);
+        long failures = s_failures;
+        double start = 0.0;
+
+        for (int j = 1; j < argc && !selected; j++)
+        {
+            selected = (_wcsicmp(argv[j], s_tests[i].name) == 0);
+        }
+
+        if (!selected)
+        {
+            continue;
+        }
+
+        printf("%S\n", s_tests[i].name);
+
+        start = GetTestTime();
+        s_tests[i].pProc();
+
+        printf("    %s, %.2f s\n", (s_failures == failures) ? "passed" : "FAILED",
+            GetTestTime() - start);
+        run++;
+    }
+
+    MFShutdown();
+
+    printf("%u tests, %ld failed checks\n", run, s_failures);
+
+    return (int)s_failures;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "Common.h"
+
+// Media Foundation headers
+#include <mfapi.h>
+#include <mfidl.h>
+#include <mferror.h>
+
+#include <stdio.h>
+
+
+
+//
+//  Console tests of the parts of the player that run without a camera - the codec, the
+//  lock-free structures, the scheduler and the file parsers.  Every test is a function
+//  that checks what it does with CHECK(); a failed check is printed and counted, and the
+//  test goes on, so one run shows every failure.
+//
+//  Benchmarks are tests too, but only run when asked for - they print their timings and
+//  fail only if their results are wrong.
+//
+
+typedef void (*TestProc)(void);
+
+// count a failed check - the run fails at the end
+void ReportFailure(PCSTR file, int line, PCSTR expression);
+
+#define CHECK(expression) \
+    do { if (!(expression)) ReportFailure(__FILE__, __LINE__, #expression); } while(false)
+
+#define CHECK_HR(expression) CHECK(SUCCEEDED(expression))
+
+// seconds since some fixed time, for the benchmarks
+double GetTestTime(void);
+
+// path of a scratch file in the temp directory - the name is kept, since the raw frame
+// files are recognized by their name
+HRESULT GetTestFilePath(PCWSTR name, WCHAR* pPath, DWORD cchPath);
+
+// write a scratch file, replacing it if it exists
+HRESULT WriteTestFile(PCWSTR path, const void* pData, DWORD cbData);
+
+// delete a scratch file and the index a frame dump reader may have written next to it
+void DeleteTestFile(PCWSTR path);
+
+// the bytes of the sample are the expected ones
+bool SampleEquals(IMFSample* pSample, const BYTE* pExpected, DWORD cbExpected);
+
+
+// the tests, one file each
+void TestFrameCodec(void);
+void TestAudioRing(void);
+void TestAudioRingConcurrent(void);
+void TestFrameSync(void);
+void TestFrameSyncConcurrent(void);
+void TestTaskScheduler(void);
+void TestFrameDump(void);
+void TestStreamingFileReader(void);
+
+void BenchFrameCodec(void);
+void BenchTaskScheduler(void);
@@ -0,0 +1,125 @@
+#include "ThreadAffinity.h"
+
+#include <psapi.h>
+
+#pragma comment(lib, "psapi.lib")
+
+
+
+//
+// Place the pools on the node and let every role use all of the node's cores.
+//
+HRESULT GetNumaNodeAffinity(USHORT node, PipelineAffinity* pAffinity)
+{
+    HRESULT hr = S_OK;
+    GROUP_AFFINITY nodeCores;
+
+    do
+    {
+        BREAK_ON_NULL(pAffinity, E_POINTER);
+
+        ZeroMemory(&nodeCores, sizeof(nodeCores));
+
+        if (!GetNumaNodeProcessorMaskEx(node, &nodeCores))
+        {
+            hr = HRESULT_FROM_WIN32(GetLastError());
+            break;
+        }
+
+        pAffinity->numaNode = node;
+        pAffinity->captureCores = nodeCores;
+        pAffinity->transformCores = nodeCores;
+        pAffinity->consumerCores = nodeCores;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+HRESULT PinThread(HANDLE thread, const GROUP_AFFINITY& cores)
+{
+    if (cores.Mask == 0)
+    {
+        return S_OK;
+    }
+
+    if (!SetThreadGroupAffinity(thread, &cores, NULL))
+    {
+        return HRESULT_FROM_WIN32(GetLastError());
+    }
+
+    return S_OK;
+}
+
+
+//
+// The capture thread belongs to a Media Foundation work queue, so it cannot be pinned when
+// it is created.  Instead it is pinned while it delivers a frame - two system calls per
+// frame, which leave the thread as it was for the other work of the queue.
+//
+CScopedThreadPin::CScopedThreadPin(const GROUP_AFFINITY& cores) :
+    m_pinned(false)
+{
+    ZeroMemory(&m_previous, sizeof(m_previous));
+
+    if (cores.Mask != 0)
+    {
+        m_pinned = (SetThreadGroupAffinity(GetCurrentThread(), &cores, &m_previous) != FALSE);
+    }
+}
+
+
+CScopedThreadPin::~CScopedThreadPin(void)
+{
+    if (m_pinned)
+    {
+        SetThreadGroupAffinity(GetCurrentThread(), &m_previous, NULL);
+    }
+}
+
+
+USHORT GetCurrentNumaNode(void)
+{
+    PROCESSOR_NUMBER processor;
+    USHORT node = NUMA_NODE_ANY;
+
+    GetCurrentProcessorNumberEx(&processor);
+
+    if (!GetNumaProcessorNodeEx(&processor, &node))
+    {
+        node = NUMA_NODE_ANY;
+    }
+
+    return node;
+}
+
+
+USHORT GetMemoryNumaNode(const void* pAddress)
+{
+    PSAPI_WORKING_SET_EX_INFORMATION info;
+
+    ZeroMemory(&info, sizeof(info));
+    info.VirtualAddress = (PVOID)pAddress;
+
+    if (!QueryWorkingSetEx(GetCurrentProcess(), &info, sizeof(info)) ||
+        !info.VirtualAttributes.Valid)
+    {
+        return NUMA_NODE_ANY;
+    }
+
+    return (USHORT)info.VirtualAttributes.Node;
+}
+
+
+DWORD CountCores(const GROUP_AFFINITY& cores)
+{
+    DWORD count = 0;
+
+    for (KAFFINITY mask = cores.Mask; mask != 0; mask &= mask - 1)
+    {
+        count++;
+    }
+
+    return count;
+}
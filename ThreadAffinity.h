@@ -0,0 +1,66 @@
+#pragma once
+
+#include "Common.h"
+
+
+
+// no NUMA preference - memory comes from the node of the allocating thread
+#define NUMA_NODE_ANY       ((USHORT)0xFFFF)
+
+
+//
+//  Placement of the threads and buffers of one capture pipeline.  An empty mask (Mask == 0)
+//  leaves that role unpinned.  On a multi-socket box, put all roles and the frame pools on
+//  the node closest to the capture device, so the frames never cross the interconnect.
+//
+struct PipelineAffinity
+{
+    USHORT          numaNode;           // node of the frame pools, NUMA_NODE_ANY for none
+    GROUP_AFFINITY  captureCores;       // thread that receives samples from the session
+    GROUP_AFFINITY  transformCores;     // task scheduler workers running the frame stages
+    GROUP_AFFINITY  consumerCores;      // threads of the frame servers
+};
+
+
+//
+//  Tile counts of one pipeline stage by where the frame memory was relative to the core
+//  that processed it.
+//
+struct NumaTrafficStats
+{
+    ULONGLONG localTiles;       // frame memory on the node of the processing core
+    ULONGLONG remoteTiles;      // frame memory on another node - crossed the interconnect
+    ULONGLONG unknownTiles;     // node of the memory could not be determined
+};
+
+
+// build a PipelineAffinity that places every role and the pools on one NUMA node
+HRESULT GetNumaNodeAffinity(USHORT node, PipelineAffinity* pAffinity);
+
+// restrict a thread to the cores in the mask - an empty mask is ignored
+HRESULT PinThread(HANDLE thread, const GROUP_AFFINITY& cores);
+
+//
+//  Pins the calling thread for the lifetime of the object, and gives it back its previous
+//  affinity after - for threads that are not ours, such as those of Media Foundation work
+//  queues, which the rest of the process shares.  An empty mask does nothing.
+//
+class CScopedThreadPin
+{
+    public:
+        CScopedThreadPin(const GROUP_AFFINITY& cores);
+        ~CScopedThreadPin(void);
+
+    private:
+        GROUP_AFFINITY m_previous;
+        bool m_pinned;
+};
+
+// NUMA node of the processor running the calling thread
+USHORT GetCurrentNumaNode(void);
+
+// NUMA node holding the physical page behind the address, NUMA_NODE_ANY if not resident
+USHORT GetMemoryNumaNode(const void* pAddress);
+
+// number of cores in the mask
+DWORD CountCores(const GROUP_AFFINITY& cores);
@@ -1,4 +1,52 @@
 #include "TopoBuilder.h"
+#include "Startup.h"
+#include "Tracer.h"
+
+#include <shlwapi.h>
+#include <wmcodecdsp.h>
+
+#pragma comment(lib, "wmcodecdspuuid.lib")
+
+
+
+void CTopoBuilder::SetPipelinePlan(const PipelinePlan& plan)
+{
+    m_plan = plan;
+    m_hasPlan = true;
+
+    SetCaptureDevice(plan.deviceIndex, plan.deviceName);
+
+    if (!IsRectEmpty(&plan.crop))
+    {
+        m_captureRegion = plan.crop;
+    }
+}
+
+
+void CTopoBuilder::SetCaptureDevice(UINT32 deviceIndex, PCWSTR deviceName)
+{
+    m_deviceIndex = deviceIndex;
+    wcsncpy_s(m_deviceName, (deviceName != NULL) ? deviceName : L"", _TRUNCATE);
+}
+
+
+void CTopoBuilder::SetCaptureRegion(const RECT* pRegion)
+{
+    if (pRegion != NULL && !IsRectEmpty(pRegion))
+    {
+        m_captureRegion = *pRegion;
+    }
+    else
+    {
+        // an empty or inverted region cannot be cropped - the whole frame is captured
+        if (pRegion != NULL)
+        {
+            OutputDebugString(L"capture: the capture region is empty, ignored\n");
+        }
+
+        SetRectEmpty(&m_captureRegion);
+    }
+}
 
 
 
@@ -14,6 +62,14 @@ HRESULT CTopoBuilder::RenderURL(PCWSTR fileUrl, HWND videoHwnd)
     {
         m_videoHwnd = videoHwnd;
 
+        // the frame sink of a previous topology cannot be reused once its session is gone
+        if(m_pFrameSink != NULL)
+        {
+            m_pFrameSink->Shutdown();
+            m_pFrameSink->Release();
+            m_pFrameSink = NULL;
+        }
+
         // first create the media source for the file/stream passed in.  Fail and fall out if
         // the media source creation fails (e.g. if the file format is not recognized)
         hr = CreateMediaSource(fileUrl);
@@ -35,7 +91,11 @@ template <class T> void SafeRelease(T **ppT)
 	}
 }
 
-HRESULT CreateVideoDeviceSource(IMFMediaSource **ppSource)
+//
+// Open the capture device whose friendly name contains deviceName, or the device at
+// deviceIndex if no name is given.
+//
+HRESULT CreateVideoDeviceSource(UINT32 deviceIndex, PCWSTR deviceName, IMFMediaSource **ppSource)
 {
     *ppSource = NULL;
 
@@ -68,18 +128,38 @@ HRESULT CreateVideoDeviceSource(IMFMediaSource **ppSource)
         goto done;
     }
 
-    if (count == 0)
+    if (deviceName != NULL && deviceName[0] != L'\0')
+    {
+        for (deviceIndex = 0; deviceIndex < count; deviceIndex++)
+        {
+            LPWSTR friendlyName = NULL;
+            UINT32 length = 0;
+            bool found = false;
+
+            if (SUCCEEDED(ppDevices[deviceIndex]->GetAllocatedString(
+                MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME, &friendlyName, &length)))
+            {
+                found = (StrStrIW(friendlyName, deviceName) != NULL);
+                CoTaskMemFree(friendlyName);
+            }
+
+            if (found)
+                break;
+        }
+    }
+
+    if (deviceIndex >= count)
     {
-        hr = E_FAIL;
+        hr = MF_E_NOT_FOUND;
         goto done;
     }
 
 	
     // Create the media source object.
-    hr = ppDevices[0]->ActivateObject(IID_PPV_ARGS(&pSource));
+    hr = ppDevices[deviceIndex]->ActivateObject(IID_PPV_ARGS(&pSource));
 	TCHAR *name;
 	UINT32 len;
-	hr = ppDevices[0]->GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME, &name, &len);
+	hr = ppDevices[deviceIndex]->GetAllocatedString(MF_DEVSOURCE_ATTRIBUTE_FRIENDLY_NAME, &name, &len);
 
     if (FAILED(hr))
     {
@@ -101,26 +181,161 @@ done:
     return hr;
 }
 
+
+HRESULT CreateAudioDeviceSource(UINT32 deviceIndex, IMFMediaSource **ppSource)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFAttributes> pAttributes;
+    IMFActivate** ppDevices = NULL;
+    UINT32 count = 0;
+
+    do
+    {
+        BREAK_ON_NULL(ppSource, E_POINTER);
+
+        hr = MFCreateAttributes(&pAttributes, 1);
+        BREAK_ON_FAIL(hr);
+
+        hr = pAttributes->SetGUID(MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE,
+            MF_DEVSOURCE_ATTRIBUTE_SOURCE_TYPE_AUDCAP_GUID);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFEnumDeviceSources(pAttributes, &ppDevices, &count);
+        BREAK_ON_FAIL(hr);
+
+        if (deviceIndex >= count)
+        {
+            hr = MF_E_NOT_FOUND;
+            break;
+        }
+
+        hr = ppDevices[deviceIndex]->ActivateObject(IID_PPV_ARGS(ppSource));
+    }
+    while(false);
+
+    for (UINT32 i = 0; i < count; i++)
+    {
+        ppDevices[i]->Release();
+    }
+    CoTaskMemFree(ppDevices);
+
+    return hr;
+}
+
+
 //
-// Create a media source for the specified URL string.  The URL can be a path to a stream, 
-// or it can be a path to a local file.
+// Create a media source for the specified URL string.  The URL is the path of a recorded
+// frame file, which is played back instead of the camera; without a URL the capture device
+// of the pipeline plan is opened.
 //
 HRESULT CTopoBuilder::CreateMediaSource(PCWSTR sURL)
 {
     HRESULT hr = S_OK;
-    MF_OBJECT_TYPE objectType = MF_OBJECT_INVALID;
-    CComPtr<IMFSourceResolver> pSourceResolver;
-    CComPtr<IUnknown> pSource;
+    IMFMediaSource* pSource = NULL;
+
+    // the source of a previous topology keeps capturing until it is shut down, and the
+    // parts of its aggregate must not be mistaken for those of the new one
+    if (m_pSource != NULL || m_pAudioSource != NULL || m_pCameraSource != NULL)
+    {
+        ShutdownSource();
+    }
 
-	IMFMediaSource *ppSource;
-	CreateVideoDeviceSource(&ppSource);
-	m_pSource = ppSource;
+    m_isFileSource = (sURL != NULL && sURL[0] != L'\0');
 
-	return hr;
+    if (m_isFileSource)
+    {
+        hr = CreateFrameFileSource(sURL, m_replayOptions, &pSource);
+    }
+    else
+    {
+        UINT32 deviceIndex = m_deviceIndex;
+        PCWSTR deviceName = m_deviceName;
+
+        // the device is usually activated already, while the application started up
+        hr = TakePrefetchedCaptureSource(deviceIndex, deviceName, &pSource);
+        if (FAILED(hr))
+        {
+            hr = CreateVideoDeviceSource(deviceIndex, deviceName, &pSource);
+        }
+
+        if (SUCCEEDED(hr))
+        {
+            CStartupTimeline::Mark(StartupPhase_Device);
+        }
+
+        // the audio device joins the camera in one source, so both start together and
+        // their samples are stamped on the clock of the one session
+        if (SUCCEEDED(hr) && m_pAudioRing != NULL)
+        {
+            hr = AggregateAudioSource(&pSource);
+        }
+    }
+
+    if (SUCCEEDED(hr))
+    {
+        m_pSource.Attach(pSource);
+    }
+    else if (pSource != NULL)
+    {
+        pSource->Shutdown();
+        pSource->Release();
+    }
+
+    return hr;
 }
 
 
 
+//
+// Replace the camera source with an aggregate of it and the audio device.  Without an audio
+// device the camera is captured alone.
+//
+HRESULT CTopoBuilder::AggregateAudioSource(IMFMediaSource** ppSource)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaSource> pAudioSource;
+    CComPtr<IMFCollection> pSources;
+    IMFMediaSource* pAggregate = NULL;
+
+    do
+    {
+        hr = CreateAudioDeviceSource(m_audioDeviceIndex, &pAudioSource);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFCreateCollection(&pSources);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSources->AddElement(*ppSource);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSources->AddElement(pAudioSource);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFCreateAggregateSource(pSources, &pAggregate);
+        BREAK_ON_FAIL(hr);
+
+        // the caller's reference to the camera is kept for shutting it down
+        m_pCameraSource.Attach(*ppSource);
+        m_pAudioSource = pAudioSource;
+        *ppSource = pAggregate;
+    }
+    while(false);
+
+    if (FAILED(hr))
+    {
+        CTracer::Instant("audio", "no audio device", "hr", hr);
+
+        if (pAudioSource != NULL)
+        {
+            pAudioSource->Shutdown();
+        }
+        hr = S_OK;
+    }
+
+    return hr;
+}
+
+
 //
 // Since we created the source, we are responsible for shutting it down.
 //
@@ -128,6 +343,28 @@ HRESULT CTopoBuilder::ShutdownSource(void)
 {    
     HRESULT hr = S_OK;
 
+    // the frame sink is handed to the topology directly rather than through an activation
+    // object, so the session will not shut it down for us
+    if(m_pFrameSink != NULL)
+    {
+        m_pFrameSink->Shutdown();
+        m_pFrameSink->Release();
+        m_pFrameSink = NULL;
+    }
+
+    // the sources in an aggregate source are shut down one by one
+    if(m_pAudioSource != NULL)
+    {
+        m_pAudioSource->Shutdown();
+        m_pAudioSource.Release();
+    }
+
+    if(m_pCameraSource != NULL)
+    {
+        m_pCameraSource->Shutdown();
+        m_pCameraSource.Release();
+    }
+
     if(m_pSource != NULL)
     {
         // shut down the source
@@ -145,6 +382,21 @@ HRESULT CTopoBuilder::ShutdownSource(void)
 }
 
 
+//
+// Only frame files can be read at any time - a camera has just the frame it delivers next.
+//
+HRESULT CTopoBuilder::GetSnapshot(LONGLONG time, IMFSample** ppSample)
+{
+    if (m_pSource == NULL || !m_isFileSource)
+    {
+        return MF_E_INVALIDREQUEST;
+    }
+
+    // the file source is created by CreateFrameFileSource() and nothing else
+    return static_cast<CFrameFileSource*>(m_pSource.p)->GetSnapshot(time, ppSample);
+}
+
+
 
 //
 // Create a playback topology from the media source by extracting presentation
@@ -216,7 +468,6 @@ HRESULT CreateMFTransform(
 	pSD->GetMediaTypeHandler(&pTH);
 	pTH->GetCurrentMediaType(&pMT);
 	pMT->GetGUID(MF_MT_SUBTYPE, &subtype);
-	printf("%d",pMT);
 	SafeRelease(&pTH);
 
 	inInfo.guidMajorType = MFMediaType_Video;
@@ -325,6 +576,16 @@ HRESULT AddMFTNode(
 	return hr;
 }
 
+static bool IsAudioStream(IMFStreamDescriptor* pStreamDescriptor)
+{
+    CComPtr<IMFMediaTypeHandler> pHandler;
+    GUID majorType = GUID_NULL;
+
+    return SUCCEEDED(pStreamDescriptor->GetMediaTypeHandler(&pHandler)) &&
+        SUCCEEDED(pHandler->GetMajorType(&majorType)) && majorType == MFMediaType_Audio;
+}
+
+
 //
 //  Adds a topology branch for one stream.
 //
@@ -368,6 +629,21 @@ HRESULT CTopoBuilder::AddBranchToPartialTopology(
         // to play it.
         if (streamSelected)
         {
+            // The audio of the capture goes to the ring, straight from the source.
+            if (m_pAudioRing != NULL && m_pAudioSource != NULL &&
+                IsAudioStream(pStreamDescriptor))
+            {
+                hr = CreateSourceStreamNode(pPresDescriptor, pStreamDescriptor, pSourceNode);
+                BREAK_ON_FAIL(hr);
+
+                hr = AddAudioCaptureBranch(pStreamDescriptor, pSourceNode);
+                break;
+            }
+
+            // Capture in the size the pipeline file asks for.
+            hr = SelectCaptureFormat(pStreamDescriptor);
+            BREAK_ON_FAIL(hr);
+
             // Create a source node for this stream.
             hr = CreateSourceStreamNode(pPresDescriptor, pStreamDescriptor, pSourceNode);
             BREAK_ON_FAIL(hr);
@@ -376,6 +652,28 @@ HRESULT CTopoBuilder::AddBranchToPartialTopology(
             hr = CreateOutputNode(pStreamDescriptor, m_videoHwnd, pOutputNode);
             BREAK_ON_FAIL(hr);
 
+            // Crop right after the source, so that nothing downstream touches the pixels
+            // outside of the region - from here on the crop node stands in for the source.
+            hr = InsertCaptureCrop(pStreamDescriptor, pSourceNode);
+            BREAK_ON_FAIL(hr);
+
+            // The frame consumers tap the full frames next to the renderer - from here on
+            // the tee stands in for the source.
+            hr = InsertFrameTap(pStreamDescriptor, pSourceNode);
+            BREAK_ON_FAIL(hr);
+
+            // A pipeline file names the transforms explicitly.
+            if (m_hasPlan)
+            {
+                hr = m_pTopology->AddNode(pSourceNode);
+                BREAK_ON_FAIL(hr);
+
+                hr = m_pTopology->AddNode(pOutputNode);
+                BREAK_ON_FAIL(hr);
+
+                hr = AddPlannedTransforms(pStreamDescriptor, pSourceNode, pOutputNode);
+                break;
+            }
 
 			hr = CreateMFTransform(pStreamDescriptor, &pImg);
 
@@ -411,6 +709,368 @@ HRESULT CTopoBuilder::AddBranchToPartialTopology(
 
 
 
+//
+//  Chain the transforms of the pipeline plan between the source and the output node of a
+//  video stream.  Other streams are connected directly.
+//
+HRESULT CTopoBuilder::AddPlannedTransforms(
+    IMFStreamDescriptor* pStreamDescriptor,
+    IMFTopologyNode* pSourceNode,
+    IMFTopologyNode* pOutputNode)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaTypeHandler> pHandler;
+    CComPtr<IMFTopologyNode> pUpstreamNode = pSourceNode;
+    GUID majorType = GUID_NULL;
+
+    do
+    {
+        hr = pStreamDescriptor->GetMediaTypeHandler(&pHandler);
+        BREAK_ON_FAIL(hr);
+
+        hr = pHandler->GetMajorType(&majorType);
+        BREAK_ON_FAIL(hr);
+
+        for (DWORD i = 0; majorType == MFMediaType_Video && i < m_plan.transformCount; i++)
+        {
+            CComPtr<IMFTransform> pTransform;
+            CComPtr<IMFTopologyNode> pTransformNode;
+
+            hr = pTransform.CoCreateInstance(m_plan.transforms[i]);
+            BREAK_ON_FAIL(hr);
+
+            hr = MFCreateTopologyNode(MF_TOPOLOGY_TRANSFORM_NODE, &pTransformNode);
+            BREAK_ON_FAIL(hr);
+
+            hr = pTransformNode->SetObject(pTransform);
+            BREAK_ON_FAIL(hr);
+
+            hr = m_pTopology->AddNode(pTransformNode);
+            BREAK_ON_FAIL(hr);
+
+            hr = pUpstreamNode->ConnectOutput(0, pTransformNode, 0);
+            BREAK_ON_FAIL(hr);
+
+            pUpstreamNode = pTransformNode;
+        }
+        BREAK_ON_FAIL(hr);
+
+        // the resolver inserts the converters the transforms and the sink need
+        hr = pUpstreamNode->ConnectOutput(0, pOutputNode, 0);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
+//
+//  Subtypes the Video Resizer DSP takes - a compressed capture (MJPG) is decoded in front of
+//  it by the topology loader.
+//
+static bool IsResizerSubtype(REFGUID subtype)
+{
+    return subtype == MFVideoFormat_NV12 || subtype == MFVideoFormat_YUY2 ||
+        subtype == MFVideoFormat_RGB32 || subtype == MFVideoFormat_RGB24 ||
+        subtype == MFVideoFormat_I420 || subtype == MFVideoFormat_IYUV ||
+        subtype == MFVideoFormat_YV12 || subtype == MFVideoFormat_UYVY;
+}
+
+
+//
+//  Put the Video Resizer DSP behind the source node, configured to cut the capture region
+//  out of the frame without scaling it.  The source node is added to the topology here, and
+//  pSourceNode is replaced with the resizer node, which the caller adds and connects in its
+//  place.  Does nothing without a region or for streams other than video.
+//
+//  The region is clipped to the frame and aligned to its chroma samples; a region outside of
+//  the frame fails.  A compressed capture is cropped in NV12, so that the topology loader
+//  puts a decoder between the source and the resizer.
+//
+HRESULT CTopoBuilder::InsertCaptureCrop(
+    IMFStreamDescriptor* pStreamDescriptor,
+    CComPtr<IMFTopologyNode> &pSourceNode)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaTypeHandler> pHandler;
+    CComPtr<IMFMediaType> pSourceType;
+    CComPtr<IMFMediaType> pInputType;
+    CComPtr<IMFMediaType> pOutputType;
+    CComPtr<IMFTransform> pResizer;
+    CComQIPtr<IWMResizerProps> pResizerProps;
+    CComPtr<IMFTopologyNode> pCropNode;
+    GUID majorType = GUID_NULL;
+    FrameFormat format = { GUID_NULL, 0, 0, 0 };
+    RECT region;
+    LONG width = 0;
+    LONG height = 0;
+
+    do
+    {
+        if (IsRectEmpty(&m_captureRegion))
+        {
+            break;
+        }
+
+        hr = pStreamDescriptor->GetMediaTypeHandler(&pHandler);
+        BREAK_ON_FAIL(hr);
+
+        hr = pHandler->GetMajorType(&majorType);
+        BREAK_ON_FAIL(hr);
+
+        if (majorType != MFMediaType_Video)
+        {
+            break;
+        }
+
+        hr = pHandler->GetCurrentMediaType(&pSourceType);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSourceType->GetGUID(MF_MT_SUBTYPE, &format.subtype);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFGetAttributeSize(pSourceType, MF_MT_FRAME_SIZE, &format.width, &format.height);
+        BREAK_ON_FAIL(hr);
+
+        if (IsResizerSubtype(format.subtype))
+        {
+            pInputType = pSourceType;
+        }
+        else
+        {
+            // the frame of the compressed type, decoded
+            hr = MFCreateMediaType(&pInputType);
+            BREAK_ON_FAIL(hr);
+
+            hr = pSourceType->CopyAllItems(pInputType);
+            BREAK_ON_FAIL(hr);
+
+            hr = pInputType->SetGUID(MF_MT_SUBTYPE, MFVideoFormat_NV12);
+            BREAK_ON_FAIL(hr);
+
+            hr = pInputType->SetUINT32(MF_MT_INTERLACE_MODE, MFVideoInterlace_Progressive);
+            BREAK_ON_FAIL(hr);
+
+            hr = pInputType->SetUINT32(MF_MT_ALL_SAMPLES_INDEPENDENT, TRUE);
+            BREAK_ON_FAIL(hr);
+
+            pInputType->DeleteItem(MF_MT_COMPRESSED);
+            pInputType->DeleteItem(MF_MT_AVG_BITRATE);
+            pInputType->DeleteItem(MF_MT_DEFAULT_STRIDE);
+            pInputType->DeleteItem(MF_MT_SAMPLE_SIZE);
+
+            format.subtype = MFVideoFormat_NV12;
+        }
+
+        if (!CFrameView::AlignRegion(format, m_captureRegion, &region))
+        {
+            OutputDebugString(L"capture: the capture region is outside of the frame\n");
+            hr = E_INVALIDARG;
+            break;
+        }
+
+        width = region.right - region.left;
+        height = region.bottom - region.top;
+
+        hr = pResizer.CoCreateInstance(CLSID_CResizerDMO);
+        BREAK_ON_FAIL(hr);
+
+        pResizerProps = pResizer;
+        BREAK_ON_NULL(pResizerProps, E_NOINTERFACE);
+
+        // same format as the source, with the size of the region
+        hr = MFCreateMediaType(&pOutputType);
+        BREAK_ON_FAIL(hr);
+
+        hr = pInputType->CopyAllItems(pOutputType);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFSetAttributeSize(pOutputType, MF_MT_FRAME_SIZE, width, height);
+        BREAK_ON_FAIL(hr);
+
+        pOutputType->DeleteItem(MF_MT_DEFAULT_STRIDE);
+        pOutputType->DeleteItem(MF_MT_SAMPLE_SIZE);
+        pOutputType->DeleteItem(MF_MT_MINIMUM_DISPLAY_APERTURE);
+        pOutputType->DeleteItem(MF_MT_GEOMETRIC_APERTURE);
+
+        hr = pResizer->SetInputType(0, pInputType, 0);
+        BREAK_ON_FAIL(hr);
+
+        hr = pResizer->SetOutputType(0, pOutputType, 0);
+        BREAK_ON_FAIL(hr);
+
+        // a one-to-one copy of the region - the resizer does not filter at unit scale
+        hr = pResizerProps->SetFullCropRegion(region.left, region.top, width, height,
+            0, 0, width, height);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFCreateTopologyNode(MF_TOPOLOGY_TRANSFORM_NODE, &pCropNode);
+        BREAK_ON_FAIL(hr);
+
+        hr = pCropNode->SetObject(pResizer);
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pTopology->AddNode(pSourceNode);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSourceNode->ConnectOutput(0, pCropNode, 0);
+        BREAK_ON_FAIL(hr);
+
+        pSourceNode = pCropNode;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
+//
+//  Put a tee behind the source node, with its second output going to the frame sink, so the
+//  frame consumers get the captured frames while the renderer shows them - the preview and
+//  the analysis share one capture, each in the size it needs.  The source node is added to
+//  the topology here, and pSourceNode is replaced with the tee, whose first output the caller
+//  connects to the renderer in its place.  Does nothing without a window, without the tap,
+//  or for streams other than video.
+//
+HRESULT CTopoBuilder::InsertFrameTap(
+    IMFStreamDescriptor* pStreamDescriptor,
+    CComPtr<IMFTopologyNode> &pSourceNode)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaTypeHandler> pHandler;
+    CComPtr<IMFStreamSink> pFrameStream;
+    CComPtr<IMFTopologyNode> pTeeNode;
+    CComPtr<IMFTopologyNode> pFrameNode;
+    GUID majorType = GUID_NULL;
+
+    do
+    {
+        if (!m_frameTap || m_videoHwnd == NULL)
+        {
+            break;
+        }
+
+        hr = pStreamDescriptor->GetMediaTypeHandler(&pHandler);
+        BREAK_ON_FAIL(hr);
+
+        hr = pHandler->GetMajorType(&majorType);
+        BREAK_ON_FAIL(hr);
+
+        if (majorType != MFMediaType_Video)
+        {
+            break;
+        }
+
+        hr = CreateFrameSinkStream(pFrameStream);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFCreateTopologyNode(MF_TOPOLOGY_OUTPUT_NODE, &pFrameNode);
+        BREAK_ON_FAIL(hr);
+
+        hr = pFrameNode->SetObject(pFrameStream);
+        BREAK_ON_FAIL(hr);
+
+        hr = MFCreateTopologyNode(MF_TOPOLOGY_TEE_NODE, &pTeeNode);
+        BREAK_ON_FAIL(hr);
+
+        // the renderer paces the tee - the frame sink takes whatever it is given
+        hr = pTeeNode->SetUINT32(MF_TOPONODE_PRIMARYOUTPUT, 0);
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pTopology->AddNode(pSourceNode);
+        BREAK_ON_FAIL(hr);
+
+        hr = m_pTopology->AddNode(pFrameNode);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSourceNode->ConnectOutput(0, pTeeNode, 0);
+        BREAK_ON_FAIL(hr);
+
+        hr = pTeeNode->ConnectOutput(1, pFrameNode, 0);
+        BREAK_ON_FAIL(hr);
+
+        pSourceNode = pTeeNode;
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
+//
+//  Set the current media type of a video capture stream to the native type with the frame
+//  size of the pipeline plan.  Without a plan, without a size, or if the device has no type
+//  of that size, the device default stays.
+//
+HRESULT CTopoBuilder::SelectCaptureFormat(IMFStreamDescriptor* pStreamDescriptor)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaTypeHandler> pHandler;
+    DWORD typeCount = 0;
+    GUID majorType = GUID_NULL;
+    bool found = false;
+
+    do
+    {
+        // a frame file has the one format it was recorded in
+        if (!m_hasPlan || m_plan.width == 0 || m_isFileSource)
+        {
+            break;
+        }
+
+        hr = pStreamDescriptor->GetMediaTypeHandler(&pHandler);
+        BREAK_ON_FAIL(hr);
+
+        hr = pHandler->GetMajorType(&majorType);
+        BREAK_ON_FAIL(hr);
+
+        if (majorType != MFMediaType_Video)
+        {
+            break;
+        }
+
+        hr = pHandler->GetMediaTypeCount(&typeCount);
+        BREAK_ON_FAIL(hr);
+
+        for (DWORD i = 0; i < typeCount; i++)
+        {
+            CComPtr<IMFMediaType> pType;
+            UINT32 width = 0;
+            UINT32 height = 0;
+
+            if (FAILED(pHandler->GetMediaTypeByIndex(i, &pType)) ||
+                FAILED(MFGetAttributeSize(pType, MF_MT_FRAME_SIZE, &width, &height)))
+            {
+                continue;
+            }
+
+            // the device lists its preferred type for a size first
+            if (width == m_plan.width && height == m_plan.height)
+            {
+                hr = pHandler->SetCurrentMediaType(pType);
+                found = true;
+                break;
+            }
+        }
+
+        // the video goes on in the current type of the device rather than not at all
+        if (!found)
+        {
+            OutputDebugString(L"capture: the device has no type of the size of the pipeline "
+                L"plan - capturing in its current type\n");
+            CTracer::Instant("topology", "capture size not supported", "width", m_plan.width);
+        }
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
 //
 //  Create a source node for the specified stream
 //
@@ -474,6 +1134,7 @@ HRESULT CTopoBuilder::CreateOutputNode(
     HRESULT hr = S_OK;
     CComPtr<IMFMediaTypeHandler> pHandler;
     CComPtr<IMFActivate> pRendererActivate;
+    CComPtr<IMFStreamSink> pFrameStream;
 
     GUID majorType = GUID_NULL;
 
@@ -494,7 +1155,20 @@ HRESULT CTopoBuilder::CreateOutputNode(
         // The activation objects are used by the session in order to create the renderers 
         // only when they are needed - i.e. only right before starting playback.  The 
         // activation objects are also used to shut down the renderers.
-        if (majorType == MFMediaType_Audio)
+        if (hwndVideo == NULL)
+        {
+            // without a window there are no renderers at all - the video stream goes to the
+            // frame sink, and any other stream is deselected
+            if (majorType == MFMediaType_Video)
+            {
+                hr = CreateFrameSinkStream(pFrameStream);
+            }
+            else
+            {
+                hr = E_FAIL;
+            }
+        }
+        else if (majorType == MFMediaType_Audio)
         {
             // if the stream major type is audio, create the audio renderer.
             hr = MFCreateAudioRendererActivate(&pRendererActivate);
@@ -521,8 +1195,16 @@ HRESULT CTopoBuilder::CreateOutputNode(
         BREAK_ON_FAIL(hr);
 
         // Store the IActivate object in the sink node - it will be extracted later by the
-        // media session during the topology render phase.
-        hr = pNode->SetObject(pRendererActivate);
+        // media session during the topology render phase.  The frame sink already exists,
+        // so its stream is stored in the node directly.
+        if (pFrameStream != NULL)
+        {
+            hr = pNode->SetObject(pFrameStream);
+        }
+        else
+        {
+            hr = pNode->SetObject(pRendererActivate);
+        }
         BREAK_ON_FAIL(hr);
     }
     while(false);
@@ -536,9 +1218,79 @@ HRESULT CTopoBuilder::CreateOutputNode(
 
 
 
+//
+//  Connect the audio stream of the capture to a sample grabber that writes it to the ring.
+//
+HRESULT CTopoBuilder::AddAudioCaptureBranch(
+    IMFStreamDescriptor* pStreamDescriptor,
+    IMFTopologyNode* pSourceNode)
+{
+    HRESULT hr = S_OK;
+    CComPtr<IMFMediaTypeHandler> pHandler;
+    CComPtr<CAudioCapture> pCapture;
+    CComPtr<IMFActivate> pSinkActivate;
+    CComPtr<IMFTopologyNode> pOutputNode;
+
+    do
+    {
+        hr = pStreamDescriptor->GetMediaTypeHandler(&pHandler);
+        BREAK_ON_FAIL(hr);
+
+        hr = CAudioCapture::CreateInstance(m_pAudioRing, &pCapture.p);
+        BREAK_ON_FAIL(hr);
 
+        hr = pCapture->SelectStreamFormat(pHandler);
+        BREAK_ON_FAIL(hr);
 
+        // the sink keeps the capture alive for as long as the session uses it
+        hr = pCapture->CreateSinkActivate(pHandler, &pSinkActivate);
+        BREAK_ON_FAIL(hr);
 
+        hr = MFCreateTopologyNode(MF_TOPOLOGY_OUTPUT_NODE, &pOutputNode);
+        BREAK_ON_FAIL(hr);
 
+        hr = pOutputNode->SetObject(pSinkActivate);
+        BREAK_ON_FAIL(hr);
 
+        hr = m_pTopology->AddNode(pSourceNode);
+        BREAK_ON_FAIL(hr);
 
+        hr = m_pTopology->AddNode(pOutputNode);
+        BREAK_ON_FAIL(hr);
+
+        hr = pSourceNode->ConnectOutput(0, pOutputNode, 0);
+    }
+    while(false);
+
+    return hr;
+}
+
+
+
+//
+//  Create the frame sink used in place of the EVR when there is no video window, and
+//  return its only stream.
+//
+HRESULT CTopoBuilder::CreateFrameSinkStream(CComPtr<IMFStreamSink> &pStreamSink)
+{
+    HRESULT hr = S_OK;
+
+    do
+    {
+        pStreamSink = NULL;
+
+        // a source has only one video stream that we render, so one sink is enough
+        if(m_pFrameSink == NULL)
+        {
+            hr = CFrameSink::CreateInstance(m_pFrameConsumers,
+                m_hasPlan ? m_plan.sinkSubtype : GUID_NULL, &m_pFrameSink);
+            BREAK_ON_FAIL(hr);
+        }
+
+        hr = m_pFrameSink->GetStreamSinkByIndex(0, &pStreamSink);
+        BREAK_ON_FAIL(hr);
+    }
+    while(false);
+
+    return hr;
+}
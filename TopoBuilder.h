@@ -8,6 +8,23 @@
 #include <mferror.h>
 #include <evr.h>
 
+#include "FrameSink.h"
+#include "PipelineConfig.h"
+#include "FrameFileSource.h"
+#include "AudioCapture.h"
+
+
+
+//
+//  Open the capture device whose friendly name contains deviceName, or the device at
+//  deviceIndex if no name is given.
+//
+HRESULT CreateVideoDeviceSource(UINT32 deviceIndex, PCWSTR deviceName, IMFMediaSource **ppSource);
+
+//
+//  Open the audio capture device at deviceIndex.
+//
+HRESULT CreateAudioDeviceSource(UINT32 deviceIndex, IMFMediaSource **ppSource);
 
 
 //
@@ -16,15 +33,50 @@
 class CTopoBuilder
 {
     public:
-        CTopoBuilder(void)  {};
+        CTopoBuilder(void) : m_pFrameConsumers(NULL), m_pFrameSink(NULL), m_hasPlan(false),
+            m_isFileSource(false), m_frameTap(false), m_deviceIndex(0), m_pAudioRing(NULL),
+            m_audioDeviceIndex(0)
+            { SetRectEmpty(&m_captureRegion); ZeroMemory(&m_replayOptions, sizeof(m_replayOptions));
+              m_deviceName[0] = L'\0'; };
         ~CTopoBuilder(void) { ShutdownSource(); };
 
-        // create a topology for the URL that will be rendered in the specified window
+        // create a topology for the URL that will be rendered in the specified window - if
+        // the window is NULL the video is delivered to the frame consumers instead.  The URL
+        // is the path of a frame file, or NULL for the capture device
         HRESULT RenderURL(PCWSTR sURL, HWND videoHwnd);
 
+        // set the consumers that will receive the frames when running without a window
+        void SetFrameConsumers(CFrameConsumerList* pConsumers) { m_pFrameConsumers = pConsumers; }
+
+        // with a window, also deliver the video to the frame consumers, through a tee in
+        // front of the renderer - takes effect on RenderURL()
+        void SetFrameTap(bool tap) { m_frameTap = tap; }
+
+        // build the next topologies from a compiled pipeline file instead of the defaults
+        void SetPipelinePlan(const PipelinePlan& plan);
+
+        // capture device opened by the next RenderURL() of the device - the one whose friendly
+        // name contains deviceName, or the one at deviceIndex if no name is given.  Replaces
+        // the device of the pipeline plan.
+        void SetCaptureDevice(UINT32 deviceIndex, PCWSTR deviceName);
+
+        // capture the audio device at deviceIndex along with the camera, into the ring - takes
+        // effect on the next RenderURL() of the device.  NULL stops capturing audio.
+        void SetAudioCapture(CAudioRing* pRing, UINT32 deviceIndex)
+            { m_pAudioRing = pRing; m_audioDeviceIndex = deviceIndex; }
+
+        // crop the video to a region right after the source, NULL for the whole frame
+        void SetCaptureRegion(const RECT* pRegion);
+
+        // pacing and looping of the frame files opened from now on
+        void SetReplayOptions(const FrameReplayOptions& options) { m_replayOptions = options; }
+
         // get the created topology
         IMFTopology* GetTopology(void) { return m_pTopology; }
 
+        // the frame of the open frame file shown at the given time
+        HRESULT GetSnapshot(LONGLONG time, IMFSample** ppSample);
+
         // shutdown the media source for the topology
         HRESULT ShutdownSource(void);
 
@@ -33,8 +85,23 @@ class CTopoBuilder
         CComQIPtr<IMFMediaSource> m_pSource;                // the MF source
         CComQIPtr<IMFVideoDisplayControl> m_pVideoDisplay;  // the EVR
         HWND m_videoHwnd;                                   // the target window
+        CFrameConsumerList* m_pFrameConsumers;              // frame consumers of the player
+        CFrameSink* m_pFrameSink;                           // sink used instead of the EVR
+        PipelinePlan m_plan;                                // compiled pipeline file
+        bool m_hasPlan;                                     // m_plan is valid
+        RECT m_captureRegion;                               // crop region, empty for none
+        FrameReplayOptions m_replayOptions;                 // how frame files are played
+        bool m_isFileSource;                                // m_pSource plays a frame file
+        bool m_frameTap;                                    // tee the video to the frame sink
+        UINT32 m_deviceIndex;                               // capture device to open
+        WCHAR m_deviceName[128];                            // part of its name, may be empty
+        CAudioRing* m_pAudioRing;                           // ring of the audio capture, or NULL
+        UINT32 m_audioDeviceIndex;                          // audio capture device to open
+        CComPtr<IMFMediaSource> m_pAudioSource;             // audio device in m_pSource
+        CComPtr<IMFMediaSource> m_pCameraSource;            // camera in m_pSource with it
 
         HRESULT CreateMediaSource(PCWSTR sURL);
+        HRESULT AggregateAudioSource(IMFMediaSource** ppSource);
         HRESULT CreateTopology(void);
 
         HRESULT AddBranchToPartialTopology(
@@ -50,5 +117,26 @@ class CTopoBuilder
             IMFStreamDescriptor* pStreamDescr,
             HWND hwndVideo, 
             CComPtr<IMFTopologyNode> &pNode);
+
+        HRESULT CreateFrameSinkStream(CComPtr<IMFStreamSink> &pStreamSink);
+
+        HRESULT AddAudioCaptureBranch(
+            IMFStreamDescriptor* pStreamDescr,
+            IMFTopologyNode* pSourceNode);
+
+        HRESULT SelectCaptureFormat(IMFStreamDescriptor* pStreamDescr);
+
+        HRESULT InsertCaptureCrop(
+            IMFStreamDescriptor* pStreamDescr,
+            CComPtr<IMFTopologyNode> &pSourceNode);
+
+        HRESULT InsertFrameTap(
+            IMFStreamDescriptor* pStreamDescr,
+            CComPtr<IMFTopologyNode> &pSourceNode);
+
+        HRESULT AddPlannedTransforms(
+            IMFStreamDescriptor* pStreamDescr,
+            IMFTopologyNode* pSourceNode,
+            IMFTopologyNode* pOutputNode);
 };
 
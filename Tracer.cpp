@@ -0,0 +1,289 @@
+#include "Tracer.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <new>
+#include <vector>
+
+
+
+enum TracePhase
+{
+    TracePhase_Span = 'X',
+    TracePhase_Instant = 'i',
+    TracePhase_Counter = 'C'
+};
+
+struct TraceEvent
+{
+    PCSTR category;
+    PCSTR name;
+    PCSTR valueName;            // NULL if the event has no value
+    LONGLONG start;             // GetMetricsTime()
+    LONGLONG duration;          // of spans
+    LONGLONG frame;             // TRACE_NO_FRAME if none
+    LONGLONG value;
+    char phase;                 // TracePhase
+};
+
+//
+// Events of one thread.  Only the owning thread writes, and it publishes an event by
+// bumping written after storing it - Dump() reads the ring behind it and drops whatever
+// the thread may have overwritten meanwhile.
+//
+struct TraceBuffer
+{
+    DWORD threadId;
+    char threadName[32];
+    volatile ULONG written;     // events ever written, the ring holds the latest ones
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+};
+
+
+volatile bool CTracer::s_enabled = false;
+
+// buffers of every thread that recorded an event - kept after the thread exits, so its
+// events can still be dumped
+static CComAutoCriticalSection s_bufferLock;
+static std::vector<TraceBuffer*> s_buffers;
+static LONGLONG s_origin = 0;                   // time stamps are written relative to it
+
+static __declspec(thread) TraceBuffer* s_pThreadBuffer = NULL;
+
+
+
+//
+// The buffer of the calling thread, created on its first event.  Only this registration
+// takes a lock.
+//
+static TraceBuffer* GetThreadBuffer(void)
+{
+    TraceBuffer* pBuffer = s_pThreadBuffer;
+
+    if (pBuffer == NULL)
+    {
+        pBuffer = new (std::nothrow) TraceBuffer();
+        if (pBuffer == NULL)
+        {
+            return NULL;
+        }
+
+        pBuffer->threadId = GetCurrentThreadId();
+        pBuffer->threadName[0] = '\0';
+        pBuffer->written = 0;
+
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(s_bufferLock);
+            s_buffers.push_back(pBuffer);
+        }
+
+        s_pThreadBuffer = pBuffer;
+    }
+
+    return pBuffer;
+}
+
+
+static void AppendEvent(const TraceEvent& event)
+{
+    TraceBuffer* pBuffer = GetThreadBuffer();
+
+    if (pBuffer != NULL)
+    {
+        ULONG index = pBuffer->written;
+
+        pBuffer->events[index & (TRACE_BUFFER_EVENTS - 1)] = event;
+
+        // the volatile store is a release - the event is complete before it is published
+        pBuffer->written = index + 1;
+    }
+}
+
+
+
+
+
+void CTracer::Enable(bool enable)
+{
+    if (enable && s_origin == 0)
+    {
+        s_origin = GetMetricsTime();
+    }
+
+    s_enabled = enable;
+}
+
+
+void CTracer::Span(PCSTR category, PCSTR name, LONGLONG start, LONGLONG end, LONGLONG frame,
+    PCSTR valueName, LONGLONG value)
+{
+    if (s_enabled)
+    {
+        TraceEvent event = { category, name, valueName, start, end - start, frame, value,
+            TracePhase_Span };
+
+        AppendEvent(event);
+    }
+}
+
+
+void CTracer::Instant(PCSTR category, PCSTR name, PCSTR valueName, LONGLONG value)
+{
+    if (s_enabled)
+    {
+        TraceEvent event = { category, name, valueName, GetMetricsTime(), 0, TRACE_NO_FRAME,
+            value, TracePhase_Instant };
+
+        AppendEvent(event);
+    }
+}
+
+
+void CTracer::Counter(PCSTR category, PCSTR name, LONGLONG value)
+{
+    if (s_enabled)
+    {
+        TraceEvent event = { category, name, name, GetMetricsTime(), 0, TRACE_NO_FRAME, value,
+            TracePhase_Counter };
+
+        AppendEvent(event);
+    }
+}
+
+
+void CTracer::SetThreadName(PCSTR name)
+{
+    TraceBuffer* pBuffer = NULL;
+
+    if (s_enabled && name != NULL)
+    {
+        pBuffer = GetThreadBuffer();
+        if (pBuffer != NULL)
+        {
+            strncpy_s(pBuffer->threadName, name, _TRUNCATE);
+        }
+    }
+}
+
+
+//
+// Copy the ring of a thread, then check how far the thread got meanwhile: events up to
+// written - TRACE_BUFFER_EVENTS may have been overwritten during the copy, including the
+// slot the thread may be in the middle of writing.
+//
+static void CopyEvents(const TraceBuffer* pBuffer, std::vector<TraceEvent>* pEvents)
+{
+    LONGLONG before = pBuffer->written;
+    LONGLONG count = min(before, (LONGLONG)TRACE_BUFFER_EVENTS);
+    LONGLONG first = before - count;
+    LONGLONG after = 0;
+    LONGLONG valid = 0;
+
+    pEvents->resize((size_t)count);
+
+    for (LONGLONG i = 0; i < count; i++)
+    {
+        (*pEvents)[(size_t)i] = pBuffer->events[(first + i) & (TRACE_BUFFER_EVENTS - 1)];
+    }
+
+    after = pBuffer->written;
+    valid = after - TRACE_BUFFER_EVENTS + 1;
+
+    if (valid > first)
+    {
+        pEvents->erase(pEvents->begin(),
+            pEvents->begin() + (size_t)min(valid - first, count));
+    }
+}
+
+
+HRESULT CTracer::Dump(PCWSTR path)
+{
+    HRESULT hr = S_OK;
+    FILE* pFile = NULL;
+    std::vector<TraceBuffer*> buffers;
+    std::vector<TraceEvent> events;
+    double microsecondsPerTick = 1000000.0 / (double)GetMetricsTicksPerSecond();
+    DWORD pid = GetCurrentProcessId();
+    bool first = true;
+
+    do
+    {
+        BREAK_ON_NULL(path, E_POINTER);
+
+        if (_wfopen_s(&pFile, path, L"w") != 0 || pFile == NULL)
+        {
+            hr = E_ACCESSDENIED;
+            break;
+        }
+
+        {
+            CComCritSecLock<CComAutoCriticalSection> lock(s_bufferLock);
+            buffers = s_buffers;
+        }
+
+        fprintf(pFile, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+        for (size_t b = 0; b < buffers.size(); b++)
+        {
+            const TraceBuffer* pBuffer = buffers[b];
+
+            if (pBuffer->threadName[0] != '\0')
+            {
+                fprintf(pFile, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%u,\"tid\":%u,"
+                    "\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n", pid, pBuffer->threadId,
+                    pBuffer->threadName);
+                first = false;
+            }
+
+            CopyEvents(pBuffer, &events);
+
+            for (size_t i = 0; i < events.size(); i++)
+            {
+                const TraceEvent& event = events[i];
+
+                fprintf(pFile, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                    "\"pid\":%u,\"tid\":%u", first ? "" : ",\n", event.name, event.category,
+                    event.phase, (double)(event.start - s_origin) * microsecondsPerTick, pid,
+                    pBuffer->threadId);
+                first = false;
+
+                if (event.phase == TracePhase_Span)
+                {
+                    fprintf(pFile, ",\"dur\":%.3f", (double)event.duration * microsecondsPerTick);
+                }
+                else if (event.phase == TracePhase_Instant)
+                {
+                    fprintf(pFile, ",\"s\":\"t\"");
+                }
+
+                fprintf(pFile, ",\"args\":{");
+                if (event.frame != TRACE_NO_FRAME)
+                {
+                    fprintf(pFile, "\"frame\":%I64d%s", event.frame,
+                        (event.valueName != NULL) ? "," : "");
+                }
+                if (event.valueName != NULL)
+                {
+                    fprintf(pFile, "\"%s\":%I64d", event.valueName, event.value);
+                }
+                fprintf(pFile, "}}");
+            }
+        }
+
+        fprintf(pFile, "\n]}\n");
+
+        if (ferror(pFile))
+        {
+            hr = E_FAIL;
+        }
+    }
+    while(false);
+
+    if (pFile != NULL)
+    {
+        fclose(pFile);
+    }
+
+    return hr;
+}
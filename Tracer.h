@@ -0,0 +1,83 @@
+#pragma once
+
+#include "Common.h"
+#include "Metrics.h"
+
+
+
+//
+//  Opt-in event tracer.  Spans of the frame path - delivery, every tile and end of frame of
+//  every pipeline stage, file reads, snapshots - and the state changes and session events of
+//  the player are recorded into a buffer per thread, and dumped on demand in the Chrome
+//  trace event format, which chrome://tracing and ui.perfetto.dev open.
+//
+//  A thread only ever writes its own buffer, so recording takes no lock and no interlocked
+//  instruction - a span costs two reads of the performance counter and one store of its
+//  event.  While tracing is disabled every call returns after testing one flag.  The
+//  buffers are rings: a thread keeps its latest TRACE_BUFFER_EVENTS events.
+//
+//  Names and categories must be string literals - only their pointers are recorded.
+//
+
+#define TRACE_BUFFER_EVENTS         8192        // power of two
+#define TRACE_NO_FRAME              (-1)
+
+
+class CTracer
+{
+    public:
+        static void Enable(bool enable);
+        static bool IsEnabled(void) { return s_enabled; }
+
+        // a span from start to end, in GetMetricsTime() units.  frame is the presentation
+        // time of the frame the span worked on, TRACE_NO_FRAME if none, and valueName names
+        // an optional argument.
+        static void Span(PCSTR category, PCSTR name, LONGLONG start, LONGLONG end,
+            LONGLONG frame = TRACE_NO_FRAME, PCSTR valueName = NULL, LONGLONG value = 0);
+
+        // something that happened at one point in time
+        static void Instant(PCSTR category, PCSTR name, PCSTR valueName = NULL,
+            LONGLONG value = 0);
+
+        // a value that changes over time, drawn as a graph
+        static void Counter(PCSTR category, PCSTR name, LONGLONG value);
+
+        // name the calling thread in the trace
+        static void SetThreadName(PCSTR name);
+
+        // write the events of every thread to a trace file - safe while tracing goes on
+        static HRESULT Dump(PCWSTR path);
+
+    private:
+        static volatile bool s_enabled;
+};
+
+
+//
+//  Records a span from its construction to its destruction.
+//
+class CTraceSpan
+{
+    public:
+        CTraceSpan(PCSTR category, PCSTR name, LONGLONG frame = TRACE_NO_FRAME) :
+            m_category(category),
+            m_name(name),
+            m_frame(frame),
+            m_start(CTracer::IsEnabled() ? GetMetricsTime() : 0)
+        {
+        }
+
+        ~CTraceSpan(void)
+        {
+            if (m_start != 0 && CTracer::IsEnabled())
+            {
+                CTracer::Span(m_category, m_name, m_start, GetMetricsTime(), m_frame);
+            }
+        }
+
+    private:
+        PCSTR m_category;
+        PCSTR m_name;
+        LONGLONG m_frame;
+        LONGLONG m_start;
+};
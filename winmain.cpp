@@ -2,21 +2,50 @@
 
 #include "Common.h"
 #include "Player.h"
+#include "FrameServer.h"
+#include "MjpegServer.h"
+#include "Metrics.h"
+#include "PipelineConfig.h"
+#include "FrameDump.h"
+#include "FrameOutputs.h"
+#include "FrameSync.h"
+#include "AnalysisCache.h"
+#include "MemoryBudget.h"
+#include "Startup.h"
+#include "Tracer.h"
 #include "resource.h"
+#include <Dbt.h>
+#include <ks.h>
+#include <ksmedia.h>
 #include <new>
 #include <iostream>
+#include <vector>
+#include <math.h>
 
 
 const wchar_t szTitle[] = L"BasicPlayback";
 const wchar_t szWindowClass[] = L"MFBASICPLAYBACK";
+const USHORT  g_frameServerPort = 9000;           // local frame fan-out port (-serve)
+const USHORT  g_previewPort = 9001;               // MJPEG over HTTP preview port (-preview)
+const USHORT  g_metricsPort = 9002;               // Prometheus metrics port (-metrics)
 
 BOOL        g_bRepaintClient = TRUE;            // Repaint the application client area?
 CPlayer     *g_pPlayer = NULL;                  // Global player object.
+PipelinePlan g_pipelinePlan;                    // compiled pipeline file (-pipeline)
+bool        g_hasPipelinePlan = false;          // g_pipelinePlan is valid
+CAnalysisCache g_analysisCache;                 // calc.exe results by picture content
+WCHAR       g_tracePath[MAX_PATH] = { 0 };      // trace file (-trace), empty if not tracing
+HDEVNOTIFY  g_hDeviceNotify = NULL;             // capture device arrival and removal
+bool        g_frameTap = false;                 // frames to the pipeline next to the window (-tap)
+HANDLE      g_hQuitEvent = NULL;                // ends the headless run when set
 
 // Note: After WM_CREATE is processed, g_pPlayer remains valid until the
 // window is destroyed.
 
 BOOL                CreateApplicationWindow(HINSTANCE, int);
+int                 RunHeadless(PCWSTR pCmdLine);
+BOOL WINAPI         OnConsoleControl(DWORD controlType);
+bool                GetSwitchValue(PCWSTR pCmdLine, PCWSTR pSwitch, PWSTR pValue, DWORD cchValue);
 LRESULT CALLBACK    WndProc(HWND, UINT, WPARAM, LPARAM);
 
 // Message handlers
@@ -26,8 +55,12 @@ void                OnKeyPress(WPARAM key);
 void                OnOpenFile(HWND parent);
 void				OnOpenCamera(HWND parent);
 void				OnGetCurrentPic(std::string &str);
-void				exeCalc(std::string path);
-void				exeCalc(std::wstring path);
+std::string			exeCalc(std::string path);
+std::string			exeCalc(std::wstring path);
+bool				RunCalc(const std::wstring& path, std::string* pOutput);
+void				ReportAnalysisCache(void);
+void                DumpTrace(void);
+void                StartCameraPrefetch(PCWSTR pCmdLine);
 char g_currentDir[MAX_PATH] = { 0 };
 wchar_t g_wcurrentDir[MAX_PATH] = { 0 };
 int initSocket()
@@ -54,12 +87,89 @@ int initSocket()
 int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine, int nCmdShow)
 {
     MSG msg;
+    WCHAR path[MAX_PATH];
+    CMetricsServer metricsServer;
+
+    CStartupTimeline::Begin();
 
     ZeroMemory(&msg, sizeof(msg));
 
+    // "-trace <file>" records the spans of the frame path and the player events, and writes
+    // them to the file as a Chrome trace on exit - and in the window whenever T is pressed
+    if (pCmdLine != NULL && GetSwitchValue(pCmdLine, L"-trace", g_tracePath,
+        ARRAYSIZE(g_tracePath)))
+    {
+        CTracer::Enable(true);
+        CTracer::SetThreadName("main");
+    }
+
+    // "-membudget <MB>" limits the memory of the frame buffers, queues and caches of the
+    // process - by default half of the physical memory.  M writes the usage to the debugger
+    // output.
+    if (pCmdLine != NULL && GetSwitchValue(pCmdLine, L"-membudget", path, ARRAYSIZE(path)))
+    {
+        GetMemoryBudget()->SetLimit((ULONGLONG)_wtoi(path) * 1024 * 1024);
+    }
+
+    GetMemoryBudget()->ExportMetrics();
+
+    // "-metrics" serves the metrics of the player, the pipeline and the servers at
+    // http://127.0.0.1:g_metricsPort/metrics, in either mode
+    if (pCmdLine != NULL && wcsstr(pCmdLine, L"-metrics") != NULL)
+    {
+        metricsServer.Start(g_metricsPort);
+    }
+
+    // "-pipeline <file>" builds the pipeline from a pipeline file, which may also ask for
+    // headless mode
+    if (pCmdLine != NULL && GetSwitchValue(pCmdLine, L"-pipeline", path, ARRAYSIZE(path)))
+    {
+        CPipelineCompiler compiler;
+
+        if (FAILED(compiler.Compile(path, &g_pipelinePlan)))
+        {
+            OutputDebugString(L"pipeline: ");
+            OutputDebugString(compiler.GetError());
+            OutputDebugString(L"\n");
+            return FALSE;
+        }
+
+        g_hasPipelinePlan = true;
+
+        if (g_pipelinePlan.sinkType == PipelineSink_Frames)
+        {
+            return RunHeadless(pCmdLine);
+        }
+    }
+
+    // "-dedup <bits>" also answers pictures from the analysis cache whose perceptual hash
+    // is at most that many bits from a cached one - by default only identical pictures are
+    if (pCmdLine != NULL && GetSwitchValue(pCmdLine, L"-dedup", path, ARRAYSIZE(path)))
+    {
+        g_analysisCache.SetPerceptualTolerance(_wtoi(path));
+    }
+
+    // "-tap" also runs the frame pipeline on the full frames while the window shows them,
+    // with the statistics stage
+    if (pCmdLine != NULL && wcsstr(pCmdLine, L"-tap") != NULL)
+    {
+        g_frameTap = true;
+    }
+
+    // "-headless" runs the capture pipeline without a window or a renderer
+    if (pCmdLine != NULL && (wcsstr(pCmdLine, L"-headless") != NULL ||
+        wcsstr(pCmdLine, L"/headless") != NULL))
+    {
+        return RunHeadless(pCmdLine);
+    }
+
+    // the camera comes up in the background while the window does
+    StartCameraPrefetch(pCmdLine);
+
     // Perform application initialization.
     if (!CreateApplicationWindow(hInstance, nCmdShow))
     {
+        EndCapturePrefetch();
         return FALSE;
     }
 
@@ -70,10 +180,473 @@ int WINAPI wWinMain(HINSTANCE hInstance, HINSTANCE hPrevInstance, PWSTR pCmdLine
         DispatchMessage(&msg);
     }
 
+    EndCapturePrefetch();
+    DumpTrace();
 	
     return 0;
 }
 
+//
+//  Start Media Foundation and activate the camera of the pipeline plan on a background
+//  thread, so that opening the camera later only takes the activated source.  Nothing is
+//  prefetched for "-replay", and "-noprefetch" leaves the camera alone until it is opened.
+//
+void StartCameraPrefetch(PCWSTR pCmdLine)
+{
+    if (pCmdLine != NULL && (wcsstr(pCmdLine, L"-noprefetch") != NULL ||
+        wcsstr(pCmdLine, L"-replay") != NULL))
+    {
+        return;
+    }
+
+    if (g_hasPipelinePlan)
+    {
+        StartCapturePrefetch(g_pipelinePlan.deviceIndex, g_pipelinePlan.deviceName);
+    }
+    else
+    {
+        StartCapturePrefetch(0, NULL);
+    }
+}
+
+
+//
+//  Copy the value that follows a command line switch, which may be quoted.
+//
+bool GetSwitchValue(PCWSTR pCmdLine, PCWSTR pSwitch, PWSTR pValue, DWORD cchValue)
+{
+    PCWSTR pStart = wcsstr(pCmdLine, pSwitch);
+    wchar_t terminator = L' ';
+    DWORD length = 0;
+
+    if (pStart == NULL || cchValue == 0)
+    {
+        return false;
+    }
+
+    pStart += wcslen(pSwitch);
+    while (*pStart == L' ')
+        pStart++;
+
+    if (*pStart == L'"')
+    {
+        terminator = L'"';
+        pStart++;
+    }
+
+    while (pStart[length] != L'\0' && pStart[length] != terminator && length + 1 < cchValue)
+    {
+        pValue[length] = pStart[length];
+        length++;
+    }
+    pValue[length] = L'\0';
+
+    return length > 0;
+}
+
+
+//
+//  Frame consumer used in headless mode - reports the process CPU time spent per frame, which
+//  is the figure to compare against the windowed (EVR) mode.
+//
+class CCpuPerFrameReporter : public IFrameConsumer
+{
+    public:
+        CCpuPerFrameReporter(void) : m_frames(0), m_lastCpu(0) {}
+
+        void OnFrame(CFrameView* pFrame)
+        {
+            const FrameFormat& format = pFrame->Format();
+            FILETIME creation, exitTime, kernel, user;
+            FrameStats stats;
+            wchar_t msg[128];
+
+            if (++m_frames % 300 != 0)
+                return;
+
+            GetProcessTimes(GetCurrentProcess(), &creation, &exitTime, &kernel, &user);
+            ULONGLONG cpu = ((ULARGE_INTEGER*)&kernel)->QuadPart + ((ULARGE_INTEGER*)&user)->QuadPart;
+
+            swprintf_s(msg, L"headless: %ux%u, %.3f ms CPU per frame\n", format.width,
+                format.height, (double)(cpu - m_lastCpu) / 10000.0 / 300.0);
+            OutputDebugString(msg);
+
+            if (SUCCEEDED(g_pPlayer->GetFrameStats(&stats)))
+            {
+                swprintf_s(msg, L"headless: luma %.1f +/- %.1f, clipped %.1f%% / %.1f%%, focus %.1f\n",
+                    stats.lumaMean, sqrt(stats.lumaVariance), stats.clippedDark * 100.0,
+                    stats.clippedBright * 100.0, stats.focus);
+                OutputDebugString(msg);
+            }
+
+            m_lastCpu = cpu;
+        }
+
+    private:
+        ULONGLONG m_frames;
+        ULONGLONG m_lastCpu;
+};
+
+
+//
+//  Reports the synchronizer of the cameras every few hundred sets.
+//
+class CFrameSetReporter : public IFrameSetConsumer
+{
+    public:
+        CFrameSetReporter(const CFrameSynchronizer* pSync) : m_pSync(pSync) {}
+
+        void OnFrameSet(const FrameSet& set)
+        {
+            if (set.sequence % 300 == 299)
+            {
+                m_pSync->Report();
+            }
+        }
+
+    private:
+        const CFrameSynchronizer* m_pSync;
+};
+
+
+//
+//  Ctrl+C, Ctrl+Break or closing the console the headless player was started from ends the
+//  run, which then shuts down cleanly.
+//
+BOOL WINAPI OnConsoleControl(DWORD controlType)
+{
+    if (g_hQuitEvent != NULL)
+    {
+        SetEvent(g_hQuitEvent);
+    }
+
+    return TRUE;
+}
+
+
+//
+//  Run the player without a window: the camera frames go to the frame consumers only.
+//  "-serve" additionally shares the frames with local clients on g_frameServerPort, and
+//  "-preview" serves a 640x360 MJPEG preview at http://127.0.0.1:g_previewPort/, and
+//  "-numa N" keeps the capture delivery, the pipeline and the servers on NUMA node N, and
+//  "-stats" adds the exposure and focus statistics to the report.  "-roi l,t,w,h" limits
+//  the stages and the servers to that rectangle of the frame.
+//
+//  The run ends when a replayed file without "-loop" ends, on Ctrl+C in the console it was
+//  started from, when the event "Local\MFCameraPlayer.Quit.<process id>" is set, or when
+//  WM_QUIT is posted to the thread.
+//
+int RunHeadless(PCWSTR pCmdLine)
+{
+    HRESULT hr = S_OK;
+    MSG msg;
+    CCpuPerFrameReporter reporter;
+    CFrameServer frameServer;
+    CMjpegServer previewServer;
+    CFrameRecorder recorder;
+    CFrameOutputStage outputs;
+    DWORD previewOutput = 0;
+    CFrameSynchronizer sync;
+    CFrameSetReporter syncReporter(&sync);
+    CPlayer* pSyncPlayer = NULL;
+    FrameReplayOptions replay = { FrameReplay_Original, false };
+    WCHAR replayPath[MAX_PATH];
+    WCHAR recordPath[MAX_PATH];
+    bool replaying = GetSwitchValue(pCmdLine, L"-replay", replayPath, ARRAYSIZE(replayPath));
+    bool recording = GetSwitchValue(pCmdLine, L"-record", recordPath, ARRAYSIZE(recordPath));
+    bool serve = (wcsstr(pCmdLine, L"-serve") != NULL);
+    bool preview = (wcsstr(pCmdLine, L"-preview") != NULL);
+    bool previewOutputs = false;
+    PCWSTR pNuma = wcsstr(pCmdLine, L"-numa ");
+    PCWSTR pRoi = wcsstr(pCmdLine, L"-roi ");
+    PCWSTR pSync = wcsstr(pCmdLine, L"-sync ");
+    PCWSTR pAudio = wcsstr(pCmdLine, L"-audio ");
+    AudioRingStats audioStats;
+    WCHAR text[160];
+    HANDLE hEndEvent = NULL;
+    HANDLE waitHandles[2];
+    DWORD waitCount = 0;
+    DWORD waitResult = 0;
+    bool quit = false;
+    PipelineAffinity affinity;
+    RECT roi;
+    RECT* pRegion = NULL;
+    int roiLeft, roiTop, roiWidth, roiHeight;
+
+    // the camera comes up in the background while the player and the servers do
+    StartCameraPrefetch(pCmdLine);
+
+    g_pPlayer = new (std::nothrow) CPlayer(NULL, &hr);
+    if (g_pPlayer == NULL || FAILED(hr))
+    {
+        delete g_pPlayer;
+        g_pPlayer = NULL;
+        EndCapturePrefetch();
+        return FALSE;
+    }
+
+    g_pPlayer->AddFrameConsumer(&reporter);
+
+    // the stages and the servers only look at the region, the reporter sees whole frames
+    if (pRoi != NULL &&
+        swscanf_s(pRoi + 5, L"%d,%d,%d,%d", &roiLeft, &roiTop, &roiWidth, &roiHeight) == 4)
+    {
+        SetRect(&roi, roiLeft, roiTop, roiLeft + roiWidth, roiTop + roiHeight);
+        pRegion = &roi;
+        g_pPlayer->SetPipelineRegion(pRegion);
+    }
+
+    if (wcsstr(pCmdLine, L"-stats") != NULL)
+    {
+        g_pPlayer->EnableFrameStats();
+    }
+
+    if (g_hasPipelinePlan)
+    {
+        g_pPlayer->SetPipelinePlan(g_pipelinePlan);
+        frameServer.SetQueueLimit(g_pipelinePlan.clientQueueDepth, DropPolicy_DropOldest);
+        frameServer.SetPacketPoolSize(g_pipelinePlan.poolBuffers);
+        previewServer.SetQueueLimit(g_pipelinePlan.clientQueueDepth, DropPolicy_DropOldest);
+    }
+
+    if (pNuma != NULL &&
+        SUCCEEDED(GetNumaNodeAffinity((USHORT)_wtoi(pNuma + 6), &affinity)))
+    {
+        g_pPlayer->SetPipelineAffinity(affinity);
+        frameServer.SetPlacement(affinity.consumerCores, affinity.numaNode);
+        previewServer.SetPlacement(affinity.consumerCores, affinity.numaNode);
+    }
+
+    if (serve && SUCCEEDED(frameServer.Start(g_frameServerPort)))
+    {
+        g_pPlayer->AddFrameConsumer(&frameServer, pRegion);
+    }
+    else
+    {
+        serve = false;
+    }
+
+    // "-outputs" makes the preview from a 640x360 output of the pipeline, scaled down once
+    // on all workers, instead of having the preview server scale down the full frames
+    previewServer.SetOutputSize(640, 360);
+    previewServer.SetMaxFrameRate(15);
+    if (preview && wcsstr(pCmdLine, L"-outputs") != NULL &&
+        SUCCEEDED(outputs.AddOutput(640, 360, MFVideoFormat_NV12, &previewOutput)) &&
+        SUCCEEDED(outputs.AddConsumer(previewOutput, &previewServer)) &&
+        SUCCEEDED(g_pPlayer->AddFrameStage(&outputs)))
+    {
+        previewOutputs = true;
+    }
+
+    if (preview && SUCCEEDED(previewServer.Start(g_previewPort)))
+    {
+        if (!previewOutputs)
+        {
+            g_pPlayer->AddFrameConsumer(&previewServer, pRegion);
+        }
+    }
+    else
+    {
+        preview = false;
+    }
+
+    // "-record <file>" dumps the frames the stages see, for "-replay <file>" to play back -
+    // in recorded time, or with "-fast" as fast as the pipeline goes, and with "-loop" forever;
+    // "-replay" also plays Y4M files and raw frame files such as "hall_1280x720.nv12"
+    // "-compress" codes the recorded frames losslessly, on the workers of the pipeline
+    if (recording && wcsstr(pCmdLine, L"-compress") != NULL)
+    {
+        recorder.EnableCompression(g_pPlayer->GetScheduler());
+    }
+
+    // "-audio <device>" captures that audio device with the camera, on the clock of the
+    // frames - a recording gets the audio of its frames in "<file>.wav"
+    if (pAudio != NULL && !replaying &&
+        SUCCEEDED(g_pPlayer->EnableAudioCapture((UINT32)_wtoi(pAudio + 7))) && recording)
+    {
+        recorder.SetAudioSource(g_pPlayer->GetAudioRing());
+    }
+
+    if (recording && SUCCEEDED(recorder.Open(recordPath)))
+    {
+        g_pPlayer->AddFrameConsumer(&recorder, pRegion);
+    }
+    else
+    {
+        recording = false;
+    }
+
+    if (replaying)
+    {
+        replay.timing = (wcsstr(pCmdLine, L"-fast") != NULL) ?
+            FrameReplay_AsFastAsPossible : FrameReplay_Original;
+        replay.loop = (wcsstr(pCmdLine, L"-loop") != NULL);
+        g_pPlayer->SetReplayOptions(replay);
+    }
+
+    // "-sync <device>" opens a second camera and matches its frames with those of the first,
+    // for a stereo pair - both on the clock of the host
+    if (pSync != NULL && !replaying && SUCCEEDED(sync.Initialize(2)))
+    {
+        pSyncPlayer = new (std::nothrow) CPlayer(NULL, &hr);
+        if (pSyncPlayer != NULL && SUCCEEDED(hr))
+        {
+            sync.AddConsumer(&syncReporter);
+            g_pPlayer->AddFrameConsumer(sync.GetInput(0), pRegion);
+            pSyncPlayer->SetCaptureDevice((UINT32)_wtoi(pSync + 6));
+            pSyncPlayer->AddFrameConsumer(sync.GetInput(1), pRegion);
+            hr = pSyncPlayer->OpenURL(NULL);
+        }
+
+        if (pSyncPlayer == NULL || FAILED(hr))
+        {
+            OutputDebugString(L"headless: cannot open the second camera for -sync\n");
+            if (pSyncPlayer != NULL)
+            {
+                pSyncPlayer->Shutdown();
+                pSyncPlayer->RemoveFrameConsumer(sync.GetInput(1));
+                pSyncPlayer->Release();
+                pSyncPlayer = NULL;
+            }
+            g_pPlayer->RemoveFrameConsumer(sync.GetInput(0));
+            hr = S_OK;
+        }
+    }
+
+    swprintf_s(text, L"Local\\MFCameraPlayer.Quit.%lu", GetCurrentProcessId());
+    g_hQuitEvent = CreateEvent(NULL, TRUE, FALSE, text);
+    if (g_hQuitEvent != NULL)
+    {
+        waitHandles[waitCount++] = g_hQuitEvent;
+
+        if (AttachConsole(ATTACH_PARENT_PROCESS))
+        {
+            SetConsoleCtrlHandler(OnConsoleControl, TRUE);
+        }
+    }
+
+    if (replaying && !replay.loop)
+    {
+        hEndEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+        if (hEndEvent != NULL)
+        {
+            g_pPlayer->SetEndOfPresentationEvent(hEndEvent);
+            waitHandles[waitCount++] = hEndEvent;
+        }
+    }
+
+    hr = g_pPlayer->OpenURL(replaying ? replayPath : NULL);
+
+    // the session events are delivered on MF work queue threads - just keep the apartment
+    // alive until one of the events is set or somebody posts WM_QUIT to this thread
+    while (SUCCEEDED(hr) && !quit)
+    {
+        waitResult = MsgWaitForMultipleObjects(waitCount, waitHandles, FALSE, INFINITE,
+            QS_ALLINPUT);
+        if (waitResult != WAIT_OBJECT_0 + waitCount)
+        {
+            break;
+        }
+
+        while (PeekMessage(&msg, NULL, 0, 0, PM_REMOVE))
+        {
+            if (msg.message == WM_QUIT)
+            {
+                quit = true;
+                break;
+            }
+
+            TranslateMessage(&msg);
+            DispatchMessage(&msg);
+        }
+    }
+
+    // Close the sessions and stop the pipelines first - nothing calls the consumers and the
+    // stages on this stack after that, and the sessions let go of their players, so the
+    // players are destroyed by their last Release() below.
+    g_pPlayer->Shutdown();
+    if (pSyncPlayer != NULL)
+    {
+        pSyncPlayer->Shutdown();
+    }
+
+    if (previewOutputs)
+    {
+        g_pPlayer->RemoveFrameStage(&outputs);
+    }
+
+    g_pPlayer->RemoveFrameConsumer(&reporter);
+
+    if (pSyncPlayer != NULL)
+    {
+        pSyncPlayer->RemoveFrameConsumer(sync.GetInput(1));
+        g_pPlayer->RemoveFrameConsumer(sync.GetInput(0));
+        pSyncPlayer->Release();
+        pSyncPlayer = NULL;
+
+        sync.Report();
+        sync.Flush();
+    }
+
+    if (serve)
+    {
+        g_pPlayer->RemoveFrameConsumer(&frameServer);
+        frameServer.Stop();
+    }
+
+    if (preview)
+    {
+        if (previewOutputs)
+        {
+            outputs.RemoveConsumer(previewOutput, &previewServer);
+        }
+        else
+        {
+            g_pPlayer->RemoveFrameConsumer(&previewServer);
+        }
+        previewServer.Stop();
+    }
+
+    if (recording)
+    {
+        g_pPlayer->RemoveFrameConsumer(&recorder);
+        recorder.Close();
+    }
+
+    if (g_pPlayer->GetAudioRing() != NULL)
+    {
+        g_pPlayer->GetAudioRing()->GetStats(&audioStats);
+        swprintf_s(text,
+            L"headless: audio %I64u frames, %I64u of silence, %I64u discontinuities, %I64u overruns\n",
+            audioStats.framesWritten, audioStats.silenceFrames, audioStats.discontinuities,
+            audioStats.overrunReads);
+        OutputDebugString(text);
+    }
+
+    g_pPlayer->SetEndOfPresentationEvent(NULL);
+    g_pPlayer->Release();
+    g_pPlayer = NULL;
+
+    if (hEndEvent != NULL)
+    {
+        CloseHandle(hEndEvent);
+    }
+
+    if (g_hQuitEvent != NULL)
+    {
+        SetConsoleCtrlHandler(OnConsoleControl, FALSE);
+        CloseHandle(g_hQuitEvent);
+        g_hQuitEvent = NULL;
+    }
+
+    GetMemoryBudget()->Report();
+
+    EndCapturePrefetch();
+    DumpTrace();
+
+    return SUCCEEDED(hr) ? 0 : FALSE;
+}
+
 BOOL CreateApplicationWindow(HINSTANCE hInst, int nCmdShow)
 {
     HWND hwnd;
@@ -106,6 +679,8 @@ BOOL CreateApplicationWindow(HINSTANCE hInst, int nCmdShow)
     ShowWindow(hwnd, nCmdShow);
     UpdateWindow(hwnd);
 
+    CStartupTimeline::Mark(StartupPhase_Window);
+
 	GetCurrentDirectoryA(MAX_PATH, g_currentDir);
 	GetCurrentDirectory(MAX_PATH, g_wcurrentDir);
     return TRUE;
@@ -142,21 +717,21 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 		{
 			std::string cmd;
 			OnGetCurrentPic(cmd);
-			exeCalc(cmd);
+			OutputDebugStringA(exeCalc(cmd).c_str());
 		}
 		
         else if(LOWORD(wParam) == ID_CONTROL_PLAY)
         {
             if(g_pPlayer != NULL)
             {
-                g_pPlayer->Play();
+                g_pPlayer->PostCommand(PlayerCommand_Play);
             }
         }
         else if(LOWORD(wParam) == ID_CONTROL_PAUSE)
         {
             if(g_pPlayer != NULL)
             {
-                g_pPlayer->Pause();
+                g_pPlayer->PostCommand(PlayerCommand_Pause);
             }
         }
         else
@@ -173,7 +748,21 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
         // Suppress window erasing, to reduce flickering while the video is playing.
         return 1;
 
+    case WM_DEVICECHANGE:
+        // capture devices only - the window registered for nothing else
+        if (g_pPlayer != NULL && (wParam == DBT_DEVICEARRIVAL ||
+            wParam == DBT_DEVICEREMOVECOMPLETE))
+        {
+            g_pPlayer->PostDeviceChange((DWORD)wParam);
+        }
+        return TRUE;
+
     case WM_DESTROY:
+        if (g_hDeviceNotify != NULL)
+        {
+            UnregisterDeviceNotification(g_hDeviceNotify);
+            g_hDeviceNotify = NULL;
+        }
         PostQuitMessage(0);
         break;
 
@@ -196,6 +785,14 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT message, WPARAM wParam, LPARAM lParam)
 LRESULT OnCreateWindow(HWND hwnd)
 {   
     HRESULT hr = S_OK;
+    DEV_BROADCAST_DEVICEINTERFACE filter = { 0 };
+
+    // tell the player when a camera is plugged in or pulled out
+    filter.dbcc_size = sizeof(filter);
+    filter.dbcc_devicetype = DBT_DEVTYP_DEVICEINTERFACE;
+    filter.dbcc_classguid = KSCATEGORY_CAPTURE;
+    g_hDeviceNotify = RegisterDeviceNotification(hwnd, &filter,
+        DEVICE_NOTIFY_WINDOW_HANDLE);
 
     // Initialize the player object.
     g_pPlayer = new (std::nothrow) CPlayer(hwnd, &hr);
@@ -206,6 +803,16 @@ LRESULT OnCreateWindow(HWND hwnd)
         delete g_pPlayer;
         g_pPlayer = NULL;
     }
+    else if (g_pPlayer != NULL && g_hasPipelinePlan)
+    {
+        g_pPlayer->SetPipelinePlan(g_pipelinePlan);
+    }
+
+    if (g_pPlayer != NULL && g_frameTap)
+    {
+        g_pPlayer->SetFrameTap(true);
+        g_pPlayer->EnableFrameStats();
+    }
 
     return 0;
 }
@@ -247,34 +854,157 @@ void OnKeyPress(WPARAM key)
     if (key == VK_SPACE)
     {
         // Space key toggles between running and paused
-        if (g_pPlayer->GetState() == PlayerState_Started)
+        // decided on the control thread, which sees the state the commands before left
+        if (g_pPlayer != NULL)
         {
-            g_pPlayer->Pause();
-        }
-        else if (g_pPlayer->GetState() == PlayerState_Paused)
-        {
-            g_pPlayer->Play();
+            g_pPlayer->PostCommand(PlayerCommand_TogglePause);
         }
     }
+    else if (key == L't' || key == L'T')
+    {
+        DumpTrace();
+    }
+    else if (key == L'm' || key == L'M')
+    {
+        GetMemoryBudget()->Report();
+    }
 }
 
-void exeCalc(std::string path)
+
+//
+//  Write the trace recorded so far, if tracing is on.
+//
+void DumpTrace(void)
 {
-	std::string commond = g_currentDir;
-	commond += "\\calc.exe  \"";
-	commond += path;
-	commond += "\"";
+    if (g_tracePath[0] != L'\0' && FAILED(CTracer::Dump(g_tracePath)))
+    {
+        OutputDebugString(L"trace: could not write ");
+        OutputDebugString(g_tracePath);
+        OutputDebugString(L"\n");
+    }
+}
+
+std::string exeCalc(std::string path)
+{
+	wchar_t wpath[MAX_PATH] = { 0 };
+
+	if (MultiByteToWideChar(CP_ACP, 0, path.c_str(), -1, wpath, MAX_PATH) == 0)
+	{
+		return std::string();
+	}
+
+	return exeCalc(std::wstring(wpath));
+}
+
+//
+//  Run calc.exe on a picture, or give its earlier output for the same picture - a static
+//  scene captured again is not analyzed again.  calc.exe results that failed are not kept.
+//  Returns the output of calc.exe, empty if it could not be run.
+//
+std::string exeCalc(std::wstring path)
+{
+	CTraceSpan span("snapshot", "exeCalc");
+	PictureKey key;
+	std::string result;
+	bool hashed = SUCCEEDED(GetPictureKey(path.c_str(), g_analysisCache.UsesPerceptualHash(), &key));
+
+	if (!hashed || !g_analysisCache.Lookup(key, &result))
+	{
+		if (RunCalc(path, &result) && hashed)
+		{
+			g_analysisCache.Insert(key, result);
+		}
+	}
 
-	system(commond.c_str());
+	ReportAnalysisCache();
+
+	return result;
 }
 
-void exeCalc(std::wstring path)
+//
+//  Run calc.exe on a picture and collect what it writes to its standard output, through an
+//  anonymous pipe - this is a Windows program, which has no console for _popen() to use.
+//  Returns true if calc.exe ran and exited with 0.
+//
+bool RunCalc(const std::wstring& path, std::string* pOutput)
 {
-	std::wstring commond = g_wcurrentDir;
-	commond += L"\\calc.exe \"";
+	SECURITY_ATTRIBUTES security = { sizeof(security), NULL, TRUE };
+	STARTUPINFO startup = { 0 };
+	PROCESS_INFORMATION process = { 0 };
+	HANDLE hRead = NULL;
+	HANDLE hWrite = NULL;
+	char output[512];
+	DWORD read = 0;
+	DWORD exitCode = 1;
+
+	std::wstring application = g_wcurrentDir;
+	application += L"\\calc.exe";
+
+	std::wstring commond = L"\"";
+	commond += application;
+	commond += L"\" \"";
 	commond += path;
 	commond += L"\"";
-	_wsystem(commond.c_str());
+
+	// only the write end is inherited by calc.exe
+	if (!CreatePipe(&hRead, &hWrite, &security, 0))
+	{
+		return false;
+	}
+	SetHandleInformation(hRead, HANDLE_FLAG_INHERIT, 0);
+
+	startup.cb = sizeof(startup);
+	startup.dwFlags = STARTF_USESTDHANDLES;
+	startup.hStdInput = NULL;
+	startup.hStdOutput = hWrite;
+	startup.hStdError = hWrite;
+
+	// CreateProcess may change the command line it is given
+	std::vector<wchar_t> commandLine(commond.begin(), commond.end());
+	commandLine.push_back(L'\0');
+
+	if (!CreateProcess(application.c_str(), &commandLine[0], NULL, NULL, TRUE,
+		CREATE_NO_WINDOW, NULL, NULL, &startup, &process))
+	{
+		CloseHandle(hRead);
+		CloseHandle(hWrite);
+		return false;
+	}
+
+	// without the write end of this process, the pipe breaks when calc.exe exits
+	CloseHandle(hWrite);
+
+	while (ReadFile(hRead, output, sizeof(output), &read, NULL) && read > 0)
+	{
+		pOutput->append(output, read);
+	}
+
+	WaitForSingleObject(process.hProcess, INFINITE);
+	GetExitCodeProcess(process.hProcess, &exitCode);
+
+	CloseHandle(process.hProcess);
+	CloseHandle(process.hThread);
+	CloseHandle(hRead);
+
+	return exitCode == 0;
+}
+
+//
+//  Hit rate and memory of the analysis cache, on the debug output.
+//
+void ReportAnalysisCache(void)
+{
+	AnalysisCacheStats stats;
+	wchar_t msg[192];
+
+	g_analysisCache.GetStats(&stats);
+
+	ULONGLONG lookups = stats.hits + stats.nearHits + stats.misses;
+	swprintf_s(msg, L"analysis cache: %.1f%% hits (%I64u exact, %I64u near, %I64u misses), "
+		L"%u entries, %I64u / %I64u KB\n", (lookups > 0) ?
+		(double)(stats.hits + stats.nearHits) * 100.0 / (double)lookups : 0.0, stats.hits,
+		stats.nearHits, stats.misses, stats.entries, stats.bytes / 1024, stats.budgetBytes / 1024);
+	OutputDebugString(msg);
 }
 
 void OnOpenCamera(HWND parent)
@@ -287,6 +1017,7 @@ void OnOpenCamera(HWND parent)
 
 void OnGetCurrentPic(std::string &str)
 {
+	CTraceSpan span("snapshot", "OnGetCurrentPic");
 	int iResult = 0;
 	SOCKET ConnectSocket;
 	ConnectSocket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
@@ -358,6 +1089,6 @@ void OnOpenFile(HWND parent)
 
     if (GetOpenFileName(&ofn)==TRUE) 
     {
-		exeCalc(ofn.lpstrFile);
+		OutputDebugStringA(exeCalc(ofn.lpstrFile).c_str());
     }
 }